@@ -13,6 +13,7 @@ BuildRequires:  pkgconfig(Qt5DBus)
 BuildRequires:  pkgconfig(Qt5Test)
 BuildRequires:  pkgconfig(qtcontacts-sqlite-qt5-extensions) >= 0.3.0
 BuildRequires:  pkgconfig(contactcache-qt5) >= 0.3.0
+BuildRequires:  pkgconfig(sqlite3)
 BuildRequires:  libphonenumber-devel
 
 %{!?qtc_qmake5:%define qtc_qmake5 %qmake5}
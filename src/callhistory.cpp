@@ -62,7 +62,8 @@ QString buildEventsQuery(CommHistory::CallEvent::CallType callType,
     QString group;
     static const QString groupTemplate = QStringLiteral(" GROUP BY strftime('%1', datetime(startTime, 'unixepoch'))");
 
-    QString q = "SELECT startTime, endTime, remoteUid from Events";
+    QString q = "SELECT startTime, endTime, " + CommHistory::DatabaseIOPrivate::uidColumn(CommHistory::DatabaseIOPrivate::RemoteUids)
+                + " from Events";
     if (!conditions.isEmpty()) {
         q += " WHERE " + conditions.join(" AND ");
     }
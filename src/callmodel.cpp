@@ -1069,7 +1069,8 @@ bool CallModel::getEvents()
     }
 
     if (!d->filterLocalUid.isEmpty()) {
-        q += QString::fromLatin1("AND localUid=:filterLocalUid ");
+        q += QString::fromLatin1("AND %1 ").arg(DatabaseIOPrivate::uidCondition(DatabaseIOPrivate::LocalUids,
+                                                                               QStringLiteral("= :filterLocalUid")));
     }
 
     if (d->referenceTime != 0) {
@@ -22,6 +22,8 @@
 
 #include "commhistorydatabase.h"
 #include "commhistorydatabasepath.h"
+#include "recipient.h"
+#include "databasemigration_p.h"
 #include <QDir>
 #include <QFile>
 #include <QSqlError>
@@ -33,28 +35,174 @@
 // Appended to GenericDataLocation (or a hardcoded equivalent on Qt4)
 #define COMMHISTORY_DATABASE_DIR "/commhistory/"
 #define COMMHISTORY_DATABASE_NAME "commhistory.db"
+#define COMMHISTORY_ARCHIVE_NAME "commhistory-archive.db"
 #define COMMHISTORY_DATA_DIR COMMHISTORY_DATABASE_DIR "data/"
 
 static QString db_root_dir = QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation);
 
 static const char *db_setup[] = {
+    // Must precede the first write to a new database. Existing databases
+    // keep their mode until DatabaseMaintenance converts them.
+    "PRAGMA auto_vacuum = INCREMENTAL",
     "PRAGMA temp_store = MEMORY",
     "PRAGMA journal_mode = WAL",
     "PRAGMA foreign_keys = ON"
 };
 static int db_setup_count = sizeof(db_setup) / sizeof(*db_setup);
 
+/* Old events can be moved to a separate archive database, which is attached
+ * to every connection as "archive". Its tables copy the columns of the main
+ * tables without their constraints and triggers, and are indexed for the
+ * queries that continue into the archive. Indexes are created after the
+ * columns of existing archives are updated. */
+static const char *db_archive_schema[] = {
+    "CREATE TABLE IF NOT EXISTS archive.Events AS SELECT * FROM main.Events WHERE 0",
+    "CREATE TABLE IF NOT EXISTS archive.EventProperties AS SELECT * FROM main.EventProperties WHERE 0",
+    "CREATE TABLE IF NOT EXISTS archive.MessageParts AS SELECT * FROM main.MessageParts WHERE 0"
+};
+static int db_archive_schema_count = sizeof(db_archive_schema) / sizeof(*db_archive_schema);
+
+static const char *db_archive_indexes[] = {
+    "CREATE UNIQUE INDEX IF NOT EXISTS archive.archive_events_id ON Events (id)",
+    "CREATE INDEX IF NOT EXISTS archive.archive_events_sorting ON Events (groupId, endTime DESC, id DESC)",
+    "CREATE INDEX IF NOT EXISTS archive.archive_events_endTime ON Events (endTime DESC, id DESC)",
+    "CREATE INDEX IF NOT EXISTS archive.archive_events_remoteUidId ON Events (remoteUidId)",
+    "CREATE INDEX IF NOT EXISTS archive.archive_events_minimizedRemoteUid ON Events (minimizedRemoteUid, endTime DESC, id DESC)",
+    "CREATE UNIQUE INDEX IF NOT EXISTS archive.archive_eventproperties_keyId ON EventProperties (eventId, keyId)",
+    "CREATE INDEX IF NOT EXISTS archive.archive_messageparts_eventId ON MessageParts (eventId)"
+};
+static int db_archive_indexes_count = sizeof(db_archive_indexes) / sizeof(*db_archive_indexes);
+
+// Converts the extra properties of an archive created before schema version 11.
+// As in the main database, PROMOTED_PROPERTIES_MIGRATION moves them to columns.
+static const char *db_archive_upgrade_properties[] = {
+    "DROP INDEX IF EXISTS archive.archive_eventproperties_eventId",
+    "INSERT OR IGNORE INTO main.EventPropertyKeys (key) SELECT DISTINCT key FROM archive.EventProperties WHERE keyId IS NULL",
+    "UPDATE archive.EventProperties SET "
+    "  keyId = (SELECT id FROM main.EventPropertyKeys AS K WHERE K.key = EventProperties.key), "
+    "  key = NULL "
+    "  WHERE keyId IS NULL"
+};
+static int db_archive_upgrade_properties_count = sizeof(db_archive_upgrade_properties) / sizeof(*db_archive_upgrade_properties);
+
+static const char *db_archive_tables[] = { "Events", "EventProperties", "MessageParts" };
+static int db_archive_tables_count = sizeof(db_archive_tables) / sizeof(*db_archive_tables);
+
+/* The archive is prepared once for each schema version of the main
+ * database and revision of the statements above, which its user_version
+ * records; increase the revision when changing them. */
+static const int db_archive_revision = 1;
+
+/* The ChangeLog lists added, modified and deleted events and groups for
+ * incremental readers; see DatabaseIO::getChanges(). */
+#define CHANGELOG_TABLE \
+    "CREATE TABLE ChangeLog ( " \
+    "  seq INTEGER PRIMARY KEY AUTOINCREMENT, " \
+    "  tableId INTEGER, " \
+    "  operation INTEGER, " \
+    "  rowId INTEGER, " \
+    "  groupId INTEGER " \
+    ")"
+
+#define EVENTS_CHANGELOG_INSERT \
+    "CREATE TRIGGER events_changelog_insert AFTER INSERT ON Events " \
+    "  BEGIN " \
+    "    INSERT INTO ChangeLog (tableId, operation, rowId, groupId) VALUES (0, 1, NEW.id, NEW.groupId); " \
+    "  END"
+
+// An event moved to another group is also logged as a change of the old group
+#define EVENTS_CHANGELOG_UPDATE \
+    "CREATE TRIGGER events_changelog_update AFTER UPDATE ON Events " \
+    "  BEGIN " \
+    "    INSERT INTO ChangeLog (tableId, operation, rowId, groupId) VALUES (0, 2, NEW.id, NEW.groupId); " \
+    "    INSERT INTO ChangeLog (tableId, operation, rowId, groupId) " \
+    "      SELECT 0, 2, OLD.id, OLD.groupId WHERE OLD.groupId IS NOT NEW.groupId; " \
+    "  END"
+
+#define EVENTS_CHANGELOG_DELETE \
+    "CREATE TRIGGER events_changelog_delete AFTER DELETE ON Events " \
+    "  BEGIN " \
+    "    INSERT INTO ChangeLog (tableId, operation, rowId, groupId) VALUES (0, 3, OLD.id, OLD.groupId); " \
+    "  END"
+
+#define GROUPS_CHANGELOG_INSERT \
+    "CREATE TRIGGER groups_changelog_insert AFTER INSERT ON Groups " \
+    "  BEGIN " \
+    "    INSERT INTO ChangeLog (tableId, operation, rowId, groupId) VALUES (1, 1, NEW.id, NEW.id); " \
+    "  END"
+
+#define GROUPS_CHANGELOG_DELETE \
+    "CREATE TRIGGER groups_changelog_delete AFTER DELETE ON Groups " \
+    "  BEGIN " \
+    "    INSERT INTO ChangeLog (tableId, operation, rowId, groupId) VALUES (1, 3, OLD.id, OLD.id); " \
+    "  END"
+
+// Keep roughly the last 10000 changes; readers that fall further behind do a full query
+#define CHANGELOG_PRUNE \
+    "CREATE TRIGGER changelog_prune AFTER INSERT ON ChangeLog " \
+    "  WHEN NEW.seq % 1000 = 0 " \
+    "  BEGIN " \
+    "    DELETE FROM ChangeLog WHERE seq <= NEW.seq - 10000; " \
+    "  END"
+
+/* Groups.lastEventTime is the endTime of the last event of the group, for
+ * paging groups in order of their last event with an index. It is maintained
+ * by triggers and changes with the events, which are logged themselves, so
+ * the ChangeLog entry for updated groups lists the other columns. */
+#define GROUPS_CHANGELOG_UPDATE \
+    "CREATE TRIGGER groups_changelog_update " \
+    "  AFTER UPDATE OF localUid, remoteUids, type, chatName, lastModified ON Groups " \
+    "  BEGIN " \
+    "    INSERT INTO ChangeLog (tableId, operation, rowId, groupId) VALUES (1, 2, NEW.id, NEW.id); " \
+    "  END"
+
+#define GROUPS_LAST_EVENT_TIME \
+    "lastEventTime = IFNULL((SELECT MAX(endTime) FROM Events WHERE groupId = Groups.id), 0)"
+
+#define GROUPS_LAST_EVENT_INSERT \
+    "CREATE TRIGGER groups_lastevent_insert AFTER INSERT ON Events " \
+    "  WHEN NEW.groupId IS NOT NULL " \
+    "  BEGIN " \
+    "    UPDATE Groups SET lastEventTime = NEW.endTime WHERE id = NEW.groupId AND lastEventTime < NEW.endTime; " \
+    "  END"
+
+#define GROUPS_LAST_EVENT_UPDATE \
+    "CREATE TRIGGER groups_lastevent_update AFTER UPDATE OF endTime, groupId ON Events " \
+    "  BEGIN " \
+    "    UPDATE Groups SET " GROUPS_LAST_EVENT_TIME " WHERE id IN (OLD.groupId, NEW.groupId); " \
+    "  END"
+
+// Archiving deletes events that are not the last of their group, which leaves the time as it was
+#define GROUPS_LAST_EVENT_DELETE \
+    "CREATE TRIGGER groups_lastevent_delete AFTER DELETE ON Events " \
+    "  WHEN OLD.endTime >= (SELECT lastEventTime FROM Groups WHERE id = OLD.groupId) " \
+    "  BEGIN " \
+    "    UPDATE Groups SET " GROUPS_LAST_EVENT_TIME " WHERE id = OLD.groupId; " \
+    "  END"
+
 static const char *db_schema[] = {
     "PRAGMA encoding = \"UTF-16\"",
 
+    // Dictionaries of the addresses referred to by Events
+    "CREATE TABLE LocalUids ( "
+    "  id INTEGER PRIMARY KEY, "
+    "  uid TEXT NOT NULL UNIQUE "
+    ")",
+    "CREATE TABLE RemoteUids ( "
+    "  id INTEGER PRIMARY KEY, "
+    "  uid TEXT NOT NULL UNIQUE "
+    ")",
+
     "CREATE TABLE Groups ( "
     "  id INTEGER PRIMARY KEY AUTOINCREMENT, "
     "  localUid TEXT, "
     "  remoteUids TEXT, "
     "  type INTEGER, "
     "  chatName TEXT, "
-    "  lastModified INTEGER UNSIGNED "
+    "  lastModified INTEGER UNSIGNED, "
+    "  lastEventTime INTEGER NOT NULL DEFAULT 0 "
     ")",
+    "CREATE INDEX groups_lastEventTime ON Groups (lastEventTime DESC, id DESC)",
 
     "CREATE TABLE Events ( "
     "  id INTEGER PRIMARY KEY AUTOINCREMENT, "
@@ -68,8 +216,8 @@ static const char *db_schema[] = {
     "  isEmergencyCall INTEGER, "
     "  status INTEGER, "
     "  bytesReceived INTEGER, "
-    "  localUid TEXT, "
-    "  remoteUid TEXT, "
+    "  localUidId INTEGER, "
+    "  remoteUidId INTEGER, "
     "  parentId INTEGER, " // XXX remove, unused
     "  subject TEXT, "
     "  freeText TEXT, "
@@ -91,21 +239,36 @@ static const char *db_schema[] = {
     "  isAction INTEGER, "
     "  hasExtraProperties BOOL DEFAULT 0, "
     "  hasMessageParts BOOL DEFAULT 0, "
+    "  minimizedRemoteUid TEXT, "
+    // Extra properties that are read with every event
+    "  subscriberIdentity TEXT, "
+    "  mmsUnread TEXT, "
+    "  mmsPushData TEXT, "
+    "  mmsExpiry TEXT, "
     "  FOREIGN KEY(groupId) REFERENCES Groups(id) ON DELETE CASCADE "
     ")",
-    "CREATE INDEX events_remoteUid ON Events (remoteUid)",
+    "CREATE INDEX events_remoteUidId ON Events (remoteUidId)",
     "CREATE INDEX events_type ON Events (type)",
     "CREATE INDEX events_messageToken ON Events (messageToken)",
     "CREATE INDEX events_sorting ON Events (groupId, endTime DESC, id DESC)",
     "CREATE INDEX events_unread ON Events (isRead)",
+    "CREATE INDEX events_minimizedRemoteUid ON Events (minimizedRemoteUid, endTime DESC, id DESC)",
+
+    // Dictionary of the keys of other extra properties
+    "CREATE TABLE EventPropertyKeys ( "
+    "  id INTEGER PRIMARY KEY, "
+    "  key TEXT NOT NULL UNIQUE "
+    ")",
 
     "CREATE TABLE EventProperties ( "
     "  eventId INTEGER, "
-    "  key TEXT, "
+    "  keyId INTEGER NOT NULL, "
     "  value BLOB, "
     "  FOREIGN KEY (eventId) REFERENCES Events(id) ON DELETE CASCADE, "
-    "  PRIMARY KEY (eventId, key) ON CONFLICT REPLACE "
+    "  FOREIGN KEY (keyId) REFERENCES EventPropertyKeys(id), "
+    "  PRIMARY KEY (eventId, keyId) ON CONFLICT REPLACE "
     ")",
+    "CREATE INDEX eventproperties_keyId ON EventProperties (keyId, eventId)",
 
     "CREATE TRIGGER eventproperties_flag_insert AFTER INSERT ON EventProperties "
     "  BEGIN "
@@ -137,7 +300,46 @@ static const char *db_schema[] = {
     "    UPDATE Events SET hasMessageParts=0 WHERE id=OLD.eventId; "
     "  END",
 
-    "PRAGMA user_version=4"
+    CHANGELOG_TABLE,
+
+    EVENTS_CHANGELOG_INSERT,
+    EVENTS_CHANGELOG_UPDATE,
+    EVENTS_CHANGELOG_DELETE,
+    GROUPS_CHANGELOG_INSERT,
+    GROUPS_CHANGELOG_UPDATE,
+    GROUPS_CHANGELOG_DELETE,
+    GROUPS_LAST_EVENT_INSERT,
+    GROUPS_LAST_EVENT_UPDATE,
+    GROUPS_LAST_EVENT_DELETE,
+    CHANGELOG_PRUNE,
+
+    // Results of contact resolution, keyed by the minimized address
+    "CREATE TABLE ContactCache ( "
+    "  localUid TEXT NOT NULL, "
+    "  remoteUid TEXT NOT NULL, "
+    "  contactId INTEGER NOT NULL, "
+    "  nameHash INTEGER, "
+    "  addressFlags INTEGER, "
+    "  PRIMARY KEY (localUid, remoteUid) "
+    ")",
+
+    // Participants of each group, as split from Groups.remoteUids
+    "CREATE TABLE GroupMembers ( "
+    "  groupId INTEGER NOT NULL, "
+    "  remoteUid TEXT NOT NULL, "
+    "  minimizedRemoteUid TEXT NOT NULL, "
+    "  FOREIGN KEY (groupId) REFERENCES Groups(id) ON DELETE CASCADE, "
+    "  PRIMARY KEY (groupId, remoteUid) ON CONFLICT IGNORE "
+    ")",
+    "CREATE INDEX groupmembers_minimized ON GroupMembers (minimizedRemoteUid, groupId)",
+
+    "CREATE TABLE Migrations ( "
+    "  name TEXT PRIMARY KEY, "
+    "  position INTEGER NOT NULL DEFAULT 0, "
+    "  lastId INTEGER NOT NULL "
+    ")",
+
+    "PRAGMA user_version=13"
 };
 static int db_schema_count = sizeof(db_schema) / sizeof(*db_schema);
 
@@ -203,12 +405,182 @@ static const char *db_upgrade_3[] = {
     0
 };
 
+static const char *db_upgrade_4[] = {
+    CHANGELOG_TABLE,
+    EVENTS_CHANGELOG_INSERT,
+    EVENTS_CHANGELOG_UPDATE,
+    EVENTS_CHANGELOG_DELETE,
+    GROUPS_CHANGELOG_INSERT,
+    // Replaced by GROUPS_CHANGELOG_UPDATE in schema version 13
+    "CREATE TRIGGER groups_changelog_update AFTER UPDATE ON Groups "
+    "  BEGIN "
+    "    INSERT INTO ChangeLog (tableId, operation, rowId, groupId) VALUES (1, 2, NEW.id, NEW.id); "
+    "  END",
+    GROUPS_CHANGELOG_DELETE,
+    CHANGELOG_PRUNE,
+    "PRAGMA user_version=5",
+    0
+};
+
+static const char *db_upgrade_5[] = {
+    "CREATE TABLE ContactCache ( "
+    "  localUid TEXT NOT NULL, "
+    "  remoteUid TEXT NOT NULL, "
+    "  contactId INTEGER NOT NULL, "
+    "  nameHash INTEGER, "
+    "  addressFlags INTEGER, "
+    "  PRIMARY KEY (localUid, remoteUid) "
+    ")",
+    "PRAGMA user_version=6",
+    0
+};
+
+static const char *db_upgrade_6[] = {
+    "CREATE TABLE GroupMembers ( "
+    "  groupId INTEGER NOT NULL, "
+    "  remoteUid TEXT NOT NULL, "
+    "  minimizedRemoteUid TEXT NOT NULL, "
+    "  FOREIGN KEY (groupId) REFERENCES Groups(id) ON DELETE CASCADE, "
+    "  PRIMARY KEY (groupId, remoteUid) ON CONFLICT IGNORE "
+    ")",
+    "CREATE INDEX groupmembers_minimized ON GroupMembers (minimizedRemoteUid, groupId)",
+    "PRAGMA user_version=7",
+    0
+};
+
+/* Data that upgrades would rewrite in every event is migrated by
+ * DatabaseMigration in small batches after the upgrade. An upgrade adds the
+ * new columns and tables, and queues the migration of events up to the last
+ * id; newer events are written in the new form. */
+#define MIGRATIONS_TABLE \
+    "CREATE TABLE IF NOT EXISTS Migrations ( " \
+    "  name TEXT PRIMARY KEY, " \
+    "  position INTEGER NOT NULL DEFAULT 0, " \
+    "  lastId INTEGER NOT NULL " \
+    ")"
+
+#define QUEUE_MIGRATION(name) \
+    "INSERT INTO Migrations (name, lastId) " \
+    "  SELECT '" name "', IFNULL((SELECT seq FROM sqlite_sequence WHERE name = 'Events'), 0)"
+
+// Existing events are given their minimized address by MINIMIZED_REMOTE_UIDS_MIGRATION
+static const char *db_upgrade_7[] = {
+    "ALTER TABLE Events ADD COLUMN minimizedRemoteUid TEXT",
+    "CREATE INDEX events_minimizedRemoteUid ON Events (minimizedRemoteUid, endTime DESC, id DESC)",
+    MIGRATIONS_TABLE,
+    QUEUE_MIGRATION(MINIMIZED_REMOTE_UIDS_MIGRATION),
+    "PRAGMA user_version=8",
+    0
+};
+
+// Events refer to their UIDs by id. The UIDs of existing events are moved by
+// UID_DICTIONARY_MIGRATION, which drops the index of the text column.
+static const char *db_upgrade_8[] = {
+    "CREATE TABLE LocalUids ( "
+    "  id INTEGER PRIMARY KEY, "
+    "  uid TEXT NOT NULL UNIQUE "
+    ")",
+    "CREATE TABLE RemoteUids ( "
+    "  id INTEGER PRIMARY KEY, "
+    "  uid TEXT NOT NULL UNIQUE "
+    ")",
+    "ALTER TABLE Events ADD COLUMN localUidId INTEGER",
+    "ALTER TABLE Events ADD COLUMN remoteUidId INTEGER",
+    "CREATE INDEX events_remoteUidId ON Events (remoteUidId)",
+    MIGRATIONS_TABLE,
+    QUEUE_MIGRATION(UID_DICTIONARY_MIGRATION),
+    "PRAGMA user_version=9",
+    0
+};
+
+// Databases from version 10 on are created with incremental vacuum. Older
+// ones need a VACUUM to convert, which can't run while clients wait for the
+// upgrade; the idle DatabaseMaintenance converts them.
+static const char *db_upgrade_9[] = {
+    "PRAGMA user_version=10",
+    0
+};
+
+// Adds columns for the extra properties read with every event, and replaces
+// the keys of EventProperties with ids in EventPropertyKeys. The existing
+// properties are left in OldEventProperties for PROPERTY_KEYS_MIGRATION,
+// then moved to their columns by PROMOTED_PROPERTIES_MIGRATION.
+static const char *db_upgrade_10[] = {
+    "ALTER TABLE Events ADD COLUMN subscriberIdentity TEXT",
+    "ALTER TABLE Events ADD COLUMN mmsUnread TEXT",
+    "ALTER TABLE Events ADD COLUMN mmsPushData TEXT",
+    "ALTER TABLE Events ADD COLUMN mmsExpiry TEXT",
+
+    "CREATE TABLE EventPropertyKeys ( "
+    "  id INTEGER PRIMARY KEY, "
+    "  key TEXT NOT NULL UNIQUE "
+    ")",
+
+    "DROP TRIGGER eventproperties_flag_insert",
+    "DROP TRIGGER eventproperties_flag_delete",
+    "ALTER TABLE EventProperties RENAME TO OldEventProperties",
+    "CREATE TABLE EventProperties ( "
+    "  eventId INTEGER, "
+    "  keyId INTEGER NOT NULL, "
+    "  value BLOB, "
+    "  FOREIGN KEY (eventId) REFERENCES Events(id) ON DELETE CASCADE, "
+    "  FOREIGN KEY (keyId) REFERENCES EventPropertyKeys(id), "
+    "  PRIMARY KEY (eventId, keyId) ON CONFLICT REPLACE "
+    ")",
+    "CREATE INDEX eventproperties_keyId ON EventProperties (keyId, eventId)",
+    MIGRATIONS_TABLE,
+    QUEUE_MIGRATION(PROPERTY_KEYS_MIGRATION),
+
+    "CREATE TRIGGER eventproperties_flag_insert AFTER INSERT ON EventProperties "
+    "  BEGIN "
+    "    UPDATE Events SET hasExtraProperties=1 WHERE id=NEW.eventId; "
+    "  END",
+    "CREATE TRIGGER eventproperties_flag_delete AFTER DELETE ON EventProperties "
+    "  WHEN (SELECT COUNT(*) FROM EventProperties WHERE eventId=OLD.eventId) = 0 "
+    "  BEGIN "
+    "    UPDATE Events SET hasExtraProperties=0 WHERE id=OLD.eventId; "
+    "  END",
+    "PRAGMA user_version=11",
+    0
+};
+
+static const char *db_upgrade_11[] = {
+    MIGRATIONS_TABLE,
+    QUEUE_MIGRATION(PROMOTED_PROPERTIES_MIGRATION),
+    "PRAGMA user_version=12",
+    0
+};
+
+// Adds Groups.lastEventTime. There are few groups, and each is computed from
+// the events_sorting index, so they are filled in the upgrade.
+static const char *db_upgrade_12[] = {
+    "ALTER TABLE Groups ADD COLUMN lastEventTime INTEGER NOT NULL DEFAULT 0",
+    "DROP TRIGGER groups_changelog_update",
+    GROUPS_CHANGELOG_UPDATE,
+    "UPDATE Groups SET " GROUPS_LAST_EVENT_TIME,
+    "CREATE INDEX groups_lastEventTime ON Groups (lastEventTime DESC, id DESC)",
+    GROUPS_LAST_EVENT_INSERT,
+    GROUPS_LAST_EVENT_UPDATE,
+    GROUPS_LAST_EVENT_DELETE,
+    "PRAGMA user_version=13",
+    0
+};
+
 // REMEMBER TO UPDATE THE SCHEMA AND USER_VERSION!
 static const char **db_upgrade[] = {
     db_upgrade_0,
     db_upgrade_1,
     db_upgrade_2,
-    db_upgrade_3
+    db_upgrade_3,
+    db_upgrade_4,
+    db_upgrade_5,
+    db_upgrade_6,
+    db_upgrade_7,
+    db_upgrade_8,
+    db_upgrade_9,
+    db_upgrade_10,
+    db_upgrade_11,
+    db_upgrade_12
 };
 static int db_upgrade_count = sizeof(db_upgrade) / sizeof(*db_upgrade);
 
@@ -225,6 +597,65 @@ static bool execute(QSqlDatabase &database, const QString &statement)
     }
 }
 
+static bool populateGroupMembers(QSqlDatabase &database)
+{
+    QSqlQuery select(database);
+    select.setForwardOnly(true);
+    if (!select.exec(QLatin1String("SELECT id, localUid, remoteUids FROM Groups"))) {
+        qWarning() << "Query failed";
+        qWarning() << select.lastError();
+        qWarning() << select.lastQuery();
+        return false;
+    }
+
+    QSqlQuery insert(database);
+    if (!insert.prepare(QLatin1String("INSERT INTO GroupMembers (groupId, remoteUid, minimizedRemoteUid) "
+                                      "VALUES (:groupId, :remoteUid, :minimizedRemoteUid)"))) {
+        qWarning() << "Failed to prepare query";
+        qWarning() << insert.lastError();
+        return false;
+    }
+
+    while (select.next()) {
+        const CommHistory::RecipientList recipients = CommHistory::RecipientList::fromUids(
+                select.value(1).toString(), select.value(2).toString().split(QLatin1Char('\n')));
+
+        insert.bindValue(":groupId", select.value(0).toInt());
+        foreach (const CommHistory::Recipient &recipient, recipients.recipients()) {
+            insert.bindValue(":remoteUid", recipient.remoteUid());
+            insert.bindValue(":minimizedRemoteUid", recipient.minimizedRemoteUid());
+            if (!insert.exec()) {
+                qWarning() << "Query failed";
+                qWarning() << insert.lastError();
+                qWarning() << insert.lastQuery();
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/* Upgrade steps that can't be expressed as queries, indexed by old version.
+ * They run after the queries of the same version, in the upgrade transaction. */
+typedef bool (*UpgradeFunction)(QSqlDatabase &database);
+static const UpgradeFunction db_upgrade_functions[] = {
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    populateGroupMembers,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0
+};
+Q_STATIC_ASSERT(sizeof(db_upgrade_functions) / sizeof(*db_upgrade_functions) == sizeof(db_upgrade) / sizeof(*db_upgrade));
+
 static bool prepareDatabase(QSqlDatabase &database)
 {
     if (!database.transaction())
@@ -271,6 +702,9 @@ static bool upgradeDatabase(QSqlDatabase &database)
                 return false;
         }
 
+        if (db_upgrade_functions[user_version] && !db_upgrade_functions[user_version](database))
+            return false;
+
         if (!query.exec() || !query.next()) {
             qWarning() << "User version query failed:" << query.lastError();
             return false;
@@ -286,6 +720,167 @@ static bool upgradeDatabase(QSqlDatabase &database)
     return true;
 }
 
+static bool archiveColumns(QSqlDatabase &database, const QString &table, QStringList &columns)
+{
+    QSqlQuery query(database);
+    if (!query.exec(QStringLiteral("PRAGMA archive.table_info(%1)").arg(table))) {
+        qWarning() << "Query failed";
+        qWarning() << query.lastError();
+        return false;
+    }
+    while (query.next())
+        columns.append(query.value(1).toString());
+
+    return true;
+}
+
+// Adds the columns that upgrades added to the main tables since the archive was created
+static bool updateArchiveColumns(QSqlDatabase &database, const QString &table)
+{
+    QStringList archiveColumns;
+    if (!archiveColumns(database, table, archiveColumns))
+        return false;
+
+    QSqlQuery query(database);
+
+    if (!query.exec(QStringLiteral("PRAGMA main.table_info(%1)").arg(table))) {
+        qWarning() << "Query failed";
+        qWarning() << query.lastError();
+        return false;
+    }
+
+    QStringList statements;
+    while (query.next()) {
+        const QString column = query.value(1).toString();
+        if (!archiveColumns.contains(column)) {
+            statements.append(QStringLiteral("ALTER TABLE archive.%1 ADD COLUMN %2 %3")
+                              .arg(table).arg(column).arg(query.value(2).toString()));
+        }
+    }
+    query.finish();
+
+    foreach (const QString &statement, statements) {
+        if (!execute(database, statement))
+            return false;
+    }
+
+    return true;
+}
+
+static bool archiveVersion(QSqlDatabase &database, int &version)
+{
+    QSqlQuery query(database);
+    if (!query.exec(QLatin1String("PRAGMA archive.user_version")) || !query.next()) {
+        qWarning() << "Archive version query failed:" << query.lastError();
+        return false;
+    }
+    version = query.value(0).toInt();
+    return true;
+}
+
+static bool prepareArchive(QSqlDatabase &database)
+{
+    const int expectedVersion = db_upgrade_count * 100 + db_archive_revision;
+
+    // Only reads, unless the archive needs to be prepared
+    int version = 0;
+    if (!archiveVersion(database, version))
+        return false;
+    if (version >= expectedVersion) {
+        if (version > expectedVersion)
+            qWarning() << "Commhistory archive schema is newer than expected";
+        return true;
+    }
+
+    if (!execute(database, "BEGIN IMMEDIATE TRANSACTION"))
+        return false;
+
+    // Another connection may have prepared it in the meantime
+    if (!archiveVersion(database, version)) {
+        execute(database, "ROLLBACK");
+        return false;
+    }
+    if (version >= expectedVersion)
+        return execute(database, "END TRANSACTION");
+
+    for (int i = 0; i < db_archive_schema_count; i++) {
+        if (!execute(database, QLatin1String(db_archive_schema[i]))) {
+            execute(database, "ROLLBACK");
+            return false;
+        }
+    }
+
+    for (int i = 0; i < db_archive_tables_count; i++) {
+        if (!updateArchiveColumns(database, QLatin1String(db_archive_tables[i]))) {
+            execute(database, "ROLLBACK");
+            return false;
+        }
+    }
+
+    // Archives created before schema version 11 still refer to property keys by name
+    QStringList propertyColumns;
+    if (!archiveColumns(database, QStringLiteral("EventProperties"), propertyColumns)) {
+        execute(database, "ROLLBACK");
+        return false;
+    }
+    bool upgradeProperties = false;
+    if (propertyColumns.contains(QStringLiteral("key"))) {
+        QSqlQuery query(database);
+        if (!query.exec(QLatin1String("SELECT 1 FROM archive.EventProperties WHERE keyId IS NULL LIMIT 1"))) {
+            qWarning() << "Query failed";
+            qWarning() << query.lastError();
+            execute(database, "ROLLBACK");
+            return false;
+        }
+        upgradeProperties = query.next();
+    }
+    if (upgradeProperties) {
+        for (int i = 0; i < db_archive_upgrade_properties_count; i++) {
+            if (!execute(database, QLatin1String(db_archive_upgrade_properties[i]))) {
+                execute(database, "ROLLBACK");
+                return false;
+            }
+        }
+    }
+
+    for (int i = 0; i < db_archive_indexes_count; i++) {
+        if (!execute(database, QLatin1String(db_archive_indexes[i]))) {
+            execute(database, "ROLLBACK");
+            return false;
+        }
+    }
+
+    if (!execute(database, QStringLiteral("PRAGMA archive.user_version = %1").arg(expectedVersion))) {
+        execute(database, "ROLLBACK");
+        return false;
+    }
+
+    return execute(database, "END TRANSACTION");
+}
+
+static bool attachArchive(QSqlDatabase &database, const QString &archiveFile)
+{
+    QSqlQuery query(database);
+    query.prepare(QLatin1String("ATTACH DATABASE :file AS archive"));
+    query.bindValue(":file", archiveFile);
+    if (!query.exec()) {
+        qWarning() << "Failed to attach archive database" << archiveFile;
+        qWarning() << query.lastError();
+        return false;
+    }
+    query.finish();
+
+    // As for the main database, auto_vacuum only applies to a new archive
+    if (!execute(database, "PRAGMA archive.auto_vacuum = INCREMENTAL")
+            || (archiveFile != QLatin1String(":memory:") && !execute(database, "PRAGMA archive.journal_mode = WAL"))
+            || !prepareArchive(database)) {
+        execute(database, "DETACH DATABASE archive");
+        return false;
+    }
+
+    return true;
+}
+
 QSqlDatabase CommHistoryDatabase::open(const QString &databaseName)
 {
     QDir databaseDir(CommHistoryDatabasePath::databaseDir());
@@ -332,9 +927,35 @@ QSqlDatabase CommHistoryDatabase::open(const QString &databaseName)
         }
     }
 
+    // Queries refer to the archive, so an empty one stands in if it is
+    // unavailable. Nothing can be archived on such a connection; see hasArchiveFile().
+    if (database.isOpen()
+            && !attachArchive(database, databaseDir.absoluteFilePath(CommHistoryDatabasePath::archiveFile()))) {
+        qCritical() << "Failed to attach the archive database; archived events are unavailable on this connection";
+        if (!attachArchive(database, QStringLiteral(":memory:")))
+            qCritical() << "Failed to attach an archive database";
+    }
+
     return database;
 }
 
+bool CommHistoryDatabase::hasArchiveFile(const QSqlDatabase &database)
+{
+    QSqlQuery query(database);
+    if (!query.exec(QLatin1String("PRAGMA database_list"))) {
+        qWarning() << "Query failed";
+        qWarning() << query.lastError();
+        return false;
+    }
+
+    // Databases in memory have no file name
+    while (query.next()) {
+        if (query.value(1).toString() == QLatin1String("archive"))
+            return !query.value(2).toString().isEmpty();
+    }
+    return false;
+}
+
 QSqlQuery CommHistoryDatabase::prepare(const char *statement, const QSqlDatabase &database)
 {
     QSqlQuery query(database);
@@ -363,6 +984,11 @@ QString CommHistoryDatabasePath::databaseFile()
     return QString(QLatin1String(COMMHISTORY_DATABASE_NAME));
 }
 
+QString CommHistoryDatabasePath::archiveFile()
+{
+    return QString(QLatin1String(COMMHISTORY_ARCHIVE_NAME));
+}
+
 QString CommHistoryDatabasePath::dataDir()
 {
     return db_root_dir + QStringLiteral(COMMHISTORY_DATA_DIR);
@@ -30,6 +30,10 @@ class CommHistoryDatabase
 public:
     static QSqlDatabase open(const QString &databaseName);
     static QSqlQuery prepare(const char *statement, const QSqlDatabase &database);
+
+    /* Returns false if the connection has no archive, or only the empty
+     * archive in memory that stands in for one that failed to attach. */
+    static bool hasArchiveFile(const QSqlDatabase &database);
 };
 
 #endif
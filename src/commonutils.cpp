@@ -21,6 +21,7 @@
 ******************************************************************************/
 
 #include "commonutils.h"
+#include "commonutils_p.h"
 #include "libcommhistoryexport.h"
 
 #include <qtcontacts-extensions.h>
@@ -29,21 +30,76 @@
 #include <QString>
 #include <QSettings>
 
+#include <string.h>
+
 namespace {
 
-int phoneNumberMatchLength()
+const quint64 unitHighBits = Q_UINT64_C(0x8000800080008000);
+
+// Returns true if all four UTF-16 code units in the word are ASCII digits
+inline bool allDigits(quint64 units)
+{
+    if (units & Q_UINT64_C(0xff80ff80ff80ff80))
+        return false;
+
+    // Each unit is below 0x80, so these additions cannot carry into the next unit;
+    // the high bit of each unit is set if it is at least '0', and at least ':'
+    const quint64 fromZero = units + Q_UINT64_C(0x7fd07fd07fd07fd0);
+    const quint64 pastNine = units + Q_UINT64_C(0x7fc67fc67fc67fc6);
+    return (fromZero & ~pastNine & unitHighBits) == unitHighBits;
+}
+
+// Returns the number of digits, or -1 if there is anything other than digits after an optional '+'
+int countDigits(const QChar *number, int length)
+{
+    const ushort *units = reinterpret_cast<const ushort *>(number);
+
+    int i = (length > 0 && units[0] == '+') ? 1 : 0;
+    const int digits = length - i;
+
+    // Test four characters at a time, for the usual case where all are digits
+    for ( ; i + 4 <= length; i += 4) {
+        quint64 word;
+        memcpy(&word, units + i, sizeof(word));
+        if (!allDigits(word))
+            return -1;
+    }
+    for ( ; i < length; ++i) {
+        if (units[i] < '0' || units[i] > '9')
+            return -1;
+    }
+
+    return digits;
+}
+
+}
+
+namespace CommHistory {
+
+LIBCOMMHISTORY_EXPORT int phoneNumberMatchLength()
 {
     // TODO: use a configuration variable to make this configurable
     static int numberMatchLength = QtContactsSqliteExtensions::DefaultMaximumPhoneNumberCharacters;
     return numberMatchLength;
 }
 
-}
+LIBCOMMHISTORY_EXPORT int minimizePhoneNumber(const QChar *number, int length, QChar *buffer)
+{
+    // Shorter numbers are kept whole, which depends on the handling of '+'
+    const int matchLength = phoneNumberMatchLength();
+    if (countDigits(number, length) <= matchLength)
+        return -1;
 
-namespace CommHistory {
+    memcpy(buffer, number + length - matchLength, matchLength * sizeof(QChar));
+    return matchLength;
+}
 
 LIBCOMMHISTORY_EXPORT QString normalizePhoneNumber(const QString &number, bool validate)
 {
+    // Numbers which are already normalized are returned as they are
+    if (countDigits(number.constData(), number.length()) > 0)
+        return number;
+
     // Validate the number, and retain the dial string
     QtContactsSqliteExtensions::NormalizePhoneNumberFlags flags(QtContactsSqliteExtensions::KeepPhoneNumberDialString);
     if (validate)
@@ -54,6 +110,13 @@ LIBCOMMHISTORY_EXPORT QString normalizePhoneNumber(const QString &number, bool v
 
 LIBCOMMHISTORY_EXPORT QString minimizePhoneNumber(const QString &number)
 {
+    QChar buffer[QtContactsSqliteExtensions::DefaultMaximumPhoneNumberCharacters];
+    Q_ASSERT(phoneNumberMatchLength() <= QtContactsSqliteExtensions::DefaultMaximumPhoneNumberCharacters);
+
+    const int length = minimizePhoneNumber(number.constData(), number.length(), buffer);
+    if (length >= 0)
+        return QString(buffer, length);
+
     return QtContactsSqliteExtensions::minimizePhoneNumber(number, phoneNumberMatchLength());
 }
 
@@ -62,6 +125,14 @@ LIBCOMMHISTORY_EXPORT bool remoteAddressMatch(const QString &localUid, const QSt
     if (localUidComparesPhoneNumbers(localUid)) {
         QString phone, phoneMatch;
         if (minimizedComparison) {
+            // Compare the usual form of numbers without creating the minimized strings
+            QChar uidBuffer[QtContactsSqliteExtensions::DefaultMaximumPhoneNumberCharacters];
+            QChar matchBuffer[QtContactsSqliteExtensions::DefaultMaximumPhoneNumberCharacters];
+            const int uidLength = minimizePhoneNumber(uid.constData(), uid.length(), uidBuffer);
+            const int matchLength = minimizePhoneNumber(match.constData(), match.length(), matchBuffer);
+            if (uidLength >= 0 && matchLength >= 0)
+                return uidLength == matchLength && memcmp(uidBuffer, matchBuffer, uidLength * sizeof(QChar)) == 0;
+
             phone = minimizePhoneNumber(uid);
             phoneMatch = minimizePhoneNumber(match);
         } else {
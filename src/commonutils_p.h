@@ -0,0 +1,52 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jollamobile.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+#ifndef COMMHISTORY_COMMONUTILS_P_H
+#define COMMHISTORY_COMMONUTILS_P_H
+
+#include <QChar>
+
+namespace CommHistory {
+
+/*!
+ * Number of trailing digits kept by minimizePhoneNumber().
+ */
+int phoneNumberMatchLength();
+
+/*!
+ * Minimize a phone number into a buffer, without allocating.
+ *
+ * This handles the common form of numbers that are only digits, with an
+ * optional leading '+', and longer than phoneNumberMatchLength(). Other
+ * numbers must be minimized with minimizePhoneNumber(const QString &),
+ * which gives the same result for all numbers.
+ *
+ * \param number Phone number characters.
+ * \param length Number of characters in number.
+ * \param buffer Output, with room for phoneNumberMatchLength() characters.
+ * \return Length of the minimized number, or -1 if the number is not handled.
+ */
+int minimizePhoneNumber(const QChar *number, int length, QChar *buffer);
+
+}
+
+#endif
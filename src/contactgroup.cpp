@@ -32,8 +32,16 @@ class ContactGroupPrivate {
     Q_DECLARE_PUBLIC(ContactGroup)
 
 public:
+    // The values a group last contributed to the aggregate properties
+    struct Contribution {
+        quint32 startTimeT, endTimeT, lastModifiedT;
+        int unreadMessages;
+    };
+
     ContactGroupPrivate(ContactGroup *parent);
 
+    static Contribution contributionOf(GroupObject *group);
+
     void updateForGroup(GroupObject *group,
                         quint32 &uStartTimeT, quint32 &uEndTimeT, quint32 &uLastModifiedT,
                         int &uUnreadMessages, QString &uSubscriberIdentity, GroupObject *&uLastEventGroup);
@@ -43,11 +51,13 @@ public:
 
     void recalculate();
     void includeGroup(GroupObject *group);
+    void applyChange(GroupObject *group, const Contribution &previous);
 
     void resolve();
 
     ContactGroup *q_ptr;
     QList<GroupObject*> groups;
+    QHash<GroupObject*, Contribution> contributions;
  
     QList<int> contactIds;
     QStringList displayNames;
@@ -91,6 +101,7 @@ void ContactGroup::addGroup(GroupObject *group)
     if (!d->groups.contains(group)) {
         d->groupsResolved &= group->isResolved();
         d->groups.append(group);
+        d->contributions.insert(group, ContactGroupPrivate::contributionOf(group));
         emit groupsChanged();
 
         d->includeGroup(group);
@@ -101,6 +112,7 @@ bool ContactGroup::removeGroup(GroupObject *group)
 {
     Q_D(ContactGroup);
     if (d->groups.removeOne(group)) {
+        d->contributions.remove(group);
         emit groupsChanged();
         d->recalculate();
     }
@@ -112,8 +124,61 @@ void ContactGroup::updateGroup(GroupObject *group)
 {
     Q_D(ContactGroup);
 
-    Q_UNUSED(group);
-    d->recalculate();
+    QHash<GroupObject*, ContactGroupPrivate::Contribution>::iterator it = d->contributions.find(group);
+    if (it == d->contributions.end()) {
+        d->recalculate();
+        return;
+    }
+
+    const ContactGroupPrivate::Contribution previous = *it;
+    *it = ContactGroupPrivate::contributionOf(group);
+    d->applyChange(group, previous);
+}
+
+ContactGroupPrivate::Contribution ContactGroupPrivate::contributionOf(GroupObject *group)
+{
+    Contribution c;
+    c.startTimeT = group->startTimeT();
+    c.endTimeT = group->endTimeT();
+    c.lastModifiedT = group->lastModifiedT();
+    c.unreadMessages = group->unreadMessages();
+    return c;
+}
+
+/* Update the aggregates for a change in one group, given what it contributed
+ * before. Sums take the difference and maximums the new value; only when a
+ * group that held a maximum moves backwards do all groups need to be walked. */
+void ContactGroupPrivate::applyChange(GroupObject *group, const Contribution &previous)
+{
+    const Contribution current = contributions.value(group);
+
+    if ((current.startTimeT < previous.startTimeT && previous.startTimeT == startTimeT)
+            || (current.endTimeT < previous.endTimeT && previous.endTimeT == endTimeT)
+            || (current.lastModifiedT < previous.lastModifiedT && previous.lastModifiedT == lastModifiedT)
+            || (group == lastEventGroup && (group->lastEventId() < 0 || current.endTimeT < previous.endTimeT))) {
+        recalculate();
+        return;
+    }
+
+    QList<int> uContactIds;
+    QStringList uDisplayNames;
+    if (!groups.isEmpty()) {
+        // As in recalculate(), the first group stands for all of them
+        uContactIds = groups[0]->recipients().contactIds();
+        uDisplayNames = groups[0]->recipients().displayNames();
+    }
+
+    quint32 uStartTimeT = qMax(startTimeT, current.startTimeT);
+    quint32 uEndTimeT = qMax(endTimeT, current.endTimeT);
+    quint32 uLastModifiedT = qMax(lastModifiedT, current.lastModifiedT);
+    int uUnreadMessages = unreadMessages - previous.unreadMessages + current.unreadMessages;
+    QString uSubscriberIdentity = current.endTimeT >= endTimeT ? group->subscriberIdentity() : subscriberIdentity;
+
+    GroupObject *uLastEventGroup = lastEventGroup;
+    if (group->lastEventId() >= 0 && (!uLastEventGroup || current.endTimeT > uLastEventGroup->endTimeT()))
+        uLastEventGroup = group;
+
+    setValues(uContactIds, uDisplayNames, uStartTimeT, uEndTimeT, uLastModifiedT, uUnreadMessages, uSubscriberIdentity, uLastEventGroup);
 }
 
 void ContactGroupPrivate::updateForGroup(GroupObject *group,
@@ -125,14 +190,15 @@ void ContactGroupPrivate::updateForGroup(GroupObject *group,
     const quint32 gLastModifiedT = group->lastModifiedT();
     const QString gSubscriberIdentity = group->subscriberIdentity();
 
+    // Follow the most recent group; compared before uEndTimeT includes this group
+    uSubscriberIdentity = uEndTimeT >= gEndTimeT ? uSubscriberIdentity : gSubscriberIdentity;
+
     uStartTimeT = qMax(gStartTimeT, uStartTimeT);
     uEndTimeT = qMax(gEndTimeT, uEndTimeT);
     uLastModifiedT = qMax(gLastModifiedT, uLastModifiedT);
 
     uUnreadMessages += group->unreadMessages();
 
-    uSubscriberIdentity = uEndTimeT >= gEndTimeT ? uSubscriberIdentity : gSubscriberIdentity;
-
     if (group->lastEventId() >= 0 && (!uLastEventGroup || gEndTimeT > uLastEventGroup->endTimeT()))
         uLastEventGroup = group;
 }
@@ -225,8 +291,8 @@ void ContactGroupPrivate::setValues(const QList<int> &uContactIds, const QString
 
 void ContactGroupPrivate::recalculate()
 {
-    /* Iterate all groups to recalculate properties. Unfortunately, we can't rely on just comparing
-       the changes to one group and have reliable data.
+    /* Iterate all groups to recalculate properties. This is needed when a group is
+       removed, or when applyChange() can't tell the new value of a maximum.
      */
 
     QList<int> uContactIds;
@@ -261,7 +327,7 @@ void ContactGroupPrivate::includeGroup(GroupObject *group)
     QStringList uDisplayNames(firstGroup ? group->recipients().displayNames() : displayNames);
     quint32 uStartTimeT = startTimeT, uEndTimeT = endTimeT, uLastModifiedT = lastModifiedT;
     int uUnreadMessages = unreadMessages;
-    QString uSubscriberIdentity = group->subscriberIdentity();
+    QString uSubscriberIdentity = firstGroup ? group->subscriberIdentity() : subscriberIdentity;
     GroupObject *uLastEventGroup = lastEventGroup;
 
     updateForGroup(group, uStartTimeT, uEndTimeT, uLastModifiedT, uUnreadMessages, uSubscriberIdentity, uLastEventGroup);
@@ -431,18 +497,18 @@ bool ContactGroup::deleteGroups()
     if (ids.isEmpty())
         return true;
 
-    DatabaseIO *database = DatabaseIO::instance();
-    if (!database->transaction())
-        return false;
-
-    if (!database->deleteGroups(ids)) {
-        database->rollback();
+    // Not in a transaction, so that the events are deleted in batches
+    // that each commit separately
+    QList<int> deletedEventIds;
+    if (!DatabaseIO::instance()->deleteGroups(ids, deletedEventIds)) {
+        // Batches committed before the failure stay deleted
+        foreach (int id, deletedEventIds)
+            emit UpdatesEmitter::instance()->eventDeleted(id);
+        if (!deletedEventIds.isEmpty())
+            emit UpdatesEmitter::instance()->groupsUpdated(ids);
         return false;
     }
 
-    if (!database->commit())
-        return false;
-
     emit UpdatesEmitter::instance()->groupsDeleted(ids);
     return true;
 }
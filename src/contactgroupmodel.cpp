@@ -24,6 +24,8 @@
 #include <QDebug>
 #include <QStringList>
 
+#include <algorithm>
+
 #include "contactgroupmodel.h"
 #include "groupmanager.h"
 #include "contactgroup.h"
@@ -47,6 +49,36 @@ inline bool contactGroupSort(ContactGroup *a, ContactGroup *b)
     return a->endTimeT() > b->endTimeT(); // descending order
 }
 
+// Recipients that match each other always produce the same address key
+QString addressKey(const Recipient &recipient)
+{
+    if (recipient.isPhoneNumber())
+        return QLatin1String("p:") + recipient.minimizedRemoteUid();
+    return QLatin1String("u:") + recipient.localUid() + QLatin1Char('\n') + recipient.minimizedRemoteUid();
+}
+
+/* Keys under which a group is indexed for indexForContacts(). Groups that
+ * could be combined share at least one key: the set of their addresses, or
+ * for single recipient groups, the resolved contact. Keys only select
+ * candidates; the full comparison is still made against each of them. */
+QStringList contactKeys(GroupObject *group)
+{
+    const RecipientList &recipients = group->recipients();
+
+    QStringList addresses;
+    addresses.reserve(recipients.size());
+    foreach (const Recipient &recipient, recipients)
+        addresses.append(addressKey(recipient));
+    addresses.sort();
+    addresses.removeDuplicates();
+
+    QStringList keys;
+    keys.append(QLatin1String("a:") + addresses.join(QChar(0x1f)));
+    if (recipients.size() == 1 && recipients.first().contactId() > 0)
+        keys.append(QString::fromLatin1("c:%1").arg(recipients.first().contactId()));
+    return keys;
+}
+
 }
 
 bool contactgroupmodel_initialized = initializeTypes();
@@ -73,9 +105,22 @@ public:
 
     void setManager(GroupManager *manager);
 
+    // Lookup structures for indexForContacts() and indexForObject()
+    QHash<GroupObject*, ContactGroup*> groupItems;
+    QHash<GroupObject*, QStringList> groupKeys;
+    QMultiHash<QString, GroupObject*> keyGroups;
+
     int indexForContacts(GroupObject *group);
     int indexForObject(GroupObject *group);
 
+    ContactGroup *itemForContacts(GroupObject *group) const;
+    bool itemMatchesGroup(ContactGroup *item, GroupObject *group) const;
+    int rowForItem(ContactGroup *item) const;
+
+    void indexGroup(GroupObject *group, ContactGroup *item);
+    void unindexGroup(GroupObject *group);
+    void clearIndex();
+
 private slots:
     void groupAdded(GroupObject *group);
     void groupUpdated(GroupObject *group);
@@ -119,6 +164,7 @@ void ContactGroupModelPrivate::setManager(GroupManager *m)
             emit q->contactGroupRemoved(g);
         qDeleteAll(items);
         items.clear();
+        clearIndex();
     }
 
     manager = m;
@@ -132,16 +178,16 @@ void ContactGroupModelPrivate::setManager(GroupManager *m)
 
         // Create data without sorting
         foreach (GroupObject *group, manager->groups()) {
-            int index = indexForContacts(group);
+            ContactGroup *item = itemForContacts(group);
 
-            if (index < 0) {
-                ContactGroup *item = new ContactGroup(this);
-                index = items.size();
+            if (!item) {
+                item = new ContactGroup(this);
                 items.append(item);
             }
 
-            items[index]->addGroup(group);
-            emit q->contactGroupCreated(items[index]);
+            item->addGroup(group);
+            indexGroup(group, item);
+            emit q->contactGroupCreated(item);
         }
 
         std::sort(items.begin(), items.end(), contactGroupSort);
@@ -155,62 +201,120 @@ void ContactGroupModelPrivate::setManager(GroupManager *m)
 
 int ContactGroupModelPrivate::indexForContacts(GroupObject *group)
 {
-    const RecipientList &searchRecipients = group->recipients();
+    ContactGroup *item = itemForContacts(group);
+    return item ? rowForItem(item) : -1;
+}
 
-    for (int i = 0; i < items.size(); i++) {
-        int matched = 0;
-        /* We have to match all groups to be sure that a contact change hasn't
-         * invalidated the relationship */
-        foreach (GroupObject *compareGroup, items[i]->groups()) {
-            const RecipientList &compareRecipients = compareGroup->recipients();
-
-            /* Multi-recipient groups are never combined, because that would create a
-             * huge set of nasty corner cases, e.g. when two groups match in contacts
-             * but not UIDs. */
-            if (searchRecipients.size() > 1 || compareRecipients.size() > 1) {
-                if (!searchRecipients.matches(compareRecipients))
-                    break;
-            } else if (!searchRecipients.hasSameContacts(compareRecipients)) {
-                break;
-            }
+int ContactGroupModelPrivate::indexForObject(GroupObject *group)
+{
+    ContactGroup *item = groupItems.value(group);
+    return item ? rowForItem(item) : -1;
+}
+
+ContactGroup *ContactGroupModelPrivate::itemForContacts(GroupObject *group) const
+{
+    QSet<ContactGroup*> candidates;
 
-            matched++;
+    // The keys of the group may have changed since it was added to its item
+    if (ContactGroup *current = groupItems.value(group))
+        candidates.insert(current);
+
+    foreach (const QString &key, contactKeys(group)) {
+        QMultiHash<QString, GroupObject*>::const_iterator it = keyGroups.constFind(key);
+        for ( ; it != keyGroups.constEnd() && it.key() == key; ++it) {
+            if (ContactGroup *item = groupItems.value(it.value()))
+                candidates.insert(item);
         }
+    }
 
-        if (matched > 0 && matched == items[i]->groups().size())
-            return i;
+    // Prefer the most recent item, which is the first in model order
+    ContactGroup *match = 0;
+    foreach (ContactGroup *item, candidates) {
+        if ((!match || contactGroupSort(item, match)) && itemMatchesGroup(item, group))
+            match = item;
     }
 
-    return -1;
+    return match;
 }
 
-int ContactGroupModelPrivate::indexForObject(GroupObject *group)
+bool ContactGroupModelPrivate::itemMatchesGroup(ContactGroup *item, GroupObject *group) const
+{
+    const RecipientList &searchRecipients = group->recipients();
+    const QList<GroupObject*> &itemGroups = item->groups();
+
+    /* We have to match all groups to be sure that a contact change hasn't
+     * invalidated the relationship */
+    foreach (GroupObject *compareGroup, itemGroups) {
+        const RecipientList &compareRecipients = compareGroup->recipients();
+
+        /* Multi-recipient groups are never combined, because that would create a
+         * huge set of nasty corner cases, e.g. when two groups match in contacts
+         * but not UIDs. */
+        if (searchRecipients.size() > 1 || compareRecipients.size() > 1) {
+            if (!searchRecipients.matches(compareRecipients))
+                return false;
+        } else if (!searchRecipients.hasSameContacts(compareRecipients)) {
+            return false;
+        }
+    }
+
+    return !itemGroups.isEmpty();
+}
+
+int ContactGroupModelPrivate::rowForItem(ContactGroup *item) const
 {
-    for (int i = 0; i < items.size(); i++) {
-        if (items[i]->groups().contains(group))
-            return i;
+    // items is kept sorted by contactGroupSort; search the run of equal end times
+    QList<ContactGroup*>::const_iterator it = std::lower_bound(items.constBegin(), items.constEnd(), item, contactGroupSort);
+    for ( ; it != items.constEnd() && (*it)->endTimeT() == item->endTimeT(); ++it) {
+        if (*it == item)
+            return it - items.constBegin();
     }
 
-    return -1;
+    return items.indexOf(item);
+}
+
+void ContactGroupModelPrivate::indexGroup(GroupObject *group, ContactGroup *item)
+{
+    unindexGroup(group);
+
+    const QStringList keys(contactKeys(group));
+    foreach (const QString &key, keys)
+        keyGroups.insert(key, group);
+    groupKeys.insert(group, keys);
+    groupItems.insert(group, item);
+}
+
+void ContactGroupModelPrivate::unindexGroup(GroupObject *group)
+{
+    QHash<GroupObject*, QStringList>::iterator it = groupKeys.find(group);
+    if (it == groupKeys.end())
+        return;
+
+    foreach (const QString &key, *it)
+        keyGroups.remove(key, group);
+    groupKeys.erase(it);
+    groupItems.remove(group);
+}
+
+void ContactGroupModelPrivate::clearIndex()
+{
+    groupItems.clear();
+    groupKeys.clear();
+    keyGroups.clear();
 }
 
 void ContactGroupModelPrivate::itemDataChanged(int index)
 {
     Q_Q(ContactGroupModel);
 
+    /* Only this item may be out of place, so the items on either side of it are
+     * still sorted. Search for the new position in the side it moves towards. */
+    ContactGroup *item = items[index];
     int newIndex = index;
-    for (int i = index - 1; i >= 0; i--) {
-        if (contactGroupSort(items[index], items[i]))
-            newIndex = i;
-        else
-            break;
-    }
-
-    for (int i = index + 1; i < items.size(); i++) {
-        if (contactGroupSort(items[i], items[index]))
-            newIndex = i;
-        else
-            break;
+    if (index > 0 && contactGroupSort(item, items[index - 1])) {
+        newIndex = std::upper_bound(items.begin(), items.begin() + index, item, contactGroupSort) - items.begin();
+    } else if (index < items.size() - 1 && contactGroupSort(items[index + 1], item)) {
+        newIndex = std::lower_bound(items.begin() + index + 1, items.end(), item, contactGroupSort) - items.begin() - 1;
     }
 
     if (newIndex != index) {
@@ -231,12 +335,10 @@ void ContactGroupModelPrivate::addGroupToIndex(GroupObject *group, int index)
 
     ContactGroup *item = index < 0 ? new ContactGroup(this) : items[index];
     item->addGroup(group);
+    indexGroup(group, item);
 
     if (index < 0) {
-        for (index = 0; index < items.size(); index++) {
-            if (contactGroupSort(item, items[index]))
-                break;
-        }
+        index = std::upper_bound(items.begin(), items.end(), item, contactGroupSort) - items.begin();
 
         q->beginInsertRows(QModelIndex(), index, index);
         items.insert(index, item);
@@ -256,6 +358,7 @@ void ContactGroupModelPrivate::removeGroupFromIndex(GroupObject *group, int inde
     Q_Q(ContactGroupModel);
 
     ContactGroup *item = items[index];
+    unindexGroup(group);
 
     // Returns true when removing the last group
     if (item->removeGroup(group)) {
@@ -299,6 +402,7 @@ void ContactGroupModelPrivate::groupUpdated(GroupObject *group)
         addGroupToIndex(group, newIndex);
     } else {
         // Update data
+        indexGroup(group, items[oldIndex]);
         items[oldIndex]->updateGroup(group);
         itemDataChanged(oldIndex);
     }
@@ -24,6 +24,7 @@
 #include "contactlistener.h"
 
 #include <QCoreApplication>
+#include <QSet>
 #include <QDebug>
 
 #include <qtcontacts-extensions.h>
@@ -34,6 +35,7 @@
 
 #include "commonutils.h"
 #include "contactresolver.h"
+#include "resolutioncache_p.h"
 #include "debug.h"
 
 namespace CommHistory {
@@ -52,9 +54,11 @@ public:
     ContactResolver *retryResolver;
     QList<Recipient> retryRecipients;
     QList<Recipient> unresolvedRecipients;
+    QSharedPointer<ResolutionCache> resolutionCache;
 
 private slots:
     void retryFinished();
+    void storedResolutionChanged(const RecipientList &recipients);
     void resolveAgain(const CommHistory::Recipient &recipient);
     void retryUnresolved();
 
@@ -98,9 +102,13 @@ QSharedPointer<ContactListener> ContactListener::instance()
 ContactListenerPrivate::ContactListenerPrivate(ContactListener *q)
     : QObject(q)
     , retryResolver(0)
+    , resolutionCache(ResolutionCache::instance())
     , q_ptr(q)
 {
     SeasideCache::registerChangeListener(this, SeasideCache::FetchAvatar);
+
+    connect(resolutionCache.data(), SIGNAL(changed(RecipientList)),
+            SLOT(storedResolutionChanged(RecipientList)));
 }
 
 ContactListenerPrivate::~ContactListenerPrivate()
@@ -134,12 +142,25 @@ void ContactListenerPrivate::retryUnresolved()
 void ContactListenerPrivate::retryFinished()
 {
     Q_Q(ContactListener);
+
+    foreach (const Recipient &recipient, retryRecipients)
+        resolutionCache->store(recipient);
+
     emit q->contactChanged(retryRecipients);
     retryResolver->deleteLater();
     retryResolver = 0;
     retryRecipients.clear();
 }
 
+void ContactListenerPrivate::storedResolutionChanged(const RecipientList &recipients)
+{
+    Q_Q(ContactListener);
+
+    // Recipients resolved from stored results have been found to match a different contact
+    emit q->contactChanged(recipients);
+    emit q->contactInfoChanged(recipients);
+}
+
 static bool recipientMatchesDetails(const Recipient &recipient, const QList<Recipient> &addresses, const QList<Recipient::PhoneNumberMatchDetails> &phoneNumbers)
 {
     if (recipient.isPhoneNumber()) {
@@ -183,21 +204,44 @@ void ContactListenerPrivate::itemUpdated(SeasideCache::CacheItem *item)
         if (!recipientMatchesDetails(recipient, addresses, phoneNumbers)) {
             DEBUG() << "Recipient" << recipient.remoteUid() << "no longer matches contact" << item->iid;
             recipient.setUnresolved();
+            resolutionCache->remove(recipient);
 
             // Try to resolve again to find a new match
             resolveAgain(recipient);
         } else if (recipient.contactUpdateIsSignificant()) {
+            resolutionCache->store(recipient);
             infoChanged.append(recipient);
         } else {
             detailsChanged.append(recipient);
         }
     }
 
-    // Check all recipients that resolved to no match against these addresses
-    foreach (const Recipient &recipient, Recipient::recipientsForContact(0)) {
+    // Check recipients that resolved to no match against these addresses. Only
+    // recipients sharing an address or minimized number can match, so look up
+    // the candidates for each detail rather than testing every recipient.
+    QList<Recipient> candidates;
+    QSet<Recipient> seen;
+    foreach (const Recipient &address, addresses) {
+        // Matching non-phone-number recipients share their instance with the address
+        if (address.isContactResolved() && address.contactId() == 0 && !seen.contains(address)) {
+            seen.insert(address);
+            candidates.append(address);
+        }
+    }
+    foreach (const Recipient::PhoneNumberMatchDetails &phoneNumber, phoneNumbers) {
+        foreach (const Recipient &recipient, Recipient::unmatchedRecipientsForPhoneNumber(phoneNumber)) {
+            if (!seen.contains(recipient)) {
+                seen.insert(recipient);
+                candidates.append(recipient);
+            }
+        }
+    }
+
+    foreach (const Recipient &recipient, candidates) {
         if (recipientMatchesDetails(recipient, addresses, phoneNumbers)) {
             DEBUG() << "Recipient" << recipient << "now resolves to updated contact" << item->iid;
             recipient.setResolved(item);
+            resolutionCache->store(recipient);
             contactChanged.append(recipient);
         }
     }
@@ -212,6 +256,8 @@ void ContactListenerPrivate::itemUpdated(SeasideCache::CacheItem *item)
 
 void ContactListenerPrivate::itemAboutToBeRemoved(SeasideCache::CacheItem *item)
 {
+    resolutionCache->removeContact(item->iid);
+
     QList<Recipient> recipients = Recipient::recipientsForContact(item->iid);
     if (!recipients.isEmpty()) {
         foreach (const Recipient &recipient, recipients) {
@@ -23,8 +23,11 @@
 #include "contactresolver.h"
 
 #include <QElapsedTimer>
+#include <QHash>
+#include <QMap>
 
 #include "commonutils.h"
+#include "resolutioncache_p.h"
 #include "debug.h"
 
 using namespace CommHistory;
@@ -39,18 +42,40 @@ class ContactResolverPrivate : public QObject, public SeasideCache::ResolveListe
 public:
     ContactResolver *q_ptr;
     QSet<Recipient> pending;
+    // Pending phone number recipients, by minimized number. Distinct recipients can share one.
+    QMultiHash<QString, Recipient> pendingPhoneNumbers;
+    // Pending recipients remaining for each unfinished batch
+    QMap<int, QSet<Recipient> > batches;
+    QList<int> finishedBatches;
+    int lastBatch;
     bool resolving;
     bool forceResolving;
+    QSharedPointer<ResolutionCache> cache;
+
+    // Pending recipients waiting for a lookup, ordered by descending priority then insertion
+    typedef QPair<int, quint32> QueueKey;
+    QMap<QueueKey, Recipient> queue;
+    QHash<Recipient, QueueKey> queued;
+    quint32 queueSequence;
+    int lookupLimit;
 
     explicit ContactResolverPrivate(ContactResolver *parent);
     ~ContactResolverPrivate();
 
-    void resolve(Recipient recipient);
+    ResolutionCache *resolutionCache();
+    bool resolve(Recipient recipient, int priority = 0);
+    bool lookup(const Recipient &recipient);
+    void lookupQueued();
+    void enqueue(const Recipient &recipient, int priority);
+    bool cancel(const Recipient &recipient);
+    void resolved(const Recipient &recipient, SeasideCache::CacheItem *item);
+    void removePending(const Recipient &recipient);
     void checkIfFinishedAsynchronously();
     virtual void addressResolved(const QString &first, const QString &second, SeasideCache::CacheItem *item);
 
 public slots:
     bool checkIfFinished();
+    void reportFinishedBatches();
 };
 
 } // namespace CommHistory
@@ -61,7 +86,8 @@ ContactResolver::ContactResolver(QObject *parent)
 }
 
 ContactResolverPrivate::ContactResolverPrivate(ContactResolver *parent)
-    : QObject(parent), q_ptr(parent), resolving(false), forceResolving(false)
+    : QObject(parent), q_ptr(parent), lastBatch(0), resolving(false), forceResolving(false),
+      queueSequence(0), lookupLimit(0)
 {
 }
 
@@ -88,6 +114,19 @@ void ContactResolver::setForceResolving(bool enabled)
     d->forceResolving = enabled;
 }
 
+int ContactResolver::lookupLimit() const
+{
+    Q_D(const ContactResolver);
+    return d->lookupLimit;
+}
+
+void ContactResolver::setLookupLimit(int limit)
+{
+    Q_D(ContactResolver);
+    d->lookupLimit = qMax(limit, 0);
+    d->lookupQueued();
+}
+
 void ContactResolver::add(const Recipient &recipient)
 {
     Q_D(ContactResolver);
@@ -115,21 +154,135 @@ void ContactResolver::add(const QList<Recipient> &recipients)
     d->checkIfFinishedAsynchronously();
 }
 
-void ContactResolverPrivate::resolve(Recipient recipient)
+void ContactResolver::add(const Recipient &recipient, int priority)
 {
-    if (!forceResolving && recipient.isContactResolved())
+    Q_D(ContactResolver);
+    d->resolve(recipient, priority);
+    d->checkIfFinishedAsynchronously();
+}
+
+void ContactResolver::add(const RecipientList &recipients, int priority)
+{
+    Q_D(ContactResolver);
+
+    foreach (const Recipient &recipient, recipients)
+        d->resolve(recipient, priority);
+
+    d->checkIfFinishedAsynchronously();
+}
+
+void ContactResolver::cancel(const Recipient &recipient)
+{
+    cancel(RecipientList(recipient));
+}
+
+void ContactResolver::cancel(const RecipientList &recipients)
+{
+    Q_D(ContactResolver);
+
+    bool cancelled = false;
+    foreach (const Recipient &recipient, recipients)
+        cancelled |= d->cancel(recipient);
+
+    if (!cancelled)
         return;
 
+    // Batches and the finished signal may now be complete; report them as for any other resolution
+    if (!d->finishedBatches.isEmpty()) {
+        bool ok = d->metaObject()->invokeMethod(d, "reportFinishedBatches", Qt::QueuedConnection);
+        Q_UNUSED(ok);
+        Q_ASSERT(ok);
+    }
+    if (d->pending.isEmpty()) {
+        bool ok = d->metaObject()->invokeMethod(d, "checkIfFinished", Qt::QueuedConnection);
+        Q_UNUSED(ok);
+        Q_ASSERT(ok);
+    }
+}
+
+int ContactResolver::addBatch(const QList<Recipient> &recipients)
+{
+    Q_D(ContactResolver);
+
+    QSet<Recipient> remaining;
+    foreach (const Recipient &recipient, recipients) {
+        if (d->resolve(recipient))
+            remaining.insert(recipient);
+    }
+
+    const int batch = ++d->lastBatch;
+    if (remaining.isEmpty()) {
+        d->finishedBatches.append(batch);
+        bool ok = d->metaObject()->invokeMethod(d, "reportFinishedBatches", Qt::QueuedConnection);
+        Q_UNUSED(ok);
+        Q_ASSERT(ok);
+    } else {
+        d->batches.insert(batch, remaining);
+    }
+
+    d->checkIfFinishedAsynchronously();
+    return batch;
+}
+
+ResolutionCache *ContactResolverPrivate::resolutionCache()
+{
+    if (!cache)
+        cache = ResolutionCache::instance();
+    return cache.data();
+}
+
+// Returns true if the recipient is waiting for resolution
+bool ContactResolverPrivate::resolve(Recipient recipient, int priority)
+{
+    if (!forceResolving && recipient.isContactResolved())
+        return false;
+
     Q_ASSERT(!recipient.localUid().isEmpty());
     if (recipient.localUid().isEmpty() || recipient.remoteUid().isEmpty()) {
         // Cannot match any contact. Set as resolved to nothing.
         recipient.setResolved(0);
-        return;
+        return false;
     }
 
-    if (pending.contains(recipient))
-        return;
+    if (pending.contains(recipient)) {
+        QHash<Recipient, QueueKey>::iterator it = queued.find(recipient);
+        if (it != queued.end() && it->first != -priority) {
+            queue.remove(*it);
+            queued.erase(it);
+            enqueue(recipient, priority);
+        }
+        return true;
+    }
+
+    // Forced resolution is used to verify results, so stored results are only used otherwise
+    if (!forceResolving && resolutionCache()->resolve(recipient))
+        return false;
+
+    if (lookupLimit > 0 && pending.size() - queued.size() >= lookupLimit) {
+        // Use a contact which is already cached, without requesting a lookup
+        SeasideCache::CacheItem *item = 0;
+        if (recipient.isPhoneNumber()) {
+            item = SeasideCache::itemByPhoneNumber(recipient.remoteUid(), false);
+        } else {
+            item = SeasideCache::itemByOnlineAccount(recipient.localUid(), recipient.remoteUid(), false);
+        }
+
+        if (item) {
+            resolved(recipient, item);
+            return false;
+        }
+
+        pending.insert(recipient);
+        enqueue(recipient, priority);
+        return true;
+    }
 
+    return lookup(recipient);
+}
+
+// Returns true if the recipient is waiting for the lookup to finish
+bool ContactResolverPrivate::lookup(const Recipient &recipient)
+{
     SeasideCache::CacheItem *item = 0;
     if (recipient.isPhoneNumber()) {
         item = SeasideCache::resolvePhoneNumber(this, recipient.remoteUid(), false);
@@ -138,9 +291,70 @@ void ContactResolverPrivate::resolve(Recipient recipient)
     }
 
     if (item) {
-        recipient.setResolved(item);
-    } else {
-        pending.insert(recipient);
+        resolved(recipient, item);
+        return false;
+    }
+
+    pending.insert(recipient);
+    if (recipient.isPhoneNumber())
+        pendingPhoneNumbers.insert(recipient.minimizedRemoteUid(), recipient);
+    return true;
+}
+
+void ContactResolverPrivate::lookupQueued()
+{
+    while (!queue.isEmpty() && (lookupLimit == 0 || pending.size() - queued.size() < lookupLimit)) {
+        const Recipient recipient(queue.take(queue.firstKey()));
+        queued.remove(recipient);
+        lookup(recipient);
+    }
+}
+
+void ContactResolverPrivate::enqueue(const Recipient &recipient, int priority)
+{
+    const QueueKey key(-priority, queueSequence++);
+    queue.insert(key, recipient);
+    queued.insert(recipient, key);
+}
+
+// Returns true if the recipient was queued
+bool ContactResolverPrivate::cancel(const Recipient &recipient)
+{
+    QHash<Recipient, QueueKey>::iterator it = queued.find(recipient);
+    if (it == queued.end())
+        return false;
+
+    queue.remove(*it);
+    queued.erase(it);
+    removePending(recipient);
+    return true;
+}
+
+void ContactResolverPrivate::resolved(const Recipient &recipient, SeasideCache::CacheItem *item)
+{
+    Q_Q(ContactResolver);
+
+    recipient.setResolved(item);
+    if (!forceResolving)
+        resolutionCache()->store(recipient);
+
+    removePending(recipient);
+    emit q->recipientResolved(recipient);
+}
+
+void ContactResolverPrivate::removePending(const Recipient &recipient)
+{
+    pending.remove(recipient);
+    if (recipient.isPhoneNumber())
+        pendingPhoneNumbers.remove(recipient.minimizedRemoteUid(), recipient);
+
+    for (QMap<int, QSet<Recipient> >::iterator it = batches.begin(); it != batches.end(); ) {
+        if (it->remove(recipient) && it->isEmpty()) {
+            finishedBatches.append(it.key());
+            it = batches.erase(it);
+        } else {
+            ++it;
+        }
     }
 }
 
@@ -157,6 +371,14 @@ void ContactResolverPrivate::checkIfFinishedAsynchronously()
     }
 }
 
+void ContactResolverPrivate::reportFinishedBatches()
+{
+    Q_Q(ContactResolver);
+
+    while (!finishedBatches.isEmpty())
+        emit q->batchFinished(finishedBatches.takeFirst());
+}
+
 bool ContactResolverPrivate::checkIfFinished()
 {
     Q_Q(ContactResolver);
@@ -177,23 +399,24 @@ void ContactResolverPrivate::addressResolved(const QString &first, const QString
         // This resolution is for a phone number - we need to call back to libcontacts
         // to select the best match from multiple possible resolutions
         const Recipient::PhoneNumberMatchDetails phoneNumber(Recipient::phoneNumberMatchDetails(second));
-        for (QSet<Recipient>::iterator it = pending.begin(); it != pending.end(); ) {
-            if (it->matchesPhoneNumber(phoneNumber)) {
+
+        // Only recipients with the same minimized number can match
+        foreach (const Recipient &recipient, pendingPhoneNumbers.values(phoneNumber.minimizedNumber)) {
+            if (recipient.matchesPhoneNumber(phoneNumber)) {
                 // Look up the best match for the full number
-                it->setResolved(SeasideCache::itemByPhoneNumber(it->remoteUid(), false));
-                it = pending.erase(it);
-            } else {
-                ++it;
+                resolved(recipient, SeasideCache::itemByPhoneNumber(recipient.remoteUid(), false));
             }
         }
     } else {
         QSet<Recipient>::iterator it = pending.find(Recipient(first, second));
         if (it != pending.end()) {
-            it->setResolved(item);
-            pending.erase(it);
+            const Recipient recipient(*it);
+            resolved(recipient, item);
         }
     }
 
+    lookupQueued();
+    reportFinishedBatches();
     checkIfFinished();
 }
 
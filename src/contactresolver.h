@@ -42,6 +42,17 @@ class ContactResolverPrivate;
  * To ensure that all contacts are resolved for a list of Event, you can add
  * the recipients for each event to ContactResolver and wait for the finished
  * signal.
+ *
+ * Recipients can also be added as a batch, which is reported by batchFinished
+ * as soon as all of its recipients are resolved, even while other recipients
+ * are still being resolved. This allows pipelining several sets of lookups.
+ *
+ * With a lookup limit, only that many recipients are looked up at once, and
+ * the rest are queued by priority. Queued recipients can be given a new
+ * priority by adding them again, or dropped with cancel(). This is useful
+ * for resolving on demand, where the most recent requests matter most.
+ * recipientResolved is emitted as each recipient is resolved, so results can
+ * be used without waiting for the whole queue.
  */
 class LIBCOMMHISTORY_EXPORT ContactResolver : public QObject
 {
@@ -55,16 +66,49 @@ public:
     bool forceResolving() const;
     void setForceResolving(bool enabled);
 
+    /* Maximum number of recipients looked up at once, or 0 for no limit */
+    int lookupLimit() const;
+    void setLookupLimit(int limit);
+
     void add(const Recipient &recipient);
     void add(const RecipientList &recipients);
     void add(const QList<Recipient> &recipients);
     template<typename T> void add(const T &value);
     template<typename T> void add(const QList<T> &value);
 
+    /* Add recipients with a priority
+     *
+     * Recipients with a higher priority are looked up first; those with equal
+     * priority are looked up in the order they were added. If a recipient is
+     * already queued, its priority is replaced.
+     */
+    void add(const Recipient &recipient, int priority);
+    void add(const RecipientList &recipients, int priority);
+    template<typename T> void add(const T &value, int priority);
+
+    /* Remove recipients which are queued and not yet being looked up
+     *
+     * Cancelled recipients are left unresolved, and are no longer part of any
+     * batch. Recipients which are already being looked up are unaffected.
+     */
+    void cancel(const Recipient &recipient);
+    void cancel(const RecipientList &recipients);
+    template<typename T> void cancel(const T &value);
+
+    /* Add recipients to be resolved as a batch
+     *
+     * Returns an identifier for the batch, which is passed to batchFinished.
+     * Batch identifiers increase in the order the batches are added.
+     */
+    int addBatch(const QList<Recipient> &recipients);
+    template<typename T> int addBatch(const QList<T> &values);
+
     bool isResolving() const;
 
 signals:
     void finished();
+    void batchFinished(int batch);
+    void recipientResolved(const CommHistory::Recipient &recipient);
 
 private:
     ContactResolverPrivate *d_ptr;
@@ -82,6 +126,25 @@ template<typename T> void ContactResolver::add(const QList<T> &value)
     }
 }
 
+template<typename T> void ContactResolver::add(const T &value, int priority)
+{
+    add(value.recipients(), priority);
+}
+
+template<typename T> void ContactResolver::cancel(const T &value)
+{
+    cancel(value.recipients());
+}
+
+template<typename T> int ContactResolver::addBatch(const QList<T> &values)
+{
+    QList<Recipient> recipients;
+    for (typename QList<T>::ConstIterator it = values.begin(); it != values.end(); it++) {
+        recipients.append(it->recipients().recipients());
+    }
+    return addBatch(recipients);
+}
+
 }
 
 #endif
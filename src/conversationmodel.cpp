@@ -140,7 +140,7 @@ QSqlQuery ConversationModelPrivate::buildQuery() const
 
     QString filters;
     if (!filterAccount.isEmpty())
-        filters += "AND Events.localUid = :filterAccount ";
+        filters += "AND " + DatabaseIOPrivate::uidCondition(DatabaseIOPrivate::LocalUids, "= :filterAccount") + " ";
     if (filterType != Event::UnknownType)
         filters += "AND Events.type = :filterType ";
     if (filterDirection != Event::UnknownDirection)
@@ -161,17 +161,20 @@ QSqlQuery ConversationModelPrivate::buildQuery() const
          * Because SQLite is unable to use indexes for ORDER BY after a IN
          * or OR expression in the query, yet somehow is able to use that indexes
          * on the UNION ALL of these queries. This is true at least up to SQLite
-         * 3.8.1. */
+         * 3.8.1.
+         *
+         * Each group also has an arm for its archived events. These are
+         * merged in order of the index, so a page that ends before the
+         * archived events only reads the first of them. */
         do {
+            const QString where = "WHERE Events.isDraft = 0 AND Events.groupId = "
+                                  + QString::number(groups[unionCount]) + " " + filters;
+
             if (unionCount)
                 q += "UNION ALL ";
-            q += DatabaseIOPrivate::eventQueryBase();
-            q += "WHERE Events.isDraft = 0 ";
-
-            if (unionCount < groups.size())
-                q += "AND Events.groupId = " + QString::number(groups[unionCount]) + " ";
-
-            q += filters;
+            q += DatabaseIOPrivate::eventQueryBase() + where;
+            q += "UNION ALL ";
+            q += DatabaseIOPrivate::archiveEventQueryBase() + where;
 
             unionCount++;
         } while (unionCount < groups.size());
@@ -179,6 +182,10 @@ QSqlQuery ConversationModelPrivate::buildQuery() const
         q += DatabaseIOPrivate::eventQueryBase();
         q += "WHERE Events.isDraft = 0 ";
         q += filters;
+        q += "UNION ALL ";
+        q += DatabaseIOPrivate::archiveEventQueryBase();
+        q += "WHERE Events.isDraft = 0 ";
+        q += filters;
     }
 
     q += "ORDER BY Events.endTime DESC, Events.id DESC ";
@@ -0,0 +1,549 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jollamobile.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+
+
+#include "databasebackup_p.h"
+#include "commhistorydatabase.h"
+#include "commhistorydatabasepath.h"
+#include "databaseio_p.h"
+
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QSqlDriver>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QTimer>
+
+#include <sqlite3.h>
+
+#include "debug.h"
+
+using namespace CommHistory;
+
+namespace {
+
+// Delay between steps, leaving the database to other writers
+const int stepInterval = 50;
+
+const int defaultStepPages = 100;
+
+// Message part files copied in each step
+const int fileBatchSize = 20;
+
+const char *connectionName = "commhistory-backup";
+const char *copyConnectionName = "commhistory-backup-copy";
+const char *restoreConnectionName = "commhistory-restore";
+
+// Parts are copied here, and their paths stored relative to the backup
+const char *backupDataDir = "data/";
+
+QString dataDirPrefix()
+{
+    return QDir::cleanPath(CommHistoryDatabasePath::dataDir()) + QLatin1Char('/');
+}
+
+QString databaseFile(const QDir &directory, const QString &schema)
+{
+    return directory.absoluteFilePath(schema == QLatin1String("archive")
+                                      ? CommHistoryDatabasePath::archiveFile()
+                                      : CommHistoryDatabasePath::databaseFile());
+}
+
+// The handle of the Qt plugin's connection is only usable with the same
+// SQLite library, which a plugin built with its own copy does not use
+sqlite3 *connectionHandle(const QSqlDatabase &database)
+{
+    QVariant handle = database.driver()->handle();
+    if (!handle.isValid() || qstrcmp(handle.typeName(), "sqlite3*") != 0) {
+        qWarning() << "Database backup needs the handle of an SQLite connection";
+        return 0;
+    }
+
+    QSqlQuery query(database);
+    if (!query.exec(QLatin1String("SELECT sqlite_version()")) || !query.next()) {
+        qWarning() << "Failed to read SQLite version";
+        qWarning() << query.lastError();
+        return 0;
+    }
+    const QString pluginVersion = query.value(0).toString();
+    query.finish();
+
+    if (pluginVersion != QLatin1String(sqlite3_libversion())) {
+        qWarning() << "Database backup refused: the Qt SQLite plugin uses SQLite" << pluginVersion
+                   << "but libcommhistory links SQLite" << sqlite3_libversion();
+        return 0;
+    }
+
+    return *static_cast<sqlite3 **>(handle.data());
+}
+
+// Moves the paths of the parts under the directory 'from' to 'to', listing
+// the moved files relative to it
+bool relocateParts(QSqlDatabase &database, const QStringList &schemas, const QString &from,
+                   const QString &to, QStringList *files)
+{
+    if (!database.transaction())
+        return false;
+
+    foreach (const QString &schema, schemas) {
+        QSqlQuery query(database);
+        query.setForwardOnly(true);
+
+        if (files) {
+            query.prepare(QStringLiteral("SELECT DISTINCT substr(path, :start) FROM %1.MessageParts "
+                                         "WHERE substr(path, 1, :length) = :from").arg(schema));
+            query.bindValue(":start", from.length() + 1);
+            query.bindValue(":length", from.length());
+            query.bindValue(":from", from);
+            if (!DatabaseIOPrivate::execQuery(query)) {
+                database.rollback();
+                return false;
+            }
+
+            while (query.next())
+                files->append(query.value(0).toString());
+            query.finish();
+        }
+
+        query.prepare(QStringLiteral("UPDATE %1.MessageParts SET path = :to || substr(path, :start) "
+                                     "WHERE substr(path, 1, :length) = :from").arg(schema));
+        query.bindValue(":to", to);
+        query.bindValue(":start", from.length() + 1);
+        query.bindValue(":length", from.length());
+        query.bindValue(":from", from);
+        if (!DatabaseIOPrivate::execQuery(query)) {
+            database.rollback();
+            return false;
+        }
+    }
+
+    return database.commit();
+}
+
+bool copyFile(const QString &source, const QString &target)
+{
+    QFile::remove(target);
+    if (!QDir().mkpath(QFileInfo(target).absolutePath()) || !QFile::copy(source, target)) {
+        qWarning() << "Failed to copy" << source << "to" << target;
+        return false;
+    }
+    return true;
+}
+
+void removeDatabaseFiles(const QDir &directory)
+{
+    QFile::remove(databaseFile(directory, QStringLiteral("main")));
+    QFile::remove(databaseFile(directory, QStringLiteral("archive")));
+}
+
+}
+
+DatabaseBackupPrivate::DatabaseBackupPrivate(DatabaseBackup *parent)
+    : QObject(parent)
+    , q(parent)
+    , stepPages(defaultStepPages)
+    , timer(new QTimer(this))
+    , running(false)
+    , created(false)
+    , sourceHandle(0)
+    , destination(0)
+    , backup(0)
+    , filesListed(false)
+    , copiedPages(0)
+    , completed(0)
+    , total(0)
+{
+    timer->setSingleShot(true);
+    connect(timer, SIGNAL(timeout()), SLOT(timeout()));
+}
+
+DatabaseBackupPrivate::~DatabaseBackupPrivate()
+{
+    if (running)
+        close(false);
+}
+
+void DatabaseBackupPrivate::timeout()
+{
+    if (!running && !start()) {
+        finish(false);
+        return;
+    }
+
+    bool done = false;
+    if (!step(done))
+        finish(false);
+    else if (done)
+        finish(true);
+    else
+        timer->start(stepInterval);
+}
+
+bool DatabaseBackupPrivate::start()
+{
+    running = true;
+    created = false;
+    schemas.clear();
+    filesListed = false;
+    files.clear();
+    copiedPages = 0;
+    completed = 0;
+    total = 0;
+
+    const QDir backupDir(directory);
+    if (!backupDir.mkpath(QLatin1String("."))) {
+        qWarning() << "Failed to create backup directory" << directory;
+        return false;
+    }
+    if (QFile::exists(databaseFile(backupDir, QStringLiteral("main")))) {
+        qWarning() << "Backup directory already contains a backup" << directory;
+        return false;
+    }
+    created = true;
+
+    source = CommHistoryDatabase::open(QLatin1String(connectionName));
+    if (!source.isOpen())
+        return false;
+    sourceHandle = connectionHandle(source);
+    if (!sourceHandle)
+        return false;
+
+    // Reading both databases in a transaction keeps their snapshots until
+    // the copy is done. In WAL mode, writers are not blocked by readers.
+    if (!source.transaction())
+        return false;
+
+    QSqlQuery query(source);
+    query.setForwardOnly(true);
+    if (!query.exec(QLatin1String("SELECT (SELECT MAX(id) FROM main.Events), (SELECT MAX(id) FROM archive.Events)"))) {
+        qWarning() << "Failed to execute query";
+        qWarning() << query.lastError();
+        return false;
+    }
+    query.finish();
+
+    // An archive in memory stands in for an unavailable one and has nothing to copy
+    if (!query.exec(QLatin1String("PRAGMA database_list"))) {
+        qWarning() << "Failed to list databases";
+        qWarning() << query.lastError();
+        return false;
+    }
+    while (query.next()) {
+        const QString schema = query.value(1).toString();
+        if ((schema == QLatin1String("main") || schema == QLatin1String("archive"))
+                && !query.value(2).toString().isEmpty()) {
+            schemas.append(schema);
+        }
+    }
+    query.finish();
+
+    foreach (const QString &schema, schemas) {
+        if (!query.exec(QStringLiteral("PRAGMA %1.page_count").arg(schema)) || !query.next()) {
+            qWarning() << "Failed to read page count of" << schema;
+            qWarning() << query.lastError();
+            return false;
+        }
+        total += query.value(0).toInt();
+        query.finish();
+    }
+
+    return true;
+}
+
+bool DatabaseBackupPrivate::step(bool &done)
+{
+    done = false;
+
+    bool ok;
+    if (!schemas.isEmpty())
+        ok = copyPages();
+    else if (!filesListed)
+        ok = listFiles();
+    else
+        ok = copyFiles(done);
+
+    if (ok)
+        emit q->progress(completed, qMax(completed, total));
+    return ok;
+}
+
+bool DatabaseBackupPrivate::copyPages()
+{
+    if (!backup) {
+        const QString file = databaseFile(QDir(directory), schemas.first());
+        QFile::remove(file);
+
+        if (sqlite3_open_v2(QFile::encodeName(file).constData(), &destination,
+                            SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, 0) != SQLITE_OK) {
+            qWarning() << "Failed to open backup database" << file << sqlite3_errmsg(destination);
+            return false;
+        }
+
+        backup = sqlite3_backup_init(destination, "main", sourceHandle,
+                                     schemas.first().toLatin1().constData());
+        if (!backup) {
+            qWarning() << "Failed to start backup of" << schemas.first() << sqlite3_errmsg(destination);
+            return false;
+        }
+    }
+
+    // Busy and locked are retried in the next step
+    const int result = sqlite3_backup_step(backup, stepPages);
+    if (result != SQLITE_OK && result != SQLITE_DONE && result != SQLITE_BUSY && result != SQLITE_LOCKED) {
+        qWarning() << "Failed to back up" << schemas.first() << sqlite3_errstr(result);
+        return false;
+    }
+
+    const int pages = sqlite3_backup_pagecount(backup);
+    completed = copiedPages + pages - sqlite3_backup_remaining(backup);
+
+    if (result == SQLITE_DONE) {
+        copiedPages += pages;
+
+        const int finishResult = sqlite3_backup_finish(backup);
+        backup = 0;
+        sqlite3_close(destination);
+        destination = 0;
+        if (finishResult != SQLITE_OK) {
+            qWarning() << "Failed to finish backup of" << schemas.first() << sqlite3_errstr(finishResult);
+            return false;
+        }
+
+        DEBUG() << Q_FUNC_INFO << "Copied" << pages << "pages of" << schemas.first();
+        schemas.removeFirst();
+    }
+
+    return true;
+}
+
+bool DatabaseBackupPrivate::listFiles()
+{
+    closeSource();
+
+    const QDir backupDir(directory);
+    QStringList copiedSchemas(QStringLiteral("main"));
+    const QString archiveFile = databaseFile(backupDir, QStringLiteral("archive"));
+    if (QFile::exists(archiveFile))
+        copiedSchemas.append(QStringLiteral("archive"));
+
+    bool ok = false;
+    {
+        QSqlDatabase copy = QSqlDatabase::addDatabase(QLatin1String("QSQLITE"), QLatin1String(copyConnectionName));
+        copy.setDatabaseName(databaseFile(backupDir, QStringLiteral("main")));
+        if (!copy.open()) {
+            qWarning() << "Failed to open backup database";
+            qWarning() << copy.lastError();
+        } else {
+            ok = true;
+            if (copiedSchemas.contains(QLatin1String("archive"))) {
+                QSqlQuery query(copy);
+                query.prepare(QLatin1String("ATTACH DATABASE :file AS archive"));
+                query.bindValue(":file", archiveFile);
+                ok = DatabaseIOPrivate::execQuery(query);
+            }
+
+            ok = ok && relocateParts(copy, copiedSchemas, dataDirPrefix(), QLatin1String(backupDataDir), &files);
+            copy.close();
+        }
+    }
+    QSqlDatabase::removeDatabase(QLatin1String(copyConnectionName));
+
+    filesListed = true;
+    total = copiedPages + files.count();
+    return ok;
+}
+
+bool DatabaseBackupPrivate::copyFiles(bool &done)
+{
+    const QDir backupDir(directory);
+    const QString dataDir = dataDirPrefix();
+
+    for (int i = 0; i < fileBatchSize && !files.isEmpty(); i++) {
+        const QString file = files.takeFirst();
+        const QString sourceFile = dataDir + file;
+
+        // As in the database, the part refers to nothing
+        if (!QFile::exists(sourceFile)) {
+            qWarning() << "Message part file is missing:" << sourceFile;
+        } else if (!copyFile(sourceFile, backupDir.absoluteFilePath(QLatin1String(backupDataDir) + file))) {
+            return false;
+        }
+        completed++;
+    }
+
+    done = files.isEmpty();
+    return true;
+}
+
+void DatabaseBackupPrivate::closeSource()
+{
+    if (!source.isValid())
+        return;
+
+    // Nothing was written, so rollback only ends the snapshot
+    if (source.isOpen()) {
+        source.rollback();
+        source.close();
+    }
+    source = QSqlDatabase();
+    sourceHandle = 0;
+    QSqlDatabase::removeDatabase(QLatin1String(connectionName));
+}
+
+void DatabaseBackupPrivate::close(bool successful)
+{
+    timer->stop();
+
+    if (backup) {
+        sqlite3_backup_finish(backup);
+        backup = 0;
+    }
+    if (destination) {
+        sqlite3_close(destination);
+        destination = 0;
+    }
+    closeSource();
+
+    // The files of an incomplete backup are left for the next one to replace
+    if (!successful && created)
+        removeDatabaseFiles(QDir(directory));
+
+    running = false;
+    schemas.clear();
+    files.clear();
+}
+
+void DatabaseBackupPrivate::finish(bool successful)
+{
+    close(successful);
+    emit q->finished(successful);
+}
+
+DatabaseBackup::DatabaseBackup(QObject *parent)
+    : QObject(parent)
+    , d(new DatabaseBackupPrivate(this))
+{
+}
+
+DatabaseBackup::~DatabaseBackup()
+{
+}
+
+void DatabaseBackup::setStepPages(int pages)
+{
+    d->stepPages = qMax(1, pages);
+}
+
+int DatabaseBackup::stepPages() const
+{
+    return d->stepPages;
+}
+
+void DatabaseBackup::schedule(const QString &directory)
+{
+    if (d->running || d->timer->isActive())
+        return;
+
+    d->directory = directory;
+    d->timer->start(0);
+}
+
+bool DatabaseBackup::backup(const QString &directory)
+{
+    if (d->running || d->timer->isActive()) {
+        qWarning() << "Database backup is already running";
+        return false;
+    }
+
+    d->directory = directory;
+    if (!d->start()) {
+        d->finish(false);
+        return false;
+    }
+
+    bool done = false;
+    while (!done) {
+        if (!d->step(done)) {
+            d->finish(false);
+            return false;
+        }
+    }
+
+    d->finish(true);
+    return true;
+}
+
+bool DatabaseBackup::isRunning() const
+{
+    return d->running;
+}
+
+bool DatabaseBackup::restore(const QString &directory)
+{
+    const QDir backupDir(directory);
+    if (!QFile::exists(databaseFile(backupDir, QStringLiteral("main")))) {
+        qWarning() << "No database backup in" << directory;
+        return false;
+    }
+
+    const QDir databaseDir(CommHistoryDatabasePath::databaseDir());
+    if (QFile::exists(databaseFile(databaseDir, QStringLiteral("main")))
+            || QFile::exists(databaseFile(databaseDir, QStringLiteral("archive")))) {
+        qWarning() << "Can't restore over an existing database in" << databaseDir.absolutePath();
+        return false;
+    }
+    if (!databaseDir.mkpath(QLatin1String(".")))
+        return false;
+
+    bool ok = copyFile(databaseFile(backupDir, QStringLiteral("main")), databaseFile(databaseDir, QStringLiteral("main")));
+    if (ok && QFile::exists(databaseFile(backupDir, QStringLiteral("archive"))))
+        ok = copyFile(databaseFile(backupDir, QStringLiteral("archive")), databaseFile(databaseDir, QStringLiteral("archive")));
+
+    const QDir partsDir(backupDir.absoluteFilePath(QLatin1String(backupDataDir)));
+    const QString dataDir = dataDirPrefix();
+    QDirIterator it(partsDir.absolutePath(), QDir::Files, QDirIterator::Subdirectories);
+    while (ok && it.hasNext()) {
+        const QString file = it.next();
+        ok = copyFile(file, dataDir + partsDir.relativeFilePath(file));
+    }
+
+    // Opening also upgrades a backup of an older version
+    if (ok) {
+        {
+            QSqlDatabase database = CommHistoryDatabase::open(QLatin1String(restoreConnectionName));
+            ok = database.isOpen()
+                && relocateParts(database, QStringList() << QStringLiteral("main") << QStringLiteral("archive"),
+                                 QLatin1String(backupDataDir), dataDir, 0);
+            database.close();
+        }
+        QSqlDatabase::removeDatabase(QLatin1String(restoreConnectionName));
+    }
+
+    if (!ok) {
+        qWarning() << "Failed to restore database backup from" << directory;
+        removeDatabaseFiles(databaseDir);
+    }
+    return ok;
+}
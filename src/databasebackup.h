@@ -0,0 +1,117 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jollamobile.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+
+
+#ifndef COMMHISTORY_DATABASEBACKUP_H
+#define COMMHISTORY_DATABASEBACKUP_H
+
+#include <QObject>
+
+#include "libcommhistoryexport.h"
+
+namespace CommHistory {
+
+class DatabaseBackupPrivate;
+
+/*!
+ * \class DatabaseBackup
+ *
+ * Copies the database, the archive and the message part files under the
+ * data directory to a backup directory. The databases are copied with the
+ * SQLite online backup interface a few pages at a time, from a connection
+ * that keeps reading the same snapshot, so the copy is consistent without
+ * blocking other writers. Paths of the copied parts are stored relative to
+ * the backup directory, and restore() copies the backup into a new data
+ * directory.
+ *
+ * The online backup uses the connection of the Qt SQLite plugin, so backups
+ * fail if the plugin uses another SQLite version than libcommhistory.
+ */
+class LIBCOMMHISTORY_EXPORT DatabaseBackup : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit DatabaseBackup(QObject *parent = 0);
+    ~DatabaseBackup();
+
+    /*!
+     * Set the number of database pages copied in each step.
+     *
+     * \param pages step size, 100 by default
+     */
+    void setStepPages(int pages);
+    int stepPages() const;
+
+    /*!
+     * Back up to the directory in steps, with the event loop running between
+     * them. Does nothing if already scheduled or running.
+     *
+     * \param directory created if needed; must not contain a backup
+     */
+    void schedule(const QString &directory);
+
+    /*!
+     * Back up to the directory now, returning when done.
+     *
+     * \param directory created if needed; must not contain a backup
+     * \return true if successful, otherwise false
+     */
+    bool backup(const QString &directory);
+
+    bool isRunning() const;
+
+    /*!
+     * Copy a backup into the database directory, which must not have a
+     * database yet. Paths of the restored parts are moved to the data
+     * directory.
+     *
+     * \param directory backup directory
+     * \return true if successful, otherwise false
+     */
+    static bool restore(const QString &directory);
+
+Q_SIGNALS:
+    /*!
+     * Emitted after each step.
+     *
+     * \param completed database pages and files copied
+     * \param total pages to copy, and files once the databases are copied
+     */
+    void progress(int completed, int total);
+
+    /*!
+     * Emitted when the backup has finished.
+     *
+     * \param successful false if the backup stopped because of an error
+     */
+    void finished(bool successful);
+
+private:
+    friend class DatabaseBackupPrivate;
+    DatabaseBackupPrivate *d;
+};
+
+}
+
+#endif
@@ -0,0 +1,89 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jollamobile.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+
+
+#ifndef COMMHISTORY_DATABASEBACKUP_P_H
+#define COMMHISTORY_DATABASEBACKUP_P_H
+
+#include "databasebackup.h"
+
+#include <QSqlDatabase>
+#include <QStringList>
+
+class QTimer;
+
+struct sqlite3;
+struct sqlite3_backup;
+
+namespace CommHistory {
+
+class DatabaseBackupPrivate : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit DatabaseBackupPrivate(DatabaseBackup *parent);
+    ~DatabaseBackupPrivate();
+
+    bool start();
+    bool step(bool &done);
+    bool copyPages();
+    bool listFiles();
+    bool copyFiles(bool &done);
+    void closeSource();
+    void close(bool successful);
+    void finish(bool successful);
+
+public Q_SLOTS:
+    void timeout();
+
+public:
+    DatabaseBackup *q;
+
+    int stepPages;
+
+    QTimer *timer;
+    bool running;
+
+    QString directory;
+    // Set once the backup files in the directory are ours to remove
+    bool created;
+
+    // Reads the snapshot being copied until the databases are done
+    QSqlDatabase source;
+    sqlite3 *sourceHandle;
+    QStringList schemas;
+    sqlite3 *destination;
+    sqlite3_backup *backup;
+
+    bool filesListed;
+    QStringList files;
+
+    int copiedPages;
+    int completed;
+    int total;
+};
+
+}
+
+#endif
@@ -25,14 +25,41 @@
 #include "commhistorydatabase.h"
 #include "contactlistener.h"
 #include "group.h"
+#include "messagepartcollector_p.h"
+#include "mmsconstants.h"
+#include "databasemigration_p.h"
 #include <QSqlQuery>
 #include <QSqlError>
+#include <QElapsedTimer>
 #include "debug.h"
 
 using namespace CommHistory;
 
 Q_GLOBAL_STATIC(DatabaseIO, databaseIO)
 
+/* Extra properties that are read with most events are stored in columns of
+ * Events, in the order of EVENT_QUERY_COLUMNS. Other extra properties are
+ * stored in EventProperties. */
+static const struct {
+    const char *key;
+    const char *column;
+} promotedProperties[] = {
+    { "subscriberIdentity", "subscriberIdentity" },
+    { MMS_PROPERTY_UNREAD, "mmsUnread" },
+    { MMS_PROPERTY_PUSH_DATA, "mmsPushData" },
+    { MMS_PROPERTY_EXPIRY, "mmsExpiry" }
+};
+static const int promotedPropertiesCount = sizeof(promotedProperties) / sizeof(*promotedProperties);
+
+static bool isPromotedProperty(const QString &key)
+{
+    for (int i = 0; i < promotedPropertiesCount; i++) {
+        if (key == QLatin1String(promotedProperties[i].key))
+            return true;
+    }
+    return false;
+}
+
 class QueryHelper {
 public:
     typedef QPair<QByteArray,QVariant> Field;
@@ -76,9 +103,15 @@ public:
         return query;
     }
 
-    static FieldList eventFields(const Event &event, const Event::PropertySet &properties)
+    static bool eventFields(const Event &event, const Event::PropertySet &properties, FieldList &fields)
     {
-        FieldList fields;
+        DatabaseIOPrivate *d = DatabaseIOPrivate::instance();
+        QVariant id;
+
+        // Events that UID_DICTIONARY_MIGRATION has not reached have their UIDs
+        // as text, which must not be read back instead of a cleared id
+        const bool clearUidText = (properties.contains(Event::LocalUid) || properties.contains(Event::RemoteUid))
+                                  && d->migrationPending(UID_DICTIONARY_MIGRATION);
 
         foreach (Event::Property property, properties) {
             switch (property) {
@@ -113,10 +146,18 @@ public:
                     fields.append(QueryHelper::Field("bytesReceived", event.bytesReceived()));
                     break;
                 case Event::LocalUid:
-                    fields.append(QueryHelper::Field("localUid", event.localUid()));
+                    if (!d->dictionaryId(DatabaseIOPrivate::LocalUids, event.localUid(), id))
+                        return false;
+                    fields.append(QueryHelper::Field("localUidId", id));
+                    if (clearUidText)
+                        fields.append(QueryHelper::Field("localUid", QVariant()));
                     break;
                 case Event::RemoteUid:
-                    fields.append(QueryHelper::Field("remoteUid", event.recipients().value(0).remoteUid()));
+                    if (!d->dictionaryId(DatabaseIOPrivate::RemoteUids, event.recipients().value(0).remoteUid(), id))
+                        return false;
+                    fields.append(QueryHelper::Field("remoteUidId", id));
+                    if (clearUidText)
+                        fields.append(QueryHelper::Field("remoteUid", QVariant()));
                     break;
                 case Event::Subject:
                     fields.append(QueryHelper::Field("subject", event.subject()));
@@ -175,12 +216,21 @@ public:
                         fields.append(QueryHelper::Field("headers", re));
                     }
                     break;
+                case Event::ExtraProperties:
+                    {
+                        const QVariantMap extraProperties = event.extraProperties();
+                        for (int i = 0; i < promotedPropertiesCount; i++) {
+                            QVariantMap::const_iterator it = extraProperties.constFind(QLatin1String(promotedProperties[i].key));
+                            fields.append(QueryHelper::Field(promotedProperties[i].column,
+                                    it != extraProperties.constEnd() ? QVariant(it->toString()) : QVariant()));
+                        }
+                    }
+                    break;
                 /* Irrelevant properties from Event */
                 case Event::Id:
                 case Event::ContactId:
                 case Event::ContactName:
                 case Event::Contacts:
-                case Event::ExtraProperties:
                 case Event::Recipients:
                 case Event::IsResolved:
                     break;
@@ -194,7 +244,13 @@ public:
             }
         }
 
-        return fields;
+        // Indexed for recipient queries; how the address is minimized depends on the local UID
+        if (properties.contains(Event::LocalUid) || properties.contains(Event::RemoteUid)) {
+            const Recipient recipient(event.localUid(), event.recipients().value(0).remoteUid());
+            fields.append(QueryHelper::Field("minimizedRemoteUid", recipient.minimizedRemoteUid()));
+        }
+
+        return true;
     }
 
     static FieldList groupFields(const Group &group, const Group::PropertySet &properties)
@@ -301,6 +357,7 @@ public:
             qWarning() << "Database savepoint rollback failed:" << query.lastError();
         else
             active = false;
+        DatabaseIOPrivate::instance()->clearDictionaryIds();
         return re;
     }
 
@@ -310,6 +367,96 @@ private:
     bool active;
 };
 
+/* Splits a bulk deletion into transactions that each hold the write lock
+ * for about maxLockTime milliseconds. The batch size is adapted to the
+ * time taken by the previous transaction. Between transactions, the
+ * connection sleeps for long enough that writers waiting in the SQLite busy
+ * handler get the lock.
+ *
+ * Within a transaction of the caller, batches cannot be committed, and all
+ * of them run in that transaction. */
+class DeletionBatches
+{
+public:
+    DeletionBatches(const QSqlDatabase &db, bool nested, int maxLockTime)
+        : db(db), nested(nested), maxLockTime(maxLockTime),
+          batchSize(maxLockTime > 0 ? int(DatabaseIOPrivate::initialBatchSize) : -1),
+          committed(false), active(false)
+    {
+    }
+
+    ~DeletionBatches()
+    {
+        if (active)
+            rollback();
+    }
+
+    // LIMIT for the next batch, -1 for no limit
+    int size() const { return batchSize; }
+
+    // True if a batch that deleted this many rows was the last one
+    bool isLast(int rows) const { return batchSize < 0 || rows < batchSize; }
+
+    bool begin()
+    {
+        if (active)
+            return false;
+
+        if (committed && !nested)
+            QThread::msleep(qMax(1, maxLockTime / 2));
+
+        if (!nested && !db.transaction()) {
+            qWarning() << "Failed to start transaction";
+            qWarning() << db.lastError();
+            return false;
+        }
+
+        active = true;
+        timer.start();
+        return true;
+    }
+
+    bool commit()
+    {
+        if (!active)
+            return false;
+
+        active = false;
+        if (!nested && !db.commit()) {
+            qWarning() << "Failed to commit transaction";
+            qWarning() << db.lastError();
+            db.rollback();
+            DatabaseIOPrivate::instance()->clearDictionaryIds();
+            return false;
+        }
+
+        committed = true;
+        if (batchSize > 0)
+            batchSize = DatabaseIOPrivate::nextBatchSize(batchSize, timer.elapsed(), maxLockTime);
+        return true;
+    }
+
+    void rollback()
+    {
+        if (!active)
+            return;
+
+        active = false;
+        if (!nested)
+            db.rollback();
+        DatabaseIOPrivate::instance()->clearDictionaryIds();
+    }
+
+private:
+    QSqlDatabase db;
+    QElapsedTimer timer;
+    bool nested;
+    int maxLockTime;
+    int batchSize;
+    bool committed;
+    bool active;
+};
+
 DatabaseIO *DatabaseIO::instance()
 {
     return databaseIO();
@@ -330,7 +477,7 @@ DatabaseIOPrivate *DatabaseIOPrivate::instance()
 }
 
 DatabaseIOPrivate::DatabaseIOPrivate(DatabaseIO *p)
-    : q(p)
+    : q(p), inTransaction(false), maxWriteLockTime(defaultMaxWriteLockTime)
 {
 }
 
@@ -351,12 +498,134 @@ QSqlQuery DatabaseIOPrivate::prepareQuery(const QString &s, int limit, int offse
 
 QSqlDatabase &DatabaseIOPrivate::connection()
 {
-    if (!m_pConnection.isValid())
+    if (!m_pConnection.isValid()) {
         m_pConnection = CommHistoryDatabase::open("commhistory");
+        if (m_pConnection.isValid())
+            scheduleMigrations();
+    }
 
     return m_pConnection;
 }
 
+bool DatabaseIOPrivate::dictionaryId(Dictionary dictionary, const QString &value, QVariant &id)
+{
+    static const char *selectQueries[] = {
+        "SELECT id FROM LocalUids WHERE uid=:value",
+        "SELECT id FROM RemoteUids WHERE uid=:value",
+        "SELECT id FROM EventPropertyKeys WHERE key=:value"
+    };
+    // Another process may add the same value after it was looked up
+    static const char *insertQueries[] = {
+        "INSERT OR IGNORE INTO LocalUids (uid) VALUES (:value)",
+        "INSERT OR IGNORE INTO RemoteUids (uid) VALUES (:value)",
+        "INSERT OR IGNORE INTO EventPropertyKeys (key) VALUES (:value)"
+    };
+
+    // Empty values refer to no row; events without an address read back an empty string
+    if (value.isEmpty()) {
+        id = QVariant();
+        return true;
+    }
+
+    QHash<QString, int> &ids(dictionaryIds[dictionary]);
+    QHash<QString, int>::const_iterator it = ids.constFind(value);
+    if (it != ids.constEnd()) {
+        id = *it;
+        return true;
+    }
+
+    QSqlQuery query = CommHistoryDatabase::prepare(selectQueries[dictionary], connection());
+    query.bindValue(":value", value);
+
+    if (!query.exec()) {
+        qWarning() << "Failed to execute query";
+        qWarning() << query.lastError();
+        qWarning() << query.lastQuery();
+        return false;
+    }
+
+    if (!query.next()) {
+        query.finish();
+        QSqlQuery insertQuery = CommHistoryDatabase::prepare(insertQueries[dictionary], connection());
+        insertQuery.bindValue(":value", value);
+
+        if (!insertQuery.exec()) {
+            qWarning() << "Failed to execute query";
+            qWarning() << insertQuery.lastError();
+            qWarning() << insertQuery.lastQuery();
+            return false;
+        }
+        insertQuery.finish();
+
+        if (!query.exec()) {
+            qWarning() << "Failed to execute query";
+            qWarning() << query.lastError();
+            qWarning() << query.lastQuery();
+            return false;
+        }
+        if (!query.next()) {
+            qWarning() << "Failed to add dictionary value" << value;
+            return false;
+        }
+    }
+    const int result = query.value(0).toInt();
+    query.finish();
+
+    // There are few accounts and keys, but remote addresses accumulate over time
+    if (ids.size() >= maxCachedDictionaryIds)
+        ids.clear();
+    ids.insert(value, result);
+
+    id = result;
+    return true;
+}
+
+static const char *uidTables[] = { "LocalUids", "RemoteUids" };
+static const char *uidTextColumns[] = { "localUid", "remoteUid" };
+
+QString DatabaseIOPrivate::uidColumn(Dictionary dictionary)
+{
+    const QString column = QString::fromLatin1("(SELECT uid FROM %1 WHERE id = Events.%2Id)")
+                           .arg(QLatin1String(uidTables[dictionary]), QLatin1String(uidTextColumns[dictionary]));
+    if (!instance()->migrationPending(UID_DICTIONARY_MIGRATION))
+        return column;
+
+    return QString::fromLatin1("IFNULL(%1, Events.%2)").arg(column, QLatin1String(uidTextColumns[dictionary]));
+}
+
+QString DatabaseIOPrivate::uidCondition(Dictionary dictionary, const QString &comparison)
+{
+    const QString condition = QString::fromLatin1("Events.%1Id IN (SELECT id FROM %2 WHERE uid %3)")
+                              .arg(QLatin1String(uidTextColumns[dictionary]), QLatin1String(uidTables[dictionary]), comparison);
+    if (!instance()->migrationPending(UID_DICTIONARY_MIGRATION))
+        return condition;
+
+    return QString::fromLatin1("(%1 OR (Events.%2Id IS NULL AND Events.%2 %3))")
+           .arg(condition, QLatin1String(uidTextColumns[dictionary]), comparison);
+}
+
+void DatabaseIOPrivate::clearDictionaryIds()
+{
+    for (int i = 0; i <= PropertyKeys; i++)
+        dictionaryIds[i].clear();
+}
+
+void DatabaseIOPrivate::collectMessageParts(QThread *thread)
+{
+    if (collector && collector->thread() != thread) {
+        QMetaObject::invokeMethod(collector, "deleteLater", Qt::QueuedConnection);
+        collector.clear();
+    }
+
+    if (!collector) {
+        collector = new MessagePartCollector(thread);
+        connect(collector, SIGNAL(finished(qint64)), q, SIGNAL(messagePartsCollected(qint64)),
+                Qt::QueuedConnection);
+    }
+
+    QMetaObject::invokeMethod(collector, "schedule", Qt::QueuedConnection);
+}
+
 QSqlQuery DatabaseIOPrivate::createQuery()
 {
     return QSqlQuery(connection());
@@ -386,7 +655,10 @@ bool DatabaseIO::addEvent(Event &event)
     if (!savepoint.begin())
         return false;
 
-    QueryHelper::FieldList fields = QueryHelper::eventFields(event, event.allProperties());
+    QueryHelper::FieldList fields;
+    if (!QueryHelper::eventFields(event, event.allProperties(), fields))
+        return false;
+
     QSqlQuery query = QueryHelper::insertQuery("INSERT INTO Events (:fields) VALUES (:values)", fields);
 
     if (!query.exec()) {
@@ -412,12 +684,22 @@ bool DatabaseIO::addEvent(Event &event)
 bool DatabaseIOPrivate::insertEventProperties(int eventId, const QVariantMap &properties)
 {
     QSqlQuery query = CommHistoryDatabase::prepare(
-        "INSERT INTO EventProperties (eventId, key, value) VALUES (:eventId, :key, :value)",
+        "INSERT INTO EventProperties (eventId, keyId, value) VALUES (:eventId, :keyId, :value)",
         connection());
     query.bindValue(":eventId", eventId);
 
     for (QVariantMap::const_iterator it = properties.begin(); it != properties.end(); it++) {
-        query.bindValue(":key", it.key());
+        // Stored in Events by QueryHelper::eventFields()
+        if (isPromotedProperty(it.key()))
+            continue;
+
+        QVariant keyId;
+        if (!dictionaryId(PropertyKeys, it.key(), keyId))
+            return false;
+        if (keyId.isNull())
+            continue;
+
+        query.bindValue(":keyId", keyId);
         query.bindValue(":value", it.value().toString());
         if (!query.exec()) {
             qWarning() << "Failed to execute query";
@@ -467,6 +749,27 @@ bool DatabaseIOPrivate::insertMessageParts(Event &event)
     return true;
 }
 
+bool DatabaseIOPrivate::insertGroupMembers(int groupId, const RecipientList &recipients)
+{
+    QSqlQuery query = CommHistoryDatabase::prepare(
+        "INSERT INTO GroupMembers (groupId, remoteUid, minimizedRemoteUid) VALUES (:groupId, :remoteUid, :minimizedRemoteUid)",
+        connection());
+    query.bindValue(":groupId", groupId);
+
+    for (RecipientList::const_iterator it = recipients.constBegin(), end = recipients.constEnd(); it != end; ++it) {
+        query.bindValue(":remoteUid", it->remoteUid());
+        query.bindValue(":minimizedRemoteUid", it->minimizedRemoteUid());
+        if (!query.exec()) {
+            qWarning() << "Failed to execute query";
+            qWarning() << query.lastError();
+            qWarning() << query.lastQuery();
+            return false;
+        }
+    }
+
+    return true;
+}
+
 // See http://www.sqlite.org/fileformat2.html#seqtab
 bool DatabaseIO::reserveEventIds(int count, int *firstReservedId)
 {
@@ -514,44 +817,70 @@ bool DatabaseIO::reserveEventIds(int count, int *firstReservedId)
     return true;
 }
 
-static const char *baseEventQuery =
-    "\n SELECT "
-    "\n Events.id, "
-    "\n Events.type, "
-    "\n Events.startTime, "
-    "\n Events.endTime, "
-    "\n Events.direction, "
-    "\n Events.isDraft, "
-    "\n Events.isRead, "
-    "\n Events.isMissedCall, "
-    "\n Events.isEmergencyCall, "
-    "\n Events.status, "
-    "\n Events.bytesReceived, "
-    "\n Events.localUid, "
-    "\n Events.remoteUid, "
-    "\n Events.subject, "
-    "\n Events.freeText, "
-    "\n Events.groupId, "
-    "\n Events.messageToken, "
-    "\n Events.lastModified, "
-    "\n Events.vCardFileName, "
-    "\n Events.vCardLabel, "
-    "\n Events.reportDelivery, "
-    "\n Events.validityPeriod, "
-    "\n Events.contentLocation, "
-    "\n Events.headers, "
-    "\n Events.readStatus, "
-    "\n Events.reportRead, "
-    "\n Events.reportedReadRequested, "
-    "\n Events.mmsId, "
-    "\n Events.isAction, "
-    "\n Events.hasExtraProperties, "
-    "\n Events.hasMessageParts "
-    "\n FROM Events ";
+#define EVENT_QUERY_COLUMNS(localUidColumn, remoteUidColumn) \
+    "\n SELECT " \
+    "\n Events.id, " \
+    "\n Events.type, " \
+    "\n Events.startTime, " \
+    "\n Events.endTime, " \
+    "\n Events.direction, " \
+    "\n Events.isDraft, " \
+    "\n Events.isRead, " \
+    "\n Events.isMissedCall, " \
+    "\n Events.isEmergencyCall, " \
+    "\n Events.status, " \
+    "\n Events.bytesReceived, " \
+    "\n " localUidColumn ", " \
+    "\n " remoteUidColumn ", " \
+    "\n Events.subject, " \
+    "\n Events.freeText, " \
+    "\n Events.groupId, " \
+    "\n Events.messageToken, " \
+    "\n Events.lastModified, " \
+    "\n Events.vCardFileName, " \
+    "\n Events.vCardLabel, " \
+    "\n Events.reportDelivery, " \
+    "\n Events.validityPeriod, " \
+    "\n Events.contentLocation, " \
+    "\n Events.headers, " \
+    "\n Events.readStatus, " \
+    "\n Events.reportRead, " \
+    "\n Events.reportedReadRequested, " \
+    "\n Events.mmsId, " \
+    "\n Events.isAction, " \
+    "\n Events.hasExtraProperties, " \
+    "\n Events.hasMessageParts, " \
+    "\n Events.subscriberIdentity, " \
+    "\n Events.mmsUnread, " \
+    "\n Events.mmsPushData, " \
+    "\n Events.mmsExpiry "
+
+#define LOCAL_UID_COLUMN "(SELECT uid FROM LocalUids WHERE id = Events.localUidId)"
+#define REMOTE_UID_COLUMN "(SELECT uid FROM RemoteUids WHERE id = Events.remoteUidId)"
+
+// Until UID_DICTIONARY_MIGRATION completes, the UIDs may be in the text columns
+#define LOCAL_UID_FALLBACK "IFNULL(" LOCAL_UID_COLUMN ", Events.localUid)"
+#define REMOTE_UID_FALLBACK "IFNULL(" REMOTE_UID_COLUMN ", Events.remoteUid)"
+
+static const char *baseEventQuery = EVENT_QUERY_COLUMNS(LOCAL_UID_COLUMN, REMOTE_UID_COLUMN) "\n FROM Events ";
+static const char *fallbackEventQuery = EVENT_QUERY_COLUMNS(LOCAL_UID_FALLBACK, REMOTE_UID_FALLBACK) "\n FROM Events ";
+
+// Archived events are read with the same columns and table name
+static const char *archiveEventQuery =
+    EVENT_QUERY_COLUMNS(LOCAL_UID_COLUMN, REMOTE_UID_COLUMN) "\n FROM archive.Events AS Events ";
+static const char *fallbackArchiveEventQuery =
+    EVENT_QUERY_COLUMNS(LOCAL_UID_FALLBACK, REMOTE_UID_FALLBACK) "\n FROM archive.Events AS Events ";
 
 QString DatabaseIOPrivate::eventQueryBase() 
 {
-    return QLatin1String(baseEventQuery);
+    return QLatin1String(instance()->migrationPending(UID_DICTIONARY_MIGRATION)
+                         ? fallbackEventQuery : baseEventQuery);
+}
+
+QString DatabaseIOPrivate::archiveEventQueryBase()
+{
+    return QLatin1String(instance()->migrationPending(UID_DICTIONARY_MIGRATION)
+                         ? fallbackArchiveEventQuery : archiveEventQuery);
 }
 
 QString DatabaseIOPrivate::limitClause(int limit, int offset)
@@ -653,11 +982,26 @@ void DatabaseIOPrivate::readEventResult(QSqlQuery &query, Event &event, bool &ha
     event.setIsAction(query.value(++field).toBool());
     hasExtraProperties = query.value(++field).toBool();
     hasMessageParts = query.value(++field).toBool();
+
+    QVariantMap extraProperties;
+    for (int i = 0; i < promotedPropertiesCount; i++) {
+        const QVariant value = query.value(++field);
+        if (!value.isNull())
+            extraProperties.insert(QLatin1String(promotedProperties[i].key), value.toString());
+    }
+    if (!extraProperties.isEmpty()) {
+        event.setExtraProperties(extraProperties);
+        event.resetModifiedProperty(Event::ExtraProperties);
+    }
 }
 
 bool DatabaseIO::getEvent(int id, Event &event)
 {
-    QByteArray q = baseEventQuery;
+    // The archive is only read for events that are not in the main table
+    QByteArray q = DatabaseIOPrivate::eventQueryBase().toLatin1();
+    q += "\n WHERE Events.id = :eventId";
+    q += "\n UNION ALL ";
+    q += DatabaseIOPrivate::archiveEventQueryBase().toLatin1();
     q += "\n WHERE Events.id = :eventId LIMIT 1";
 
     QSqlQuery query = CommHistoryDatabase::prepare(q, d->connection());
@@ -690,7 +1034,15 @@ bool DatabaseIO::getEvent(int id, Event &event)
 
 bool DatabaseIO::getEventExtraProperties(Event &event)
 {
-    const char *q = "SELECT key, value FROM EventProperties WHERE eventId=:eventId";
+    QByteArray q;
+    // Until PROPERTY_KEYS_MIGRATION completes, older properties are stored
+    // with their keys. They are read first, so that newer values replace them.
+    if (d->migrationPending(PROPERTY_KEYS_MIGRATION))
+        q = "SELECT key, value FROM OldEventProperties WHERE eventId=:eventId UNION ALL ";
+    q += "SELECT Keys.key, Properties.value FROM EventProperties AS Properties "
+         "  JOIN EventPropertyKeys AS Keys ON (Keys.id = Properties.keyId) WHERE Properties.eventId=:eventId "
+         "UNION ALL SELECT Keys.key, Properties.value FROM archive.EventProperties AS Properties "
+         "  JOIN EventPropertyKeys AS Keys ON (Keys.id = Properties.keyId) WHERE Properties.eventId=:eventId";
     QSqlQuery query = CommHistoryDatabase::prepare(q, d->connection());
     query.bindValue(":eventId", event.id());
 
@@ -701,7 +1053,13 @@ bool DatabaseIO::getEventExtraProperties(Event &event)
         return false;
     }
 
+    // Promoted properties were already read with the event
     QVariantMap data;
+    const QVariantMap current = event.extraProperties();
+    for (QVariantMap::const_iterator it = current.constBegin(); it != current.constEnd(); ++it) {
+        if (isPromotedProperty(it.key()))
+            data.insert(it.key(), it.value());
+    }
     while (query.next())
         data.insert(query.value(0).toString(), query.value(1).toString());
     event.setExtraProperties(data);
@@ -711,7 +1069,8 @@ bool DatabaseIO::getEventExtraProperties(Event &event)
 
 bool DatabaseIO::getMessageParts(Event &event)
 {
-    const char *q = "SELECT id, contentId, contentType, path FROM MessageParts WHERE eventId=:eventId";
+    const char *q = "SELECT id, contentId, contentType, path FROM MessageParts WHERE eventId=:eventId "
+                    "UNION ALL SELECT id, contentId, contentType, path FROM archive.MessageParts WHERE eventId=:eventId";
     QSqlQuery query = CommHistoryDatabase::prepare(q, d->connection());
     query.bindValue(":eventId", event.id());
 
@@ -737,7 +1096,7 @@ bool DatabaseIO::getMessageParts(Event &event)
 
 bool DatabaseIO::getEventByMessageToken(const QString &token, Event &event)
 {
-    QByteArray q = baseEventQuery;
+    QByteArray q = DatabaseIOPrivate::eventQueryBase().toLatin1();
     q += "\n WHERE Events.messageToken = :messageToken LIMIT 1";
 
     QSqlQuery query = CommHistoryDatabase::prepare(q, d->connection());
@@ -774,7 +1133,7 @@ bool DatabaseIO::getEventByMmsId(const QString &mmsId, Event &event)
     bool ok = false;
 
     if (!mmsId.isEmpty()) {
-        QByteArray q = baseEventQuery;
+        QByteArray q = DatabaseIOPrivate::eventQueryBase().toLatin1();
         q += "WHERE Events.mmsId=:mmsId"
              " AND Events.type=:type"
              " AND Events.direction=:direction LIMIT 1";
@@ -809,7 +1168,7 @@ bool DatabaseIO::getEventByMmsId(const QString &mmsId, Event &event)
 bool DatabaseIO::eventExists(int id)
 {
     QSqlQuery query = CommHistoryDatabase::prepare(
-        "SELECT Events.id FROM Events WHERE id=:id",
+        "SELECT id FROM Events WHERE id=:id UNION ALL SELECT id FROM archive.Events WHERE id=:id",
         d->connection());
     query.bindValue(":id", id);
     if (query.exec()) {
@@ -828,7 +1187,14 @@ bool DatabaseIO::modifyEvent(Event &event)
     if (!savepoint.begin())
         return false;
 
-    QueryHelper::FieldList fields = QueryHelper::eventFields(event, event.modifiedProperties());
+    QueryHelper::FieldList fields;
+    if (!QueryHelper::eventFields(event, event.modifiedProperties(), fields))
+        return false;
+
+    // Archived events are modified in the main table
+    if (!d->restoreArchivedEvents(QList<int>() << event.id()))
+        return false;
+
     QSqlQuery query = QueryHelper::updateQuery("UPDATE Events SET :fields WHERE id=:eventId", fields);
     query.bindValue(":eventId", event.id());
 
@@ -841,16 +1207,22 @@ bool DatabaseIO::modifyEvent(Event &event)
     query.finish();
 
     if (event.modifiedProperties().contains(Event::ExtraProperties)) {
-        const char *q = "DELETE FROM EventProperties WHERE eventId=:eventId";
-        query = CommHistoryDatabase::prepare(q, d->connection());
-        query.bindValue(":eventId", event.id());
-        if (!query.exec()) {
-            qWarning() << "Failed to execute query";
-            qWarning() << query.lastError();
-            qWarning() << query.lastQuery();
-            return false;
+        QList<const char *> statements;
+        statements << "DELETE FROM EventProperties WHERE eventId=:eventId";
+        if (d->migrationPending(PROPERTY_KEYS_MIGRATION))
+            statements << "DELETE FROM OldEventProperties WHERE eventId=:eventId";
+
+        foreach (const char *q, statements) {
+            query = CommHistoryDatabase::prepare(q, d->connection());
+            query.bindValue(":eventId", event.id());
+            if (!query.exec()) {
+                qWarning() << "Failed to execute query";
+                qWarning() << query.lastError();
+                qWarning() << query.lastQuery();
+                return false;
+            }
+            query.finish();
         }
-        query.finish();
 
         QVariantMap properties = event.extraProperties();
         if (!properties.isEmpty() && !d->insertEventProperties(event.id(), properties))
@@ -868,7 +1240,7 @@ bool DatabaseIO::modifyEvent(Event &event)
             }
         }
 
-        // Parts with no associated event are cleaned up asynchronously
+        // Parts with no associated event are removed by MessagePartCollector
         QByteArray q = "UPDATE MessageParts SET eventId=NULL WHERE eventId=:eventId AND id NOT IN (" + idList + ")";
         query = CommHistoryDatabase::prepare(q, d->connection());
         query.bindValue(":eventId", event.id());
@@ -889,6 +1261,13 @@ bool DatabaseIO::modifyEvent(Event &event)
 
 bool DatabaseIO::moveEvent(Event &event, int groupId)
 {
+    AutoSavepoint savepoint(d->connection());
+    if (!savepoint.begin())
+        return false;
+
+    if (!d->restoreArchivedEvents(QList<int>() << event.id()))
+        return false;
+
     static const char *q = "UPDATE Events SET groupId=:groupId WHERE id=:id";
     QSqlQuery query = CommHistoryDatabase::prepare(q, d->connection());
     query.bindValue(":groupId", groupId);
@@ -900,13 +1279,28 @@ bool DatabaseIO::moveEvent(Event &event, int groupId)
         qWarning() << query.lastQuery();
         return false;
     }
+    query.finish();
+
+    if (event.groupId() >= 0 && !d->restoreGroupHeads("AND groupId = " + QByteArray::number(event.groupId())))
+        return false;
+
+    if (!savepoint.release())
+        return false;
 
     event.setGroupId(groupId);
     return true;
 }
 
-bool DatabaseIO::deleteEvent(Event &event, QThread *)
+bool DatabaseIO::deleteEvent(Event &event, QThread *backgroundThread)
 {
+    AutoSavepoint savepoint(d->connection());
+    if (!savepoint.begin())
+        return false;
+
+    qint64 sequence;
+    if (!d->changeLogPosition(sequence))
+        return false;
+
     static const char *q = "DELETE FROM Events WHERE id=:id";
     QSqlQuery query = CommHistoryDatabase::prepare(q, d->connection());
     query.bindValue(":id", event.id());
@@ -917,6 +1311,20 @@ bool DatabaseIO::deleteEvent(Event &event, QThread *)
         qWarning() << query.lastQuery();
         return false;
     }
+    query.finish();
+
+    if (!d->deleteArchivedIds(QList<int>() << event.id(), sequence))
+        return false;
+
+    if (event.groupId() >= 0 && !d->restoreGroupHeads("AND groupId = " + QByteArray::number(event.groupId())))
+        return false;
+
+    if (!savepoint.release())
+        return false;
+
+    // Parts of the event are left with a null eventId
+    if (backgroundThread && event.type() == Event::MMSEvent)
+        collectMessageParts(backgroundThread);
 
     return true;
 }
@@ -928,6 +1336,10 @@ bool DatabaseIO::addGroup(Group &group)
         return false;
     }
 
+    AutoSavepoint savepoint(d->connection());
+    if (!savepoint.begin())
+        return false;
+
     QueryHelper::FieldList fields = QueryHelper::groupFields(group, Group::allProperties());
     QSqlQuery query = QueryHelper::insertQuery("INSERT INTO Groups (:fields) VALUES (:values)", fields);
 
@@ -938,7 +1350,13 @@ bool DatabaseIO::addGroup(Group &group)
         return false;
     }
 
-    group.setId(query.lastInsertId().toInt());
+    const int groupId = query.lastInsertId().toInt();
+    query.finish();
+
+    if (!d->insertGroupMembers(groupId, group.recipients()) || !savepoint.release())
+        return false;
+
+    group.setId(groupId);
     return true;
 }
 
@@ -981,6 +1399,24 @@ void DatabaseIOPrivate::readGroupResult(QSqlQuery &query, Group &group)
     group.setSubscriberIdentity(query.value(16).toString());
 }
 
+static const char *groupSubscriberIdentityColumn = "LastEvent.subscriberIdentity";
+
+// Until PROMOTED_PROPERTIES_MIGRATION completes, the property may be in EventProperties
+static const char *groupSubscriberIdentityFallback =
+    "IFNULL(LastEvent.subscriberIdentity, ("
+    "\n  SELECT value FROM EventProperties WHERE eventId = LastEvent.id "
+    "\n  AND keyId = (SELECT id FROM EventPropertyKeys WHERE key = 'subscriberIdentity')"
+    "\n ))";
+
+// and until PROPERTY_KEYS_MIGRATION completes, in OldEventProperties
+static const char *groupSubscriberIdentityKeyFallback =
+    "IFNULL(LastEvent.subscriberIdentity, IFNULL(("
+    "\n  SELECT value FROM EventProperties WHERE eventId = LastEvent.id "
+    "\n  AND keyId = (SELECT id FROM EventPropertyKeys WHERE key = 'subscriberIdentity')"
+    "\n ), ("
+    "\n  SELECT value FROM OldEventProperties WHERE eventId = LastEvent.id AND key = 'subscriberIdentity'"
+    "\n )))";
+
 static const char *baseGroupQuery =
     "\n SELECT "
     "\n Groups.id, "
@@ -999,7 +1435,7 @@ static const char *baseGroupQuery =
     "\n LastEvent.type, "
     "\n LastEvent.status, "
     "\n LastEvent.isDraft, "
-    "\n LastSubscriberIdentity.value "
+    "\n :subscriberIdentityColumn "
     "\n FROM Groups "
     "\n LEFT JOIN ("
     "\n  SELECT groupId, COUNT(*) as unread "
@@ -1014,14 +1450,24 @@ static const char *baseGroupQuery =
     "\n   ORDER BY endTime DESC, id DESC "
     "\n   LIMIT 1 "
     "\n  )"
-    "\n )"
-    "\n LEFT JOIN EventProperties AS LastSubscriberIdentity ON ("
-    "\n  LastSubscriberIdentity.eventId = LastEvent.id AND LastSubscriberIdentity.key = 'subscriberIdentity'"
     "\n ) ";
 
-bool DatabaseIO::getGroup(int id, Group &group)
+QByteArray DatabaseIOPrivate::groupQueryBase()
 {
+    const char *column = groupSubscriberIdentityColumn;
+    if (migrationPending(PROPERTY_KEYS_MIGRATION))
+        column = groupSubscriberIdentityKeyFallback;
+    else if (migrationPending(PROMOTED_PROPERTIES_MIGRATION))
+        column = groupSubscriberIdentityFallback;
+
     QByteArray q = baseGroupQuery;
+    q.replace(":subscriberIdentityColumn", column);
+    return q;
+}
+
+bool DatabaseIO::getGroup(int id, Group &group)
+{
+    QByteArray q = d->groupQueryBase();
     q += "\n WHERE Groups.id = :groupId GROUP BY Groups.id LIMIT 1";
 
     QSqlQuery query = CommHistoryDatabase::prepare(q, d->connection());
@@ -1047,7 +1493,7 @@ bool DatabaseIO::getGroup(int id, Group &group)
 
 bool DatabaseIO::getGroups(const QString &localUid, const QString &remoteUid, QList<Group> &result, const QString &queryOrder)
 {
-    QByteArray q = baseGroupQuery;
+    QByteArray q = d->groupQueryBase();
     if (!localUid.isEmpty() || !remoteUid.isEmpty()) {
         q += " WHERE ";
         if (!localUid.isEmpty()) {
@@ -1086,6 +1532,10 @@ bool DatabaseIO::getGroups(const QString &localUid, const QString &remoteUid, QL
 
 bool DatabaseIO::modifyGroup(Group &group)
 {
+    AutoSavepoint savepoint(d->connection());
+    if (!savepoint.begin())
+        return false;
+
     QueryHelper::FieldList fields = QueryHelper::groupFields(group, group.modifiedProperties());
     QSqlQuery query = QueryHelper::updateQuery("UPDATE Groups SET :fields WHERE id=:groupId", fields);
     query.bindValue(":groupId", group.id());
@@ -1096,8 +1546,27 @@ bool DatabaseIO::modifyGroup(Group &group)
         qWarning() << query.lastQuery();
         return false;
     }
+    query.finish();
 
-    return true;
+    // Minimized addresses depend on the local UID as well
+    const Group::PropertySet modified = group.modifiedProperties();
+    if (modified.contains(Group::Recipients) || modified.contains(Group::LocalUid)) {
+        QSqlQuery deleteQuery = CommHistoryDatabase::prepare("DELETE FROM GroupMembers WHERE groupId=:groupId", d->connection());
+        deleteQuery.bindValue(":groupId", group.id());
+
+        if (!deleteQuery.exec()) {
+            qWarning() << "Failed to execute query";
+            qWarning() << deleteQuery.lastError();
+            qWarning() << deleteQuery.lastQuery();
+            return false;
+        }
+        deleteQuery.finish();
+
+        if (!d->insertGroupMembers(group.id(), group.recipients()))
+            return false;
+    }
+
+    return savepoint.release();
 }
 
 bool DatabaseIO::deleteGroup(int groupId, QThread *backgroundThread)
@@ -1105,7 +1574,7 @@ bool DatabaseIO::deleteGroup(int groupId, QThread *backgroundThread)
     return deleteGroups(QList<int>() << groupId, backgroundThread);
 }
 
-static inline QByteArray joinNumberList(const QList<int> &list)
+QByteArray DatabaseIOPrivate::joinNumberList(const QList<int> &list)
 {
     QByteArray re;
     foreach (int i, list) {
@@ -1116,12 +1585,15 @@ static inline QByteArray joinNumberList(const QList<int> &list)
     return re;
 }
 
-bool DatabaseIO::deleteGroups(QList<int> groupIds, QThread *backgroundThread)
+bool DatabaseIO::getGroups(const QList<int> &groupIds, QList<Group> &result)
 {
-    Q_UNUSED(backgroundThread);
+    result.clear();
+    if (groupIds.isEmpty())
+        return true;
+
+    QByteArray q = d->groupQueryBase();
+    q += "\n WHERE Groups.id IN (" + DatabaseIOPrivate::joinNumberList(groupIds) + ") GROUP BY Groups.id";
 
-    // Events are deleted via SQL foreign keys
-    QByteArray q = "DELETE FROM Groups WHERE id IN (" + joinNumberList(groupIds) + ")";
     QSqlQuery query = CommHistoryDatabase::prepare(q, d->connection());
 
     if (!query.exec()) {
@@ -1131,14 +1603,39 @@ bool DatabaseIO::deleteGroups(QList<int> groupIds, QThread *backgroundThread)
         return false;
     }
 
+    while (query.next()) {
+        Group g;
+        d->readGroupResult(query, g);
+        result.append(g);
+    }
+
     return true;
 }
 
-bool DatabaseIO::totalEventsInGroup(int groupId, int &totalEvents)
+bool DatabaseIO::getGroupsByMember(const QString &localUid, const QString &remoteUid, QList<Group> &result)
 {
-    static const char *q = "SELECT COUNT(id) FROM Events WHERE groupId=:groupId";
-    QSqlQuery query = CommHistoryDatabase::prepare(q, d->connection());
-    query.bindValue(":groupId", groupId);
+    result.clear();
+    if (remoteUid.isEmpty())
+        return true;
+
+    /* Members are stored with Recipient::minimizedRemoteUid(), which depends
+     * on whether the account uses phone numbers. Without knowing that here,
+     * both forms are candidates, and the groups are matched exactly below. */
+    const QString minimized = remoteUid.toLower();
+    const QString minimizedPhone = minimizePhoneNumber(remoteUid).toLower();
+
+    QByteArray q = "SELECT DISTINCT GroupMembers.groupId FROM GroupMembers ";
+    if (!localUid.isEmpty())
+        q += "JOIN Groups ON (Groups.id = GroupMembers.groupId) ";
+    q += "WHERE GroupMembers.minimizedRemoteUid IN (:minimized, :minimizedPhone) ";
+    if (!localUid.isEmpty())
+        q += "AND Groups.localUid = :localUid ";
+
+    QSqlQuery query = CommHistoryDatabase::prepare(q.data(), d->connection());
+    query.bindValue(":minimized", minimized);
+    query.bindValue(":minimizedPhone", minimizedPhone.isEmpty() ? minimized : minimizedPhone);
+    if (!localUid.isEmpty())
+        query.bindValue(":localUid", localUid);
 
     if (!query.exec()) {
         qWarning() << "Failed to execute query";
@@ -1147,19 +1644,208 @@ bool DatabaseIO::totalEventsInGroup(int groupId, int &totalEvents)
         return false;
     }
 
-    if (query.next()) {
-        totalEvents = query.value(0).toInt();
-        return true;
+    QList<int> groupIds;
+    while (query.next())
+        groupIds.append(query.value(0).toInt());
+    query.finish();
+
+    QList<Group> groups;
+    if (!getGroups(groupIds, groups))
+        return false;
+
+    foreach (const Group &g, groups) {
+        if (g.recipients().matchesRemoteUid(remoteUid))
+            result.append(g);
     }
 
-    return false;
+    return true;
 }
 
-bool DatabaseIO::markAsReadGroup(int groupId)
+bool DatabaseIO::getGroupsByRecipients(const RecipientList &recipients, QList<Group> &result)
 {
-    static const char *q = "UPDATE Events SET isRead=1 WHERE groupId=:groupId AND isRead=0";
-    QSqlQuery query = CommHistoryDatabase::prepare(q, d->connection());
-    query.bindValue(":groupId", groupId);
+    result.clear();
+    if (recipients.isEmpty())
+        return true;
+
+    QStringList minimized;
+    for (RecipientList::const_iterator it = recipients.constBegin(), end = recipients.constEnd(); it != end; ++it) {
+        const QString uid = it->minimizedRemoteUid();
+        if (!minimized.contains(uid))
+            minimized.append(uid);
+    }
+
+    // Candidates have a member for every address; the exact comparison is done below
+    QByteArray q =
+        "\n SELECT GroupMembers.groupId FROM GroupMembers "
+        "\n JOIN Groups ON (Groups.id = GroupMembers.groupId) "
+        "\n WHERE Groups.localUid = :localUid AND GroupMembers.minimizedRemoteUid IN (";
+    for (int i = 0; i < minimized.size(); i++) {
+        if (i)
+            q += ',';
+        q += ":member" + QByteArray::number(i);
+    }
+    q += ") "
+        "\n GROUP BY GroupMembers.groupId "
+        "\n HAVING COUNT(DISTINCT GroupMembers.minimizedRemoteUid) = :count";
+
+    QSqlQuery query = CommHistoryDatabase::prepare(q.data(), d->connection());
+    query.bindValue(":localUid", recipients.first().localUid());
+    for (int i = 0; i < minimized.size(); i++)
+        query.bindValue(":member" + QString::number(i), minimized.at(i));
+    query.bindValue(":count", minimized.size());
+
+    if (!query.exec()) {
+        qWarning() << "Failed to execute query";
+        qWarning() << query.lastError();
+        qWarning() << query.lastQuery();
+        return false;
+    }
+
+    QList<int> groupIds;
+    while (query.next())
+        groupIds.append(query.value(0).toInt());
+    query.finish();
+
+    QList<Group> groups;
+    if (!getGroups(groupIds, groups))
+        return false;
+
+    foreach (const Group &g, groups) {
+        if (g.recipients().matches(recipients))
+            result.append(g);
+    }
+
+    return true;
+}
+
+bool DatabaseIO::getGroupsPage(const QString &localUid, const QString &remoteUid,
+                               quint32 afterEndTime, int afterId, int limit,
+                               QList<Group> &result)
+{
+    result.clear();
+
+    /* The full group query aggregates over all events, so the page is
+     * selected first from groups_lastEventTime, seeking to the end of the
+     * previous page, and only the groups in it are read in full. */
+    QList<QByteArray> conditions;
+    if (!localUid.isEmpty())
+        conditions << "localUid = :localUid";
+    if (!remoteUid.isEmpty())
+        conditions << "remoteUids = :remoteUid";
+    if (afterId >= 0)
+        conditions << "lastEventTime <= :afterEndTime AND (lastEventTime < :afterEndTime OR id < :afterId)";
+
+    QByteArray q = "SELECT id FROM Groups ";
+    for (int i = 0; i < conditions.size(); i++)
+        q += (i ? "AND " : "WHERE ") + conditions.at(i) + " ";
+    q += "ORDER BY lastEventTime DESC, id DESC LIMIT :limit";
+
+    QSqlQuery query = CommHistoryDatabase::prepare(q.data(), d->connection());
+    if (!localUid.isEmpty())
+        query.bindValue(":localUid", localUid);
+    if (!remoteUid.isEmpty())
+        query.bindValue(":remoteUid", remoteUid);
+    if (afterId >= 0) {
+        query.bindValue(":afterEndTime", afterEndTime);
+        query.bindValue(":afterId", afterId);
+    }
+    query.bindValue(":limit", limit);
+
+    if (!query.exec()) {
+        qWarning() << "Failed to execute query";
+        qWarning() << query.lastError();
+        qWarning() << query.lastQuery();
+        return false;
+    }
+
+    QList<int> groupIds;
+    while (query.next())
+        groupIds.append(query.value(0).toInt());
+    query.finish();
+
+    QList<Group> groups;
+    if (!getGroups(groupIds, groups))
+        return false;
+
+    // Restore the page order
+    QHash<int, Group> groupsById;
+    foreach (const Group &g, groups)
+        groupsById.insert(g.id(), g);
+    foreach (int id, groupIds) {
+        QHash<int, Group>::const_iterator it = groupsById.constFind(id);
+        if (it != groupsById.constEnd())
+            result.append(*it);
+    }
+
+    return true;
+}
+
+bool DatabaseIO::deleteGroups(QList<int> groupIds, QThread *backgroundThread)
+{
+    QList<int> deletedEventIds;
+    return deleteGroups(groupIds, deletedEventIds, backgroundThread);
+}
+
+bool DatabaseIO::deleteGroups(const QList<int> &groupIds, QList<int> &deletedEventIds, QThread *backgroundThread)
+{
+    const QByteArray idList = DatabaseIOPrivate::joinNumberList(groupIds);
+    deletedEventIds.clear();
+
+    qint64 sequence;
+    if (!d->changeLogPosition(sequence))
+        return false;
+
+    // Events are removed first in bounded batches, as the foreign key
+    // cascade would delete all of them in one statement
+    bool ok = d->deleteEvents("WHERE groupId IN (" + idList + ")", QVariantMap(), &deletedEventIds)
+        && d->deleteArchivedEvents("WHERE groupId IN (" + idList + ")", QVariantMap(), sequence, &deletedEventIds);
+
+    if (ok) {
+        QByteArray q = "DELETE FROM Groups WHERE id IN (" + idList + ")";
+        QSqlQuery query = CommHistoryDatabase::prepare(q, d->connection());
+
+        if (!query.exec()) {
+            qWarning() << "Failed to execute query";
+            qWarning() << query.lastError();
+            qWarning() << query.lastQuery();
+            ok = false;
+        }
+    }
+
+    // Parts of events in committed batches are collected even on failure
+    if (backgroundThread && !deletedEventIds.isEmpty())
+        collectMessageParts(backgroundThread);
+
+    return ok;
+}
+
+bool DatabaseIO::totalEventsInGroup(int groupId, int &totalEvents)
+{
+    static const char *q = "SELECT (SELECT COUNT(id) FROM Events WHERE groupId=:groupId) "
+                           "+ (SELECT COUNT(id) FROM archive.Events WHERE groupId=:groupId)";
+    QSqlQuery query = CommHistoryDatabase::prepare(q, d->connection());
+    query.bindValue(":groupId", groupId);
+
+    if (!query.exec()) {
+        qWarning() << "Failed to execute query";
+        qWarning() << query.lastError();
+        qWarning() << query.lastQuery();
+        return false;
+    }
+
+    if (query.next()) {
+        totalEvents = query.value(0).toInt();
+        return true;
+    }
+
+    return false;
+}
+
+bool DatabaseIO::markAsReadGroup(int groupId)
+{
+    static const char *q = "UPDATE Events SET isRead=1 WHERE groupId=:groupId AND isRead=0";
+    QSqlQuery query = CommHistoryDatabase::prepare(q, d->connection());
+    query.bindValue(":groupId", groupId);
 
     if (!query.exec()) {
         qWarning() << "Failed to execute query";
@@ -1174,7 +1860,7 @@ bool DatabaseIO::markAsReadGroup(int groupId)
 bool DatabaseIO::markAsRead(const QList<int> &eventIds)
 {
     QByteArray q = "UPDATE Events SET isRead=1 WHERE id IN (";
-    q += joinNumberList(eventIds) + ") AND isRead=0";
+    q += DatabaseIOPrivate::joinNumberList(eventIds) + ") AND isRead=0";
 
     QSqlQuery query = CommHistoryDatabase::prepare(q, d->connection());
     if (!query.exec()) {
@@ -1205,13 +1891,45 @@ bool DatabaseIO::markAsReadAll(Event::EventType eventType)
 
 bool DatabaseIO::deleteAllEvents(Event::EventType eventType)
 {
-    QByteArray q = "DELETE FROM Events ";
-    if (eventType != Event::UnknownType)
-        q += "WHERE type=:eventType ";
+    QByteArray condition;
+    QVariantMap values;
+    if (eventType != Event::UnknownType) {
+        condition = "WHERE type=:eventType";
+        values.insert(":eventType", eventType);
+    }
 
-    QSqlQuery query = CommHistoryDatabase::prepare(q, d->connection());
-    if (eventType != Event::UnknownType)
-        query.bindValue(":eventType", eventType);
+    qint64 sequence;
+    if (!d->changeLogPosition(sequence))
+        return false;
+
+    if (!d->deleteEvents(condition, values))
+        return false;
+
+    if (!d->deleteArchivedEvents(condition, values, sequence))
+        return false;
+
+    // Groups with other types of archived events keep the newest of them
+    if (!d->restoreGroupHeads(QByteArray()))
+        return false;
+
+    return d->deleteEmptyGroups();
+}
+
+void DatabaseIO::setMaxWriteLockTime(int milliseconds)
+{
+    d->maxWriteLockTime = milliseconds;
+}
+
+int DatabaseIO::maxWriteLockTime() const
+{
+    return d->maxWriteLockTime;
+}
+
+bool DatabaseIO::lastChangeSequence(qint64 &sequence)
+{
+    QSqlQuery query = CommHistoryDatabase::prepare(
+            "SELECT seq FROM sqlite_sequence WHERE name = 'ChangeLog'",
+            d->connection());
 
     if (!query.exec()) {
         qWarning() << "Failed to execute query";
@@ -1220,13 +1938,17 @@ bool DatabaseIO::deleteAllEvents(Event::EventType eventType)
         return false;
     }
 
-    return d->deleteEmptyGroups();
+    sequence = query.next() ? query.value(0).toLongLong() : 0;
+    return true;
 }
 
-bool DatabaseIOPrivate::deleteEmptyGroups()
+bool DatabaseIO::getChanges(qint64 sinceSequence, QList<Change> &changes, bool &complete)
 {
-    static const char *q = "DELETE FROM Groups WHERE (SELECT COUNT(id) FROM Events WHERE groupId=Groups.id) = 0";
-    QSqlQuery query = CommHistoryDatabase::prepare(q, connection());
+    QSqlQuery query = CommHistoryDatabase::prepare(
+            "SELECT seq, tableId, operation, rowId, groupId FROM ChangeLog WHERE seq > :seq ORDER BY seq",
+            d->connection());
+    query.bindValue(":seq", sinceSequence);
+
     if (!query.exec()) {
         qWarning() << "Failed to execute query";
         qWarning() << query.lastError();
@@ -1234,8 +1956,578 @@ bool DatabaseIOPrivate::deleteEmptyGroups()
         return false;
     }
 
-    if (query.numRowsAffected() > 0)
-        DEBUG() << Q_FUNC_INFO << "Deleted" << query.numRowsAffected() << "empty groups";
+    changes.clear();
+    while (query.next()) {
+        Change change;
+        change.sequence = query.value(0).toLongLong();
+        change.table = static_cast<Change::Table>(query.value(1).toInt());
+        change.operation = static_cast<Change::Operation>(query.value(2).toInt());
+        change.id = query.value(3).toInt();
+        change.groupId = query.value(4).isNull() ? -1 : query.value(4).toInt();
+        changes.append(change);
+    }
+
+    // Sequence numbers are contiguous and pruning only removes the oldest
+    // entries, so a gap after sinceSequence means entries were lost.
+    complete = changes.isEmpty() || changes.first().sequence == sinceSequence + 1;
+    return true;
+}
+
+bool DatabaseIO::dataVersion(int &version)
+{
+    QSqlQuery query = CommHistoryDatabase::prepare("PRAGMA data_version", d->connection());
+
+    if (!query.exec() || !query.next()) {
+        qWarning() << "Failed to execute query";
+        qWarning() << query.lastError();
+        qWarning() << query.lastQuery();
+        return false;
+    }
+
+    version = query.value(0).toInt();
+    return true;
+}
+
+bool DatabaseIOPrivate::deleteEvents(const QByteArray &condition, const QVariantMap &values, QList<int> *deletedIds)
+{
+    QSqlQuery query = CommHistoryDatabase::prepare("SELECT COUNT(*) FROM Events " + condition, connection());
+    for (QVariantMap::const_iterator it = values.constBegin(); it != values.constEnd(); ++it)
+        query.bindValue(it.key(), it.value());
+
+    if (!query.exec() || !query.next()) {
+        qWarning() << "Failed to execute query";
+        qWarning() << query.lastError();
+        qWarning() << query.lastQuery();
+        return false;
+    }
+
+    const int total = query.value(0).toInt();
+    query.finish();
+    if (!total)
+        return true;
+
+    // Properties and message parts of the events go with them via foreign keys.
+    // When the ids are wanted, each batch selects them before deleting.
+    const QByteArray batchIds = "SELECT id FROM Events " + condition + " LIMIT :limit";
+    if (deletedIds)
+        query = CommHistoryDatabase::prepare(batchIds, connection());
+    else
+        query = CommHistoryDatabase::prepare("DELETE FROM Events WHERE id IN (" + batchIds + ")", connection());
+
+    DeletionBatches batches(connection(), inTransaction, maxWriteLockTime);
+    int deleted = 0;
+    for (;;) {
+        if (!batches.begin())
+            return false;
+
+        for (QVariantMap::const_iterator it = values.constBegin(); it != values.constEnd(); ++it)
+            query.bindValue(it.key(), it.value());
+        query.bindValue(":limit", batches.size());
+
+        if (!query.exec()) {
+            qWarning() << "Failed to execute query";
+            qWarning() << query.lastError();
+            qWarning() << query.lastQuery();
+            return false;
+        }
+
+        int rows = 0;
+        QList<int> batch;
+        if (deletedIds) {
+            while (query.next())
+                batch.append(query.value(0).toInt());
+            query.finish();
+
+            if (!batch.isEmpty()) {
+                QSqlQuery deleteQuery = CommHistoryDatabase::prepare(
+                        "DELETE FROM Events WHERE id IN (" + joinNumberList(batch) + ")", connection());
+                if (!execute(deleteQuery))
+                    return false;
+            }
+            rows = batch.size();
+        } else {
+            rows = query.numRowsAffected();
+            query.finish();
+        }
+
+        // Committing adapts the batch size, so whether this was the last batch is decided first
+        const bool last = batches.isLast(rows);
+        if (!batches.commit())
+            return false;
+
+        if (deletedIds)
+            deletedIds->append(batch);
+        deleted += rows;
+        emit q->deletionProgress(deleted, total);
+
+        if (last)
+            break;
+    }
+
+    return true;
+}
+
+bool DatabaseIOPrivate::deleteEmptyGroups(const QByteArray &groupCondition, QList<int> *deletedIds)
+{
+    // Groups are checked in windows of consecutive ids, so each batch costs
+    // the same however few of the groups are empty
+    QSqlQuery windowQuery = CommHistoryDatabase::prepare(
+            "SELECT MAX(id), COUNT(*) FROM (SELECT id FROM Groups WHERE id > :lastId " + groupCondition
+            + " ORDER BY id LIMIT :limit)",
+            connection());
+    const QByteArray emptyGroups = "FROM Groups WHERE id > :lastId AND id <= :windowEnd " + groupCondition
+            + " AND NOT EXISTS (SELECT 1 FROM Events WHERE groupId=Groups.id)";
+    QSqlQuery deleteQuery = CommHistoryDatabase::prepare(
+            deletedIds ? "SELECT id " + emptyGroups : "DELETE " + emptyGroups, connection());
+
+    DeletionBatches batches(connection(), inTransaction, maxWriteLockTime);
+    int lastId = -1;
+    int deleted = 0;
+    for (;;) {
+        if (!batches.begin())
+            return false;
+
+        windowQuery.bindValue(":lastId", lastId);
+        windowQuery.bindValue(":limit", batches.size());
+        if (!execQuery(windowQuery) || !windowQuery.next())
+            return false;
+
+        const int windowEnd = windowQuery.value(0).toInt();
+        const int count = windowQuery.value(1).toInt();
+        windowQuery.finish();
+
+        QList<int> batch;
+        if (count) {
+            deleteQuery.bindValue(":lastId", lastId);
+            deleteQuery.bindValue(":windowEnd", windowEnd);
+            if (!execQuery(deleteQuery))
+                return false;
+
+            if (deletedIds) {
+                while (deleteQuery.next())
+                    batch.append(deleteQuery.value(0).toInt());
+                deleteQuery.finish();
+
+                if (!batch.isEmpty()) {
+                    QSqlQuery query = CommHistoryDatabase::prepare(
+                            "DELETE FROM Groups WHERE id IN (" + joinNumberList(batch) + ")", connection());
+                    if (!execute(query))
+                        return false;
+                }
+                deleted += batch.size();
+            } else {
+                deleted += deleteQuery.numRowsAffected();
+                deleteQuery.finish();
+            }
+        }
+
+        const bool last = batches.isLast(count);
+        if (!batches.commit())
+            return false;
+
+        if (deletedIds)
+            deletedIds->append(batch);
+        if (last)
+            break;
+        lastId = windowEnd;
+    }
+
+    if (deleted > 0)
+        DEBUG() << Q_FUNC_INFO << "Deleted" << deleted << "empty groups";
+
+    return true;
+}
+
+bool DatabaseIOPrivate::execQuery(QSqlQuery &query)
+{
+    if (!query.exec()) {
+        qWarning() << "Failed to execute query";
+        qWarning() << query.lastError();
+        qWarning() << query.lastQuery();
+        return false;
+    }
+
+    return true;
+}
+
+bool DatabaseIOPrivate::execute(QSqlQuery &query)
+{
+    if (!execQuery(query))
+        return false;
+
+    query.finish();
+    return true;
+}
+
+int DatabaseIOPrivate::nextBatchSize(int batchSize, qint64 elapsed, int maxLockTime)
+{
+    // Aim below the limit, as batches vary in cost
+    const qint64 target = qint64(batchSize) * maxLockTime * 3 / 4 / qMax<qint64>(elapsed, 1);
+    return int(qBound<qint64>(1, target, qMin(qint64(batchSize) * 2, qint64(maxBatchSize))));
+}
+
+bool DatabaseIOPrivate::tableColumns(const char *table, QByteArray &columns)
+{
+    QHash<QByteArray, QByteArray>::const_iterator it = columnLists.constFind(table);
+    if (it != columnLists.constEnd()) {
+        columns = *it;
+        return true;
+    }
+
+    // The archive has at least the columns of the main tables
+    QSqlQuery query(connection());
+    if (!query.exec(QString::fromLatin1("PRAGMA main.table_info(%1)").arg(QLatin1String(table)))) {
+        qWarning() << "Failed to execute query";
+        qWarning() << query.lastError();
+        qWarning() << query.lastQuery();
+        return false;
+    }
+
+    columns.clear();
+    while (query.next()) {
+        if (!columns.isEmpty())
+            columns += ", ";
+        columns += query.value(1).toString().toLatin1();
+    }
+
+    columnLists.insert(table, columns);
+    return true;
+}
+
+bool DatabaseIOPrivate::changeLogPosition(qint64 &sequence)
+{
+    QSqlQuery query = CommHistoryDatabase::prepare(
+            "SELECT seq FROM sqlite_sequence WHERE name = 'ChangeLog'", connection());
+    if (!query.exec()) {
+        qWarning() << "Failed to execute query";
+        qWarning() << query.lastError();
+        qWarning() << query.lastQuery();
+        return false;
+    }
+
+    sequence = query.next() ? query.value(0).toLongLong() : 0;
+    query.finish();
+    return true;
+}
+
+bool DatabaseIOPrivate::migrationPending(const char *name)
+{
+    // Migrations can complete in any process, so this is not cached
+    QSqlQuery query = CommHistoryDatabase::prepare("SELECT 1 FROM Migrations WHERE name = :name", connection());
+    query.bindValue(":name", QLatin1String(name));
+    // Fall back to reading both forms if the state can't be read
+    if (!execQuery(query))
+        return true;
+
+    const bool pending = query.next();
+    query.finish();
+    return pending;
+}
+
+void DatabaseIOPrivate::scheduleMigrations()
+{
+    if (!migration)
+        migration = new DatabaseMigration(this);
+
+    if (migration->isPending())
+        migration->schedule();
+}
+
+bool DatabaseIOPrivate::rewindChangeLog(qint64 sequence)
+{
+    // Only valid within the write transaction that added the entries, so
+    // that sequence numbers stay contiguous for getChanges()
+    QSqlQuery query = CommHistoryDatabase::prepare("DELETE FROM ChangeLog WHERE seq > :seq", connection());
+    query.bindValue(":seq", sequence);
+    if (!execute(query))
+        return false;
+
+    query = CommHistoryDatabase::prepare("UPDATE sqlite_sequence SET seq = :seq WHERE name = 'ChangeLog'", connection());
+    query.bindValue(":seq", sequence);
+    return execute(query);
+}
+
+bool DatabaseIOPrivate::archiveEvents(const QList<int> &eventIds)
+{
+    if (eventIds.isEmpty())
+        return true;
+
+    // Events moved to an archive in memory would be lost with the connection
+    if (!CommHistoryDatabase::hasArchiveFile(connection())) {
+        qWarning() << "Events can't be archived without an archive database";
+        return false;
+    }
+
+    if (inTransaction) {
+        qWarning() << "Events can't be archived in a transaction";
+        return false;
+    }
+
+    // The archive only stores properties with the ids of their keys
+    if (migrationPending(PROPERTY_KEYS_MIGRATION)) {
+        qWarning() << "Events can't be archived until their properties are migrated";
+        return false;
+    }
+
+    QByteArray eventColumns, propertyColumns, partColumns;
+    if (!tableColumns("Events", eventColumns)
+            || !tableColumns("EventProperties", propertyColumns)
+            || !tableColumns("MessageParts", partColumns))
+        return false;
+
+    // Copies left by an interrupted move are replaced
+    const QByteArray idList = joinNumberList(eventIds);
+    if (!q->transaction())
+        return false;
+
+    qint64 sequence = 0;
+    if (!changeLogPosition(sequence)) {
+        q->rollback();
+        return false;
+    }
+
+    const QByteArray copyStatements[] = {
+        "INSERT OR REPLACE INTO archive.Events (" + eventColumns + ") SELECT " + eventColumns
+            + " FROM main.Events WHERE id IN (" + idList + ")",
+        "DELETE FROM archive.EventProperties WHERE eventId IN (" + idList + ")",
+        "INSERT INTO archive.EventProperties (" + propertyColumns + ") SELECT " + propertyColumns
+            + " FROM main.EventProperties WHERE eventId IN (" + idList + ")",
+        "DELETE FROM archive.MessageParts WHERE eventId IN (" + idList + ")",
+        "INSERT INTO archive.MessageParts (" + partColumns + ") SELECT " + partColumns
+            + " FROM main.MessageParts WHERE eventId IN (" + idList + ")"
+    };
+
+    for (unsigned i = 0; i < sizeof(copyStatements) / sizeof(*copyStatements); i++) {
+        QSqlQuery query = CommHistoryDatabase::prepare(copyStatements[i], connection());
+        if (!execute(query)) {
+            q->rollback();
+            return false;
+        }
+    }
+
+    if (!q->commit())
+        return false;
+
+    // Events changed by another connection since they were copied stay in
+    // the main database. Parts are deleted before their event, which would
+    // otherwise leave them for the collector to remove with their files.
+    const QByteArray copied = "(SELECT id FROM archive.Events WHERE id IN (" + idList + ") "
+        "AND id NOT IN (SELECT rowId FROM main.ChangeLog WHERE tableId = 0 AND seq > :seq))";
+    const QByteArray deleteStatements[] = {
+        "DELETE FROM main.MessageParts WHERE eventId IN " + copied,
+        "DELETE FROM main.Events WHERE id IN " + copied
+    };
+
+    if (!q->transaction())
+        return false;
+
+    qint64 deleteSequence = 0;
+    if (!changeLogPosition(deleteSequence)) {
+        q->rollback();
+        return false;
+    }
+
+    for (unsigned i = 0; i < sizeof(deleteStatements) / sizeof(*deleteStatements); i++) {
+        QSqlQuery query = CommHistoryDatabase::prepare(deleteStatements[i], connection());
+        query.bindValue(":seq", sequence);
+        if (!execute(query)) {
+            q->rollback();
+            return false;
+        }
+    }
+
+    // Archived events are still visible, so the move is not a change
+    if (!rewindChangeLog(deleteSequence)) {
+        q->rollback();
+        return false;
+    }
+
+    if (!q->commit())
+        return false;
+
+    // The copies of events that stayed are removed from the archive
+    return repairArchive("AND id IN (" + idList + ")");
+}
+
+bool DatabaseIOPrivate::restoreArchivedEvents(const QList<int> &eventIds)
+{
+    if (eventIds.isEmpty())
+        return true;
+
+    QByteArray eventColumns, propertyColumns, partColumns;
+    if (!tableColumns("Events", eventColumns)
+            || !tableColumns("EventProperties", propertyColumns)
+            || !tableColumns("MessageParts", partColumns))
+        return false;
+
+    const QByteArray idList = joinNumberList(eventIds);
+    QSqlQuery query = CommHistoryDatabase::prepare("SELECT id, EXISTS (SELECT 1 FROM main.Events AS M WHERE M.id = A.id) "
+            "FROM archive.Events AS A WHERE id IN (" + idList + ")", connection());
+    if (!query.exec()) {
+        qWarning() << "Failed to execute query";
+        qWarning() << query.lastError();
+        qWarning() << query.lastQuery();
+        return false;
+    }
+
+    // Usually none of the events are archived. An event also in the main
+    // table was left by an interrupted move, and its main copy is kept.
+    QList<int> archivedIds, restoredIds;
+    while (query.next()) {
+        archivedIds.append(query.value(0).toInt());
+        if (!query.value(1).toBool())
+            restoredIds.append(query.value(0).toInt());
+    }
+    query.finish();
+    if (archivedIds.isEmpty())
+        return true;
+
+    AutoSavepoint savepoint(connection());
+    if (!savepoint.begin())
+        return false;
+
+    qint64 sequence = 0;
+    if (!changeLogPosition(sequence))
+        return false;
+
+    QList<QByteArray> statements;
+    if (!restoredIds.isEmpty()) {
+        const QByteArray restoredList = joinNumberList(restoredIds);
+        statements << "INSERT INTO main.Events (" + eventColumns + ") SELECT " + eventColumns
+                      + " FROM archive.Events WHERE id IN (" + restoredList + ")"
+                   << "INSERT INTO main.EventProperties (" + propertyColumns + ") SELECT " + propertyColumns
+                      + " FROM archive.EventProperties WHERE eventId IN (" + restoredList + ")"
+                   << "INSERT INTO main.MessageParts (" + partColumns + ") SELECT " + partColumns
+                      + " FROM archive.MessageParts WHERE eventId IN (" + restoredList + ")";
+    }
+
+    // The main database commits first, so if the archive's deletions are
+    // interrupted, the events are left in both and repairArchive() completes it
+    const QByteArray archivedList = joinNumberList(archivedIds);
+    statements << "DELETE FROM archive.EventProperties WHERE eventId IN (" + archivedList + ")"
+               << "DELETE FROM archive.MessageParts WHERE eventId IN (" + archivedList + ")"
+               << "DELETE FROM archive.Events WHERE id IN (" + archivedList + ")";
+
+    foreach (const QByteArray &statement, statements) {
+        query = CommHistoryDatabase::prepare(statement, connection());
+        if (!execute(query))
+            return false;
+    }
+
+    if (!rewindChangeLog(sequence))
+        return false;
+
+    return savepoint.release();
+}
+
+bool DatabaseIOPrivate::repairArchive(const QByteArray &condition)
+{
+    const QByteArray events = "(SELECT id FROM archive.Events WHERE id IN (SELECT id FROM main.Events) " + condition + ")";
+    const QByteArray statements[] = {
+        "DELETE FROM archive.EventProperties WHERE eventId IN " + events,
+        "DELETE FROM archive.MessageParts WHERE eventId IN " + events,
+        "DELETE FROM archive.Events WHERE id IN " + events
+    };
+
+    AutoSavepoint savepoint(connection());
+    if (!savepoint.begin())
+        return false;
+
+    for (unsigned i = 0; i < sizeof(statements) / sizeof(*statements); i++) {
+        QSqlQuery query = CommHistoryDatabase::prepare(statements[i], connection());
+        if (!execute(query))
+            return false;
+    }
+
+    return savepoint.release();
+}
+
+bool DatabaseIOPrivate::restoreGroupHeads(const QByteArray &groupCondition)
+{
+    QSqlQuery query = CommHistoryDatabase::prepare(
+            "SELECT (SELECT id FROM archive.Events AS A WHERE A.groupId = G.groupId "
+            "ORDER BY A.endTime DESC, A.id DESC LIMIT 1) "
+            "FROM (SELECT DISTINCT groupId FROM archive.Events WHERE groupId IS NOT NULL " + groupCondition + ") AS G "
+            "WHERE NOT EXISTS (SELECT 1 FROM main.Events WHERE groupId = G.groupId)",
+            connection());
+    if (!query.exec()) {
+        qWarning() << "Failed to execute query";
+        qWarning() << query.lastError();
+        qWarning() << query.lastQuery();
+        return false;
+    }
+
+    QList<int> eventIds;
+    while (query.next())
+        eventIds.append(query.value(0).toInt());
+    query.finish();
+
+    return restoreArchivedEvents(eventIds);
+}
+
+bool DatabaseIOPrivate::deleteArchivedEvents(const QByteArray &condition, const QVariantMap &values,
+                                             qint64 loggedSince, QList<int> *deletedIds)
+{
+    QSqlQuery query = CommHistoryDatabase::prepare("SELECT id FROM archive.Events " + condition + " LIMIT :limit",
+                                                   connection());
+
+    DeletionBatches batches(connection(), inTransaction, maxWriteLockTime);
+    for (;;) {
+        if (!batches.begin())
+            return false;
+
+        for (QVariantMap::const_iterator it = values.constBegin(); it != values.constEnd(); ++it)
+            query.bindValue(it.key(), it.value());
+        query.bindValue(":limit", batches.size());
+        if (!execQuery(query))
+            return false;
+
+        QList<int> batch;
+        while (query.next())
+            batch.append(query.value(0).toInt());
+        query.finish();
+
+        if (!batch.isEmpty() && !deleteArchivedIds(batch, loggedSince))
+            return false;
+
+        const bool last = batches.isLast(batch.size());
+        if (!batches.commit())
+            return false;
+
+        if (deletedIds)
+            deletedIds->append(batch);
+
+        if (last)
+            break;
+    }
+
+    return true;
+}
+
+bool DatabaseIOPrivate::deleteArchivedIds(const QList<int> &eventIds, qint64 loggedSince)
+{
+    const QByteArray idList = joinNumberList(eventIds);
+
+    // Triggers only log changes to the main tables. Events also deleted
+    // from the main table, after an interrupted move, were logged since
+    // loggedSince. Parts stay in the archive with a null eventId, for the
+    // collector to remove with their files.
+    const QByteArray statements[] = {
+        "INSERT INTO main.ChangeLog (tableId, operation, rowId, groupId) "
+            "SELECT 0, 3, id, groupId FROM archive.Events WHERE id IN (" + idList + ")"
+            " AND id NOT IN (SELECT rowId FROM main.ChangeLog WHERE seq > :seq AND tableId = 0 AND operation = 3)",
+        "UPDATE archive.MessageParts SET eventId = NULL WHERE eventId IN (" + idList + ")",
+        "DELETE FROM archive.EventProperties WHERE eventId IN (" + idList + ")",
+        "DELETE FROM archive.Events WHERE id IN (" + idList + ")"
+    };
+
+    for (unsigned i = 0; i < sizeof(statements) / sizeof(*statements); i++) {
+        QSqlQuery query = CommHistoryDatabase::prepare(statements[i], connection());
+        if (i == 0)
+            query.bindValue(":seq", loggedSince);
+        if (!execute(query))
+            return false;
+    }
 
     return true;
 }
@@ -1243,6 +2535,7 @@ bool DatabaseIOPrivate::deleteEmptyGroups()
 bool DatabaseIO::transaction()
 {
     bool re = d->connection().transaction();
+    d->inTransaction = re;
     if (!re) {
         qWarning() << "Failed to start transaction";
         qWarning() << d->connection().lastError();
@@ -1253,6 +2546,7 @@ bool DatabaseIO::transaction()
 bool DatabaseIO::commit()
 {
     bool re = d->connection().commit();
+    d->inTransaction = false;
     if (!re) {
         qWarning() << "Failed to commit transaction";
         qWarning() << d->connection().lastError();
@@ -1261,8 +2555,17 @@ bool DatabaseIO::commit()
     return re;
 }
 
+void DatabaseIO::collectMessageParts(QThread *backgroundThread)
+{
+    d->collectMessageParts(backgroundThread);
+}
+
 bool DatabaseIO::rollback()
 {
+    // Dictionary entries added in the transaction are gone
+    d->clearDictionaryIds();
+    d->inTransaction = false;
+
     bool re = d->connection().rollback();
     if (!re) {
         qWarning() << "Failed to rollback transaction";
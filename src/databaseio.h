@@ -45,6 +45,30 @@ class LIBCOMMHISTORY_EXPORT DatabaseIO : public QObject
     Q_OBJECT
 
 public:
+    /*!
+     * A single entry of the change journal. Entries are written by the
+     * database for every insert, update and delete of an event or group,
+     * including those made by other processes.
+     */
+    struct Change {
+        enum Table {
+            EventsTable = 0,
+            GroupsTable = 1
+        };
+
+        enum Operation {
+            Insert = 1,
+            Update = 2,
+            Delete = 3
+        };
+
+        qint64 sequence;
+        Table table;
+        Operation operation;
+        int id;
+        int groupId;
+    };
+
     DatabaseIO();
     ~DatabaseIO();
     static DatabaseIO* instance();
@@ -176,6 +200,58 @@ public:
     bool getGroups(const QString &localUid, const QString &remoteUid, QList<Group> &groups,
                    const QString &queryOrder = QString());
 
+    /*!
+     * Query several groups by id with a single query. Ids that do not
+     * exist are silently skipped.
+     *
+     * \param groupIds Database ids of the groups
+     * \param groups Reference to container for results
+     * \return true if successful, otherwise false
+     */
+    bool getGroups(const QList<int> &groupIds, QList<Group> &groups);
+
+    /*!
+     * Query one page of groups, ordered by the end time of their last
+     * event, newest first. Pages are keyed on the last group of the previous
+     * page rather than an offset, so groups added meanwhile do not shift
+     * the following pages.
+     *
+     * \param localUid Local account filter, as for getGroups()
+     * \param remoteUid Remote contact filter, as for getGroups()
+     * \param afterEndTime End time of the last group of the previous page
+     * \param afterId Id of the last group of the previous page, or -1 for the first page
+     * \param limit Maximum number of groups in the page
+     * \param groups Reference to container for results
+     * \return true if successful, otherwise false
+     */
+    bool getGroupsPage(const QString &localUid, const QString &remoteUid,
+                       quint32 afterEndTime, int afterId, int limit,
+                       QList<Group> &groups);
+
+    /*!
+     * Query the groups with a participant matching \a remoteUid, optionally
+     * limited to one local account. Unlike getGroups(), this matches any
+     * participant of multi-recipient groups, and compares addresses as
+     * Recipient::matchesRemoteUid() does rather than by exact string.
+     *
+     * \param localUid Optional local UID to limit results
+     * \param remoteUid Remote UID of the participant
+     * \param groups Reference to container for results
+     * \return true if successful, otherwise false
+     */
+    bool getGroupsByMember(const QString &localUid, const QString &remoteUid, QList<Group> &groups);
+
+    /*!
+     * Query the groups whose participants match \a recipients, as compared
+     * by RecipientList::matches(). All recipients must have the same
+     * local UID.
+     *
+     * \param recipients Participants of the group
+     * \param groups Reference to container for results
+     * \return true if successful, otherwise false
+     */
+    bool getGroupsByRecipients(const RecipientList &recipients, QList<Group> &groups);
+
     /*!
      * Modifye a group.
      *
@@ -197,6 +273,9 @@ public:
     /*!
      * Delete groups
      *
+     * The events of the groups are deleted in batches, as in
+     * deleteAllEvents().
+     *
      * \param groupIds Existing group ids
      * \param backgroundThread optional thread (to delete mms attachments)
      *
@@ -204,6 +283,22 @@ public:
      */
     bool deleteGroups(QList<int> groupIds, QThread *backgroundThread = 0);
 
+    /*!
+     * Delete groups and their events, as deleteGroups() above.
+     *
+     * Batches of events are committed as they are deleted, so a failure
+     * can leave the groups with some of their events deleted. Outside of
+     * a transaction, \a deletedEventIds lists the events that are gone,
+     * whether or not the call succeeds.
+     *
+     * \param groupIds Existing group ids
+     * \param deletedEventIds result, ids of the deleted events
+     * \param backgroundThread optional thread (to delete mms attachments)
+     *
+     * \return true if successful, otherwise false
+     */
+    bool deleteGroups(const QList<int> &groupIds, QList<int> &deletedEventIds, QThread *backgroundThread = 0);
+
     /*!
      * Query the number of events in a group
      *
@@ -246,11 +341,59 @@ public:
      *
      * If Event::UnknownType is passed, all events are deleted.
      *
+     * Outside of a transaction, events and then empty groups are deleted in
+     * batches that each commit separately and hold the write lock for about
+     * maxWriteLockTime(). Other connections can write between the batches.
+     * deletionProgress() is emitted after each batch.
+     *
      * \param eventType
      * \return true if successful, otherwise false
      */
     bool deleteAllEvents(Event::EventType eventType);
 
+    /*!
+     * Set the time a bulk deletion may hold the write lock in one
+     * transaction. Other writers wait at most about this long for a
+     * deletion. Zero or less deletes in a single transaction.
+     *
+     * \param milliseconds lock time, 100 by default
+     */
+    void setMaxWriteLockTime(int milliseconds);
+    int maxWriteLockTime() const;
+
+    /*!
+     * Query the sequence number of the most recent change journal entry.
+     * Read this before a query to later fetch the changes made after it.
+     *
+     * \param sequence result, 0 if the journal is empty
+     * \return true if successful, otherwise false
+     */
+    bool lastChangeSequence(qint64 &sequence);
+
+    /*!
+     * Query the change journal entries after \a sinceSequence, in order.
+     *
+     * The journal is pruned automatically. If entries following
+     * \a sinceSequence have already been removed, \a complete is set to
+     * false and the caller must fall back to a full query.
+     *
+     * \param sinceSequence last sequence number already seen by the caller
+     * \param changes result
+     * \param complete false if the journal no longer covers \a sinceSequence
+     * \return true if successful, otherwise false
+     */
+    bool getChanges(qint64 sinceSequence, QList<Change> &changes, bool &complete);
+
+    /*!
+     * Query SQLite's data_version for this connection. The value changes
+     * only when another connection commits to the database, which makes it
+     * a cheap test for whether the change journal needs to be read.
+     *
+     * \param version result
+     * \return true if successful, otherwise false
+     */
+    bool dataVersion(int &version);
+
     /*!
      * Initate a new database transaction.
      */
@@ -270,6 +413,33 @@ public:
      */
     bool rollback();
 
+    /*!
+     * Remove message parts that no longer belong to an event, with their
+     * files and unused data directories. The work is done in small batches
+     * on \a backgroundThread after a short delay, and requests made in the
+     * meantime are merged. deleteEvent() and deleteGroups() call this when
+     * given a thread.
+     *
+     * \param backgroundThread running thread to collect parts in
+     */
+    void collectMessageParts(QThread *backgroundThread);
+
+signals:
+    /*!
+     * Emitted when a collection started by collectMessageParts() finishes.
+     *
+     * \param reclaimedBytes size of the files that were removed
+     */
+    void messagePartsCollected(qint64 reclaimedBytes);
+
+    /*!
+     * Emitted after each batch of deleteAllEvents() and deleteGroups().
+     *
+     * \param deletedEvents events deleted so far
+     * \param totalEvents events to delete
+     */
+    void deletionProgress(int deletedEvents, int totalEvents);
+
 private:
     friend class DatabaseIOPrivate;
     DatabaseIOPrivate * const d;
@@ -28,6 +28,7 @@
 #include <QHash>
 #include <QSet>
 #include <QQueue>
+#include <QPointer>
 #include <QThread>
 #include <QThreadStorage>
 #include <QStringList>
@@ -40,6 +41,8 @@ namespace CommHistory {
 
 class Group;
 class DatabaseIO;
+class MessagePartCollector;
+class DatabaseMigration;
 
 /**
  * \class DatabaseIOPrivate
@@ -67,21 +70,127 @@ public:
     static void readGroupResult(QSqlQuery &query, Group &group);
 
     static QString eventQueryBase();
+    /* Same columns as eventQueryBase(), from the archived events */
+    static QString archiveEventQueryBase();
+    /* Columns read by readGroupResult(), from Groups and their last event */
+    QByteArray groupQueryBase();
     static QString limitClause(int limit, int offset);
     static QString categoryClause(int categoryMask);
 
     bool getEvents(const QString &querySuffix, QList<Event> &events);
 
-    bool deleteEmptyGroups();
+    /* Deletes events matching condition, a WHERE clause using the bound
+     * values, in transactions bounded by maxWriteLockTime. If deletedIds is
+     * given, the ids of events in committed batches are appended to it,
+     * also when a later batch fails. */
+    bool deleteEvents(const QByteArray &condition, const QVariantMap &values, QList<int> *deletedIds = 0);
+    /* Deletes groups without events, matching an AND clause on their id, in
+     * the same bounded transactions. Ids of deleted groups are appended to
+     * deletedIds, if given. */
+    bool deleteEmptyGroups(const QByteArray &groupCondition = QByteArray(), QList<int> *deletedIds = 0);
+
+    /* Size of the next batch of a bulk change, adapted from the time taken
+     * by the last one so that each holds the write lock for below maxLockTime */
+    static int nextBatchSize(int batchSize, qint64 elapsed, int maxLockTime);
+    enum {
+        initialBatchSize = 100,
+        maxBatchSize = 10000
+    };
+
+    /* Events can be moved to the archive database, where they stay
+     * readable. Only read events that are not the last of their group are
+     * archived, so that group summaries and unread counts can be computed
+     * from the main table. Moves in either direction leave no entries in
+     * the ChangeLog.
+     *
+     * Attached databases in WAL mode commit separately, so archiveEvents()
+     * copies the events to the archive and removes them from the main table
+     * in separate transactions, outside of any other. An interrupted move
+     * leaves an event in both, where the main table's copy is the current
+     * one; restoreArchivedEvents() keeps it, and repairArchive() removes the
+     * archive's copies of such events, matching an AND clause on id. */
+    bool archiveEvents(const QList<int> &eventIds);
+    bool restoreArchivedEvents(const QList<int> &eventIds);
+    bool repairArchive(const QByteArray &condition = QByteArray());
+    /* Restores the last archived event of groups, matching an AND clause on
+     * groupId, that have no events left in the main table. */
+    bool restoreGroupHeads(const QByteArray &groupCondition);
+    /* Deletes archived events in batches bounded by the write lock time.
+     * Deletions from the main table logged after the ChangeLog position
+     * loggedSince are not logged again. deleteArchivedIds() deletes the
+     * given events in the current transaction. */
+    bool deleteArchivedEvents(const QByteArray &condition, const QVariantMap &values,
+                              qint64 loggedSince, QList<int> *deletedIds = 0);
+    bool deleteArchivedIds(const QList<int> &eventIds, qint64 loggedSince);
 
     bool insertEventProperties(int eventId, const QVariantMap &properties);
     bool insertMessageParts(Event &event);
+    bool insertGroupMembers(int groupId, const RecipientList &recipients);
+
+    enum Dictionary {
+        LocalUids,
+        RemoteUids,
+        PropertyKeys
+    };
+
+    /* Events refer to their local and remote UIDs, and extra properties to
+     * their keys, by their id in a dictionary table. This returns the id of
+     * a value, adding it if needed, or a null id for an empty value. Ids are
+     * cached until a rollback. */
+    bool dictionaryId(Dictionary dictionary, const QString &value, QVariant &id);
+    void clearDictionaryIds();
+
+    /* The local or remote UID of Events, and a condition comparing it, such
+     * as "= :value". Until UID_DICTIONARY_MIGRATION completes, these also
+     * read the text columns of the events that it has not reached. */
+    static QString uidColumn(Dictionary dictionary);
+    static QString uidCondition(Dictionary dictionary, const QString &comparison);
+
+    /* Schedules removal of orphaned message parts on a background thread */
+    void collectMessageParts(QThread *thread);
 
     QSqlQuery createQuery();
+    /* Executes a query, logging any error; execute() also finishes it */
+    static bool execQuery(QSqlQuery &query);
+    static bool execute(QSqlQuery &query);
+    static QByteArray joinNumberList(const QList<int> &list);
     QSqlDatabase& connection();
 
 public:
     QSqlDatabase m_pConnection;
+
+    // Set between DatabaseIO::transaction() and commit() or rollback()
+    bool inTransaction;
+    int maxWriteLockTime;
+
+    enum { defaultMaxWriteLockTime = 100 };
+
+    /* Changes that leave the data of events as it was are removed from the
+     * ChangeLog by rewinding it to its position before them, within the
+     * same write transaction. */
+    bool changeLogPosition(qint64 &sequence);
+    bool rewindChangeLog(qint64 sequence);
+
+    /* Returns true until a migration of DatabaseMigration has completed,
+     * while queries need to read the data in its old form as well. */
+    bool migrationPending(const char *name);
+
+    /* Runs the migrations queued by schema upgrades in the background, with
+     * the event loop of this thread. Called when the connection is opened. */
+    void scheduleMigrations();
+
+private:
+    bool tableColumns(const char *table, QByteArray &columns);
+
+    enum { maxCachedDictionaryIds = 1000 };
+
+    QHash<QString, int> dictionaryIds[PropertyKeys + 1];
+
+    QPointer<MessagePartCollector> collector;
+    QPointer<DatabaseMigration> migration;
+
+    // Column lists of the main tables, by table name
+    QHash<QByteArray, QByteArray> columnLists;
 };
 
 } // namespace
@@ -0,0 +1,449 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jollamobile.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+
+#include "databasemaintenance_p.h"
+#include "databaseio_p.h"
+#include "constants.h"
+
+#include <QFileInfo>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QTimer>
+#include <QtDBus/QtDBus>
+
+#include "debug.h"
+
+using namespace CommHistory;
+
+namespace {
+
+// Free pages returned by each incremental vacuum step
+const int vacuumStepPages = 256;
+
+// Delay between steps while the history stays idle
+const int stepInterval = 100;
+
+const int defaultCheckInterval = 60 * 1000;
+const int defaultIdleInterval = 10 * 1000;
+const qint64 defaultCheckpointThreshold = 1024 * 1024;
+const qint64 defaultTruncateThreshold = 8 * 1024 * 1024;
+const qint64 defaultVacuumThreshold = 1024 * 1024;
+
+bool pragmaValue(QSqlQuery &query, const QString &pragma, qint64 &value)
+{
+    if (!query.exec(pragma) || !query.next()) {
+        qWarning() << "Failed to execute query";
+        qWarning() << query.lastError();
+        qWarning() << query.lastQuery();
+        return false;
+    }
+    value = query.value(0).toLongLong();
+    query.finish();
+    return true;
+}
+
+}
+
+DatabaseMaintenancePrivate::DatabaseMaintenancePrivate(DatabaseMaintenance *parent)
+    : QObject(parent)
+    , q(parent)
+    , checkInterval(defaultCheckInterval)
+    , idleInterval(defaultIdleInterval)
+    , checkpointThreshold(defaultCheckpointThreshold)
+    , truncateThreshold(defaultTruncateThreshold)
+    , vacuumThreshold(defaultVacuumThreshold)
+    , autoVacuumConversion(true)
+    , checkTimer(new QTimer(this))
+    , timer(new QTimer(this))
+    , running(false)
+    , phase(DonePhase)
+{
+    schemas[0].name = QStringLiteral("main");
+    schemas[1].name = QStringLiteral("archive");
+
+    connect(checkTimer, SIGNAL(timeout()), SLOT(check()));
+    timer->setSingleShot(true);
+    connect(timer, SIGNAL(timeout()), SLOT(timeout()));
+
+    // Writes from any process postpone maintenance
+    QDBusConnection::sessionBus().connect(
+        QString(), QString(), COMM_HISTORY_SERVICE_NAME, EVENTS_ADDED_SIGNAL,
+        this, SLOT(eventsChanged()));
+    QDBusConnection::sessionBus().connect(
+        QString(), QString(), COMM_HISTORY_SERVICE_NAME, EVENTS_UPDATED_SIGNAL,
+        this, SLOT(eventsChanged()));
+}
+
+DatabaseMaintenancePrivate::~DatabaseMaintenancePrivate()
+{
+}
+
+bool DatabaseMaintenancePrivate::measure()
+{
+    QSqlQuery query(DatabaseIOPrivate::instance()->connection());
+
+    // The WAL files are found from the attached files, which may be in memory
+    if (!query.exec(QLatin1String("PRAGMA database_list"))) {
+        qWarning() << "Failed to execute query";
+        qWarning() << query.lastError();
+        qWarning() << query.lastQuery();
+        return false;
+    }
+    for (int i = 0; i < 2; i++)
+        schemas[i].walFile.clear();
+    while (query.next()) {
+        const QString file = query.value(2).toString();
+        for (int i = 0; i < 2; i++) {
+            if (query.value(1).toString() == schemas[i].name && !file.isEmpty())
+                schemas[i].walFile = file + QLatin1String("-wal");
+        }
+    }
+    query.finish();
+
+    qint64 walSize = 0, freelistSize = 0;
+    for (int i = 0; i < 2; i++) {
+        Schema &schema(schemas[i]);
+        qint64 autoVacuum = 0;
+        if (!pragmaValue(query, QString::fromLatin1("PRAGMA %1.freelist_count").arg(schema.name), schema.freePages)
+                || !pragmaValue(query, QString::fromLatin1("PRAGMA %1.page_size").arg(schema.name), schema.pageSize)
+                || !pragmaValue(query, QString::fromLatin1("PRAGMA %1.auto_vacuum").arg(schema.name), autoVacuum))
+            return false;
+
+        // Only incremental mode (2) keeps free pages for incremental_vacuum
+        schema.incrementalVacuum = (autoVacuum == 2);
+        schema.walSize = schema.walFile.isEmpty() ? 0 : QFileInfo(schema.walFile).size();
+
+        walSize += schema.walSize;
+        freelistSize += schema.freePages * schema.pageSize;
+    }
+
+    emit q->measured(walSize, freelistSize);
+    return true;
+}
+
+bool DatabaseMaintenancePrivate::needsMaintenance() const
+{
+    for (int i = 0; i < 2; i++) {
+        if ((schemas[i].incrementalVacuum || autoVacuumConversion)
+                && schemas[i].freePages * schemas[i].pageSize > vacuumThreshold)
+            return true;
+    }
+
+    return q->walSize() > checkpointThreshold;
+}
+
+void DatabaseMaintenancePrivate::eventsChanged()
+{
+    if (timer->isActive())
+        timer->start(idleInterval);
+}
+
+void DatabaseMaintenancePrivate::check()
+{
+    if (running || timer->isActive())
+        return;
+
+    if (measure() && needsMaintenance())
+        timer->start(idleInterval);
+}
+
+void DatabaseMaintenancePrivate::timeout()
+{
+    // Steps write outside of any transaction of DatabaseIO
+    if (DatabaseIOPrivate::instance()->inTransaction) {
+        timer->start(stepInterval);
+        return;
+    }
+
+    if (!running && !start()) {
+        finish(false);
+        return;
+    }
+
+    bool done = false;
+    if (!step(done))
+        finish(false);
+    else if (done)
+        finish(true);
+    else
+        timer->start(stepInterval);
+}
+
+bool DatabaseMaintenancePrivate::start()
+{
+    running = true;
+    phase = VacuumPhase;
+    return true;
+}
+
+bool DatabaseMaintenancePrivate::step(bool &done)
+{
+    done = false;
+    if (!measure())
+        return false;
+
+    if (phase == VacuumPhase) {
+        for (int i = 0; i < 2; i++) {
+            Schema &schema(schemas[i]);
+            if (schema.freePages * schema.pageSize <= vacuumThreshold)
+                continue;
+
+            if (!schema.incrementalVacuum) {
+                if (!autoVacuumConversion)
+                    continue;
+
+                // One long step, which also frees all of the pages
+                if (!convert(schema) || !measure())
+                    return false;
+                return true;
+            }
+
+            const qint64 freePages = schema.freePages;
+            if (!vacuum(schema) || !measure())
+                return false;
+
+            // Vacuuming can stop early, e.g. while another connection writes
+            if (schema.freePages < freePages)
+                return true;
+        }
+
+        // Vacuum steps add to the WAL, so it is checkpointed last
+        phase = CheckpointPhase;
+    }
+
+    if (phase == CheckpointPhase) {
+        const qint64 walSize = q->walSize();
+        if (walSize > checkpointThreshold && !checkpoint(walSize > truncateThreshold))
+            return false;
+        phase = DonePhase;
+    }
+
+    done = true;
+    return true;
+}
+
+void DatabaseMaintenancePrivate::finish(bool successful)
+{
+    timer->stop();
+    running = false;
+    phase = DonePhase;
+
+    if (successful)
+        successful = measure();
+
+    emit q->finished(successful);
+}
+
+bool DatabaseMaintenancePrivate::vacuum(Schema &schema)
+{
+    const qint64 pages = qMin<qint64>(schema.freePages, vacuumStepPages);
+    QSqlQuery query(DatabaseIOPrivate::instance()->connection());
+    if (!query.exec(QString::fromLatin1("PRAGMA %1.incremental_vacuum(%2)").arg(schema.name).arg(pages))) {
+        qWarning() << "Failed to execute query";
+        qWarning() << query.lastError();
+        qWarning() << query.lastQuery();
+        return false;
+    }
+
+    // Each page is freed by stepping the statement
+    while (query.next()) {
+    }
+    query.finish();
+
+    DEBUG() << Q_FUNC_INFO << "Vacuumed up to" << pages << "pages of" << schema.name;
+    return true;
+}
+
+bool DatabaseMaintenancePrivate::convert(Schema &schema)
+{
+    // The mode of an existing database only changes when VACUUM rewrites it
+    qWarning() << "Enabling incremental vacuum for commhistory database" << schema.name;
+    QSqlQuery query(DatabaseIOPrivate::instance()->connection());
+    if (!query.exec(QString::fromLatin1("PRAGMA %1.auto_vacuum = INCREMENTAL").arg(schema.name))
+            || !query.exec(QString::fromLatin1("VACUUM %1").arg(schema.name))) {
+        qWarning() << "Failed to execute query";
+        qWarning() << query.lastError();
+        qWarning() << query.lastQuery();
+        return false;
+    }
+    query.finish();
+    return true;
+}
+
+bool DatabaseMaintenancePrivate::checkpoint(bool truncate)
+{
+    QSqlQuery query(DatabaseIOPrivate::instance()->connection());
+    const QString pragma = truncate ? QStringLiteral("PRAGMA wal_checkpoint(TRUNCATE)")
+                                    : QStringLiteral("PRAGMA wal_checkpoint(PASSIVE)");
+    if (!query.exec(pragma) || !query.next()) {
+        qWarning() << "Failed to execute query";
+        qWarning() << query.lastError();
+        qWarning() << query.lastQuery();
+        return false;
+    }
+
+    // A busy checkpoint is not an error; readers kept part of the WAL in use
+    if (query.value(0).toInt())
+        DEBUG() << Q_FUNC_INFO << "Checkpoint was blocked by readers";
+    DEBUG() << Q_FUNC_INFO << (truncate ? "Truncated" : "Checkpointed") << query.value(2).toInt()
+            << "of" << query.value(1).toInt() << "WAL frames";
+    query.finish();
+    return true;
+}
+
+DatabaseMaintenance::DatabaseMaintenance(QObject *parent)
+    : QObject(parent)
+    , d(new DatabaseMaintenancePrivate(this))
+{
+}
+
+DatabaseMaintenance::~DatabaseMaintenance()
+{
+}
+
+void DatabaseMaintenance::setCheckInterval(int milliseconds)
+{
+    d->checkInterval = qMax(1, milliseconds);
+    if (d->checkTimer->isActive())
+        d->checkTimer->start(d->checkInterval);
+}
+
+int DatabaseMaintenance::checkInterval() const
+{
+    return d->checkInterval;
+}
+
+void DatabaseMaintenance::setIdleInterval(int milliseconds)
+{
+    d->idleInterval = qMax(0, milliseconds);
+}
+
+int DatabaseMaintenance::idleInterval() const
+{
+    return d->idleInterval;
+}
+
+void DatabaseMaintenance::setCheckpointThreshold(qint64 bytes)
+{
+    d->checkpointThreshold = qMax<qint64>(0, bytes);
+}
+
+qint64 DatabaseMaintenance::checkpointThreshold() const
+{
+    return d->checkpointThreshold;
+}
+
+void DatabaseMaintenance::setTruncateThreshold(qint64 bytes)
+{
+    d->truncateThreshold = qMax<qint64>(0, bytes);
+}
+
+qint64 DatabaseMaintenance::truncateThreshold() const
+{
+    return d->truncateThreshold;
+}
+
+void DatabaseMaintenance::setVacuumThreshold(qint64 bytes)
+{
+    d->vacuumThreshold = qMax<qint64>(0, bytes);
+}
+
+qint64 DatabaseMaintenance::vacuumThreshold() const
+{
+    return d->vacuumThreshold;
+}
+
+void DatabaseMaintenance::setAutoVacuumConversion(bool enabled)
+{
+    d->autoVacuumConversion = enabled;
+}
+
+bool DatabaseMaintenance::autoVacuumConversion() const
+{
+    return d->autoVacuumConversion;
+}
+
+bool DatabaseMaintenance::incrementalVacuumEnabled() const
+{
+    return d->schemas[0].incrementalVacuum && d->schemas[1].incrementalVacuum;
+}
+
+void DatabaseMaintenance::start()
+{
+    d->checkTimer->start(d->checkInterval);
+}
+
+void DatabaseMaintenance::stop()
+{
+    d->checkTimer->stop();
+    if (!d->running)
+        d->timer->stop();
+}
+
+bool DatabaseMaintenance::isActive() const
+{
+    return d->checkTimer->isActive();
+}
+
+bool DatabaseMaintenance::measure()
+{
+    return d->measure();
+}
+
+bool DatabaseMaintenance::maintain()
+{
+    if (DatabaseIOPrivate::instance()->inTransaction) {
+        qWarning() << "Database maintenance can't run in a transaction";
+        return false;
+    }
+
+    d->timer->stop();
+    if (!d->running)
+        d->start();
+
+    bool done = false;
+    while (!done) {
+        if (!d->step(done)) {
+            d->finish(false);
+            return false;
+        }
+    }
+
+    d->finish(true);
+    return true;
+}
+
+bool DatabaseMaintenance::isRunning() const
+{
+    return d->running;
+}
+
+qint64 DatabaseMaintenance::walSize() const
+{
+    return d->schemas[0].walSize + d->schemas[1].walSize;
+}
+
+qint64 DatabaseMaintenance::freelistSize() const
+{
+    return d->schemas[0].freePages * d->schemas[0].pageSize + d->schemas[1].freePages * d->schemas[1].pageSize;
+}
@@ -0,0 +1,169 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jollamobile.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+
+#ifndef COMMHISTORY_DATABASEMAINTENANCE_H
+#define COMMHISTORY_DATABASEMAINTENANCE_H
+
+#include <QObject>
+
+#include "libcommhistoryexport.h"
+
+namespace CommHistory {
+
+class DatabaseMaintenancePrivate;
+
+/*!
+ * \class DatabaseMaintenance
+ *
+ * Keeps the write-ahead log and the free pages of the database and its
+ * archive small. SQLite only checkpoints the WAL when a commit finds it
+ * large enough, and cannot reset it while other connections read, so a
+ * long-lived reader lets it grow. Pages freed by deletions are reused, but
+ * not returned to the file system.
+ *
+ * While started, the sizes are measured every checkInterval(). When one is
+ * over its threshold, maintenance runs once the history has been idle:
+ * free pages are returned with incremental vacuum steps, then the WAL is
+ * checkpointed, truncating it if it is over truncateThreshold(). Each step
+ * is short, and the event loop runs between them.
+ */
+class LIBCOMMHISTORY_EXPORT DatabaseMaintenance : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit DatabaseMaintenance(QObject *parent = 0);
+    ~DatabaseMaintenance();
+
+    /*!
+     * Set how often the sizes are measured while started.
+     *
+     * \param milliseconds interval, one minute by default
+     */
+    void setCheckInterval(int milliseconds);
+    int checkInterval() const;
+
+    /*!
+     * Set the time without added or updated events after which maintenance
+     * starts. Changes during maintenance also postpone the next step.
+     *
+     * \param milliseconds idle time, 10 seconds by default
+     */
+    void setIdleInterval(int milliseconds);
+    int idleInterval() const;
+
+    /*!
+     * Set the WAL size above which it is checkpointed without waiting for
+     * readers, 1 MB by default.
+     */
+    void setCheckpointThreshold(qint64 bytes);
+    qint64 checkpointThreshold() const;
+
+    /*!
+     * Set the WAL size above which the checkpoint also truncates it, 8 MB by
+     * default. Truncating fails while other connections read from the WAL.
+     */
+    void setTruncateThreshold(qint64 bytes);
+    qint64 truncateThreshold() const;
+
+    /*!
+     * Set the size of free pages above which they are vacuumed, 1 MB by
+     * default. The free pages of databases created before incremental
+     * vacuum was enabled are only vacuumed after they are converted; see
+     * setAutoVacuumConversion().
+     */
+    void setVacuumThreshold(qint64 bytes);
+    qint64 vacuumThreshold() const;
+
+    /*!
+     * Set whether a database without incremental vacuum is converted when
+     * its free pages are over the vacuum threshold, enabled by default.
+     * This is how databases upgraded from before schema version 10 get
+     * incremental vacuum. The conversion is a full VACUUM, which rewrites
+     * the file and holds the write lock until it finishes; it runs once,
+     * as a single step of the idle maintenance or of maintain().
+     */
+    void setAutoVacuumConversion(bool enabled);
+    bool autoVacuumConversion() const;
+
+    /*!
+     * False if the database or its archive was created before incremental
+     * vacuum was enabled and has not been converted, when last measured.
+     */
+    bool incrementalVacuumEnabled() const;
+
+    /*!
+     * Start or stop measuring the sizes periodically.
+     */
+    void start();
+    void stop();
+    bool isActive() const;
+
+    /*!
+     * Measure the sizes now, updating walSize() and freelistSize().
+     *
+     * \return true if successful, otherwise false
+     */
+    bool measure();
+
+    /*!
+     * Run maintenance now, returning when the sizes are below their
+     * thresholds or cannot be reduced further.
+     *
+     * \return true if successful, otherwise false
+     */
+    bool maintain();
+
+    bool isRunning() const;
+
+    /*!
+     * Size of the WAL files when last measured, in bytes.
+     */
+    qint64 walSize() const;
+
+    /*!
+     * Size of the free pages when last measured, in bytes.
+     */
+    qint64 freelistSize() const;
+
+Q_SIGNALS:
+    /*!
+     * Emitted when the sizes have been measured.
+     */
+    void measured(qint64 walSize, qint64 freelistSize);
+
+    /*!
+     * Emitted when maintenance has finished.
+     *
+     * \param successful false if maintenance stopped because of an error
+     */
+    void finished(bool successful);
+
+private:
+    friend class DatabaseMaintenancePrivate;
+    DatabaseMaintenancePrivate *d;
+};
+
+}
+
+#endif
@@ -0,0 +1,97 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jollamobile.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+
+#ifndef COMMHISTORY_DATABASEMAINTENANCE_P_H
+#define COMMHISTORY_DATABASEMAINTENANCE_P_H
+
+#include "databasemaintenance.h"
+
+#include <QString>
+
+class QTimer;
+
+namespace CommHistory {
+
+class DatabaseMaintenancePrivate : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit DatabaseMaintenancePrivate(DatabaseMaintenance *parent);
+    ~DatabaseMaintenancePrivate();
+
+    enum Phase {
+        VacuumPhase,
+        CheckpointPhase,
+        DonePhase
+    };
+
+    // Sizes of one of the attached databases
+    struct Schema {
+        Schema() : walSize(0), freePages(0), pageSize(0), incrementalVacuum(false) {}
+
+        QString name;
+        QString walFile;
+        qint64 walSize;
+        qint64 freePages;
+        qint64 pageSize;
+        bool incrementalVacuum;
+    };
+
+    bool measure();
+    bool needsMaintenance() const;
+
+    bool start();
+    bool step(bool &done);
+    void finish(bool successful);
+
+    bool vacuum(Schema &schema);
+    bool convert(Schema &schema);
+    bool checkpoint(bool truncate);
+
+public Q_SLOTS:
+    void eventsChanged();
+    void check();
+    void timeout();
+
+public:
+    DatabaseMaintenance *q;
+
+    int checkInterval;
+    int idleInterval;
+    qint64 checkpointThreshold;
+    qint64 truncateThreshold;
+    qint64 vacuumThreshold;
+    bool autoVacuumConversion;
+
+    QTimer *checkTimer;
+    QTimer *timer;
+    bool running;
+    Phase phase;
+
+    Schema schemas[2];
+};
+
+}
+
+#endif
@@ -0,0 +1,504 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jollamobile.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+
+#include "databasemigration_p.h"
+#include "databaseio_p.h"
+#include "databaseio.h"
+#include "commhistorydatabase.h"
+#include "recipient.h"
+
+#include <QSqlQuery>
+#include <QStringList>
+#include <QTimer>
+
+#include "debug.h"
+
+using namespace CommHistory;
+
+namespace {
+
+// Delay between batches, leaving the database to other writers
+const int stepInterval = 100;
+
+const int defaultBatchSize = 500;
+
+// Minimized addresses depend on how Recipient compares the local UID, so
+// they are computed for each event. The UIDs may not be migrated yet.
+bool minimizeRemoteUids(QSqlDatabase &db, qint64 first, qint64 last)
+{
+    const QString localUid = DatabaseIOPrivate::uidColumn(DatabaseIOPrivate::LocalUids);
+    const QString remoteUid = DatabaseIOPrivate::uidColumn(DatabaseIOPrivate::RemoteUids);
+
+    foreach (const QString &schema, QStringList() << QStringLiteral("main") << QStringLiteral("archive")) {
+        QSqlQuery query = CommHistoryDatabase::prepare(
+                QString::fromLatin1("SELECT id, %1, %2 FROM %3.Events AS Events "
+                                    "WHERE id >= :first AND id <= :last AND minimizedRemoteUid IS NULL")
+                .arg(localUid, remoteUid, schema).toUtf8(), db);
+        query.bindValue(":first", first);
+        query.bindValue(":last", last);
+        if (!DatabaseIOPrivate::execQuery(query))
+            return false;
+
+        // Updated after reading, rather than under an open cursor
+        QList<QPair<int, QString> > events;
+        while (query.next()) {
+            const Recipient recipient(query.value(1).toString(), query.value(2).toString());
+            events.append(qMakePair(query.value(0).toInt(), recipient.minimizedRemoteUid()));
+        }
+        query.finish();
+
+        query = CommHistoryDatabase::prepare(
+                QString::fromLatin1("UPDATE %1.Events SET minimizedRemoteUid = :minimizedRemoteUid WHERE id = :id")
+                .arg(schema).toUtf8(), db);
+        for (int i = 0; i < events.size(); i++) {
+            query.bindValue(":minimizedRemoteUid", events.at(i).second);
+            query.bindValue(":id", events.at(i).first);
+            if (!DatabaseIOPrivate::execQuery(query))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+#define UID_RANGE "id >= :first AND id <= :last"
+
+#define UID_INSERT(schema, table, column) \
+    "INSERT OR IGNORE INTO main." table " (uid) " \
+    "SELECT DISTINCT " column " FROM " schema ".Events WHERE " UID_RANGE " AND " column " != ''"
+
+// Ids that events were given since the upgrade are kept. The old columns
+// can't be dropped, but clearing them releases their space.
+#define UID_UPDATE(schema) \
+    "UPDATE " schema ".Events SET " \
+    "localUidId = IFNULL(localUidId, (SELECT id FROM main.LocalUids WHERE uid = Events.localUid)), " \
+    "remoteUidId = IFNULL(remoteUidId, (SELECT id FROM main.RemoteUids WHERE uid = Events.remoteUid)), " \
+    "localUid = NULL, remoteUid = NULL " \
+    "WHERE " UID_RANGE " AND (localUid IS NOT NULL OR remoteUid IS NOT NULL)"
+
+const char * const uidDictionary[] = {
+    UID_INSERT("main", "LocalUids", "localUid"),
+    UID_INSERT("main", "RemoteUids", "remoteUid"),
+    UID_UPDATE("main"),
+    UID_INSERT("archive", "LocalUids", "localUid"),
+    UID_INSERT("archive", "RemoteUids", "remoteUid"),
+    UID_UPDATE("archive")
+};
+
+// The index of the text column served queries until the migration completed
+const char * const uidDictionaryCompletion[] = {
+    "DROP INDEX IF EXISTS main.events_remoteUid"
+};
+
+// Properties of events from before schema version 11 are copied with the
+// ids of their keys, keeping any value stored for the event since
+const char * const propertyKeys[] = {
+    "INSERT OR IGNORE INTO main.EventPropertyKeys (key) "
+    "SELECT DISTINCT key FROM main.OldEventProperties WHERE eventId >= :first AND eventId <= :last",
+    "INSERT OR IGNORE INTO main.EventProperties (eventId, keyId, value) "
+    "SELECT P.eventId, K.id, P.value FROM main.OldEventProperties AS P "
+    "JOIN main.EventPropertyKeys AS K ON (K.key = P.key) WHERE P.eventId >= :first AND P.eventId <= :last",
+    "DELETE FROM main.OldEventProperties WHERE eventId >= :first AND eventId <= :last"
+};
+
+// The table is left empty, as other processes may read it until they see
+// that the migration has completed
+const char * const propertyKeysCompletion[] = {
+    "DELETE FROM main.OldEventProperties"
+};
+
+#define PROMOTED_KEYS "('subscriberIdentity', 'mms-unread', 'mms-push-data', 'mms-expiry')"
+
+// Events of the batch that still have promoted properties in EventProperties
+#define PROMOTED_EVENTS(schema) \
+    "id IN (SELECT eventId FROM " schema ".EventProperties WHERE eventId >= :first AND eventId <= :last " \
+    "AND keyId IN (SELECT id FROM main.EventPropertyKeys WHERE key IN " PROMOTED_KEYS "))"
+
+#define PROMOTED_VALUE(schema, key, column) \
+    column " = IFNULL((SELECT P.value FROM " schema ".EventProperties AS P " \
+    "JOIN main.EventPropertyKeys AS K ON (K.id = P.keyId) " \
+    "WHERE P.eventId = Events.id AND K.key = '" key "'), " column ")"
+
+#define PROMOTED_UPDATE(schema) \
+    "UPDATE " schema ".Events SET " \
+    PROMOTED_VALUE(schema, "subscriberIdentity", "subscriberIdentity") ", " \
+    PROMOTED_VALUE(schema, "mms-unread", "mmsUnread") ", " \
+    PROMOTED_VALUE(schema, "mms-push-data", "mmsPushData") ", " \
+    PROMOTED_VALUE(schema, "mms-expiry", "mmsExpiry") \
+    " WHERE " PROMOTED_EVENTS(schema)
+
+#define PROMOTED_DELETE(schema) \
+    "DELETE FROM " schema ".EventProperties WHERE eventId >= :first AND eventId <= :last " \
+    "AND keyId IN (SELECT id FROM main.EventPropertyKeys WHERE key IN " PROMOTED_KEYS ")"
+
+const char * const promotedProperties[] = {
+    PROMOTED_UPDATE("main"),
+    // hasExtraProperties is updated by a trigger in the main table only
+    PROMOTED_DELETE("main"),
+    PROMOTED_UPDATE("archive"),
+    "UPDATE archive.Events SET hasExtraProperties = EXISTS ("
+    "SELECT 1 FROM archive.EventProperties AS P WHERE P.eventId = Events.id "
+    "AND P.keyId NOT IN (SELECT id FROM main.EventPropertyKeys WHERE key IN " PROMOTED_KEYS ")) "
+    "WHERE " PROMOTED_EVENTS("archive"),
+    PROMOTED_DELETE("archive")
+};
+
+#define STATEMENTS(list) list, sizeof(list) / sizeof(*list)
+
+// Applied in the order that the upgrades queue them
+const DatabaseMigrationPrivate::Definition migrations[] = {
+    { MINIMIZED_REMOTE_UIDS_MIGRATION, 0, 0, minimizeRemoteUids, 0, 0 },
+    { UID_DICTIONARY_MIGRATION, STATEMENTS(uidDictionary), 0, STATEMENTS(uidDictionaryCompletion) },
+    { PROPERTY_KEYS_MIGRATION, STATEMENTS(propertyKeys), 0, STATEMENTS(propertyKeysCompletion) },
+    { PROMOTED_PROPERTIES_MIGRATION, STATEMENTS(promotedProperties), 0, 0, 0 }
+};
+const int migrationCount = sizeof(migrations) / sizeof(*migrations);
+
+// Events in the range of a migration, in both tables
+const char *rangeCondition = " WHERE id > :position AND id <= :lastId";
+
+bool remainingEvents(const char *name, int &count)
+{
+    QSqlDatabase &db(DatabaseIOPrivate::instance()->connection());
+    QByteArray q = "SELECT (SELECT COUNT(*) FROM main.Events";
+    q += rangeCondition;
+    q += ") + (SELECT COUNT(*) FROM archive.Events";
+    q += rangeCondition;
+    q += ") FROM Migrations AS M WHERE name = :name";
+    q.replace(":position", "M.position").replace(":lastId", "M.lastId");
+
+    QSqlQuery query = CommHistoryDatabase::prepare(q, db);
+    query.bindValue(":name", QLatin1String(name));
+    if (!DatabaseIOPrivate::execQuery(query))
+        return false;
+
+    count = query.next() ? query.value(0).toInt() : 0;
+    return true;
+}
+
+}
+
+DatabaseMigrationPrivate::DatabaseMigrationPrivate(DatabaseMigration *parent)
+    : QObject(parent)
+    , q(parent)
+    , batchSize(defaultBatchSize)
+    , timer(new QTimer(this))
+    , running(false)
+    , migratedEvents(0)
+    , totalEvents(0)
+{
+    timer->setSingleShot(true);
+    connect(timer, SIGNAL(timeout()), SLOT(timeout()));
+}
+
+DatabaseMigrationPrivate::~DatabaseMigrationPrivate()
+{
+}
+
+const DatabaseMigrationPrivate::Definition *DatabaseMigrationPrivate::definition(const QString &name)
+{
+    for (int i = 0; i < migrationCount; i++) {
+        if (name == QLatin1String(migrations[i].name))
+            return &migrations[i];
+    }
+    return 0;
+}
+
+void DatabaseMigrationPrivate::timeout()
+{
+    // Batches use their own transactions
+    if (DatabaseIOPrivate::instance()->inTransaction) {
+        timer->start(stepInterval);
+        return;
+    }
+
+    if (!running && !start()) {
+        finish(false);
+        return;
+    }
+
+    bool done = false;
+    if (!step(done))
+        finish(false);
+    else if (done)
+        finish(true);
+    else
+        timer->start(stepInterval);
+}
+
+bool DatabaseMigrationPrivate::start()
+{
+    running = true;
+    pending.clear();
+    migratedEvents = 0;
+    totalEvents = 0;
+
+    QSqlQuery query = CommHistoryDatabase::prepare("SELECT name FROM Migrations ORDER BY rowid",
+                                                   DatabaseIOPrivate::instance()->connection());
+    if (!DatabaseIOPrivate::execQuery(query))
+        return false;
+
+    QStringList names;
+    while (query.next())
+        names.append(query.value(0).toString());
+    query.finish();
+
+    foreach (const QString &name, names) {
+        // Migrations queued by a newer version are left to it
+        const Definition *migration = definition(name);
+        if (!migration) {
+            qWarning() << "Unknown database migration" << name;
+            continue;
+        }
+
+        int count = 0;
+        if (!remainingEvents(migration->name, count))
+            return false;
+
+        pending.append(migration);
+        totalEvents += count;
+    }
+
+    return true;
+}
+
+bool DatabaseMigrationPrivate::step(bool &done)
+{
+    done = pending.isEmpty();
+    if (done)
+        return true;
+
+    bool migrationDone = false;
+    if (!migrateBatch(*pending.first(), migrationDone))
+        return false;
+
+    if (migrationDone)
+        pending.removeFirst();
+    done = pending.isEmpty();
+    return true;
+}
+
+bool DatabaseMigrationPrivate::migrateBatch(const Definition &migration, bool &done)
+{
+    done = false;
+
+    DatabaseIO *database = DatabaseIO::instance();
+    DatabaseIOPrivate *io = DatabaseIOPrivate::instance();
+    QSqlDatabase &db(io->connection());
+
+    if (!database->transaction())
+        return false;
+
+    // Writing first takes the write lock before the position is read, so
+    // that processes running the same migration don't repeat a batch
+    QSqlQuery query = CommHistoryDatabase::prepare(
+            "UPDATE Migrations SET position = position WHERE name = :name", db);
+    query.bindValue(":name", QLatin1String(migration.name));
+    if (!DatabaseIOPrivate::execQuery(query)) {
+        database->rollback();
+        return false;
+    }
+    query.finish();
+
+    query = CommHistoryDatabase::prepare("SELECT position, lastId FROM Migrations WHERE name = :name", db);
+    query.bindValue(":name", QLatin1String(migration.name));
+    if (!DatabaseIOPrivate::execQuery(query)) {
+        database->rollback();
+        return false;
+    }
+
+    // Another process may have completed the migration
+    if (!query.next()) {
+        query.finish();
+        done = true;
+        return database->commit();
+    }
+    const qint64 position = query.value(0).toLongLong();
+    const qint64 lastId = query.value(1).toLongLong();
+    query.finish();
+
+    QByteArray q = "SELECT MAX(id), COUNT(*) FROM (SELECT id FROM main.Events";
+    q += rangeCondition;
+    q += " UNION ALL SELECT id FROM archive.Events";
+    q += rangeCondition;
+    q += " ORDER BY id LIMIT :limit)";
+    query = CommHistoryDatabase::prepare(q, db);
+    query.bindValue(":position", position);
+    query.bindValue(":lastId", lastId);
+    query.bindValue(":limit", batchSize);
+    if (!DatabaseIOPrivate::execQuery(query) || !query.next()) {
+        database->rollback();
+        return false;
+    }
+    const int count = query.value(1).toInt();
+    const qint64 last = query.value(0).toLongLong();
+    query.finish();
+
+    if (count == 0) {
+        for (int i = 0; i < migration.completionCount; i++) {
+            query = CommHistoryDatabase::prepare(migration.completion[i], db);
+            if (!DatabaseIOPrivate::execQuery(query)) {
+                database->rollback();
+                return false;
+            }
+            query.finish();
+        }
+
+        query = CommHistoryDatabase::prepare("DELETE FROM Migrations WHERE name = :name", db);
+        query.bindValue(":name", QLatin1String(migration.name));
+        if (!DatabaseIOPrivate::execQuery(query)) {
+            database->rollback();
+            return false;
+        }
+        query.finish();
+
+        DEBUG() << Q_FUNC_INFO << "Completed database migration" << migration.name;
+        done = true;
+        return database->commit();
+    }
+
+    // The data of the events is unchanged, so the changes are not logged
+    qint64 sequence = 0;
+    if (!io->changeLogPosition(sequence)) {
+        database->rollback();
+        return false;
+    }
+
+    for (int i = 0; i < migration.statementCount; i++) {
+        query = CommHistoryDatabase::prepare(migration.statements[i], db);
+        query.bindValue(":first", position + 1);
+        query.bindValue(":last", last);
+        if (!DatabaseIOPrivate::execQuery(query)) {
+            database->rollback();
+            return false;
+        }
+        query.finish();
+    }
+
+    if (migration.function && !migration.function(db, position + 1, last)) {
+        database->rollback();
+        return false;
+    }
+
+    if (!io->rewindChangeLog(sequence)) {
+        database->rollback();
+        return false;
+    }
+
+    query = CommHistoryDatabase::prepare("UPDATE Migrations SET position = :position WHERE name = :name", db);
+    query.bindValue(":position", last);
+    query.bindValue(":name", QLatin1String(migration.name));
+    if (!DatabaseIOPrivate::execQuery(query)) {
+        database->rollback();
+        return false;
+    }
+    query.finish();
+
+    if (!database->commit())
+        return false;
+
+    migratedEvents += count;
+    emit q->progress(migratedEvents, qMax(migratedEvents, totalEvents));
+    return true;
+}
+
+void DatabaseMigrationPrivate::finish(bool successful)
+{
+    timer->stop();
+    running = false;
+    pending.clear();
+
+    emit q->finished(successful);
+}
+
+DatabaseMigration::DatabaseMigration(QObject *parent)
+    : QObject(parent)
+    , d(new DatabaseMigrationPrivate(this))
+{
+}
+
+DatabaseMigration::~DatabaseMigration()
+{
+}
+
+void DatabaseMigration::setBatchSize(int events)
+{
+    d->batchSize = qMax(1, events);
+}
+
+int DatabaseMigration::batchSize() const
+{
+    return d->batchSize;
+}
+
+bool DatabaseMigration::isPending() const
+{
+    QSqlQuery query = CommHistoryDatabase::prepare("SELECT name FROM Migrations",
+                                                   DatabaseIOPrivate::instance()->connection());
+    if (!DatabaseIOPrivate::execQuery(query))
+        return false;
+
+    while (query.next()) {
+        if (DatabaseMigrationPrivate::definition(query.value(0).toString()))
+            return true;
+    }
+    return false;
+}
+
+void DatabaseMigration::schedule()
+{
+    if (d->running || d->timer->isActive())
+        return;
+
+    d->timer->start(0);
+}
+
+bool DatabaseMigration::migrate()
+{
+    if (DatabaseIOPrivate::instance()->inTransaction) {
+        qWarning() << "Database migration can't run in a transaction";
+        return false;
+    }
+
+    d->timer->stop();
+    if (!d->running && !d->start()) {
+        d->finish(false);
+        return false;
+    }
+
+    bool done = false;
+    while (!done) {
+        if (!d->step(done)) {
+            d->finish(false);
+            return false;
+        }
+    }
+
+    d->finish(true);
+    return true;
+}
+
+bool DatabaseMigration::isRunning() const
+{
+    return d->running;
+}
@@ -0,0 +1,112 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jollamobile.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+
+#ifndef COMMHISTORY_DATABASEMIGRATION_H
+#define COMMHISTORY_DATABASEMIGRATION_H
+
+#include <QObject>
+
+#include "libcommhistoryexport.h"
+
+namespace CommHistory {
+
+class DatabaseMigrationPrivate;
+
+/*!
+ * \class DatabaseMigration
+ *
+ * Migrates the data of existing events after a schema upgrade. Upgrades run
+ * in an exclusive transaction when the database is opened, so an upgrade
+ * that would rewrite every event only adds the new columns and tables there,
+ * and queues a migration of the events that existed at the time.
+ *
+ * Migrations run in batches of events, each in its own transaction, and
+ * their position is stored in the database, so that they continue from the
+ * last batch in any process. Queries read the data in its old form until
+ * the migration has completed, so the history stays usable throughout.
+ *
+ * The library schedules pending migrations when it opens the database, and
+ * runs them with the event loop of the thread that opened it. An instance is
+ * only needed to follow the progress, or to run migrations without an event
+ * loop with migrate().
+ */
+class LIBCOMMHISTORY_EXPORT DatabaseMigration : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit DatabaseMigration(QObject *parent = 0);
+    ~DatabaseMigration();
+
+    /*!
+     * Set the number of events migrated in each transaction.
+     *
+     * \param events batch size, 500 by default
+     */
+    void setBatchSize(int events);
+    int batchSize() const;
+
+    /*!
+     * Returns true if the database has migrations left to run.
+     */
+    bool isPending() const;
+
+    /*!
+     * Run the pending migrations in batches, with the event loop running
+     * between them. Does nothing if already scheduled or running.
+     */
+    void schedule();
+
+    /*!
+     * Run the pending migrations now, returning when done.
+     *
+     * \return true if successful, otherwise false
+     */
+    bool migrate();
+
+    bool isRunning() const;
+
+Q_SIGNALS:
+    /*!
+     * Emitted after each batch.
+     *
+     * \param migratedEvents events migrated since the run started
+     * \param totalEvents events left to migrate when the run started
+     */
+    void progress(int migratedEvents, int totalEvents);
+
+    /*!
+     * Emitted when the run has finished.
+     *
+     * \param successful false if the run stopped because of an error
+     */
+    void finished(bool successful);
+
+private:
+    friend class DatabaseMigrationPrivate;
+    DatabaseMigrationPrivate *d;
+};
+
+}
+
+#endif
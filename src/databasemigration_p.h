@@ -0,0 +1,101 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jollamobile.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+
+#ifndef COMMHISTORY_DATABASEMIGRATION_P_H
+#define COMMHISTORY_DATABASEMIGRATION_P_H
+
+#include "databasemigration.h"
+
+#include <QList>
+#include <QSqlDatabase>
+
+class QTimer;
+
+/* Fills the minimizedRemoteUid column, added in schema version 8, of the
+ * events from before it. */
+#define MINIMIZED_REMOTE_UIDS_MIGRATION "minimizedRemoteUids"
+
+/* Replaces the local and remote UIDs stored as text in events from before
+ * schema version 9 with their ids in LocalUids and RemoteUids. */
+#define UID_DICTIONARY_MIGRATION "uidDictionary"
+
+/* Moves the extra properties of events from before schema version 11 out of
+ * OldEventProperties, which stores their keys as text, into EventProperties. */
+#define PROPERTY_KEYS_MIGRATION "propertyKeys"
+
+/* Moves the extra properties stored in Events columns since schema version
+ * 11 out of EventProperties. */
+#define PROMOTED_PROPERTIES_MIGRATION "promotedProperties"
+
+namespace CommHistory {
+
+class DatabaseMigrationPrivate : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit DatabaseMigrationPrivate(DatabaseMigration *parent);
+    ~DatabaseMigrationPrivate();
+
+    typedef bool (*BatchFunction)(QSqlDatabase &db, qint64 first, qint64 last);
+
+    // Statements run for each batch, with the range of event ids bound to
+    // :first and :last, followed by the function for data that SQL can't
+    // convert. Events are migrated in both the main and the archive tables,
+    // as they can move between them during the migration. The completion
+    // statements run in the transaction that removes the migration.
+    struct Definition {
+        const char *name;
+        const char * const *statements;
+        int statementCount;
+        BatchFunction function;
+        const char * const *completion;
+        int completionCount;
+    };
+
+    static const Definition *definition(const QString &name);
+
+    bool start();
+    bool step(bool &done);
+    bool migrateBatch(const Definition &migration, bool &done);
+    void finish(bool successful);
+
+public Q_SLOTS:
+    void timeout();
+
+public:
+    DatabaseMigration *q;
+
+    int batchSize;
+
+    QTimer *timer;
+    bool running;
+
+    QList<const Definition *> pending;
+    int migratedEvents;
+    int totalEvents;
+};
+
+}
+
+#endif
@@ -889,6 +889,13 @@ void EventModel::fetchMore(const QModelIndex &parent)
     Q_UNUSED(parent);
 }
 
+bool EventModel::synchronize()
+{
+    Q_D(EventModel);
+
+    return d->synchronize();
+}
+
 void EventModel::setBackgroundThread(QThread *thread)
 {
     Q_D(EventModel);
@@ -348,6 +348,19 @@ public:
      */
     virtual void fetchMore(const QModelIndex &parent);
 
+    /*!
+     * Apply changes made by other processes since the last query, using the
+     * database change journal. Call this after the application has been
+     * suspended or may otherwise have missed change signals.
+     *
+     * Does nothing if no other process has written to the database.
+     *
+     * \return true if successful. false if an error occurred or the journal
+     * no longer covers the model contents, in which case the model should
+     * be reset with a new query.
+     */
+    bool synchronize();
+
     virtual bool isTree() const;
     virtual QueryMode queryMode() const;
     virtual uint chunkSize() const;
@@ -48,6 +48,11 @@ bool initializeTypes()
 
 const int defaultChunkSize = 50;
 
+// Contacts looked up at once when resolving on demand; further requests are queued
+const int onDemandLookupLimit = 10;
+// Queued requests kept when resolving on demand; older requests are for rows no longer shown
+const int onDemandRequestLimit = 100;
+
 }
 
 bool eventmodel_p_initialized = initializeTypes();
@@ -56,6 +61,8 @@ EventModelPrivate::EventModelPrivate(EventModel *model)
         : addResolver(0)
         , receiveResolver(0)
         , onDemandResolver(0)
+        , onDemandSequence(0)
+        , onDemandReportScheduled(false)
         , queryMode(EventModel::AsyncQuery)
         , chunkSize(defaultChunkSize)
         , firstChunkSize(0)
@@ -67,6 +74,8 @@ EventModelPrivate::EventModelPrivate(EventModel *model)
         , accept(false)
         , threadCanFetchMore(false)
         , bufferInsertions(false)
+        , changeSequence(-1)
+        , dataVersion(0)
         , resolveContacts(EventModel::DoNotResolve)
         , propertyMask(Event::allProperties())
         , bgThread(0)
@@ -158,6 +167,13 @@ bool EventModelPrivate::executeQuery(QSqlQuery &query)
 
     isReady = false;
 
+    // Changes after this point are applied by synchronize(). Only a query into an
+    // empty model defines the position; later chunks continue from it.
+    if (!eventRootItem->childCount()) {
+        if (!database()->lastChangeSequence(changeSequence) || !database()->dataVersion(dataVersion))
+            changeSequence = -1;
+    }
+
     if (!query.exec()) {
         qWarning() << "Failed to execute query";
         qWarning() << query.lastError();
@@ -339,28 +355,75 @@ void EventModelPrivate::resolveIfRequired(const Event &event) const
     if (resolveContacts != EventModel::ResolveOnDemand || event.isResolved())
         return;
 
+    EventModelPrivate *d = const_cast<EventModelPrivate *>(this);
+
     if (!onDemandResolver) {
-        onDemandResolver = new ContactResolver(const_cast<EventModelPrivate *>(this));
-        connect(onDemandResolver, SIGNAL(finished()), SLOT(onDemandResolverFinished()));
+        onDemandResolver = new ContactResolver(d);
+        onDemandResolver->setLookupLimit(onDemandLookupLimit);
+        connect(onDemandResolver, SIGNAL(recipientResolved(CommHistory::Recipient)),
+                SLOT(onDemandRecipientResolved(CommHistory::Recipient)));
+    }
+
+    // data() is called for the rows being shown, so the latest requests are resolved first
+    const RecipientList &recipients(event.recipients());
+    for (RecipientList::const_iterator it = recipients.constBegin(), end = recipients.constEnd(); it != end; ++it) {
+        const Recipient &recipient(*it);
+        if (recipient.isContactResolved())
+            continue;
+
+        const int priority = ++onDemandSequence;
+        QHash<Recipient, int>::iterator pit = onDemandPriorities.find(recipient);
+        if (pit != onDemandPriorities.end()) {
+            onDemandRequests.remove(*pit);
+            *pit = priority;
+        } else {
+            onDemandPriorities.insert(recipient, priority);
+        }
+        onDemandRequests.insert(priority, recipient);
+
+        onDemandResolver->add(recipient, priority);
+    }
+
+    // Recipients resolved without a lookup, or by another resolver, still need the event updated
+    if (recipients.allContactsResolved()) {
+        for (RecipientList::const_iterator it = recipients.constBegin(), end = recipients.constEnd(); it != end; ++it)
+            d->onDemandRecipientResolved(*it);
     }
 
-    pendingOnDemand.append(event);
-    onDemandResolver->add(event);
+    // Drop the oldest requests; if those rows are shown again, they will be requested again
+    while (onDemandRequests.size() > onDemandRequestLimit) {
+        const Recipient recipient(onDemandRequests.take(onDemandRequests.firstKey()));
+        onDemandPriorities.remove(recipient);
+        onDemandResolver->cancel(recipient);
+    }
 }
 
-void EventModelPrivate::onDemandResolverFinished()
+void EventModelPrivate::onDemandRecipientResolved(const Recipient &recipient)
 {
-    QList<Event> resolved(pendingOnDemand);
-    pendingOnDemand.clear();
+    QHash<Recipient, int>::iterator it = onDemandPriorities.find(recipient);
+    if (it != onDemandPriorities.end()) {
+        onDemandRequests.remove(*it);
+        onDemandPriorities.erase(it);
+    }
 
-    QSet<Recipient> resolvedRecipients;
-    foreach (const Event &event, resolved) {
-        const RecipientList &recipients(event.recipients());
-        for (RecipientList::const_iterator it = recipients.constBegin(), end = recipients.constEnd(); it != end; ++it)
-            resolvedRecipients.insert(*it);
+    // Report recipients resolved together with one set of dataChanged signals
+    onDemandResolved.insert(recipient);
+    if (!onDemandReportScheduled) {
+        onDemandReportScheduled = true;
+        bool ok = metaObject()->invokeMethod(this, "reportOnDemandResolved", Qt::QueuedConnection);
+        Q_UNUSED(ok);
+        Q_ASSERT(ok);
     }
+}
 
-    slotContactChanged(resolvedRecipients.values());
+void EventModelPrivate::reportOnDemandResolved()
+{
+    QSet<Recipient> resolved;
+    resolved.swap(onDemandResolved);
+    onDemandReportScheduled = false;
+
+    if (!resolved.isEmpty())
+        recipientsUpdated(resolved, true);
 }
 
 void EventModelPrivate::modifyInModel(Event &event)
@@ -509,8 +572,76 @@ bool EventModelPrivate::canFetchMore() const
     return threadCanFetchMore;
 }
 
+bool EventModelPrivate::synchronize()
+{
+    if (changeSequence < 0)
+        return true;
+
+    int version = 0;
+    if (!database()->dataVersion(version))
+        return false;
+    if (version == dataVersion)
+        return true;
+
+    QList<DatabaseIO::Change> changes;
+    bool complete = false;
+    if (!database()->getChanges(changeSequence, changes, complete))
+        return false;
+    if (!complete) {
+        qWarning() << Q_FUNC_INFO << "Change journal does not reach back to" << changeSequence;
+        return false;
+    }
+
+    DEBUG() << Q_FUNC_INFO << "applying" << changes.size() << "changes";
+
+    QList<int> changedIds;
+    QSet<int> changedSet, deletedSet;
+    foreach (const DatabaseIO::Change &change, changes) {
+        if (change.table != DatabaseIO::Change::EventsTable)
+            continue;
+
+        if (change.operation == DatabaseIO::Change::Delete) {
+            deletedSet.insert(change.id);
+        } else if (!changedSet.contains(change.id)) {
+            changedSet.insert(change.id);
+            changedIds.append(change.id);
+        }
+    }
+
+    foreach (int id, deletedSet)
+        eventDeletedSlot(id);
+
+    QList<Event> added, updated;
+    foreach (int id, changedIds) {
+        if (deletedSet.contains(id))
+            continue;
+
+        Event event;
+        if (!database()->getEvent(id, event))
+            continue;
+
+        if (findEvent(id).isValid())
+            updated.append(event);
+        else
+            added.append(event);
+    }
+
+    if (!updated.isEmpty())
+        eventsUpdatedSlot(updated);
+    if (!added.isEmpty())
+        eventsAddedSlot(added);
+
+    if (!changes.isEmpty())
+        changeSequence = changes.last().sequence;
+    dataVersion = version;
+    return true;
+}
+
 void EventModelPrivate::recipientsChangedRecursive(const QSet<Recipient> &recipients, EventTreeItem *parent, bool resolved)
 {
+    // Adjacent changed rows are reported together
+    int firstChanged = -1;
+
     for (int row = 0; row < parent->childCount(); row++) {
         const Event &event(parent->eventAt(row));
         EventTreeItem *child = parent->child(row);
@@ -521,13 +652,19 @@ void EventModelPrivate::recipientsChangedRecursive(const QSet<Recipient> &recipi
                     event.setIsResolved(true);
             }
 
-            // XXX coalesce
             // XXX role dataChanged signal
-            emitDataChanged(row, child);
+            if (firstChanged < 0)
+                firstChanged = row;
+        } else if (firstChanged >= 0) {
+            emitDataChanged(parent, firstChanged, row - 1);
+            firstChanged = -1;
         }
         if (child->childCount())
             recipientsChangedRecursive(recipients, child, resolved);
     }
+
+    if (firstChanged >= 0)
+        emitDataChanged(parent, firstChanged, parent->childCount() - 1);
 }
 
 void EventModelPrivate::recipientsUpdated(const QSet<Recipient> &recipients, bool resolved)
@@ -583,6 +720,8 @@ void EventModelPrivate::setResolveContacts(EventModel::ContactResolveType type)
 
         delete onDemandResolver;
         onDemandResolver = 0;
+        onDemandPriorities.clear();
+        onDemandRequests.clear();
     }
 }
 
@@ -595,3 +734,12 @@ void EventModelPrivate::emitDataChanged(int row, void *data)
     emit q->dataChanged(left, right);
 }
 
+void EventModelPrivate::emitDataChanged(EventTreeItem *parent, int first, int last)
+{
+    Q_Q(EventModel);
+
+    const QModelIndex left(q->createIndex(first, 0, parent->child(first)));
+    const QModelIndex right(q->createIndex(last, EventModel::NumberOfColumns - 1, parent->child(last)));
+    emit q->dataChanged(left, right);
+}
+
@@ -25,6 +25,9 @@
 #define COMMHISTORY_EVENTMODEL_P_H
 
 #include <QList>
+#include <QHash>
+#include <QMap>
+#include <QSet>
 #include <QGenericArgument>
 
 #include "eventmodel.h"
@@ -124,6 +127,11 @@ public:
 
     bool canFetchMore() const;
 
+    /*!
+     * Apply change journal entries written after changeSequence.
+     */
+    virtual bool synchronize();
+
     void setResolveContacts(EventModel::ContactResolveType resolveType);
     void resolveAddedEvents(const QList<Event> &events);
 
@@ -133,6 +141,7 @@ public:
 
     void recipientsChangedRecursive(const QSet<Recipient> &recipients, EventTreeItem *parent, bool resolved = false);
     void emitDataChanged(int row, void *data);
+    void emitDataChanged(EventTreeItem *parent, int first, int last);
 
     // This is the root node for the internal event tree. In a standard
     // flat model, eventRootNode has rowCount() children with events.
@@ -141,7 +150,14 @@ public:
     EventTreeItem *eventRootItem;
 
     mutable ContactResolver *addResolver, *receiveResolver, *onDemandResolver;
-    mutable QList<Event> pendingAdded, pendingReceived, pendingOnDemand, bufferedInsertions;
+    mutable QList<Event> pendingAdded, pendingReceived, bufferedInsertions;
+
+    // Unresolved recipients requested by data(), by priority; later requests have higher priority
+    mutable QHash<Recipient, int> onDemandPriorities;
+    mutable QMap<int, Recipient> onDemandRequests;
+    mutable int onDemandSequence;
+    QSet<Recipient> onDemandResolved;
+    bool onDemandReportScheduled;
 
     EventModel::QueryMode queryMode;
     uint chunkSize;
@@ -155,6 +171,10 @@ public:
     bool threadCanFetchMore;
     bool bufferInsertions;
 
+    // Change journal position of the model contents, or -1 before the first query
+    qint64 changeSequence;
+    int dataVersion;
+
     // Do not set directly, use setResolveContacts to enable listener
     EventModel::ContactResolveType resolveContacts;
 
@@ -172,7 +192,8 @@ public Q_SLOTS:
 
     virtual void receiveResolverFinished();
     virtual void addResolverFinished();
-    virtual void onDemandResolverFinished();
+    virtual void onDemandRecipientResolved(const CommHistory::Recipient &recipient);
+    virtual void reportOnDemandResolved();
 
     virtual void eventsReceivedSlot(int start, int end, QList<CommHistory::Event> events);
 
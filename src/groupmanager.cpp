@@ -23,6 +23,7 @@
 
 #include <QtDBus/QtDBus>
 #include <QSqlQuery>
+#include <QTimer>
 
 #include "commonutils.h"
 #include "contactresolver.h"
@@ -49,6 +50,50 @@ bool initializeTypes()
 
 const int defaultChunkSize = 50;
 
+// Window for coalescing group update notifications into one query
+const int groupUpdateInterval = 20;
+
+// Contacts looked up at once when resolving on demand; further requests are queued
+const int onDemandLookupLimit = 10;
+
+// Key for looking up groups by their exact local and remote UIDs. Recipients
+// that compare equal always share the minimized remote UID.
+QString uidsKey(const QString &localUid, const CommHistory::RecipientList &recipients)
+{
+    QStringList remoteUids;
+    remoteUids.reserve(recipients.size());
+    foreach (const CommHistory::Recipient &recipient, recipients)
+        remoteUids.append(recipient.minimizedRemoteUid());
+    std::sort(remoteUids.begin(), remoteUids.end());
+
+    return localUid + QLatin1Char('\n') + remoteUids.join(QLatin1Char('\n'));
+}
+
+// Apply a new event to a group summary; used for both the stored Group and
+// its GroupObject, so that the object emits its change signals
+template<typename T> void applyEvent(T &group, const CommHistory::Event &event)
+{
+    if (event.endTimeT() >= group.endTimeT()) {
+        group.setLastEventId(event.id());
+        if (event.type() == CommHistory::Event::MMSEvent) {
+            group.setLastMessageText(event.subject().isEmpty() ? event.freeText() : event.subject());
+        } else {
+            group.setLastMessageText(event.freeText());
+        }
+        group.setLastVCardFileName(event.fromVCardFileName());
+        group.setLastVCardLabel(event.fromVCardLabel());
+        group.setLastEventStatus(event.status());
+        group.setLastEventType(event.type());
+        group.setLastEventIsDraft(event.isDraft());
+        group.setStartTimeT(event.startTimeT());
+        group.setEndTimeT(event.endTimeT());
+        group.setSubscriberIdentity(event.subscriberIdentity());
+    }
+    group.setRecipients(CommHistory::RecipientList(group.recipients()).unite(event.recipients()));
+    if (!event.isRead())
+        group.setUnreadMessages(group.unreadMessages() + 1);
+}
+
 }
 
 bool groupmanager_initialized = initializeTypes();
@@ -75,16 +120,31 @@ public:
     void add(const Group &group);
     void addGroups(const QList<Group> &groups);
 
+    void insertGroup(const Group &group);
+    GroupObject *object(int groupId);
+    void indexGroup(const Group &group);
+    void unindexGroup(int groupId);
+    int findGroup(const QString &localUid, const RecipientList &recipients) const;
+
+    void emitGroupAdded(int groupId);
+    void emitGroupUpdated(int groupId);
+
     void modifyInModel(Group &group, bool query = true);
+    void refreshGroups(const QList<int> &groupIds);
 
     void resolve(GroupObject &group);
 
     ContactResolver *resolver();
 
+    bool isPaged() const;
+    bool isFetched(const Group &group) const;
+    bool fetchGroups(int limit);
     bool canFetchMore() const;
 
     bool commitTransaction(const QList<int> &groupIds);
 
+    bool synchronize();
+
     DatabaseIO* database();
 
 public Q_SLOTS:
@@ -97,10 +157,16 @@ public Q_SLOTS:
 
     void groupsDeletedSlot(const QList<int> &groupIds);
 
+    void refreshPendingGroups();
+
+    void groupUidsChanged();
+
     void slotContactInfoChanged(const RecipientList &recipients);
     void slotContactChanged(const RecipientList &recipients);
 
     void contactResolveFinished();
+    void scheduleOnDemandReport();
+    void reportOnDemandResolved();
 
 public:
     EventModel::QueryMode queryMode;
@@ -109,21 +175,44 @@ public:
     int queryLimit;
     int queryOffset;
     bool isReady;
-    QHash<int,GroupObject*> groups;
+
+    // Last group of the most recently fetched page, for paged queries
+    bool hasMore;
+    quint32 fetchEndTime;
+    int fetchId;
+
+    // All loaded groups; GroupObjects are only created on request
+    QHash<int,Group> groups;
+    QHash<int,GroupObject*> objects;
+
+    // Index of group ids by uidsKey(), maintained alongside groups
+    QMultiHash<QString,int> uidIndex;
+    QHash<int,QString> uidIndexKeys;
 
     QString filterLocalUid;
     QString filterRemoteUid;
 
+    // Change journal position of the loaded groups, or -1 before getGroups()
+    qint64 changeSequence;
+    int dataVersion;
+
     QThread *bgThread;
 
     QSharedPointer<ContactListener> contactListener;
     ContactResolver *contactResolver;
+    ContactResolver *onDemandResolver;
     GroupManager::ContactResolveType resolveContacts;
     QSharedPointer<UpdatesEmitter> emitter;
 
     QList<Group> pendingResolve;
     QSet<int> pendingIds;
-    QList<GroupObject *> pendingObjects;
+    // Ids of groups requested by resolve(), in request order; later requests have higher priority
+    QList<int> onDemandGroups;
+    int onDemandSequence;
+    bool onDemandReportScheduled;
+
+    QSet<int> pendingUpdateIds;
+    QTimer updateTimer;
 };
 
 }
@@ -138,14 +227,26 @@ GroupManagerPrivate::GroupManagerPrivate(GroupManager *manager)
         , queryLimit(0)
         , queryOffset(0)
         , isReady(true)
+        , hasMore(false)
+        , fetchEndTime(0)
+        , fetchId(-1)
         , filterLocalUid(QString())
         , filterRemoteUid(QString())
+        , changeSequence(-1)
+        , dataVersion(0)
         , bgThread(0)
         , contactResolver(0)
+        , onDemandResolver(0)
+        , onDemandSequence(0)
+        , onDemandReportScheduled(false)
         , resolveContacts(GroupManager::DoNotResolve)
 {
     emitter = UpdatesEmitter::instance();
 
+    updateTimer.setSingleShot(true);
+    updateTimer.setInterval(groupUpdateInterval);
+    connect(&updateTimer, SIGNAL(timeout()), this, SLOT(refreshPendingGroups()));
+
     QDBusConnection::sessionBus().connect(
         QString(),
         QString(),
@@ -195,15 +296,113 @@ bool GroupManagerPrivate::groupMatchesFilter(const Group &group) const
 
 void GroupManagerPrivate::add(const Group &group)
 {
-    Q_Q(GroupManager);
-
     DEBUG() << Q_FUNC_INFO << ": added" << group.toString();
 
     if (!groups.contains(group.id())) {
-        GroupObject *go = new GroupObject(group, q);
-        groups.insert(go->id(), go);
-        emit q->groupAdded(go);
+        insertGroup(group);
+        emitGroupAdded(group.id());
+    }
+}
+
+void GroupManagerPrivate::insertGroup(const Group &group)
+{
+    groups.insert(group.id(), group);
+    indexGroup(group);
+}
+
+GroupObject *GroupManagerPrivate::object(int groupId)
+{
+    Q_Q(GroupManager);
+
+    GroupObject *go = objects.value(groupId);
+    if (go)
+        return go;
+
+    QHash<int,Group>::const_iterator it = groups.constFind(groupId);
+    if (it == groups.constEnd())
+        return 0;
+
+    go = new GroupObject(*it, q);
+    objects.insert(groupId, go);
+
+    connect(go, SIGNAL(localUidChanged()), this, SLOT(groupUidsChanged()));
+    connect(go, SIGNAL(recipientsChanged()), this, SLOT(groupUidsChanged()));
+    return go;
+}
+
+void GroupManagerPrivate::indexGroup(const Group &group)
+{
+    const QString key(uidsKey(group.localUid(), group.recipients()));
+
+    QHash<int,QString>::iterator it = uidIndexKeys.find(group.id());
+    if (it != uidIndexKeys.end()) {
+        if (*it == key)
+            return;
+        uidIndex.remove(*it, group.id());
+        *it = key;
+    } else {
+        uidIndexKeys.insert(group.id(), key);
+    }
+
+    uidIndex.insert(key, group.id());
+}
+
+void GroupManagerPrivate::unindexGroup(int groupId)
+{
+    QHash<int,QString>::iterator it = uidIndexKeys.find(groupId);
+    if (it != uidIndexKeys.end()) {
+        uidIndex.remove(*it, groupId);
+        uidIndexKeys.erase(it);
+    }
+}
+
+void GroupManagerPrivate::groupUidsChanged()
+{
+    // UIDs set directly on a GroupObject are carried over to the stored group
+    GroupObject *go = qobject_cast<GroupObject*>(sender());
+    if (!go || objects.value(go->id()) != go)
+        return;
+
+    QHash<int,Group>::iterator it = groups.find(go->id());
+    if (it == groups.end())
+        return;
+
+    it->setLocalUid(go->localUid());
+    it->setRecipients(go->recipients());
+    indexGroup(*it);
+}
+
+int GroupManagerPrivate::findGroup(const QString &localUid, const RecipientList &recipients) const
+{
+    const QString key(uidsKey(localUid, recipients));
+
+    QMultiHash<QString,int>::const_iterator it = uidIndex.constFind(key);
+    for ( ; it != uidIndex.constEnd() && it.key() == key; ++it) {
+        const Group &g = groups[it.value()];
+        if (g.localUid() == localUid && g.recipients() == recipients)
+            return it.value();
     }
+
+    return -1;
+}
+
+void GroupManagerPrivate::emitGroupAdded(int groupId)
+{
+    Q_Q(GroupManager);
+
+    // Avoid creating a GroupObject when nobody is listening for one
+    if (q->receivers(SIGNAL(groupAdded(GroupObject*))) > 0)
+        emit q->groupAdded(object(groupId));
+    emit q->groupDataAdded(groupId);
+}
+
+void GroupManagerPrivate::emitGroupUpdated(int groupId)
+{
+    Q_Q(GroupManager);
+
+    if (GroupObject *go = objects.value(groupId))
+        emit q->groupUpdated(go);
+    emit q->groupDataUpdated(groupId);
 }
 
 void GroupManagerPrivate::addGroups(const QList<Group> &groups)
@@ -233,30 +432,110 @@ bool GroupManagerPrivate::commitTransaction(const QList<int> &groupIds)
 
 void GroupManagerPrivate::modifyInModel(Group &group, bool query)
 {
-    Q_Q(GroupManager);
-
-    GroupObject *go = groups.value(group.id());
-    if (!go)
+    QHash<int,Group>::iterator it = groups.find(group.id());
+    if (it == groups.end())
         return;
 
+    GroupObject *go = objects.value(group.id());
     if (query) {
         Group newGroup;
         if (!database()->getGroup(group.id(), newGroup))
             return;
-        go->set(newGroup);
+        *it = newGroup;
+        if (go)
+            go->set(newGroup);
     } else {
-        go->copyValidProperties(group);
+        it->copyValidProperties(group);
+        if (go)
+            go->copyValidProperties(group);
     }
+    indexGroup(*it);
 
-    emit q->groupUpdated(go);
-    DEBUG() << Q_FUNC_INFO << ": updated" << go->toString();
+    emitGroupUpdated(group.id());
+    DEBUG() << Q_FUNC_INFO << ": updated" << it->toString();
+}
+
+void GroupManagerPrivate::refreshGroups(const QList<int> &groupIds)
+{
+    // While paging, groups that are not loaded yet may have moved into the loaded range
+    QList<int> queryIds;
+    foreach (int id, groupIds) {
+        if (groups.contains(id) || (hasMore && !pendingIds.contains(id)))
+            queryIds.append(id);
+    }
+
+    if (queryIds.isEmpty())
+        return;
+
+    QList<Group> results;
+    if (!database()->getGroups(queryIds, results))
+        return;
+
+    QList<Group> newGroups;
+    foreach (const Group &group, results) {
+        QHash<int,Group>::iterator it = groups.find(group.id());
+        if (it == groups.end()) {
+            if (isFetched(group) && !group.recipients().isEmpty() && groupMatchesFilter(group))
+                newGroups.append(group);
+            continue;
+        }
+
+        *it = group;
+        indexGroup(group);
+        if (GroupObject *go = objects.value(group.id()))
+            go->set(group);
+        emitGroupUpdated(group.id());
+        DEBUG() << Q_FUNC_INFO << ": updated" << group.toString();
+    }
+
+    addGroups(newGroups);
 }
 
 void GroupManagerPrivate::resolve(GroupObject &group)
 {
     if (resolveContacts == GroupManager::ResolveOnDemand) {
-        pendingObjects.append(&group);
-        resolver()->add(group);
+        if (!onDemandResolver) {
+            onDemandResolver = new ContactResolver(this);
+            onDemandResolver->setLookupLimit(onDemandLookupLimit);
+            connect(onDemandResolver, SIGNAL(recipientResolved(CommHistory::Recipient)),
+                    this, SLOT(scheduleOnDemandReport()));
+        }
+
+        // Groups are requested as they are shown, so the latest requests are resolved first
+        onDemandGroups.append(group.id());
+        onDemandResolver->add(group, ++onDemandSequence);
+        scheduleOnDemandReport();
+    }
+}
+
+void GroupManagerPrivate::scheduleOnDemandReport()
+{
+    if (!onDemandReportScheduled) {
+        onDemandReportScheduled = true;
+        bool ok = metaObject()->invokeMethod(this, "reportOnDemandResolved", Qt::QueuedConnection);
+        Q_UNUSED(ok);
+        Q_ASSERT(ok);
+    }
+}
+
+void GroupManagerPrivate::reportOnDemandResolved()
+{
+    Q_Q(GroupManager);
+
+    onDemandReportScheduled = false;
+
+    // Report the groups resolved since the last report, most recently requested first
+    for (int i = onDemandGroups.size() - 1; i >= 0; --i) {
+        GroupObject *go = objects.value(onDemandGroups.at(i));
+        if (go && !go->recipients().allContactsResolved())
+            continue;
+
+        onDemandGroups.removeAt(i);
+        if (go) {
+            DEBUG() << "Finished resolving group" << go->id() << go->recipients().debugString();
+            emit q->groupUpdated(go);
+            emit q->groupDataUpdated(go->id());
+        }
     }
 }
 
@@ -272,7 +551,6 @@ ContactResolver *GroupManagerPrivate::resolver()
 
 void GroupManagerPrivate::eventsAddedSlot(const QList<Event> &events)
 {
-    Q_Q(GroupManager);
     DEBUG() << Q_FUNC_INFO << events.count();
 
     foreach (const Event &event, events) {
@@ -282,31 +560,16 @@ void GroupManagerPrivate::eventsAddedSlot(const QList<Event> &events)
             continue;
         }
 
-        GroupObject *go = groups.value(event.groupId());
-        if (!go)
+        QHash<int,Group>::iterator it = groups.find(event.groupId());
+        if (it == groups.end())
             continue;
 
-        if (event.endTimeT() >= go->endTimeT()) {
-            DEBUG() << Q_FUNC_INFO << ": updating group" << go->id();
-            go->setLastEventId(event.id());
-            if (event.type() == Event::MMSEvent) {
-                go->setLastMessageText(event.subject().isEmpty() ? event.freeText() : event.subject());
-            } else {
-                go->setLastMessageText(event.freeText());
-            }
-            go->setLastVCardFileName(event.fromVCardFileName());
-            go->setLastVCardLabel(event.fromVCardLabel());
-            go->setLastEventStatus(event.status());
-            go->setLastEventType(event.type());
-            go->setLastEventIsDraft(event.isDraft());
-            go->setStartTimeT(event.startTimeT());
-            go->setEndTimeT(event.endTimeT());
-            go->setSubscriberIdentity(event.subscriberIdentity());
-        }
-        go->setRecipients(RecipientList(go->recipients()).unite(event.recipients()));
-        if (!event.isRead())
-            go->setUnreadMessages(go->unreadMessages() + 1);
-        emit q->groupUpdated(go);
+        DEBUG() << Q_FUNC_INFO << ": updating group" << it->id();
+        applyEvent(*it, event);
+        indexGroup(*it);
+        if (GroupObject *go = objects.value(event.groupId()))
+            applyEvent(*go, event);
+        emitGroupUpdated(event.groupId());
     }
 }
 
@@ -317,10 +580,8 @@ void GroupManagerPrivate::groupsAddedSlot(const QList<CommHistory::Group> &added
     QList<Group> newGroups;
 
     foreach (Group group, addedGroups) {
-        GroupObject *go = groups.value(group.id());
-
         // If the group has not been added to the model, add it.
-        if (!go && !group.recipients().isEmpty() && groupMatchesFilter(group))
+        if (!groups.contains(group.id()) && !group.recipients().isEmpty() && groupMatchesFilter(group))
             newGroups.append(group);
     }
 
@@ -331,12 +592,23 @@ void GroupManagerPrivate::groupsUpdatedSlot(const QList<int> &groupIds)
 {
     DEBUG() << Q_FUNC_INFO << groupIds.count();
 
+    // Notifications tend to arrive in bursts (e.g. marking several
+    // conversations read), so refresh all of them with one query
     foreach (int id, groupIds) {
-        Group g;
-        g.setId(id);
-
-        modifyInModel(g);
+        if (groups.contains(id) || hasMore)
+            pendingUpdateIds.insert(id);
     }
+
+    if (!pendingUpdateIds.isEmpty() && !updateTimer.isActive())
+        updateTimer.start();
+}
+
+void GroupManagerPrivate::refreshPendingGroups()
+{
+    QList<int> groupIds(pendingUpdateIds.toList());
+    pendingUpdateIds.clear();
+
+    refreshGroups(groupIds);
 }
 
 void GroupManagerPrivate::groupsUpdatedFullSlot(const QList<CommHistory::Group> &groups)
@@ -355,20 +627,135 @@ void GroupManagerPrivate::groupsDeletedSlot(const QList<int> &groupIds)
     DEBUG() << Q_FUNC_INFO << groupIds.count();
 
     foreach (int id, groupIds) {
-        GroupObject *go = groups.value(id);
-        if (!go)
+        if (!groups.contains(id))
             continue;
 
-        q->groupDeleted(go); 
-        emit go->groupDeleted();
-        go->deleteLater();
+        GroupObject *go = objects.take(id);
+        if (go) {
+            emit q->groupDeleted(go);
+            emit go->groupDeleted();
+            go->deleteLater();
+        }
+        emit q->groupDataDeleted(id);
+
+        unindexGroup(id);
         groups.remove(id);
     }
 }
 
+bool GroupManagerPrivate::isPaged() const
+{
+    return !queryLimit && !queryOffset && queryMode == EventModel::StreamedAsyncQuery && chunkSize > 0;
+}
+
+// True if the group sorts within the pages fetched so far
+bool GroupManagerPrivate::isFetched(const Group &group) const
+{
+    if (!hasMore)
+        return true;
+
+    return group.endTimeT() > fetchEndTime
+            || (group.endTimeT() == fetchEndTime && group.id() > fetchId);
+}
+
+bool GroupManagerPrivate::fetchGroups(int limit)
+{
+    QList<Group> results;
+    if (!database()->getGroupsPage(filterLocalUid, filterRemoteUid, fetchEndTime, fetchId, limit, results)) {
+        hasMore = false;
+        return false;
+    }
+
+    // A short page is the last one
+    hasMore = results.size() == limit;
+    if (!results.isEmpty()) {
+        fetchEndTime = results.last().endTimeT();
+        fetchId = results.last().id();
+    }
+
+    DEBUG() << Q_FUNC_INFO << "fetched" << results.size() << "groups, more:" << hasMore;
+
+    // Groups may already have been added by change notifications
+    QList<Group> newGroups;
+    foreach (const Group &group, results) {
+        if (!groups.contains(group.id()) && !pendingIds.contains(group.id()))
+            newGroups.append(group);
+    }
+
+    addGroups(newGroups);
+    return true;
+}
+
 bool GroupManagerPrivate::canFetchMore() const
 {
-    return false;
+    return hasMore;
+}
+
+bool GroupManagerPrivate::synchronize()
+{
+    Q_Q(GroupManager);
+
+    if (changeSequence < 0)
+        return true;
+
+    int version = 0;
+    if (!database()->dataVersion(version))
+        return false;
+    if (version == dataVersion)
+        return true;
+
+    QList<DatabaseIO::Change> changes;
+    bool complete = false;
+    if (!database()->getChanges(changeSequence, changes, complete))
+        return false;
+    if (!complete) {
+        DEBUG() << Q_FUNC_INFO << "change journal does not reach back to" << changeSequence << "- reloading";
+        return q->getGroups(filterLocalUid, filterRemoteUid);
+    }
+
+    DEBUG() << Q_FUNC_INFO << "applying" << changes.size() << "changes";
+
+    // Event changes are folded into a refresh of their group
+    QList<int> changedIds, deletedIds;
+    QSet<int> changedSet, deletedSet;
+    foreach (const DatabaseIO::Change &change, changes) {
+        if (change.table == DatabaseIO::Change::GroupsTable
+                && change.operation == DatabaseIO::Change::Delete) {
+            if (!deletedSet.contains(change.id)) {
+                deletedSet.insert(change.id);
+                deletedIds.append(change.id);
+            }
+        } else if (change.groupId >= 0 && !changedSet.contains(change.groupId)) {
+            changedSet.insert(change.groupId);
+            changedIds.append(change.groupId);
+        }
+    }
+
+    groupsDeletedSlot(deletedIds);
+
+    QList<int> loadedIds;
+    QList<Group> newGroups;
+    foreach (int id, changedIds) {
+        if (deletedSet.contains(id))
+            continue;
+
+        if (groups.contains(id)) {
+            loadedIds.append(id);
+        } else if (!pendingIds.contains(id)) {
+            Group g;
+            if (database()->getGroup(id, g) && !g.recipients().isEmpty() && groupMatchesFilter(g)
+                    && isFetched(g))
+                newGroups.append(g);
+        }
+    }
+
+    refreshGroups(loadedIds);
+    addGroups(newGroups);
+
+    if (!changes.isEmpty())
+        changeSequence = changes.last().sequence;
+    dataVersion = version;
+    return true;
 }
 
 DatabaseIO* GroupManagerPrivate::database()
@@ -378,26 +765,30 @@ DatabaseIO* GroupManagerPrivate::database()
 
 void GroupManagerPrivate::slotContactInfoChanged(const RecipientList &recipients)
 {
-    Q_Q(GroupManager);
-
     QSet<Recipient> changed = QSet<Recipient>::fromList(recipients.recipients());
 
-    foreach (GroupObject *group, groups) {
-        if (group->recipients().intersects(changed))
-            emit q->groupUpdated(group);
+    QList<int> updatedIds;
+    foreach (const Group &group, groups) {
+        if (group.recipients().intersects(changed))
+            updatedIds.append(group.id());
     }
+
+    foreach (int id, updatedIds)
+        emitGroupUpdated(id);
 }
 
 void GroupManagerPrivate::slotContactChanged(const RecipientList &recipients)
 {
-    Q_Q(GroupManager);
-
     QSet<Recipient> changed = QSet<Recipient>::fromList(recipients.recipients());
 
-    foreach (GroupObject *group, groups) {
-        if (group->recipients().intersects(changed))
-            emit q->groupUpdated(group);
+    QList<int> updatedIds;
+    foreach (const Group &group, groups) {
+        if (group.recipients().intersects(changed))
+            updatedIds.append(group.id());
     }
+
+    foreach (int id, updatedIds)
+        emitGroupUpdated(id);
 }
 
 GroupManager::GroupManager(QObject *parent)
@@ -438,10 +829,20 @@ void GroupManager::setOffset(int offset)
 }
 
 GroupObject *GroupManager::group(int groupId) const
+{
+    return d->object(groupId);
+}
+
+Group GroupManager::groupData(int groupId) const
 {
     return d->groups.value(groupId);
 }
 
+QList<Group> GroupManager::groupData() const
+{
+    return d->groups.values();
+}
+
 bool GroupManager::uidPairsMatch(const QString &localUid1, const QString &remoteUid1, const QString &localUid2, const QString &remoteUid2) const
 {
     return Recipient(localUid1, remoteUid1).matches(Recipient(localUid2, remoteUid2));
@@ -454,13 +855,7 @@ GroupObject *GroupManager::findGroup(const QString &localUid, const QString &rem
 
 GroupObject *GroupManager::findGroup(const QString &localUid, const QStringList &remoteUids) const
 {
-    RecipientList match = RecipientList::fromUids(localUid, remoteUids);
-    foreach (GroupObject *g, d->groups) {
-        if (g->localUid() == localUid && g->recipients() == match)
-            return g;
-    }
-
-    return 0;
+    return d->object(d->findGroup(localUid, RecipientList::fromUids(localUid, remoteUids)));
 }
 
 bool GroupManager::addGroup(Group &group)
@@ -550,23 +945,46 @@ bool GroupManager::getGroups(const QString &localUid,
     d->isReady = false;
 
     if (!d->groups.isEmpty()) {
-        foreach (GroupObject *go, d->groups)
-            emit groupDeleted(go);
-        qDeleteAll(d->groups);
+        foreach (int id, d->groups.keys()) {
+            if (GroupObject *go = d->objects.value(id))
+                emit groupDeleted(go);
+            emit groupDataDeleted(id);
+        }
+        qDeleteAll(d->objects);
+        d->objects.clear();
         d->groups.clear();
+        d->uidIndex.clear();
+        d->uidIndexKeys.clear();
     }
 
+    d->updateTimer.stop();
+    d->pendingUpdateIds.clear();
+
+    d->hasMore = false;
+    d->fetchEndTime = 0;
+    d->fetchId = -1;
+
     QString queryOrder;
     if (d->queryLimit > 0)
         queryOrder += QString::fromLatin1("LIMIT %1 ").arg(d->queryLimit);
     if (d->queryOffset > 0)
         queryOrder += QString::fromLatin1("OFFSET %1 ").arg(d->queryOffset);
 
-    QList<Group> results;
-    if (!d->database()->getGroups(localUid, remoteUid, results, queryOrder))
-        return false;
+    // Changes after this point are applied by synchronize()
+    if (!d->database()->lastChangeSequence(d->changeSequence)
+            || !d->database()->dataVersion(d->dataVersion))
+        d->changeSequence = -1;
 
-    d->addGroups(results);
+    if (d->isPaged()) {
+        if (!d->fetchGroups(d->firstChunkSize > 0 ? d->firstChunkSize : d->chunkSize))
+            return false;
+    } else {
+        QList<Group> results;
+        if (!d->database()->getGroups(localUid, remoteUid, results, queryOrder))
+            return false;
+
+        d->addGroups(results);
+    }
 
     if (!d->isReady && d->pendingResolve.isEmpty()) {
         d->isReady = true;
@@ -584,27 +1002,15 @@ void GroupManagerPrivate::contactResolveFinished()
         DEBUG() << "Finished resolving" << pendingResolve.size() << "groups";
 
         foreach (const Group &g, pendingResolve) {
-            GroupObject *go = new GroupObject(g, q);
+            insertGroup(g);
             DEBUG() << g.id() << g.recipients().debugString();
-            groups.insert(g.id(), go);
-            emit q->groupAdded(go);
+            emitGroupAdded(g.id());
         }
 
         pendingResolve.clear();
         pendingIds.clear();
     }
 
-    if (!pendingObjects.isEmpty()) {
-        DEBUG() << "Finished resolving" << pendingObjects.size() << "group objects";
-
-        foreach (GroupObject *go, pendingObjects) {
-            DEBUG() << go->id() << go->recipients().debugString();
-            emit q->groupUpdated(go);
-        }
-
-        pendingObjects.clear();
-    }
-
     if (!isReady) {
         isReady = true;
         emit q->modelReady(true);
@@ -626,19 +1032,15 @@ bool GroupManager::markAsReadGroup(int id)
     if (!d->commitTransaction(QList<int>() << id))
         return false;
 
-    GroupObject *group = 0;
-    foreach (GroupObject *g, d->groups) {
-        if (g->id() == id) {
-            group = g;
-            group->setUnreadMessages(0);
-            break;
-        }
-    }
-
-    if (group)
-        emit d->emitter->groupsUpdatedFull(QList<Group>() << group->toGroup());
-    else
+    QHash<int,Group>::iterator it = d->groups.find(id);
+    if (it != d->groups.end()) {
+        it->setUnreadMessages(0);
+        if (GroupObject *go = d->objects.value(id))
+            go->setUnreadMessages(0);
+        emit d->emitter->groupsUpdatedFull(QList<Group>() << *it);
+    } else {
         emit d->emitter->groupsUpdated(QList<int>() << id);
+    }
 
     return true;
 }
@@ -655,17 +1057,19 @@ bool GroupManager::deleteGroups(const QList<int> &groupIds)
 {
     DEBUG() << Q_FUNC_INFO << groupIds;
 
-    if (!d->database()->transaction())
-        return false;
-
-    if (!d->database()->deleteGroups(groupIds, d->bgThread)) {
-        d->database()->rollback();
+    // Not in a transaction, so that the events are deleted in batches
+    // that each commit separately
+    QList<int> deletedEventIds;
+    if (!d->database()->deleteGroups(groupIds, deletedEventIds, d->bgThread)) {
+        // Batches committed before the failure stay deleted
+        foreach (int id, deletedEventIds)
+            emit d->emitter->eventDeleted(id);
+        if (!deletedEventIds.isEmpty())
+            emit d->emitter->groupsUpdated(groupIds);
         return false;
     }
 
-    if (!d->commitTransaction(groupIds))
-        return false;
-
+    emit groupsCommitted(groupIds, true);
     emit d->emitter->groupsDeleted(groupIds);
     return true;
 }
@@ -674,10 +1078,7 @@ bool GroupManager::deleteAll()
 {
     DEBUG() << Q_FUNC_INFO;
 
-    QList<int> ids;
-    foreach (GroupObject *group, d->groups) {
-        ids << group->id();
-    }
+    QList<int> ids = d->groups.keys();
 
     if (ids.isEmpty())
         return true;
@@ -692,11 +1093,22 @@ bool GroupManager::canFetchMore() const
 
 void GroupManager::fetchMore()
 {
+    if (d->canFetchMore())
+        d->fetchGroups(d->chunkSize);
+}
+
+bool GroupManager::synchronize()
+{
+    return d->synchronize();
 }
 
 QList<GroupObject*> GroupManager::groups() const
 {
-    return d->groups.values();
+    QList<GroupObject*> result;
+    result.reserve(d->groups.size());
+    foreach (int id, d->groups.keys())
+        result.append(d->object(id));
+    return result;
 }
 
 bool GroupManager::isReady() const
@@ -44,6 +44,11 @@ class DatabaseIO;
  *
  * Use groupAdded, groupUpdated, and groupRemoved signals to monitor
  * changes, or the indiviual change signals for a GroupObject.
+ *
+ * Groups are stored as Group values. The GroupObject for a group is only
+ * created when it is requested through group(), findGroup() or groups(), or
+ * when the groupAdded() signal is connected. Models that only need the data
+ * should use groupData() and the groupData* signals instead.
  */
 class LIBCOMMHISTORY_EXPORT GroupManager : public QObject
 {
@@ -67,6 +72,10 @@ public:
 
     /*!
      * Set query mode. See EventModel::setQueryMode().
+     *
+     * With EventModel::StreamedAsyncQuery and no limit or offset, groups are
+     * loaded in chunks ordered by their last event, newest first.
+     * getGroups() loads the first chunk, and fetchMore() the following ones.
      */
     EventModel::QueryMode queryMode() const;
     void setQueryMode(EventModel::QueryMode mode);
@@ -122,10 +131,24 @@ public:
     Q_INVOKABLE CommHistory::GroupObject *findGroup(const QString &localUid, const QStringList &remoteUids) const;
 
     /*!
-     * Get a list of all loaded group objects
+     * Get a list of all loaded group objects. This creates a GroupObject for
+     * every loaded group.
      */
     QList<GroupObject*> groups() const;
 
+    /*!
+     * Get the data of a loaded group without creating a GroupObject
+     *
+     * \param groupId group ID
+     * \return group, or an invalid group if it is not loaded
+     */
+    Group groupData(int groupId) const;
+
+    /*!
+     * Get the data of all loaded groups without creating GroupObjects
+     */
+    QList<Group> groupData() const;
+
     /*!
      * Add a new group. If successful, group.id() is updated.
      *
@@ -166,6 +189,19 @@ public:
     bool getGroups(const QString &localUid = QString(),
                    const QString &remoteUid = QString());
 
+    /*!
+     * Apply changes made by other processes since getGroups(), using the
+     * database change journal, instead of re-running the full query. Call
+     * this after the application has been suspended or may otherwise have
+     * missed change signals.
+     *
+     * If the journal no longer covers the loaded groups, the manager is
+     * reset with getGroups() using the previous filter.
+     *
+     * \return true if successful, otherwise false
+     */
+    bool synchronize();
+
     /*!
      * Delete groups from database.
      *
@@ -236,7 +272,14 @@ public:
     void setResolveContacts(ContactResolveType resolveType);
     ContactResolveType resolveContacts() const;
 
+    /*!
+     * Returns true if a chunked query has more groups to load.
+     */
     bool canFetchMore() const;
+
+    /*!
+     * Load the next chunk of chunkSize() groups, if any.
+     */
     void fetchMore();
 
     void resolve(GroupObject &group);
@@ -279,6 +322,19 @@ Q_SIGNALS:
      * \param group Group
      */
     void groupDeleted(GroupObject *group);
+
+    /*!
+     * Equivalents of groupAdded(), groupUpdated() and groupDeleted() which
+     * are emitted for every group, whether or not it has a GroupObject.
+     * groupUpdated() and groupDeleted() are only emitted for groups that
+     * have one.
+     *
+     * \param groupId Group ID
+     */
+    void groupDataAdded(int groupId);
+    void groupDataUpdated(int groupId);
+    void groupDataDeleted(int groupId);
+
     /*!
      * Emitted when contact resolution policy is changed.
      */
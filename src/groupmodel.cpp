@@ -22,6 +22,8 @@
 
 #include <QtDBus/QtDBus>
 
+#include <algorithm>
+
 #include "commonutils.h"
 #include "groupmodel.h"
 #include "groupmodel_p.h"
@@ -43,9 +45,14 @@ bool initializeTypes()
     return true;
 }
 
-inline bool groupObjectSort(GroupObject *a, GroupObject *b)
+inline bool groupSort(const Group &a, const Group &b)
 {
-    return a->endTimeT() > b->endTimeT(); // descending order
+    return a.endTimeT() > b.endTimeT(); // descending order
+}
+
+inline bool groupBeforeEndTime(const Group &group, quint32 endTime)
+{
+    return group.endTimeT() > endTime;
 }
 
 }
@@ -77,6 +84,7 @@ void GroupModelPrivate::setManager(GroupManager *m)
 
     q->beginResetModel();
     groups.clear();
+    rowEndTimes.clear();
 
     if (manager) {
         disconnect(manager, 0, this, 0);
@@ -86,15 +94,18 @@ void GroupModelPrivate::setManager(GroupManager *m)
     manager = m;
 
     if (manager) {
-        connect(manager, SIGNAL(groupAdded(GroupObject*)), SLOT(groupAdded(GroupObject*)));
-        connect(manager, SIGNAL(groupUpdated(GroupObject*)), SLOT(groupUpdated(GroupObject*)));
-        connect(manager, SIGNAL(groupDeleted(GroupObject*)), SLOT(groupDeleted(GroupObject*)));
+        connect(manager, SIGNAL(groupDataAdded(int)), SLOT(groupAdded(int)));
+        connect(manager, SIGNAL(groupDataUpdated(int)), SLOT(groupUpdated(int)));
+        connect(manager, SIGNAL(groupDataDeleted(int)), SLOT(groupDeleted(int)));
 
         connect(manager, SIGNAL(modelReady(bool)), q, SIGNAL(modelReady(bool)));
         connect(manager, SIGNAL(groupsCommitted(QList<int>,bool)), q, SIGNAL(groupsCommitted(QList<int>,bool)));
 
-        groups = manager->groups();
-        std::sort(groups.begin(), groups.end(), groupObjectSort);
+        groups = manager->groupData();
+        std::sort(groups.begin(), groups.end(), groupSort);
+        rowEndTimes.reserve(groups.size());
+        foreach (const Group &group, groups)
+            rowEndTimes.insert(group.id(), group.endTimeT());
     }
 
     q->endResetModel();
@@ -102,39 +113,57 @@ void GroupModelPrivate::setManager(GroupManager *m)
         emit q->modelReady(true);
 }
 
-void GroupModelPrivate::groupAdded(GroupObject *group)
+int GroupModelPrivate::rowForGroup(int groupId) const
 {
-    Q_Q(GroupModel);
+    QHash<int, quint32>::const_iterator it = rowEndTimes.constFind(groupId);
+    if (it == rowEndTimes.constEnd())
+        return -1;
 
-    int index = 0;
-    for (; index < groups.size(); index++) {
-        if (groupObjectSort(group, groups[index]))
-            break;
+    // Rows are sorted by end time, so only rows sharing this one's end time need to be checked
+    QList<Group>::const_iterator row = std::lower_bound(groups.constBegin(), groups.constEnd(), *it, groupBeforeEndTime);
+    for (; row != groups.constEnd() && row->endTimeT() == *it; ++row) {
+        if (row->id() == groupId)
+            return row - groups.constBegin();
     }
 
+    return -1;
+}
+
+void GroupModelPrivate::groupAdded(int groupId)
+{
+    Q_Q(GroupModel);
+
+    Group group = manager->groupData(groupId);
+    int index = std::upper_bound(groups.begin(), groups.end(), group, groupSort) - groups.begin();
+
     q->beginInsertRows(QModelIndex(), index, index);
     groups.insert(index, group);
+    rowEndTimes.insert(groupId, group.endTimeT());
     q->endInsertRows();
 }
 
-void GroupModelPrivate::groupUpdated(GroupObject *group)
+void GroupModelPrivate::groupUpdated(int groupId)
 {
     Q_Q(GroupModel);
 
-    int index = groups.indexOf(group);
+    int index = rowForGroup(groupId);
     if (index < 0)
         return;
 
+    groups[index] = manager->groupData(groupId);
+    const Group &group = groups[index];
+    rowEndTimes.insert(groupId, group.endTimeT());
+
     int newIndex = index;
     for (int i = index - 1; i >= 0; i--) {
-        if (groupObjectSort(group, groups[i]))
+        if (groupSort(group, groups[i]))
             newIndex = i;
         else
             break;
     }
 
     for (int i = index + 1; i < groups.size(); i++) {
-        if (groupObjectSort(groups[i], group))
+        if (groupSort(groups[i], group))
             newIndex = i;
         else
             break;
@@ -153,16 +182,17 @@ void GroupModelPrivate::groupUpdated(GroupObject *group)
                         q->index(newIndex, GroupModel::NumberOfColumns-1, QModelIndex()));
 }
 
-void GroupModelPrivate::groupDeleted(GroupObject *group)
+void GroupModelPrivate::groupDeleted(int groupId)
 {
     Q_Q(GroupModel);
 
-    int index = groups.indexOf(group);
+    int index = rowForGroup(groupId);
     if (index < 0)
         return;
 
     q->beginRemoveRows(QModelIndex(), index, index);
     groups.removeAt(index);
+    rowEndTimes.remove(groupId);
     q->endRemoveRows();
 }
 
@@ -266,18 +296,16 @@ QVariant GroupModel::data(const QModelIndex &index, int role) const
         return QVariant();
     }
 
-    GroupObject *group = d->groups.value(index.row());
-    if (!group)
-        return QVariant();
+    const Group &group = d->groups.at(index.row());
 
     if (role == GroupRole) {
-        return QVariant::fromValue(group->toGroup());
+        return QVariant::fromValue(group);
     } else if (role == GroupObjectRole) {
-        return QVariant::fromValue<QObject*>(group);
+        return QVariant::fromValue<QObject*>(d->manager->group(group.id()));
     } else if (role == ContactIdsRole) {
-        return QVariant::fromValue<QList<int> >(group->recipients().contactIds());
+        return QVariant::fromValue<QList<int> >(group.recipients().contactIds());
     } else if (role == TimeSectionRole) {
-        return group->endTime().toLocalTime().date();
+        return group.endTime().toLocalTime().date();
     }
 
     int column = index.column();
@@ -293,49 +321,49 @@ QVariant GroupModel::data(const QModelIndex &index, int role) const
     QVariant var;
     switch (column) {
         case GroupId:
-            var = QVariant::fromValue(group->id());
+            var = QVariant::fromValue(group.id());
             break;
         case LocalUid:
-            var = QVariant::fromValue(group->localUid());
+            var = QVariant::fromValue(group.localUid());
             break;
         case RemoteUids:
-            var = QVariant::fromValue(group->recipients().remoteUids());
+            var = QVariant::fromValue(group.recipients().remoteUids());
             break;
         case ChatName:
-            var = QVariant::fromValue(group->chatName());
+            var = QVariant::fromValue(group.chatName());
             break;
         case EndTime:
-            var = QVariant::fromValue(group->endTime());
+            var = QVariant::fromValue(group.endTime());
             break;
         case UnreadMessages:
-            var = QVariant::fromValue(group->unreadMessages());
+            var = QVariant::fromValue(group.unreadMessages());
             break;
         case LastEventId:
-            var = QVariant::fromValue(group->lastEventId());
+            var = QVariant::fromValue(group.lastEventId());
             break;
         case Contacts:
-            var = QVariant::fromValue(group->recipients().contactIds());
+            var = QVariant::fromValue(group.recipients().contactIds());
             break;
         case LastMessageText:
-            var = QVariant::fromValue(group->lastMessageText());
+            var = QVariant::fromValue(group.lastMessageText());
             break;
         case LastVCardFileName:
-            var = QVariant::fromValue(group->lastVCardFileName());
+            var = QVariant::fromValue(group.lastVCardFileName());
             break;
         case LastVCardLabel:
-            var = QVariant::fromValue(group->lastVCardLabel());
+            var = QVariant::fromValue(group.lastVCardLabel());
             break;
         case LastEventType:
-            var = QVariant::fromValue((int)group->lastEventType());
+            var = QVariant::fromValue((int)group.lastEventType());
             break;
         case LastEventStatus:
-            var = QVariant::fromValue((int)group->lastEventStatus());
+            var = QVariant::fromValue((int)group.lastEventStatus());
             break;
         case LastModified:
-            var = QVariant::fromValue(group->lastModified());
+            var = QVariant::fromValue(group.lastModified());
             break;
         case StartTime:
-            var = QVariant::fromValue(group->startTime());
+            var = QVariant::fromValue(group.startTime());
             break;
         default:
             DEBUG() << "Group::data: invalid column id??" << column;
@@ -347,23 +375,22 @@ QVariant GroupModel::data(const QModelIndex &index, int role) const
 
 Group GroupModel::group(const QModelIndex &index) const
 {
-    GroupObject *go = d->groups.value(index.row());
-    if (go)
-        return go->toGroup();
-    return Group();
+    return d->groups.value(index.row());
 }
 
 GroupObject *GroupModel::groupObject(const QModelIndex &index) const
 {
-    return d->groups.value(index.row());
+    if (index.row() < 0 || index.row() >= d->groups.size())
+        return 0;
+
+    return d->manager->group(d->groups[index.row()].id());
 }
 
 QModelIndex GroupModel::findGroup(int id) const
 {
-    for (int i = 0; i < d->groups.size(); ++i) {
-        if (d->groups[i]->id() == id)
-            return index(i, 0, QModelIndex());
-    }
+    int row = d->rowForGroup(id);
+    if (row >= 0)
+        return index(row, 0, QModelIndex());
     return QModelIndex();
 }
 
@@ -24,6 +24,7 @@
 #define COMMHISTORY_GROUPMODEL_P_H
 
 #include <QAbstractItemModel>
+#include <QHash>
 #include <QList>
 #include <QPair>
 
@@ -53,13 +54,18 @@ public:
     void setManager(GroupManager *manager);
     void ensureManager();
 
+    int rowForGroup(int groupId) const;
+
     GroupManager *manager;
-    QList<GroupObject*> groups;
+    // Rows hold group data; GroupObjects are requested from the manager when needed
+    QList<Group> groups;
+    // End time each loaded row is sorted by, to find a group's row without a full scan
+    QHash<int, quint32> rowEndTimes;
 
 public slots:
-    void groupAdded(GroupObject *group);
-    void groupUpdated(GroupObject *group);
-    void groupDeleted(GroupObject *group);
+    void groupAdded(int groupId);
+    void groupUpdated(int groupId);
+    void groupDeleted(int groupId);
 };
 
 }
@@ -0,0 +1,314 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jollamobile.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+#include "messagepartcollector_p.h"
+#include "commhistorydatabase.h"
+#include "commhistorydatabasepath.h"
+
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QThread>
+#include <QTimer>
+#include <QDebug>
+
+using namespace CommHistory;
+
+namespace {
+
+// Delay before collecting, so that the deleting transaction has committed and requests are merged
+const int collectDelay = 2000;
+
+// Parts deleted in each transaction
+const int partBatchSize = 50;
+
+// Data directories checked before returning to the event loop
+const int directoryBatchSize = 20;
+
+// Directories modified more recently may belong to an event that is still being stored
+const int directoryGracePeriod = 3600;
+
+const char *connectionName = "commhistory-collector";
+
+bool isInDataDir(const QString &path)
+{
+    const QString dataDir = QDir::cleanPath(CommHistoryDatabasePath::dataDir()) + QLatin1Char('/');
+    return QDir::cleanPath(path).startsWith(dataDir);
+}
+
+}
+
+MessagePartCollector::MessagePartCollector(QThread *thread)
+    : timer(new QTimer(this))
+    , reclaimedBytes(0)
+    , running(false)
+    , rescheduled(false)
+{
+    timer->setSingleShot(true);
+    timer->setInterval(collectDelay);
+    connect(timer, SIGNAL(timeout()), SLOT(start()));
+
+    moveToThread(thread);
+    connect(thread, SIGNAL(finished()), SLOT(deleteLater()));
+}
+
+MessagePartCollector::~MessagePartCollector()
+{
+    if (database.isValid()) {
+        database.close();
+        database = QSqlDatabase();
+        QSqlDatabase::removeDatabase(QLatin1String(connectionName));
+    }
+}
+
+QSqlDatabase &MessagePartCollector::connection()
+{
+    // Connections can only be used from the thread that opened them
+    if (!database.isValid())
+        database = CommHistoryDatabase::open(QLatin1String(connectionName));
+
+    return database;
+}
+
+void MessagePartCollector::schedule()
+{
+    if (running)
+        rescheduled = true;
+    else
+        timer->start();
+}
+
+void MessagePartCollector::start()
+{
+    running = true;
+    rescheduled = false;
+    reclaimedBytes = 0;
+
+    if (!connection().isOpen()) {
+        qWarning() << "Message part collection failed: no database connection";
+        finish();
+        return;
+    }
+
+    collectParts();
+}
+
+void MessagePartCollector::collectParts()
+{
+    QSqlDatabase &db(connection());
+    if (!db.transaction()) {
+        qWarning() << "Failed to begin transaction";
+        qWarning() << db.lastError();
+        finish();
+        return;
+    }
+
+    // Deleted archived events leave their parts in the archive
+    QSqlQuery query = CommHistoryDatabase::prepare("SELECT 0, id, path FROM main.MessageParts WHERE eventId IS NULL "
+                                                   "UNION ALL SELECT 1, id, path FROM archive.MessageParts "
+                                                   "WHERE eventId IS NULL LIMIT :limit", db);
+    query.bindValue(":limit", partBatchSize);
+
+    if (!query.exec()) {
+        qWarning() << "Failed to execute query";
+        qWarning() << query.lastError();
+        qWarning() << query.lastQuery();
+        db.rollback();
+        finish();
+        return;
+    }
+
+    int count = 0;
+    QByteArray idLists[2];
+    QStringList paths;
+    while (query.next()) {
+        QByteArray &idList(idLists[query.value(0).toInt()]);
+        if (!idList.isEmpty())
+            idList += ',';
+        idList += QByteArray::number(query.value(1).toInt());
+
+        const QString path = query.value(2).toString();
+        if (!path.isEmpty())
+            paths.append(path);
+        count++;
+    }
+    query.finish();
+
+    // Archived parts keep the ids they had in the main table, which may since
+    // have been reused, so only the orphaned rows are matched
+    const QByteArray statements[] = {
+        "DELETE FROM main.MessageParts WHERE eventId IS NULL AND id IN (" + idLists[0] + ")",
+        "DELETE FROM archive.MessageParts WHERE eventId IS NULL AND id IN (" + idLists[1] + ")"
+    };
+
+    // Modifying an event stores its parts again as new rows, which can
+    // share the files of the orphaned ones
+    if (!paths.isEmpty()) {
+        const QByteArray orphanPaths = "(SELECT path FROM main.MessageParts WHERE eventId IS NULL AND id IN (" + idLists[0] + ")"
+                                       " UNION ALL SELECT path FROM archive.MessageParts WHERE eventId IS NULL AND id IN (" + idLists[1] + "))";
+        QSqlQuery liveQuery = CommHistoryDatabase::prepare(
+                "SELECT path FROM main.MessageParts WHERE eventId IS NOT NULL AND path IN " + orphanPaths
+                + " UNION SELECT path FROM archive.MessageParts WHERE eventId IS NOT NULL AND path IN " + orphanPaths, db);
+        if (!liveQuery.exec()) {
+            qWarning() << "Failed to execute query";
+            qWarning() << liveQuery.lastError();
+            qWarning() << liveQuery.lastQuery();
+            db.rollback();
+            finish();
+            return;
+        }
+
+        while (liveQuery.next())
+            paths.removeAll(liveQuery.value(0).toString());
+        liveQuery.finish();
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (idLists[i].isEmpty())
+            continue;
+
+        QSqlQuery deleteQuery = CommHistoryDatabase::prepare(statements[i], db);
+        if (!deleteQuery.exec()) {
+            qWarning() << "Failed to execute query";
+            qWarning() << deleteQuery.lastError();
+            qWarning() << deleteQuery.lastQuery();
+            db.rollback();
+            finish();
+            return;
+        }
+    }
+
+    if (!db.commit()) {
+        qWarning() << "Failed to commit transaction";
+        qWarning() << db.lastError();
+        db.rollback();
+        finish();
+        return;
+    }
+
+    // Files are removed after the rows; any left behind are found with their directory
+    foreach (const QString &path, paths)
+        reclaimedBytes += removeFile(path);
+
+    if (count == partBatchSize) {
+        QMetaObject::invokeMethod(this, "collectParts", Qt::QueuedConnection);
+    } else {
+        pendingDirectories = QDir(CommHistoryDatabasePath::dataDir()).entryList(QDir::Dirs | QDir::NoDotAndDotDot);
+        QMetaObject::invokeMethod(this, "collectDirectories", Qt::QueuedConnection);
+    }
+}
+
+qint64 MessagePartCollector::removeFile(const QString &path)
+{
+    // Files elsewhere are not owned by commhistory
+    if (!isInDataDir(path))
+        return 0;
+
+    QFileInfo info(path);
+    if (!info.isFile())
+        return 0;
+
+    const qint64 size = info.size();
+    if (!QFile::remove(info.absoluteFilePath())) {
+        qWarning() << "Failed to remove message part" << info.absoluteFilePath();
+        return 0;
+    }
+
+    // The directory of the event goes with its last part; rmdir fails for others
+    if (isInDataDir(info.absolutePath()))
+        QDir().rmdir(info.absolutePath());
+
+    return size;
+}
+
+void MessagePartCollector::collectDirectories()
+{
+    QSqlDatabase &db(connection());
+    // Archived events keep their directories
+    QSqlQuery eventQuery = CommHistoryDatabase::prepare("SELECT 1 FROM Events WHERE id=:id "
+                                                        "UNION ALL SELECT 1 FROM archive.Events WHERE id=:id", db);
+    QSqlQuery partQuery = CommHistoryDatabase::prepare("SELECT 1 FROM MessageParts WHERE substr(path, 1, :length) = :path "
+                                                       "UNION ALL SELECT 1 FROM archive.MessageParts "
+                                                       "WHERE substr(path, 1, :length) = :path LIMIT 1", db);
+    const QDateTime modifiedLimit = QDateTime::currentDateTime().addSecs(-directoryGracePeriod);
+
+    for (int i = 0; i < directoryBatchSize && !pendingDirectories.isEmpty(); i++) {
+        // Directories are named by event id, as in CommHistoryDatabasePath::dataDir(id)
+        const QString name = pendingDirectories.takeFirst();
+        bool ok = false;
+        const int eventId = name.toInt(&ok);
+        if (!ok || QString::number(eventId) != name)
+            continue;
+
+        const QString path = CommHistoryDatabasePath::dataDir(eventId);
+        if (QFileInfo(path).lastModified() > modifiedLimit)
+            continue;
+
+        eventQuery.bindValue(":id", eventId);
+        partQuery.bindValue(":length", path.length());
+        partQuery.bindValue(":path", path);
+        if (!eventQuery.exec() || !partQuery.exec()) {
+            qWarning() << "Failed to execute query";
+            qWarning() << eventQuery.lastError() << partQuery.lastError();
+            finish();
+            return;
+        }
+
+        const bool referenced = eventQuery.next() || partQuery.next();
+        eventQuery.finish();
+        partQuery.finish();
+        if (referenced)
+            continue;
+
+        qint64 size = 0;
+        QDirIterator it(path, QDir::Files | QDir::Hidden | QDir::System, QDirIterator::Subdirectories);
+        while (it.hasNext()) {
+            it.next();
+            size += it.fileInfo().size();
+        }
+
+        if (QDir(path).removeRecursively())
+            reclaimedBytes += size;
+        else
+            qWarning() << "Failed to remove unused data directory" << path;
+    }
+
+    if (pendingDirectories.isEmpty())
+        finish();
+    else
+        QMetaObject::invokeMethod(this, "collectDirectories", Qt::QueuedConnection);
+}
+
+void MessagePartCollector::finish()
+{
+    running = false;
+    pendingDirectories.clear();
+    emit finished(reclaimedBytes);
+
+    if (rescheduled) {
+        rescheduled = false;
+        timer->start();
+    }
+}
@@ -0,0 +1,82 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jollamobile.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+#ifndef COMMHISTORY_MESSAGEPARTCOLLECTOR_P_H
+#define COMMHISTORY_MESSAGEPARTCOLLECTOR_P_H
+
+#include <QObject>
+#include <QSqlDatabase>
+#include <QStringList>
+
+class QThread;
+class QTimer;
+
+namespace CommHistory {
+
+/* Removes message parts that no longer belong to an event
+ *
+ * Parts are left with a null eventId when their event is deleted, or when a
+ * modified event no longer includes them. Parts of deleted archived events
+ * stay in the archive the same way. The collector deletes those rows from
+ * both tables, and their files under the data directory. It then removes the data
+ * directories of events that no longer exist and that no part refers to.
+ *
+ * The collector runs on a background thread with its own connection. Rows
+ * are deleted in small batches that each commit separately, and the event
+ * loop runs between batches, so that other writers are not blocked for long.
+ * Requests made while a collection is scheduled or running are merged.
+ */
+class MessagePartCollector : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit MessagePartCollector(QThread *thread);
+    ~MessagePartCollector();
+
+public slots:
+    void schedule();
+
+signals:
+    void finished(qint64 reclaimedBytes);
+
+private slots:
+    void start();
+    void collectParts();
+    void collectDirectories();
+
+private:
+    QSqlDatabase &connection();
+    qint64 removeFile(const QString &path);
+    void finish();
+
+    QSqlDatabase database;
+    QTimer *timer;
+    QStringList pendingDirectories;
+    qint64 reclaimedBytes;
+    bool running;
+    bool rescheduled;
+};
+
+}
+
+#endif
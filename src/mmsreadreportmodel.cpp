@@ -22,6 +22,7 @@
 
 #include "mmsreadreportmodel.h"
 #include "mmsconstants.h"
+#include "databasemigration_p.h"
 #include "commhistorydatabase.h"
 #include "databaseio_p.h"
 #include "eventmodel_p.h"
@@ -41,7 +42,6 @@ public:
 #define QUERY_EVENT_TYPE         ":type"
 #define QUERY_EVENT_DIRECTION    ":direction"
 #define QUERY_EVENT_REPORT_READ  ":reportRead"
-#define QUERY_EVENT_PROPERTY_KEY ":propertyKey"
 #define QUERY_EVENT_GROUP_ID     ":groupId"
 
 QSqlQuery MmsReadReportModel::Private::buildGroupQuery(int groupId)
@@ -54,9 +54,20 @@ QSqlQuery MmsReadReportModel::Private::buildGroupQuery(int groupId)
          " AND Events.direction = " QUERY_EVENT_DIRECTION
          " AND Events.reportRead = " QUERY_EVENT_REPORT_READ
          " AND Events.mmsId != '' "
-         " AND Events.id IN ("
-         " SELECT DISTINCT eventId from EventProperties"
-         " WHERE EventProperties.key = " QUERY_EVENT_PROPERTY_KEY " )"
+         " AND (Events.mmsUnread IS NOT NULL";
+    // Until migrated, the property may be in EventProperties, or in
+    // OldEventProperties with its key
+    DatabaseIOPrivate *io = DatabaseIOPrivate::instance();
+    if (io->migrationPending(PROMOTED_PROPERTIES_MIGRATION)) {
+        q += " OR Events.id IN ("
+             " SELECT eventId FROM EventProperties"
+             " WHERE keyId = (SELECT id FROM EventPropertyKeys WHERE key = '" MMS_PROPERTY_UNREAD "'))";
+    }
+    if (io->migrationPending(PROPERTY_KEYS_MIGRATION)) {
+        q += " OR Events.id IN ("
+             " SELECT eventId FROM OldEventProperties WHERE key = '" MMS_PROPERTY_UNREAD "')";
+    }
+    q += ")"
          " ORDER BY Events.endTime DESC, Events.id DESC";
 
     QSqlQuery query = DatabaseIOPrivate::prepareQuery(q);
@@ -66,7 +77,6 @@ QSqlQuery MmsReadReportModel::Private::buildGroupQuery(int groupId)
     query.bindValue(QUERY_EVENT_TYPE, Event::MMSEvent);
     query.bindValue(QUERY_EVENT_DIRECTION, Event::Inbound);
     query.bindValue(QUERY_EVENT_REPORT_READ, true);
-    query.bindValue(QUERY_EVENT_PROPERTY_KEY, QString(MMS_PROPERTY_UNREAD));
     return query;
 }
 
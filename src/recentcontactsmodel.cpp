@@ -22,15 +22,18 @@
 #include "recentcontactsmodel.h"
 
 #include "databaseio_p.h"
+#include "databasemigration_p.h"
 #include "commhistorydatabase.h"
 #include "eventmodel_p.h"
 #include "contactlistener.h"
+#include "contactresolver.h"
 #include "debug.h"
 
 #include <seasidecache.h>
 
 #include <QContactFavorite>
 
+#include <QMap>
 #include <QSqlQuery>
 #include <QSqlError>
 
@@ -54,6 +57,8 @@ static bool contactIsFavorite(int contactId)
 
 class RecentContactsModelPrivate : public EventModelPrivate
 {
+    Q_OBJECT
+
 public:
     Q_DECLARE_PUBLIC(RecentContactsModel)
 
@@ -61,7 +66,8 @@ public:
         : EventModelPrivate(model),
           requiredProperty(RecentContactsModel::NoPropertyRequired),
           excludeFavorites(false),
-          addressFlags(0)
+          addressFlags(0),
+          batchResolver(0)
     {
         setResolveContacts(EventModel::ResolveOnDemand);
     }
@@ -69,13 +75,20 @@ public:
     virtual bool acceptsEvent(const Event &event) const;
     virtual bool fillModel(int start, int end, QList<Event> events, bool resolved);
     virtual void prependEvents(QList<Event> events, bool resolved);
+    virtual void clearEvents();
 
     virtual void slotContactInfoChanged(const RecipientList &recipients);
     virtual void slotContactChanged(const RecipientList &recipients);
     virtual void slotContactDetailsChanged(const RecipientList &recipients);
 
+    bool isResolvingBatches() const;
+
+private slots:
+    void batchResolved(int batch);
+
 private:
     void removeFavorites(const RecipientList &recipients);
+    void resolveUnresolvedEvents();
 
     int requiredProperty;
     bool excludeFavorites;
@@ -83,6 +96,11 @@ private:
     QList<Event> unresolvedEvents;
     QList<Event> resolvedEvents;
     QSet<int> resolvedContactIds;
+
+    // Events submitted for resolution, by batch in the order of submission
+    ContactResolver *batchResolver;
+    QMap<int, QList<Event> > resolvingBatches;
+    QSet<int> resolvedBatches;
 };
 
 bool RecentContactsModelPrivate::acceptsEvent(const Event &event) const
@@ -230,15 +248,17 @@ void RecentContactsModelPrivate::prependEvents(QList<Event> events, bool resolve
         }
     }
 
-    if (!unresolvedEvents.isEmpty()) {
+    if (!unresolvedEvents.isEmpty() || !resolvingBatches.isEmpty()) {
         // Do we have enough items to reach the limit?
         if (queryLimit == 0 || resolvedEvents.count() < queryLimit) {
-            resolveAddedEvents(QList<Event>() << unresolvedEvents.takeFirst());
+            resolveUnresolvedEvents();
             return;
         }
 
         // We won't ever show these events; just drop them
         unresolvedEvents.clear();
+        resolvingBatches.clear();
+        resolvedBatches.clear();
     }
 
     if (!resolvedEvents.isEmpty()) {
@@ -314,6 +334,74 @@ void RecentContactsModelPrivate::prependEvents(QList<Event> events, bool resolve
     }
 }
 
+void RecentContactsModelPrivate::clearEvents()
+{
+    EventModelPrivate::clearEvents();
+
+    unresolvedEvents.clear();
+    resolvedEvents.clear();
+    resolvedContactIds.clear();
+    resolvingBatches.clear();
+    resolvedBatches.clear();
+}
+
+bool RecentContactsModelPrivate::isResolvingBatches() const
+{
+    return !resolvingBatches.isEmpty();
+}
+
+void RecentContactsModelPrivate::resolveUnresolvedEvents()
+{
+    if (!batchResolver) {
+        batchResolver = new ContactResolver(this);
+        connect(batchResolver, SIGNAL(batchFinished(int)), SLOT(batchResolved(int)));
+    }
+
+    // Keep enough events resolving to fill the remaining rows, rather than
+    // waiting for each event to be resolved before requesting the next
+    int inProgress = 0;
+    foreach (const QList<Event> &batch, resolvingBatches)
+        inProgress += batch.count();
+
+    const int required = queryLimit ? queryLimit - resolvedEvents.count() : unresolvedEvents.count();
+    const int count = qMin(required - inProgress, unresolvedEvents.count());
+    if (count <= 0)
+        return;
+
+    const QList<Event> events(unresolvedEvents.mid(0, count));
+    unresolvedEvents.erase(unresolvedEvents.begin(), unresolvedEvents.begin() + count);
+    resolvingBatches.insert(batchResolver->addBatch(events), events);
+}
+
+void RecentContactsModelPrivate::batchResolved(int batch)
+{
+    // Ignore batches that were dropped after they were submitted
+    if (!resolvingBatches.contains(batch))
+        return;
+
+    resolvedBatches.insert(batch);
+
+    // Batches can finish out of order, but the events must be added in order
+    QList<Event> resolved;
+    while (!resolvingBatches.isEmpty() && resolvedBatches.contains(resolvingBatches.firstKey())) {
+        const int first = resolvingBatches.firstKey();
+        resolvedBatches.remove(first);
+        resolved.append(resolvingBatches.take(first));
+    }
+
+    if (resolved.isEmpty())
+        return;
+
+    QList<Event>::iterator it = resolved.begin(), end = resolved.end();
+    for ( ; it != end; ++it) {
+        Event &event(*it);
+        if (!event.isResolved() && event.recipients().allContactsResolved())
+            event.setIsResolved(true);
+    }
+
+    prependEvents(resolved, true);
+}
+
 RecentContactsModel::RecentContactsModel(QObject *parent)
     : EventModel(*new RecentContactsModelPrivate(this), parent)
 {
@@ -367,7 +455,7 @@ bool RecentContactsModel::resolving() const
 {
     Q_D(const RecentContactsModel);
 
-    return !d->isReady || (d->addResolver && d->addResolver->isResolving()) ||
+    return !d->isReady || d->isResolvingBatches() || (d->addResolver && d->addResolver->isResolving()) ||
            (d->receiveResolver && d->receiveResolver->isResolving());
 }
 
@@ -389,23 +477,32 @@ bool RecentContactsModel::getEvents()
         limitClause = QStringLiteral("LIMIT ") + QString::number(4 * d->queryLimit);
     }
 
+    // Until migrated, some events have their UIDs as text, so events are
+    // grouped by the UIDs rather than their ids
+    QString remoteKey = QStringLiteral("Events.remoteUidId");
+    QString localKey = QStringLiteral("Events.localUidId");
+    if (DatabaseIOPrivate::instance()->migrationPending(UID_DICTIONARY_MIGRATION)) {
+        remoteKey = DatabaseIOPrivate::uidColumn(DatabaseIOPrivate::RemoteUids);
+        localKey = DatabaseIOPrivate::uidColumn(DatabaseIOPrivate::LocalUids);
+    }
+
     QString q = DatabaseIOPrivate::eventQueryBase() + QString::fromLatin1(
 " WHERE Events.id IN ("
   " SELECT lastId FROM ("
     " SELECT max(id) AS lastId, max(endTime) FROM Events"
     " JOIN ("
-      " SELECT remoteUid, localUid, max(endTime) AS lastEventTime FROM Events"
+      " SELECT %3 AS remoteKey, %4 AS localKey, max(endTime) AS lastEventTime FROM Events"
       " %1"
-      " GROUP BY remoteUid, localUid"
+      " GROUP BY remoteKey, localKey"
       " ORDER BY lastEventTime DESC"
       " %2"
     " ) AS LastEvent ON Events.endTime = LastEvent.lastEventTime"
-                   " AND Events.remoteUid = LastEvent.remoteUid"
-                   " AND Events.localUid = LastEvent.localUid"
-    " GROUP BY Events.remoteUid, Events.localUid"
+                   " AND %3 IS LastEvent.remoteKey"
+                   " AND %4 = LastEvent.localKey"
+    " GROUP BY %3, %4"
   " )"
 " )"
-" ORDER BY Events.endTime DESC").arg(categoryClause).arg(limitClause);
+" ORDER BY Events.endTime DESC").arg(categoryClause, limitClause, remoteKey, localKey);
 
     QSqlQuery query = d->prepareQuery(q, 0, 0);
 
@@ -416,3 +513,5 @@ bool RecentContactsModel::getEvents()
 }
 
 } // namespace CommHistory
+
+#include "recentcontactsmodel.moc"
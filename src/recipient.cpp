@@ -24,7 +24,11 @@
 #include "commonutils.h"
 #include <QSet>
 #include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
 #include <QDebug>
+#include <QVector>
+#include <algorithm>
 
 #include <phonenumbers/phonenumberutil.h>
 
@@ -61,6 +65,26 @@ QPair<QString, QString> makeUidPair(const QString &localUid, const QString &remo
                      ::minimizeRemoteUid(remoteUid, usesPhoneNumberComparison));
 }
 
+bool phoneNumbersMatch(const ::i18n::phonenumbers::PhoneNumber *parsed, const QString &number, const QString &other)
+{
+    // TODO: consider plumbing the region code here for potentially more accurate matching
+    ::i18n::phonenumbers::PhoneNumberUtil *util = ::i18n::phonenumbers::PhoneNumberUtil::GetInstance();
+
+    // Using the parsed form gives the same result as IsNumberMatchWithTwoStrings(),
+    // without parsing the first number again
+    ::i18n::phonenumbers::PhoneNumberUtil::MatchType match = parsed
+        ? util->IsNumberMatchWithOneString(*parsed, other.toStdString())
+        : util->IsNumberMatchWithTwoStrings(number.toStdString(), other.toStdString());
+    return match == ::i18n::phonenumbers::PhoneNumberUtil::EXACT_MATCH || match == ::i18n::phonenumbers::PhoneNumberUtil::NSN_MATCH;
+}
+
+// Results of full phone number comparisons, keyed on the serial of the recipient
+// and the number compared against. When the cache is full, it is discarded.
+typedef QPair<quint64, QString> PhoneNumberMatchKey;
+typedef QHash<PhoneNumberMatchKey, bool> PhoneNumberMatchCache;
+
+const int maxPhoneNumberMatchCacheSize = 4096;
+
 }
 
 bool recipient_initialized = initializeTypes();
@@ -80,10 +104,18 @@ public:
     quint32 remoteUidHash;
     quint32 contactNameHash;
     quint32 addressFlags;
+    // The following are only valid while holding phoneNumberMatchMutex
+    quint64 serial;
+    ::i18n::phonenumbers::PhoneNumber parsedNumber;
+    bool isNumberParsed;
+    bool isNumberValid;
 
     RecipientPrivate(const QString &localUid, const QString &remoteUid);
     ~RecipientPrivate();
 
+    const ::i18n::phonenumbers::PhoneNumber *phoneNumber();
+    bool matchesPhoneNumber(const QString &number);
+
     static QSharedPointer<RecipientPrivate> get(const QString &localUid, const QString &remoteUid);
 };
 
@@ -93,10 +125,57 @@ using namespace CommHistory;
 
 typedef QHash<QPair<QString,QString>,WeakRecipient> RecipientUidMap;
 typedef QMultiHash<int,WeakRecipient> RecipientContactMap;
+typedef QMultiHash<quint32,WeakRecipient> RecipientHashMap;
+
+// Interned instances are sharded by the hash of their uids, so that Recipient can be
+// created from any thread without all lookups contending for the same lock
+class RecipientInstances
+{
+public:
+    enum { ShardCount = 16 };
+
+    struct Shard {
+        QMutex mutex;
+        RecipientUidMap instances;
+    };
+
+    Shard &shard(const QPair<QString, QString> &uids)
+    {
+        return shards[qHash(uids) % ShardCount];
+    }
 
-Q_GLOBAL_STATIC(RecipientUidMap, recipientInstances);
+private:
+    Shard shards[ShardCount];
+};
+
+Q_GLOBAL_STATIC(RecipientInstances, recipientInstances);
 Q_GLOBAL_STATIC(RecipientContactMap, recipientContactMap);
+// Phone number recipients which are resolved to no contact, by their minimized number hash
+Q_GLOBAL_STATIC(RecipientHashMap, unmatchedPhoneNumbers);
 Q_GLOBAL_STATIC_WITH_ARGS(QSharedPointer<RecipientPrivate>, sharedNullRecipient, (new RecipientPrivate(QString(), QString())));
+Q_GLOBAL_STATIC(PhoneNumberMatchCache, phoneNumberMatchCache);
+Q_GLOBAL_STATIC(QMutex, phoneNumberMatchMutex);
+// Guards recipientContactMap and unmatchedPhoneNumbers. Recursive, because the last
+// reference to an instance found in the maps may be released while holding it.
+Q_GLOBAL_STATIC_WITH_ARGS(QMutex, resolvedRecipientsMutex, (QMutex::Recursive));
+
+static quint64 lastRecipientSerial = 0;
+
+static void insertResolved(const QSharedPointer<RecipientPrivate> &d)
+{
+    QMutexLocker locker(resolvedRecipientsMutex());
+    recipientContactMap->insert(d->item ? d->item->iid : 0, d.toWeakRef());
+    if (!d->item && d->isPhoneNumber)
+        unmatchedPhoneNumbers->insert(d->remoteUidHash, d.toWeakRef());
+}
+
+static void removeResolved(const QSharedPointer<RecipientPrivate> &d)
+{
+    QMutexLocker locker(resolvedRecipientsMutex());
+    recipientContactMap->remove(d->item ? d->item->iid : 0, d.toWeakRef());
+    if (!d->item && d->isPhoneNumber)
+        unmatchedPhoneNumbers->remove(d->remoteUidHash, d.toWeakRef());
+}
 
 Recipient::Recipient()
 {
@@ -142,16 +221,70 @@ RecipientPrivate::RecipientPrivate(const QString &local, const QString &remote)
     , remoteUidHash(qHash(minimizedRemoteUid))
     , contactNameHash(0)
     , addressFlags(0)
+    , serial(0)
+    , isNumberParsed(false)
+    , isNumberValid(false)
 {
 }
 
 RecipientPrivate::~RecipientPrivate()
 {
     if (!recipientInstances.isDestroyed()) {
-        recipientInstances->remove(makeUidPair(localUid, remoteUid));
+        const QPair<QString, QString> uids = makeUidPair(localUid, remoteUid);
+        RecipientInstances::Shard &shard(recipientInstances->shard(uids));
+
+        // Another thread may already have replaced our expired entry with a new instance
+        QMutexLocker locker(&shard.mutex);
+        RecipientUidMap::iterator it = shard.instances.find(uids);
+        if (it != shard.instances.end() && it->isNull())
+            shard.instances.erase(it);
+    }
+
+    if (isResolved && !item && isPhoneNumber && !unmatchedPhoneNumbers.isDestroyed()) {
+        QMutexLocker locker(resolvedRecipientsMutex());
+
+        // Our own entry can no longer be resolved, so drop any expired entries
+        RecipientHashMap::iterator it = unmatchedPhoneNumbers->find(remoteUidHash);
+        while (it != unmatchedPhoneNumbers->end() && it.key() == remoteUidHash) {
+            if (!*it)
+                it = unmatchedPhoneNumbers->erase(it);
+            else
+                ++it;
+        }
     }
 }
 
+const ::i18n::phonenumbers::PhoneNumber *RecipientPrivate::phoneNumber()
+{
+    if (!isNumberParsed) {
+        ::i18n::phonenumbers::PhoneNumberUtil *util = ::i18n::phonenumbers::PhoneNumberUtil::GetInstance();
+        isNumberValid = util->Parse(remoteUid.toStdString(), "ZZ", &parsedNumber) == ::i18n::phonenumbers::PhoneNumberUtil::NO_PARSING_ERROR;
+        isNumberParsed = true;
+    }
+    return isNumberValid ? &parsedNumber : 0;
+}
+
+bool RecipientPrivate::matchesPhoneNumber(const QString &number)
+{
+    QMutexLocker locker(phoneNumberMatchMutex());
+
+    // Serials are never reused, so entries left by destroyed instances can't be matched
+    if (!serial)
+        serial = ++lastRecipientSerial;
+
+    const PhoneNumberMatchKey key(serial, number);
+    PhoneNumberMatchCache::const_iterator it = phoneNumberMatchCache()->constFind(key);
+    if (it != phoneNumberMatchCache()->constEnd())
+        return *it;
+
+    const bool match = ::phoneNumbersMatch(phoneNumber(), remoteUid, number);
+
+    if (phoneNumberMatchCache()->size() >= maxPhoneNumberMatchCacheSize)
+        phoneNumberMatchCache()->clear();
+    phoneNumberMatchCache()->insert(key, match);
+    return match;
+}
+
 QSharedPointer<RecipientPrivate> RecipientPrivate::get(const QString &localUid, const QString &remoteUid)
 {
     if (localUid.isEmpty() && remoteUid.isEmpty()) {
@@ -159,11 +292,19 @@ QSharedPointer<RecipientPrivate> RecipientPrivate::get(const QString &localUid,
     }
 
     const QPair<QString, QString> uids = makeUidPair(localUid, remoteUid);
-    QSharedPointer<RecipientPrivate> instance = recipientInstances->value(uids);
-    if (!instance) {
-        instance = QSharedPointer<RecipientPrivate>(new RecipientPrivate(localUid, remoteUid));
-        recipientInstances->insert(uids, instance);
+    RecipientInstances::Shard &shard(recipientInstances->shard(uids));
+
+    QMutexLocker locker(&shard.mutex);
+    RecipientUidMap::iterator it = shard.instances.find(uids);
+    if (it != shard.instances.end()) {
+        // The instance may be in the process of being destroyed by another thread
+        QSharedPointer<RecipientPrivate> instance = it->toStrongRef();
+        if (instance)
+            return instance;
     }
+
+    QSharedPointer<RecipientPrivate> instance(new RecipientPrivate(localUid, remoteUid));
+    shard.instances.insert(uids, instance.toWeakRef());
     return instance;
 }
 
@@ -233,6 +374,12 @@ bool Recipient::matches(const Recipient &o) const
     return d->remoteUid == o.d->remoteUid;
 }
 
+quint64 Recipient::matchKey() const
+{
+    // Same fields as are required to be equal by matches()
+    return (quint64(d->remoteUidHash) << 32) | (d->isPhoneNumber ? 0 : d->localUidHash);
+}
+
 bool Recipient::isSameContact(const Recipient &o) const
 {
     if (d == o.d)
@@ -269,10 +416,7 @@ bool Recipient::matchesPhoneNumber(const PhoneNumberMatchDetails &phoneNumber) c
     if (d->remoteUid == phoneNumber.number)
         return true;
 
-    // TODO: consider plumbing the region code here for potentially more accurate matching
-    ::i18n::phonenumbers::PhoneNumberUtil *util = ::i18n::phonenumbers::PhoneNumberUtil::GetInstance();
-    ::i18n::phonenumbers::PhoneNumberUtil::MatchType match = util->IsNumberMatchWithTwoStrings(d->remoteUid.toStdString(), phoneNumber.number.toStdString());
-    return match == ::i18n::phonenumbers::PhoneNumberUtil::EXACT_MATCH || match == ::i18n::phonenumbers::PhoneNumberUtil::NSN_MATCH;
+    return d->matchesPhoneNumber(phoneNumber.number);
 }
 
 bool Recipient::matchesAddressFlags(quint64 flags) const
@@ -281,6 +425,10 @@ bool Recipient::matchesAddressFlags(quint64 flags) const
         return false;
     if (addressFlagValues(flags) == 0)
         return true;
+
+    // Until the contact is loaded, use the flags it had when it was last resolved
+    if (d->item->contactState == SeasideCache::ContactAbsent)
+        return d->addressFlags & flags;
     return d->item->statusFlags & flags;
 }
 
@@ -305,19 +453,23 @@ bool Recipient::isContactResolved() const
 }
 
 bool Recipient::setResolved(SeasideCache::CacheItem *item) const
+{
+    return setResolved(item, item ? item->statusFlags : 0);
+}
+
+bool Recipient::setResolved(SeasideCache::CacheItem *item, quint64 statusFlags) const
 {
     if (d->isResolved && item == d->item)
         return false;
 
-    if (d->isResolved && d->item)
-        recipientContactMap->remove(d->item->iid, d);
-
-    recipientContactMap->insert(item ? item->iid : 0, d.toWeakRef());
+    if (d->isResolved)
+        removeResolved(d);
 
     d->isResolved = true;
     d->item = item;
+    insertResolved(d);
     d->contactNameHash = item ? qHash(item->displayLabel) : 0;
-    d->addressFlags = item ? addressFlagValues(item->statusFlags) : 0;
+    d->addressFlags = item ? addressFlagValues(statusFlags) : 0;
     return true;
 }
 
@@ -326,8 +478,7 @@ void Recipient::setUnresolved() const
     if (!d->isResolved)
         return;
 
-    if (d->item)
-        recipientContactMap->remove(d->item->iid, d);
+    removeResolved(d);
 
     d->isResolved = false;
     d->item = 0;
@@ -337,7 +488,7 @@ void Recipient::setUnresolved() const
 
 bool Recipient::contactUpdateIsSignificant() const
 {
-    if (d->item) {
+    if (d->item && d->item->contactState != SeasideCache::ContactAbsent) {
         // The contact display label may have been updated
         const quint32 hash(qHash(d->item->displayLabel));
         const quint32 addressFlags(addressFlagValues(d->item->statusFlags));
@@ -352,20 +503,56 @@ bool Recipient::contactUpdateIsSignificant() const
 
 QList<Recipient> Recipient::recipientsForContact(int contactId)
 {
+    QMutexLocker locker(resolvedRecipientsMutex());
+
     QList<Recipient> re;
     RecipientContactMap::iterator it = recipientContactMap->find(contactId);
     for (; it != recipientContactMap->end() && it.key() == contactId; ) {
-        if (!*it) {
+        const QSharedPointer<RecipientPrivate> instance = it->toStrongRef();
+        if (!instance) {
             it = recipientContactMap->erase(it);
             continue;
         }
 
-        re.append(Recipient(*it));
+        re.append(Recipient(instance));
         it++;
     }
     return re;
 }
 
+QList<Recipient> Recipient::unmatchedRecipientsForPhoneNumber(const PhoneNumberMatchDetails &phoneNumber)
+{
+    if (phoneNumber.minimizedNumberHash == 0) {
+        // Without the hash there is nothing to narrow the candidates by
+        QList<Recipient> re;
+        foreach (const Recipient &recipient, recipientsForContact(0)) {
+            if (recipient.isPhoneNumber())
+                re.append(recipient);
+        }
+        return re;
+    }
+
+    QMutexLocker locker(resolvedRecipientsMutex());
+
+    // Recipients with an empty number may match any number, see matchesPhoneNumber()
+    QList<Recipient> re;
+    const quint32 hashes[] = { phoneNumber.minimizedNumberHash, 0 };
+    for (int i = 0; i < 2; ++i) {
+        RecipientHashMap::iterator it = unmatchedPhoneNumbers->find(hashes[i]);
+        for (; it != unmatchedPhoneNumbers->end() && it.key() == hashes[i]; ) {
+            const QSharedPointer<RecipientPrivate> instance = it->toStrongRef();
+            if (!instance) {
+                it = unmatchedPhoneNumbers->erase(it);
+                continue;
+            }
+
+            re.append(Recipient(instance));
+            it++;
+        }
+    }
+    return re;
+}
+
 Recipient::PhoneNumberMatchDetails Recipient::phoneNumberMatchDetails(const QString &s)
 {
     PhoneNumberMatchDetails rv;
@@ -390,6 +577,13 @@ Recipient::PhoneNumberMatchDetails Recipient::toPhoneNumberMatchDetails() const
     return det;
 }
 
+struct RecipientList::Canonical
+{
+    // Recipients without any that match an earlier recipient, ordered by key
+    QList<Recipient> recipients;
+    QVector<quint64> keys;
+};
+
 RecipientList::RecipientList()
 {
 }
@@ -521,49 +715,139 @@ QList<Recipient> removeMatches(const RecipientList &list, bool (Recipient::*mf)(
     return rv;
 }
 
-QList<Recipient> removeMatches(const RecipientList &list)
-{
-    return removeMatches(list, &Recipient::matches);
-}
-
 QList<Recipient> removeSameContacts(const RecipientList &list)
 {
     return removeMatches(list, &Recipient::isSameContact);
 }
 
+// Lists up to this size are united by comparing each pair of recipients
+const int uniteScanLimit = 16;
+
 }
 
-bool RecipientList::matches(const RecipientList &o) const
+void RecipientList::makeCanonical(const QList<Recipient> &recipients, Canonical &canonical)
 {
-    if (m_recipients.size() == 1 && o.m_recipients.size() == 1)
-        return m_recipients.first().matches(o.m_recipients.first());
+    // Sort by key, keeping the original order of recipients with the same key
+    QVector<QPair<quint64, int> > order;
+    order.reserve(recipients.size());
+    for (int i = 0; i < recipients.size(); ++i)
+        order.append(qMakePair(recipients.at(i).matchKey(), i));
+    std::sort(order.begin(), order.end());
 
-    QList<Recipient> myRecipients(removeMatches(m_recipients));
-    QList<Recipient> otherRecipients(removeMatches(o.m_recipients));
+    canonical.recipients.reserve(order.size());
+    canonical.keys.reserve(order.size());
 
-    if (myRecipients.size() != otherRecipients.size())
-        return false;
+    int runStart = 0;
+    for (int i = 0; i < order.size(); ++i) {
+        if (i > 0 && order.at(i).first != order.at(i - 1).first)
+            runStart = canonical.recipients.size();
 
-    foreach (const Recipient &r, myRecipients) {
-        QList<Recipient>::iterator it = otherRecipients.begin(), end = otherRecipients.end();
-        for ( ; it != end; ++it) {
-            if (r.matches(*it)) {
-                otherRecipients.erase(it);
+        // Only recipients with the same key can match
+        const Recipient &r(recipients.at(order.at(i).second));
+        int j = runStart;
+        for ( ; j < canonical.recipients.size(); ++j) {
+            if (r.matches(canonical.recipients.at(j)))
                 break;
-            }
         }
-        if (it == end)
+        if (j == canonical.recipients.size()) {
+            canonical.recipients.append(r);
+            canonical.keys.append(order.at(i).first);
+        }
+    }
+}
+
+bool RecipientList::canonicalMatches(const QList<Recipient> &a, const QList<Recipient> &b)
+{
+    // Built for each comparison, so that lists can be shared between threads
+    Canonical canonicalA, canonicalB;
+    makeCanonical(a, canonicalA);
+    makeCanonical(b, canonicalB);
+    return canonicalMatches(canonicalA, canonicalB);
+}
+
+bool RecipientList::canonicalMatches(const Canonical &a, const Canonical &b)
+{
+    const int size = a.recipients.size();
+    if (b.recipients.size() != size)
+        return false;
+
+    int i = 0;
+    while (i < size) {
+        const quint64 key = a.keys.at(i);
+        if (b.keys.at(i) != key)
             return false;
+
+        int end = i + 1;
+        while (end < size && a.keys.at(end) == key)
+            ++end;
+        if (end < size && b.keys.at(end) == key)
+            return false;
+        if (b.keys.at(end - 1) != key)
+            return false;
+
+        if (end - i == 1) {
+            if (!a.recipients.at(i).matches(b.recipients.at(i)))
+                return false;
+        } else {
+            // Recipients with colliding keys are paired by testing each
+            QList<Recipient> others(b.recipients.mid(i, end - i));
+            for (int j = i; j < end; ++j) {
+                QList<Recipient>::iterator it = others.begin(), otherEnd = others.end();
+                for ( ; it != otherEnd; ++it) {
+                    if (a.recipients.at(j).matches(*it)) {
+                        others.erase(it);
+                        break;
+                    }
+                }
+                if (it == otherEnd)
+                    return false;
+            }
+        }
+
+        i = end;
     }
 
     return true;
 }
 
+bool RecipientList::matches(const RecipientList &o) const
+{
+    if (m_recipients.size() == 1 && o.m_recipients.size() == 1)
+        return m_recipients.first().matches(o.m_recipients.first());
+
+    return canonicalMatches(m_recipients, o.m_recipients);
+}
+
 bool RecipientList::hasSameContacts(const RecipientList &o) const
 {
     if (m_recipients.size() == 1 && o.m_recipients.size() == 1)
         return m_recipients.first().isSameContact(o.m_recipients.first());
 
+    if (allContactsResolved() && o.allContactsResolved()) {
+        // Resolved recipients with a contact are the same only if the contact is the same,
+        // and those without a contact are the same if their addresses match
+        QSet<int> myContacts, otherContacts;
+        QList<Recipient> myAddresses, otherAddresses;
+        foreach (const Recipient &r, m_recipients) {
+            if (r.contactId())
+                myContacts.insert(r.contactId());
+            else
+                myAddresses.append(r);
+        }
+        foreach (const Recipient &r, o.m_recipients) {
+            if (r.contactId())
+                otherContacts.insert(r.contactId());
+            else
+                otherAddresses.append(r);
+        }
+
+        if (myContacts != otherContacts)
+            return false;
+        if (myAddresses.isEmpty() && otherAddresses.isEmpty())
+            return true;
+        return canonicalMatches(myAddresses, otherAddresses);
+    }
+
     QList<Recipient> myRecipients(removeSameContacts(m_recipients));
     QList<Recipient> otherRecipients(removeSameContacts(o.m_recipients));
 
@@ -705,9 +989,42 @@ void RecipientList::append(const QList<Recipient> &o)
 
 RecipientList &RecipientList::unite(const RecipientList &other)
 {
+    if (m_recipients.size() + other.m_recipients.size() <= uniteScanLimit) {
+        foreach (const Recipient &r, other.m_recipients) {
+            if (constFind(r) == constEnd()) {
+                append(r);
+            }
+        }
+        return *this;
+    }
+
+    // Index the recipients as isSameContact() compares them: by contact, or by address
+    QSet<int> contacts;
+    QMultiHash<quint64, Recipient> addresses;
+    foreach (const Recipient &r, m_recipients) {
+        if (r.contactId())
+            contacts.insert(r.contactId());
+        addresses.insert(r.matchKey(), r);
+    }
+
     foreach (const Recipient &r, other.m_recipients) {
-        if (constFind(r) == constEnd()) {
+        bool found = r.contactId() && contacts.contains(r.contactId());
+        if (!found) {
+            const quint64 key = r.matchKey();
+            QMultiHash<quint64, Recipient>::const_iterator it = addresses.constFind(key), end = addresses.constEnd();
+            for ( ; !found && it != end && it.key() == key; ++it) {
+                // Resolved recipients with a contact are only compared by contact
+                if (r.isContactResolved() && it->isContactResolved() && (r.contactId() || it->contactId()))
+                    continue;
+                found = it->matches(r);
+            }
+        }
+
+        if (!found) {
             append(r);
+            if (r.contactId())
+                contacts.insert(r.contactId());
+            addresses.insert(r.matchKey(), r);
         }
     }
     return *this;
@@ -715,8 +1032,9 @@ RecipientList &RecipientList::unite(const RecipientList &other)
 
 RecipientList &RecipientList::operator<<(const Recipient &recipient)
 {
-    if (!m_recipients.contains(recipient))
+    if (!m_recipients.contains(recipient)) {
         m_recipients.append(recipient);
+    }
     return *this;
 }
 
@@ -57,6 +57,9 @@ typedef QWeakPointer<RecipientPrivate> WeakRecipient;
  *
  * Instances may be equal without being exactly identical, e.g. when using
  * minimized phone number comparisons. In that case, they may not be shared.
+ *
+ * Recipients may be created and compared from any thread. Contact resolution
+ * is only updated from the thread running the contact resolver.
  */
 class LIBCOMMHISTORY_EXPORT Recipient
 {
@@ -113,6 +116,13 @@ public:
      */
     bool setResolved(SeasideCache::CacheItem *item) const;
 
+    /* Update the resolved contact, for a contact that may not be loaded yet
+     *
+     * This is used to restore an earlier resolution of the recipient. Until
+     * the contact is loaded, statusFlags are used by matchesAddressFlags().
+     */
+    bool setResolved(SeasideCache::CacheItem *item, quint64 statusFlags) const;
+
     /* Removes the resolved contact from this recipient
      *
      * Generally, this is only called by the contact listener.
@@ -138,6 +148,14 @@ public:
      */
     static QList<Recipient> recipientsForContact(int contactId);
 
+    /* Get existing recipients resolved to no contact that may match a phone number
+     *
+     * Only recipients with the same minimized number are returned, so this is
+     * much cheaper than testing every recipientsForContact(0) result. The
+     * candidates must still be tested with matchesPhoneNumber().
+     */
+    static QList<Recipient> unmatchedRecipientsForPhoneNumber(const PhoneNumberMatchDetails &phoneNumber);
+
     /* Return the string in the form suitable for testing phone number matches
      */
     static PhoneNumberMatchDetails phoneNumberMatchDetails(const QString &s);
@@ -147,11 +165,21 @@ public:
     PhoneNumberMatchDetails toPhoneNumberMatchDetails() const;
 
 private:
+    /* Recipients can only match if their match keys are equal */
+    quint64 matchKey() const;
+
     QSharedPointer<RecipientPrivate> d;
 
+    friend class RecipientList;
     friend uint qHash(const CommHistory::Recipient &value, uint seed);
 };
 
+/* A list of recipients, as used for the participants of an event or group
+ *
+ * Comparisons between lists use a canonical form of each list, where matching
+ * recipients are removed and the remainder are ordered by address hash, so
+ * that the forms are compared with a linear merge.
+ */
 class LIBCOMMHISTORY_EXPORT RecipientList
 {
 public:
@@ -251,7 +279,12 @@ public:
     RecipientList &operator<<(const Recipient &recipient);
 
 private:
+    struct Canonical;
+
     static RecipientList fromCacheItem(const SeasideCache::CacheItem *item);
+    static void makeCanonical(const QList<Recipient> &recipients, Canonical &canonical);
+    static bool canonicalMatches(const QList<Recipient> &a, const QList<Recipient> &b);
+    static bool canonicalMatches(const Canonical &a, const Canonical &b);
 
     QList<Recipient> m_recipients;
 };
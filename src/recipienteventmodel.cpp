@@ -24,6 +24,7 @@
 #include "recipienteventmodel.h"
 
 #include "databaseio_p.h"
+#include "databasemigration_p.h"
 #include "eventmodel_p.h"
 #include "recipienteventmodel_p.h"
 
@@ -70,29 +71,49 @@ bool RecipientEventModelPrivate::fillModel(int start, int end, QList<CommHistory
 void RecipientEventModelPrivate::fetchEvents()
 {
     if (!m_recipients.isEmpty()) {
-        // Get the events that match these addresses
+        // Get the events that match these addresses. Placeholders are named,
+        // as the clauses are repeated for the archive
         QStringList clauses;
-        QVariantList values;
+        QVariantMap values;
+        // Until migrated, older events are matched by a pattern on the address
+        const bool minimizedPending = DatabaseIOPrivate::instance()->migrationPending(MINIMIZED_REMOTE_UIDS_MIGRATION);
+        QString minimizedCondition("minimizedRemoteUid = :minimized%1");
+        if (minimizedPending) {
+            minimizedCondition = QString("(%1 OR (minimizedRemoteUid IS NULL AND %2 LIKE :pattern%3))")
+                    .arg(minimizedCondition, DatabaseIOPrivate::uidColumn(DatabaseIOPrivate::RemoteUids), "%1");
+        }
+        const QString phoneClause = QString("(%1 AND %2)").arg(minimizedCondition,
+                DatabaseIOPrivate::uidCondition(DatabaseIOPrivate::LocalUids, QString("LIKE '%1%%'").arg(RING_ACCOUNT)));
+        const QString uidClause = QString("(%1 AND %2)").arg(
+                DatabaseIOPrivate::uidCondition(DatabaseIOPrivate::RemoteUids, "= :remote%1"),
+                DatabaseIOPrivate::uidCondition(DatabaseIOPrivate::LocalUids, "= :local%1"));
         for (RecipientList::const_iterator it = m_recipients.constBegin();
             it != m_recipients.constEnd(); ++it) {
+            const QString index = QString::number(clauses.size());
             if (CommHistory::localUidComparesPhoneNumbers(it->localUid())) {
-                clauses.append(QString("(remoteUid LIKE ? AND localUid LIKE '%1%%')").arg(RING_ACCOUNT));
-                values.append(QString("%%%1%%").arg(minimizePhoneNumber(it->remoteUid())));
+                // Matching numbers share a minimized form, which is indexed with endTime
+                clauses.append(QString(phoneClause).replace("%1", index));
+                values.insert(":minimized" + index, it->minimizedRemoteUid());
+                if (minimizedPending)
+                    values.insert(":pattern" + index, QString("%%1%").arg(minimizePhoneNumber(it->remoteUid())));
             } else {
-                clauses.append("(remoteUid = ? AND localUid = ?)");
-                values.append(it->remoteUid());
-                values.append(it->localUid());
+                clauses.append(QString(uidClause).replace("%1", index));
+                values.insert(":remote" + index, it->remoteUid());
+                values.insert(":local" + index, it->localUid());
             }
         }
 
         QString where("WHERE ( ");
         where.append(clauses.join(" OR "));
-        where.append(" ) ORDER BY Events.endTime DESC, Events.id DESC");
+        where.append(" ) ");
 
-        QSqlQuery query = prepareQuery(DatabaseIOPrivate::eventQueryBase() + where);
+        // Archived events continue the main events in the same order
+        QSqlQuery query = prepareQuery(DatabaseIOPrivate::eventQueryBase() + where
+                                       + "UNION ALL " + DatabaseIOPrivate::archiveEventQueryBase() + where
+                                       + "ORDER BY Events.endTime DESC, Events.id DESC");
 
-        foreach (const QVariant &value, values)
-            query.addBindValue(value);
+        for (QVariantMap::const_iterator it = values.constBegin(); it != values.constEnd(); ++it)
+            query.bindValue(it.key(), it.value());
 
         executeQuery(query);
     } else {
@@ -0,0 +1,291 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jollamobile.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+#include "resolutioncache_p.h"
+
+#include <QCoreApplication>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QTimer>
+#include <QDebug>
+
+#include <seasidecache.h>
+
+#include "commonutils.h"
+#include "contactresolver.h"
+#include "databaseio.h"
+#include "databaseio_p.h"
+#include "debug.h"
+
+using namespace CommHistory;
+
+namespace {
+
+// Delay before writing changes, so that a set of resolutions are written together
+const int flushDelay = 1000;
+
+quint32 addressFlagValues(quint64 statusFlags)
+{
+    return statusFlags & (QContactStatusFlags::HasPhoneNumber | QContactStatusFlags::HasEmailAddress | QContactStatusFlags::HasOnlineAccount);
+}
+
+}
+
+Q_GLOBAL_STATIC(QWeakPointer<ResolutionCache>, resolutionCacheInstance);
+
+QSharedPointer<ResolutionCache> ResolutionCache::instance()
+{
+    QSharedPointer<ResolutionCache> result = resolutionCacheInstance->toStrongRef();
+    if (!result) {
+        result = QSharedPointer<ResolutionCache>(new ResolutionCache);
+        *resolutionCacheInstance = result.toWeakRef();
+    }
+
+    return result;
+}
+
+ResolutionCache::ResolutionCache()
+    : validator(0)
+    , loaded(false)
+    , flushScheduled(false)
+{
+    // Write while the database is still usable, rather than from the destructor
+    if (QCoreApplication *app = QCoreApplication::instance())
+        connect(app, SIGNAL(aboutToQuit()), SLOT(flush()));
+}
+
+ResolutionCache::~ResolutionCache()
+{
+}
+
+ResolutionCache::Key ResolutionCache::key(const Recipient &recipient)
+{
+    // Phone numbers match regardless of the account, as in Recipient
+    return qMakePair(recipient.isPhoneNumber() ? RING_ACCOUNT : recipient.localUid(),
+                     recipient.minimizedRemoteUid());
+}
+
+void ResolutionCache::load()
+{
+    if (loaded)
+        return;
+    loaded = true;
+
+    QSqlQuery query = DatabaseIOPrivate::prepareQuery(QStringLiteral(
+        "SELECT localUid, remoteUid, contactId, nameHash, addressFlags FROM ContactCache"));
+    if (!query.exec()) {
+        qWarning() << "Failed to execute query";
+        qWarning() << query.lastError();
+        qWarning() << query.lastQuery();
+        return;
+    }
+
+    while (query.next()) {
+        Entry entry;
+        entry.contactId = query.value(2).toInt();
+        entry.nameHash = query.value(3).toUInt();
+        entry.addressFlags = query.value(4).toUInt();
+        entries.insert(qMakePair(query.value(0).toString(), query.value(1).toString()), entry);
+    }
+
+    DEBUG() << "Loaded" << entries.count() << "stored contact resolutions";
+}
+
+bool ResolutionCache::resolve(const Recipient &recipient)
+{
+    load();
+
+    QHash<Key, Entry>::const_iterator it = entries.constFind(key(recipient));
+    if (it == entries.constEnd())
+        return false;
+
+    // Request the contact to be loaded, which also reports any changes to ContactListener
+    SeasideCache::CacheItem *item = 0;
+    if (it->contactId) {
+        item = SeasideCache::itemById(it->contactId, true);
+        if (!item)
+            return false;
+    }
+
+    recipient.setResolved(item, it->addressFlags);
+
+    // Resolve again in the background to confirm the stored result
+    if (!validator) {
+        validator = new ContactResolver(this);
+        validator->setForceResolving(true);
+        connect(validator, SIGNAL(finished()), SLOT(validated()));
+    }
+
+    if (!validating.contains(recipient)) {
+        validating.insert(recipient, it->contactId);
+        validator->add(recipient);
+    }
+    return true;
+}
+
+void ResolutionCache::validated()
+{
+    QList<Recipient> changedRecipients;
+
+    QHash<Recipient, int>::const_iterator it = validating.constBegin(), end = validating.constEnd();
+    for ( ; it != end; ++it) {
+        const Recipient &recipient(it.key());
+        if (recipient.contactId() != it.value()) {
+            DEBUG() << "Stored resolution for" << recipient << "changed from" << it.value() << "to" << recipient.contactId();
+            changedRecipients.append(recipient);
+        }
+        store(recipient);
+    }
+    validating.clear();
+
+    if (!changedRecipients.isEmpty())
+        emit changed(RecipientList(changedRecipients));
+}
+
+void ResolutionCache::store(const Recipient &recipient)
+{
+    if (!recipient.isContactResolved() || recipient.remoteUid().isEmpty())
+        return;
+
+    load();
+
+    const Key k(key(recipient));
+    QHash<Key, Entry>::iterator it = entries.find(k);
+
+    Entry entry;
+    entry.contactId = recipient.contactId();
+    entry.nameHash = 0;
+    entry.addressFlags = 0;
+
+    if (entry.contactId) {
+        SeasideCache::CacheItem *item = SeasideCache::existingItem(static_cast<quint32>(entry.contactId));
+        if (!item || item->contactState == SeasideCache::ContactAbsent) {
+            // The contact isn't loaded; keep what was stored for it
+            if (it != entries.end() && it->contactId == entry.contactId)
+                return;
+        } else {
+            entry.nameHash = qHash(item->displayLabel);
+            entry.addressFlags = addressFlagValues(item->statusFlags);
+        }
+    }
+
+    if (it != entries.end()) {
+        if (it->contactId == entry.contactId && it->nameHash == entry.nameHash && it->addressFlags == entry.addressFlags)
+            return;
+        *it = entry;
+    } else {
+        entries.insert(k, entry);
+    }
+
+    storedEntries.insert(k, entry);
+    removedEntries.remove(k);
+    scheduleFlush();
+}
+
+void ResolutionCache::remove(const Recipient &recipient)
+{
+    load();
+
+    const Key k(key(recipient));
+    if (entries.remove(k)) {
+        storedEntries.remove(k);
+        removedEntries.insert(k);
+        scheduleFlush();
+    }
+}
+
+void ResolutionCache::removeContact(int contactId)
+{
+    load();
+
+    for (QHash<Key, Entry>::iterator it = entries.begin(); it != entries.end(); ) {
+        if (it->contactId == contactId) {
+            storedEntries.remove(it.key());
+            removedEntries.insert(it.key());
+            it = entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    if (!removedEntries.isEmpty())
+        scheduleFlush();
+}
+
+void ResolutionCache::scheduleFlush()
+{
+    if (!flushScheduled) {
+        flushScheduled = true;
+        QTimer::singleShot(flushDelay, this, SLOT(flush()));
+    }
+}
+
+void ResolutionCache::flush()
+{
+    flushScheduled = false;
+
+    if (storedEntries.isEmpty() && removedEntries.isEmpty())
+        return;
+
+    DatabaseIO *database = DatabaseIO::instance();
+    if (!database->transaction())
+        return;
+
+    QSqlQuery removeQuery = DatabaseIOPrivate::prepareQuery(QStringLiteral(
+        "DELETE FROM ContactCache WHERE localUid = :localUid AND remoteUid = :remoteUid"));
+    foreach (const Key &k, removedEntries) {
+        removeQuery.bindValue(QStringLiteral(":localUid"), k.first);
+        removeQuery.bindValue(QStringLiteral(":remoteUid"), k.second);
+        if (!removeQuery.exec()) {
+            qWarning() << "Failed to execute query";
+            qWarning() << removeQuery.lastError();
+            qWarning() << removeQuery.lastQuery();
+            database->rollback();
+            return;
+        }
+    }
+
+    QSqlQuery storeQuery = DatabaseIOPrivate::prepareQuery(QStringLiteral(
+        "INSERT OR REPLACE INTO ContactCache (localUid, remoteUid, contactId, nameHash, addressFlags) "
+        "VALUES (:localUid, :remoteUid, :contactId, :nameHash, :addressFlags)"));
+    QHash<Key, Entry>::const_iterator it = storedEntries.constBegin(), end = storedEntries.constEnd();
+    for ( ; it != end; ++it) {
+        storeQuery.bindValue(QStringLiteral(":localUid"), it.key().first);
+        storeQuery.bindValue(QStringLiteral(":remoteUid"), it.key().second);
+        storeQuery.bindValue(QStringLiteral(":contactId"), it->contactId);
+        storeQuery.bindValue(QStringLiteral(":nameHash"), it->nameHash);
+        storeQuery.bindValue(QStringLiteral(":addressFlags"), it->addressFlags);
+        if (!storeQuery.exec()) {
+            qWarning() << "Failed to execute query";
+            qWarning() << storeQuery.lastError();
+            qWarning() << storeQuery.lastQuery();
+            database->rollback();
+            return;
+        }
+    }
+
+    if (!database->commit())
+        return;
+
+    storedEntries.clear();
+    removedEntries.clear();
+}
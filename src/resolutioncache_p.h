@@ -0,0 +1,109 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jollamobile.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+#ifndef COMMHISTORY_RESOLUTIONCACHE_P_H
+#define COMMHISTORY_RESOLUTIONCACHE_P_H
+
+#include <QObject>
+#include <QHash>
+#include <QPair>
+#include <QSet>
+#include <QSharedPointer>
+
+#include "recipient.h"
+
+namespace CommHistory {
+
+class ContactResolver;
+
+/* Stores the results of contact resolution in the database
+ *
+ * When a recipient has been resolved before, it is resolved immediately from
+ * the stored result, without waiting for a contact lookup. The contact is
+ * loaded in the background, and the recipient is resolved again to validate
+ * the stored result. Recipients which now resolve differently are reported
+ * with changed().
+ *
+ * Stored results are replaced whenever a recipient is resolved again, and
+ * removed when ContactListener finds that a recipient no longer matches its
+ * contact or the contact is removed.
+ *
+ * Changes are written shortly after they are made, and when the application
+ * is about to quit. Changes not yet written when the last user releases the
+ * cache are discarded; those recipients are looked up again next time.
+ */
+class ResolutionCache : public QObject
+{
+    Q_OBJECT
+
+public:
+    static QSharedPointer<ResolutionCache> instance();
+    ~ResolutionCache();
+
+    /* Resolve a recipient from its stored result
+     *
+     * Returns false if there is no stored result for the recipient.
+     */
+    bool resolve(const Recipient &recipient);
+
+    /* Store the current resolution of a recipient */
+    void store(const Recipient &recipient);
+
+    void remove(const Recipient &recipient);
+    void removeContact(int contactId);
+
+public slots:
+    /* Write pending changes to the database */
+    void flush();
+
+signals:
+    void changed(const RecipientList &recipients);
+
+private slots:
+    void validated();
+
+private:
+    struct Entry {
+        int contactId;
+        quint32 nameHash;
+        quint32 addressFlags;
+    };
+    typedef QPair<QString, QString> Key;
+
+    ResolutionCache();
+
+    static Key key(const Recipient &recipient);
+    void load();
+    void scheduleFlush();
+
+    QHash<Key, Entry> entries;
+    QHash<Key, Entry> storedEntries;
+    QSet<Key> removedEntries;
+    ContactResolver *validator;
+    QHash<Recipient, int> validating;
+    bool loaded;
+    bool flushScheduled;
+};
+
+}
+
+#endif
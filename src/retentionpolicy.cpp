@@ -0,0 +1,673 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jollamobile.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+
+#include "retentionpolicy_p.h"
+#include "databaseio.h"
+#include "databaseio_p.h"
+#include "commhistorydatabase.h"
+#include "databasemigration_p.h"
+#include "updatesemitter.h"
+#include "constants.h"
+
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QTimer>
+#include <QtDBus/QtDBus>
+
+#include <algorithm>
+
+#include "debug.h"
+
+using namespace CommHistory;
+
+namespace {
+
+// Events deleted between checks of the database size
+const int sizeCheckInterval = 1000;
+
+// Delay between steps while the history stays idle
+const int stepInterval = 500;
+
+const int defaultIdleInterval = 30 * 1000;
+
+}
+
+RetentionPolicyPrivate::RetentionPolicyPrivate(RetentionPolicy *parent)
+    : QObject(parent)
+    , q(parent)
+    , maxEventsPerGroup(0)
+    , maxDatabaseSize(0)
+    , archiveAge(0)
+    , idleInterval(defaultIdleInterval)
+    , bgThread(0)
+    , timer(new QTimer(this))
+    , running(false)
+    , phase(DonePhase)
+    , deletedEvents(0)
+    , deletedGroups(0)
+    , archivedEvents(0)
+    , lastSize(-1)
+    , archiveBatchSize(DatabaseIOPrivate::initialBatchSize)
+    , emitter(UpdatesEmitter::instance())
+{
+    timer->setSingleShot(true);
+    connect(timer, SIGNAL(timeout()), SLOT(timeout()));
+
+    // Writes from any process postpone enforcement
+    QDBusConnection::sessionBus().connect(
+        QString(), QString(), COMM_HISTORY_SERVICE_NAME, EVENTS_ADDED_SIGNAL,
+        this, SLOT(eventsChanged()));
+    QDBusConnection::sessionBus().connect(
+        QString(), QString(), COMM_HISTORY_SERVICE_NAME, EVENTS_UPDATED_SIGNAL,
+        this, SLOT(eventsChanged()));
+}
+
+RetentionPolicyPrivate::~RetentionPolicyPrivate()
+{
+}
+
+void RetentionPolicyPrivate::eventsChanged()
+{
+    if (timer->isActive())
+        timer->start(idleInterval);
+}
+
+void RetentionPolicyPrivate::timeout()
+{
+    if (!running && !start()) {
+        finish(false);
+        return;
+    }
+
+    bool done = false;
+    if (!step(done))
+        finish(false);
+    else if (done)
+        finish(true);
+    else
+        timer->start(stepInterval);
+}
+
+bool RetentionPolicyPrivate::start()
+{
+    running = true;
+    deletedEvents = 0;
+    deletedGroups = 0;
+    archivedEvents = 0;
+    pendingGroups.clear();
+    lastSize = -1;
+    archiveBatchSize = DatabaseIOPrivate::initialBatchSize;
+
+    pendingCategories.clear();
+    for (QMap<int, int>::const_iterator it = maxAges.constBegin(); it != maxAges.constEnd(); ++it) {
+        if (it.value() > 0)
+            pendingCategories.append(it.key());
+    }
+
+    phase = AgePhase;
+
+    // Completes moves between the databases that were interrupted
+    DatabaseIOPrivate *io = DatabaseIOPrivate::instance();
+    if (CommHistoryDatabase::hasArchiveFile(io->connection())) {
+        DatabaseIO *database = DatabaseIO::instance();
+        if (!database->transaction())
+            return false;
+        if (!io->repairArchive()) {
+            database->rollback();
+            return false;
+        }
+        if (!database->commit())
+            return false;
+    }
+
+    return true;
+}
+
+bool RetentionPolicyPrivate::step(bool &done)
+{
+    // Moves on through the phases until one of them has changed something
+    bool changed = false;
+    while (!changed && phase != DonePhase) {
+        switch (phase) {
+        case AgePhase:
+            if (pendingCategories.isEmpty()) {
+                phase = GroupPhase;
+                if (maxEventsPerGroup > 0 && !findGroupsOverLimit(pendingGroups))
+                    return false;
+            } else if (!deleteAgedEvents(pendingCategories.takeFirst(), changed)) {
+                return false;
+            }
+            break;
+
+        case GroupPhase:
+            if (pendingGroups.isEmpty())
+                phase = SizePhase;
+            else if (!deleteGroupEvents(pendingGroups.takeFirst(), changed))
+                return false;
+            break;
+
+        case SizePhase:
+            if (maxDatabaseSize > 0) {
+                qint64 size = 0;
+                if (!usedDatabaseSize(size))
+                    return false;
+
+                // Stop if deleting no longer frees pages, rather than
+                // deleting every event for a limit that cannot be met
+                if (size > maxDatabaseSize && (lastSize < 0 || size < lastSize)) {
+                    lastSize = size;
+                    if (!deleteEarliestEvents(changed))
+                        return false;
+                }
+            }
+            if (!changed)
+                phase = ArchivePhase;
+            break;
+
+        case ArchivePhase: {
+            QList<int> eventIds;
+            if (archiveAge > 0 && !findArchivableEvents(eventIds, archiveBatchSize))
+                return false;
+            if (eventIds.isEmpty()) {
+                phase = DonePhase;
+            } else {
+                if (!archiveBatch(eventIds))
+                    return false;
+                changed = true;
+            }
+            break;
+        }
+
+        case DonePhase:
+            break;
+        }
+    }
+
+    done = (phase == DonePhase);
+    return true;
+}
+
+void RetentionPolicyPrivate::finish(bool successful)
+{
+    timer->stop();
+    running = false;
+    phase = DonePhase;
+    pendingCategories.clear();
+    pendingGroups.clear();
+
+    if (deletedEvents || deletedGroups)
+        DEBUG() << Q_FUNC_INFO << "Deleted" << deletedEvents << "events and" << deletedGroups << "groups";
+    if (archivedEvents)
+        DEBUG() << Q_FUNC_INFO << "Archived" << archivedEvents << "events";
+
+    emit q->finished(successful, deletedEvents, deletedGroups);
+}
+
+void RetentionPolicyPrivate::agedCondition(int category, QByteArray &condition, QVariantMap &values)
+{
+    const int days = maxAges.value(category);
+    const qint64 cutoff = QDateTime::currentDateTimeUtc().addDays(-days).toMSecsSinceEpoch() / 1000;
+
+    condition = "WHERE endTime < :cutoff AND isDraft = 0";
+    const QString categoryClause = DatabaseIOPrivate::categoryClause(category);
+    if (!categoryClause.isEmpty())
+        condition += " AND" + categoryClause.toLatin1();
+
+    values.clear();
+    values.insert(":cutoff", cutoff);
+}
+
+bool RetentionPolicyPrivate::deleteAgedEvents(int category, bool &deleted)
+{
+    QByteArray condition;
+    QVariantMap values;
+    agedCondition(category, condition, values);
+    return deleteMatching(condition, values, deleted);
+}
+
+bool RetentionPolicyPrivate::findGroupsOverLimit(QList<int> &groupIds)
+{
+    static const char *q = "SELECT groupId FROM ("
+                           " SELECT groupId FROM Events WHERE groupId IS NOT NULL AND isDraft = 0"
+                           " UNION ALL SELECT groupId FROM archive.Events WHERE groupId IS NOT NULL AND isDraft = 0"
+                           ") GROUP BY groupId HAVING COUNT(*) > :max";
+    QSqlQuery query = CommHistoryDatabase::prepare(q, DatabaseIOPrivate::instance()->connection());
+    query.bindValue(":max", maxEventsPerGroup);
+    if (!DatabaseIOPrivate::execQuery(query))
+        return false;
+
+    groupIds.clear();
+    while (query.next())
+        groupIds.append(query.value(0).toInt());
+    return true;
+}
+
+bool RetentionPolicyPrivate::groupCondition(int groupId, QByteArray &condition, QVariantMap &values)
+{
+    // The oldest event to keep, following the sorting indexes of both tables
+    static const char *q = "SELECT endTime, id FROM Events WHERE groupId = :groupId AND isDraft = 0 "
+                           "UNION ALL SELECT endTime, id FROM archive.Events WHERE groupId = :groupId AND isDraft = 0 "
+                           "ORDER BY endTime DESC, id DESC LIMIT 1 OFFSET :offset";
+    QSqlQuery query = CommHistoryDatabase::prepare(q, DatabaseIOPrivate::instance()->connection());
+    query.bindValue(":groupId", groupId);
+    query.bindValue(":offset", maxEventsPerGroup - 1);
+    if (!DatabaseIOPrivate::execQuery(query))
+        return false;
+
+    condition.clear();
+    values.clear();
+    if (!query.next())
+        return true;
+
+    condition = "WHERE groupId = :groupId AND isDraft = 0 "
+                "AND (endTime < :endTime OR (endTime = :endTime AND id < :id))";
+    values.insert(":groupId", groupId);
+    values.insert(":endTime", query.value(0));
+    values.insert(":id", query.value(1));
+    query.finish();
+    return true;
+}
+
+bool RetentionPolicyPrivate::deleteGroupEvents(int groupId, bool &deleted)
+{
+    QByteArray condition;
+    QVariantMap values;
+    if (!groupCondition(groupId, condition, values))
+        return false;
+    return condition.isEmpty() || deleteMatching(condition, values, deleted);
+}
+
+bool RetentionPolicyPrivate::findMatching(const QByteArray &condition, const QVariantMap &values, QMap<int, int> &events)
+{
+    QSqlQuery query = CommHistoryDatabase::prepare(
+            "SELECT id, groupId FROM Events " + condition + " UNION ALL SELECT id, groupId FROM archive.Events " + condition,
+            DatabaseIOPrivate::instance()->connection());
+    for (QVariantMap::const_iterator it = values.constBegin(); it != values.constEnd(); ++it)
+        query.bindValue(it.key(), it.value());
+    if (!DatabaseIOPrivate::execQuery(query))
+        return false;
+
+    // Events without a group have -1
+    while (query.next())
+        events.insert(query.value(0).toInt(), query.value(1).isNull() ? -1 : query.value(1).toInt());
+    return true;
+}
+
+bool RetentionPolicyPrivate::deleteEarliestEvents(bool &deleted)
+{
+    // Ids follow the order events were stored in, and need no sorting
+    static const char *q = "SELECT MAX(id) FROM (SELECT id FROM Events WHERE isDraft = 0 "
+                           "UNION ALL SELECT id FROM archive.Events WHERE isDraft = 0 "
+                           "ORDER BY id LIMIT :limit)";
+    QSqlQuery query = CommHistoryDatabase::prepare(q, DatabaseIOPrivate::instance()->connection());
+    query.bindValue(":limit", sizeCheckInterval);
+    if (!DatabaseIOPrivate::execQuery(query))
+        return false;
+
+    if (!query.next() || query.value(0).isNull())
+        return true;
+
+    QVariantMap values;
+    values.insert(":lastId", query.value(0));
+    query.finish();
+
+    return deleteMatching("WHERE isDraft = 0 AND id <= :lastId", values, deleted);
+}
+
+bool RetentionPolicyPrivate::deleteMatching(const QByteArray &condition, const QVariantMap &values, bool &deleted)
+{
+    DatabaseIOPrivate *io = DatabaseIOPrivate::instance();
+
+    // Groups of the events are updated, or deleted when they have no events left
+    QSqlQuery query = CommHistoryDatabase::prepare(
+            "SELECT groupId FROM Events " + condition + " AND groupId IS NOT NULL "
+            "UNION SELECT groupId FROM archive.Events " + condition + " AND groupId IS NOT NULL",
+            io->connection());
+    for (QVariantMap::const_iterator it = values.constBegin(); it != values.constEnd(); ++it)
+        query.bindValue(it.key(), it.value());
+    if (!DatabaseIOPrivate::execQuery(query))
+        return false;
+
+    QList<int> groupIds;
+    while (query.next())
+        groupIds.append(query.value(0).toInt());
+    query.finish();
+
+    qint64 sequence;
+    if (!io->changeLogPosition(sequence))
+        return false;
+
+    // Deleted in transactions bounded by the write lock time of DatabaseIO
+    QList<int> eventIds, emptyGroupIds;
+    bool ok = io->deleteEvents(condition, values, &eventIds)
+        && io->deleteArchivedEvents(condition, values, sequence, &eventIds);
+
+    if (ok && !eventIds.isEmpty() && !groupIds.isEmpty()) {
+        const QByteArray groupList = DatabaseIOPrivate::joinNumberList(groupIds);
+
+        // Groups that only have archived events left get the last of them back
+        ok = io->restoreGroupHeads("AND groupId IN (" + groupList + ")")
+            && io->deleteEmptyGroups("AND id IN (" + groupList + ")", &emptyGroupIds);
+    }
+
+    deleted = !eventIds.isEmpty();
+    deletedEvents += eventIds.size();
+    deletedGroups += emptyGroupIds.size();
+
+    // Events in committed batches are reported even when a later batch failed
+    foreach (int eventId, eventIds)
+        emit emitter->eventDeleted(eventId);
+
+    // Group summaries are read from their remaining events
+    if (deleted) {
+        foreach (int groupId, emptyGroupIds)
+            groupIds.removeOne(groupId);
+        if (!groupIds.isEmpty())
+            emit emitter->groupsUpdated(groupIds);
+    }
+    if (!emptyGroupIds.isEmpty())
+        emit emitter->groupsDeleted(emptyGroupIds);
+
+    if (deleted && bgThread)
+        DatabaseIO::instance()->collectMessageParts(bgThread);
+
+    return ok;
+}
+
+bool RetentionPolicyPrivate::usedDatabaseSize(qint64 &size)
+{
+    // Deleted rows go to free pages, which are reused but not returned
+    // until the database is vacuumed
+    static const char *pragmas[] = { "page_count", "freelist_count", "page_size" };
+    static const char *schemas[] = { "main", "archive" };
+
+    QSqlQuery query(DatabaseIOPrivate::instance()->connection());
+    size = 0;
+    for (int s = 0; s < 2; s++) {
+        qint64 values[3];
+        for (int i = 0; i < 3; i++) {
+            if (!query.exec(QString::fromLatin1("PRAGMA %1.%2").arg(QLatin1String(schemas[s])).arg(QLatin1String(pragmas[i])))
+                    || !query.next()) {
+                qWarning() << "Failed to execute query";
+                qWarning() << query.lastError();
+                qWarning() << query.lastQuery();
+                return false;
+            }
+            values[i] = query.value(0).toLongLong();
+            query.finish();
+        }
+
+        size += (values[0] - values[1]) * values[2];
+    }
+
+    return true;
+}
+
+bool RetentionPolicyPrivate::findArchivableEvents(QList<int> &eventIds, int limit)
+{
+    // Archiving is skipped rather than failing every run
+    if (!CommHistoryDatabase::hasArchiveFile(DatabaseIOPrivate::instance()->connection())) {
+        qWarning() << "Archive database is unavailable; not archiving events";
+        return true;
+    }
+
+    // Properties are only archived once they refer to their keys by id
+    if (DatabaseIOPrivate::instance()->migrationPending(PROPERTY_KEYS_MIGRATION))
+        return true;
+
+    const qint64 cutoff = QDateTime::currentDateTimeUtc().addDays(-archiveAge).toMSecsSinceEpoch() / 1000;
+
+    // The last event of each group stays, as do unread events, so that
+    // group summaries only need the main table
+    QString q = QStringLiteral("SELECT id FROM Events WHERE endTime < :cutoff "
+                               "AND isRead = 1 AND isDraft = 0 AND groupId IS NOT NULL AND")
+              + DatabaseIOPrivate::categoryClause(Event::ShortMessagingCategory | Event::MultimediaMessagingCategory
+                                                  | Event::InstantMessagingCategory)
+              + QStringLiteral(" AND id IS NOT (SELECT id FROM Events AS L WHERE L.groupId = Events.groupId "
+                               "ORDER BY L.endTime DESC, L.id DESC LIMIT 1)");
+    if (limit > 0)
+        q += QStringLiteral(" LIMIT %1").arg(limit);
+
+    QSqlQuery query = CommHistoryDatabase::prepare(q.toUtf8().constData(), DatabaseIOPrivate::instance()->connection());
+    query.bindValue(":cutoff", cutoff);
+    if (!DatabaseIOPrivate::execQuery(query))
+        return false;
+
+    while (query.next())
+        eventIds.append(query.value(0).toInt());
+    return true;
+}
+
+bool RetentionPolicyPrivate::archiveBatch(const QList<int> &eventIds)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    // Uses its own transactions
+    if (!DatabaseIOPrivate::instance()->archiveEvents(eventIds))
+        return false;
+
+    archivedEvents += eventIds.size();
+
+    // Batches follow the write lock time, as deletions do
+    const int maxLockTime = DatabaseIOPrivate::instance()->maxWriteLockTime;
+    archiveBatchSize = maxLockTime > 0 ? DatabaseIOPrivate::nextBatchSize(archiveBatchSize, timer.elapsed(), maxLockTime) : 0;
+    return true;
+}
+
+RetentionPolicy::RetentionPolicy(QObject *parent)
+    : QObject(parent)
+    , d(new RetentionPolicyPrivate(this))
+{
+}
+
+RetentionPolicy::~RetentionPolicy()
+{
+}
+
+void RetentionPolicy::setMaxAge(Event::EventCategory category, int days)
+{
+    if (days > 0)
+        d->maxAges.insert(category, days);
+    else
+        d->maxAges.remove(category);
+}
+
+int RetentionPolicy::maxAge(Event::EventCategory category) const
+{
+    return d->maxAges.value(category);
+}
+
+void RetentionPolicy::setMaxEventsPerGroup(int count)
+{
+    d->maxEventsPerGroup = qMax(0, count);
+}
+
+int RetentionPolicy::maxEventsPerGroup() const
+{
+    return d->maxEventsPerGroup;
+}
+
+void RetentionPolicy::setMaxDatabaseSize(qint64 bytes)
+{
+    d->maxDatabaseSize = qMax<qint64>(0, bytes);
+}
+
+qint64 RetentionPolicy::maxDatabaseSize() const
+{
+    return d->maxDatabaseSize;
+}
+
+void RetentionPolicy::setArchiveAge(int days)
+{
+    d->archiveAge = qMax(0, days);
+}
+
+int RetentionPolicy::archiveAge() const
+{
+    return d->archiveAge;
+}
+
+void RetentionPolicy::setIdleInterval(int milliseconds)
+{
+    d->idleInterval = qMax(0, milliseconds);
+}
+
+int RetentionPolicy::idleInterval() const
+{
+    return d->idleInterval;
+}
+
+void RetentionPolicy::setBackgroundThread(QThread *thread)
+{
+    d->bgThread = thread;
+}
+
+QThread *RetentionPolicy::backgroundThread() const
+{
+    return d->bgThread;
+}
+
+void RetentionPolicy::schedule()
+{
+    if (d->running || d->timer->isActive())
+        return;
+
+    d->timer->start(d->idleInterval);
+}
+
+bool RetentionPolicy::enforce()
+{
+    d->timer->stop();
+    if (!d->running && !d->start()) {
+        d->finish(false);
+        return false;
+    }
+
+    bool done = false;
+    while (!done) {
+        if (!d->step(done)) {
+            d->finish(false);
+            return false;
+        }
+    }
+
+    d->finish(true);
+    return true;
+}
+
+bool RetentionPolicy::dryRun(QList<int> &eventIds, QList<int> &groupIds)
+{
+    QMap<int, int> events;
+    QByteArray condition;
+    QVariantMap values;
+
+    // Matches the same events as the deletions would
+    for (QMap<int, int>::const_iterator it = d->maxAges.constBegin(); it != d->maxAges.constEnd(); ++it) {
+        d->agedCondition(it.key(), condition, values);
+        if (!d->findMatching(condition, values, events))
+            return false;
+    }
+
+    if (d->maxEventsPerGroup > 0) {
+        QList<int> overLimit;
+        if (!d->findGroupsOverLimit(overLimit))
+            return false;
+        foreach (int groupId, overLimit) {
+            if (!d->groupCondition(groupId, condition, values))
+                return false;
+            if (!condition.isEmpty() && !d->findMatching(condition, values, events))
+                return false;
+        }
+    }
+
+    QSqlDatabase &db(DatabaseIOPrivate::instance()->connection());
+    if (d->maxDatabaseSize > 0) {
+        qint64 size = 0;
+        if (!d->usedDatabaseSize(size))
+            return false;
+
+        QSqlQuery query(db);
+        if (!query.exec(QLatin1String("SELECT (SELECT COUNT(*) FROM Events) + (SELECT COUNT(*) FROM archive.Events)"))
+                || !query.next()) {
+            qWarning() << "Failed to execute query";
+            qWarning() << query.lastError();
+            qWarning() << query.lastQuery();
+            return false;
+        }
+        const qint64 count = query.value(0).toLongLong();
+        query.finish();
+
+        if (count > 0 && size > d->maxDatabaseSize) {
+            // Estimate the size after the other limits from the average event
+            const qint64 average = qMax<qint64>(size / count, 1);
+            const qint64 excess = size - events.size() * average - d->maxDatabaseSize;
+            qint64 needed = excess > 0 ? (excess + average - 1) / average : 0;
+
+            QMap<int, int> earliest;
+            if (needed > 0 && !d->findMatching("WHERE isDraft = 0", QVariantMap(), earliest))
+                return false;
+            for (QMap<int, int>::const_iterator it = earliest.constBegin(); it != earliest.constEnd() && needed > 0; ++it) {
+                if (!events.contains(it.key())) {
+                    events.insert(it.key(), it.value());
+                    needed--;
+                }
+            }
+        }
+    }
+
+    eventIds = events.keys();
+    groupIds.clear();
+
+    // Groups that would have none of their events left
+    QHash<int, int> deletedPerGroup;
+    foreach (int groupId, events.values()) {
+        if (groupId >= 0)
+            deletedPerGroup[groupId]++;
+    }
+
+    if (!deletedPerGroup.isEmpty()) {
+        const QByteArray groupList = DatabaseIOPrivate::joinNumberList(deletedPerGroup.keys());
+        QSqlQuery query = CommHistoryDatabase::prepare("SELECT groupId, COUNT(*) FROM ("
+                                                       " SELECT groupId FROM Events WHERE groupId IN (" + groupList + ")"
+                                                       " UNION ALL SELECT groupId FROM archive.Events WHERE groupId IN (" + groupList + ")"
+                                                       ") GROUP BY groupId", db);
+        if (!DatabaseIOPrivate::execQuery(query))
+            return false;
+
+        while (query.next()) {
+            if (query.value(1).toInt() == deletedPerGroup.value(query.value(0).toInt()))
+                groupIds.append(query.value(0).toInt());
+        }
+        std::sort(groupIds.begin(), groupIds.end());
+    }
+
+    return true;
+}
+
+bool RetentionPolicy::isRunning() const
+{
+    return d->running;
+}
@@ -0,0 +1,163 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jollamobile.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+
+#ifndef COMMHISTORY_RETENTIONPOLICY_H
+#define COMMHISTORY_RETENTIONPOLICY_H
+
+#include <QObject>
+#include <QList>
+
+#include "event.h"
+#include "libcommhistoryexport.h"
+
+class QThread;
+
+namespace CommHistory {
+
+class RetentionPolicyPrivate;
+
+/*!
+ * \class RetentionPolicy
+ *
+ * Limits the size of the history by deleting old events. An event is deleted
+ * when it is older than the maximum age of its category, when its group has
+ * more newer events than the maximum per group, or while the database is
+ * larger than the maximum size, in which case the earliest stored events go
+ * first. Drafts are never deleted.
+ *
+ * Limits are enforced in batches, each in its own transaction. Deletions are
+ * announced once per batch with eventDeleted(), and with groupsUpdated() and
+ * groupsDeleted() for the affected groups. Groups left without events are
+ * deleted.
+ *
+ * Once the limits are met, older messages can be moved to the archive
+ * database, which keeps the main database small. Archived events are still
+ * returned by the event models and by DatabaseIO, and are moved back when
+ * they are modified. The limits apply to archived events as well.
+ */
+class LIBCOMMHISTORY_EXPORT RetentionPolicy : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit RetentionPolicy(QObject *parent = 0);
+    ~RetentionPolicy();
+
+    /*!
+     * Set the maximum age of events in a category. Event::AnyCategory
+     * applies to events of all categories.
+     *
+     * \param category event category
+     * \param days maximum age, 0 (the default) to keep events of any age
+     */
+    void setMaxAge(Event::EventCategory category, int days);
+    int maxAge(Event::EventCategory category) const;
+
+    /*!
+     * Set the number of newest events kept in each group.
+     *
+     * \param count maximum events, 0 (the default) to keep all
+     */
+    void setMaxEventsPerGroup(int count);
+    int maxEventsPerGroup() const;
+
+    /*!
+     * Set the maximum size of the database and its archive, not counting
+     * free pages.
+     *
+     * \param bytes maximum size, 0 (the default) for no limit
+     */
+    void setMaxDatabaseSize(qint64 bytes);
+    qint64 maxDatabaseSize() const;
+
+    /*!
+     * Set the age after which messages are archived. The last event of a
+     * group and unread events are not archived, and neither are calls.
+     *
+     * \param days age of archived events, 0 (the default) to archive none
+     */
+    void setArchiveAge(int days);
+    int archiveAge() const;
+
+    /*!
+     * Set the time without added or updated events after which a scheduled
+     * enforcement starts. Changes during an enforcement also postpone the
+     * next batch by this long.
+     *
+     * \param milliseconds idle time, 30 seconds by default
+     */
+    void setIdleInterval(int milliseconds);
+    int idleInterval() const;
+
+    /*!
+     * Set the thread used to remove the message parts of deleted events, as
+     * in DatabaseIO::collectMessageParts(). Without a thread, the parts are
+     * removed by the next collection.
+     */
+    void setBackgroundThread(QThread *thread);
+    QThread *backgroundThread() const;
+
+    /*!
+     * Enforce the limits once the history has been idle. The event loop
+     * runs between batches. Does nothing if already scheduled or running.
+     */
+    void schedule();
+
+    /*!
+     * Enforce the limits now, returning when done.
+     *
+     * \return true if successful, otherwise false
+     */
+    bool enforce();
+
+    /*!
+     * Find the events and groups that enforcing the limits would delete,
+     * without deleting anything. For the size limit, the number of events
+     * is estimated from the average size of an event.
+     *
+     * \param eventIds result, events that would be deleted
+     * \param groupIds result, groups that would be left empty
+     * \return true if successful, otherwise false
+     */
+    bool dryRun(QList<int> &eventIds, QList<int> &groupIds);
+
+    bool isRunning() const;
+
+Q_SIGNALS:
+    /*!
+     * Emitted when enforcing the limits has finished.
+     *
+     * \param successful false if enforcing stopped because of an error
+     * \param deletedEvents number of events deleted
+     * \param deletedGroups number of empty groups deleted
+     */
+    void finished(bool successful, int deletedEvents, int deletedGroups);
+
+private:
+    friend class RetentionPolicyPrivate;
+    RetentionPolicyPrivate *d;
+};
+
+}
+
+#endif
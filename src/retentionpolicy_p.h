@@ -0,0 +1,108 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jollamobile.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+
+#ifndef COMMHISTORY_RETENTIONPOLICY_P_H
+#define COMMHISTORY_RETENTIONPOLICY_P_H
+
+#include "retentionpolicy.h"
+
+#include <QMap>
+#include <QVariantMap>
+#include <QSharedPointer>
+
+class QTimer;
+
+namespace CommHistory {
+
+class UpdatesEmitter;
+
+class RetentionPolicyPrivate : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit RetentionPolicyPrivate(RetentionPolicy *parent);
+    ~RetentionPolicyPrivate();
+
+    enum Phase {
+        AgePhase,
+        GroupPhase,
+        SizePhase,
+        ArchivePhase,
+        DonePhase
+    };
+
+    bool start();
+    bool step(bool &done);
+    void finish(bool successful);
+
+    /* Each deletion is split into transactions by DatabaseIO, and removes
+     * the groups left without events. deleted is set if any event matched. */
+    bool deleteAgedEvents(int category, bool &deleted);
+    bool deleteGroupEvents(int groupId, bool &deleted);
+    bool deleteEarliestEvents(bool &deleted);
+    bool deleteMatching(const QByteArray &condition, const QVariantMap &values, bool &deleted);
+    bool findGroupsOverLimit(QList<int> &groupIds);
+
+    /* Conditions on events in both tables, shared by the deletions and
+     * dryRun(). A group within its limit gets an empty condition. */
+    void agedCondition(int category, QByteArray &condition, QVariantMap &values);
+    bool groupCondition(int groupId, QByteArray &condition, QVariantMap &values);
+    /* Adds the (id, groupId) of matching events, with -1 for no group */
+    bool findMatching(const QByteArray &condition, const QVariantMap &values, QMap<int, int> &events);
+
+    bool findArchivableEvents(QList<int> &eventIds, int limit);
+    bool archiveBatch(const QList<int> &eventIds);
+    bool usedDatabaseSize(qint64 &size);
+
+public Q_SLOTS:
+    void eventsChanged();
+    void timeout();
+
+public:
+    RetentionPolicy *q;
+
+    QMap<int, int> maxAges;
+    int maxEventsPerGroup;
+    qint64 maxDatabaseSize;
+    int archiveAge;
+    int idleInterval;
+    QThread *bgThread;
+
+    QTimer *timer;
+    bool running;
+    Phase phase;
+    QList<int> pendingCategories;
+    QList<int> pendingGroups;
+    int deletedEvents;
+    int deletedGroups;
+    int archivedEvents;
+    qint64 lastSize;
+    int archiveBatchSize;
+
+    QSharedPointer<UpdatesEmitter> emitter;
+};
+
+}
+
+#endif
@@ -97,7 +97,8 @@ bool SingleEventModel::getEventById(int eventId)
     d->m_eventId = eventId;
 
     const QString where = QString::fromLatin1(" WHERE id = %1").arg(eventId);
-    QSqlQuery query = d->prepareQuery(DatabaseIOPrivate::eventQueryBase() + where);
+    QSqlQuery query = d->prepareQuery(DatabaseIOPrivate::eventQueryBase() + where + " UNION ALL "
+                                      + DatabaseIOPrivate::archiveEventQueryBase() + where);
 
     return d->executeQuery(query);
 }
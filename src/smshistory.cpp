@@ -47,7 +47,8 @@ QString buildEventsQuery(const QDateTime &startTime,
     QString group;
     static const QString groupTemplate = QStringLiteral(" GROUP BY strftime('%1', datetime(startTime, 'unixepoch'))");
 
-    QString q = "SELECT startTime, remoteUid from Events";
+    QString q = "SELECT startTime, " + CommHistory::DatabaseIOPrivate::uidColumn(CommHistory::DatabaseIOPrivate::RemoteUids)
+                + " from Events";
     if (!conditions.isEmpty()) {
         q += " WHERE " + conditions.join(" AND ");
     }
@@ -1,4 +1,5 @@
 HEADERS += commonutils.h \
+           commonutils_p.h \
            eventmodel.h \
            eventmodel_p.h \
            event.h \
@@ -41,7 +42,17 @@ HEADERS += commonutils.h \
            contactresolver.h \
            draftsmodel.h \
            draftsmodel_p.h \
-           recipient.h
+           recipient.h \
+           resolutioncache_p.h \
+           messagepartcollector_p.h \
+           retentionpolicy.h \
+           retentionpolicy_p.h \
+           databasemaintenance.h \
+           databasemaintenance_p.h \
+           databasemigration.h \
+           databasemigration_p.h \
+           databasebackup.h \
+           databasebackup_p.h
 
 SOURCES += commonutils.cpp \
            eventmodel.cpp \
@@ -72,4 +83,10 @@ SOURCES += commonutils.cpp \
            contactfetcher.cpp \
            contactresolver.cpp \
            draftsmodel.cpp \
-           recipient.cpp
+           recipient.cpp \
+           resolutioncache.cpp \
+           messagepartcollector.cpp \
+           retentionpolicy.cpp \
+           databasemaintenance.cpp \
+           databasemigration.cpp \
+           databasebackup.cpp
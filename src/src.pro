@@ -42,7 +42,9 @@ QT += dbus sql contacts
 QT -= gui
 
 TARGET = commhistory-qt5
-PKGCONFIG += qtcontacts-sqlite-qt5-extensions contactcache-qt5
+# DatabaseBackup calls sqlite3 on the handles of the Qt SQLite plugin, so the
+# plugin must use this library too; the versions are compared at runtime
+PKGCONFIG += qtcontacts-sqlite-qt5-extensions contactcache-qt5 sqlite3
 LIBS += -lphonenumber
 
 DEFINES += LIBCOMMHISTORY_SHARED
@@ -70,7 +72,11 @@ QT_LIKE_HEADERS += \
                    headers/Recipient \
                    headers/Events \
                    headers/Models \
-                   headers/DatabaseIO
+                   headers/DatabaseIO \
+                   headers/RetentionPolicy \
+                   headers/DatabaseMaintenance \
+                   headers/DatabaseMigration \
+                   headers/DatabaseBackup
 
 include(sources.pri)
 
@@ -23,9 +23,12 @@
 #include <QtTest/QtTest>
 #include <QDateTime>
 #include <QDBusConnection>
+#include <QSqlDatabase>
+#include <QSqlQuery>
 #include <cstdlib>
 #include "callmodelperftest.h"
 #include "callmodel.h"
+#include "commhistorydatabasepath.h"
 #include "common.h"
 
 using namespace CommHistory;
@@ -89,6 +92,54 @@ void CallModelPerfTest::getEvents()
 
     QDateTime startTime = QDateTime::currentDateTime();
 
+    createTestData(events, contacts, selected);
+    if (QTest::currentTestFailed())
+        return;
+
+    QList<int> times;
+
+    int iterations = 10;
+    #ifdef PERF_ITERATIONS
+    iterations = PERF_ITERATIONS;
+    #endif
+
+    char *iterVar = getenv("PERF_ITERATIONS");
+    if (iterVar) {
+        int iters = QString::fromLatin1(iterVar).toInt();
+        if (iters > 0) {
+            iterations = iters;
+        }
+    }
+
+    qDebug() << Q_FUNC_INFO << "- Fetching events." << iterations << "iterations";
+    for(int i = 0; i < iterations; i++) {
+
+        CallModel fetchModel;
+
+        fetchModel.setResolveContacts(resolve ? EventModel::ResolveImmediately : EventModel::DoNotResolve);
+        fetchModel.setFilter(CallModel::SortByContact);
+
+        QElapsedTimer time;
+        time.start();
+
+        bool result = fetchModel.getEvents();
+        QVERIFY(result);
+
+        if (!fetchModel.isReady())
+            waitForSignal(&fetchModel, SIGNAL(modelReady(bool)));
+
+        int elapsed = time.elapsed();
+        times << elapsed;
+        qDebug("Time elapsed: %d ms", elapsed);
+
+        QVERIFY(fetchModel.rowCount() > 0);
+    }
+
+    summarizeResults(metaObject()->className(), times, logFile, startTime.secsTo(QDateTime::currentDateTime()));
+}
+
+void CallModelPerfTest::createTestData(int events, int contacts, int selected)
+{
     cleanupTestGroups();
     cleanupTestEvents();
 
@@ -177,6 +228,33 @@ void CallModelPerfTest::getEvents()
     qDebug() << Q_FUNC_INFO << "- adding rest of the events ("
         << ei << "/" << events << ")";
     eventList.clear();
+}
+
+void CallModelPerfTest::startup_data()
+{
+    QTest::addColumn<int>("events");
+    QTest::addColumn<int>("contacts");
+    QTest::addColumn<bool>("stored");
+
+    QTest::newRow("1000 events, 300 contacts, not stored") << 1000 << 300 << false;
+    QTest::newRow("1000 events, 300 contacts, stored") << 1000 << 300 << true;
+}
+
+void CallModelPerfTest::startup()
+{
+    QFETCH(int, events);
+    QFETCH(int, contacts);
+    QFETCH(bool, stored);
+
+    QDateTime startTime = QDateTime::currentDateTime();
+
+    createTestData(events, contacts, contacts);
+    if (QTest::currentTestFailed())
+        return;
+
+    QSqlDatabase database = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), QStringLiteral("perf_callmodel"));
+    database.setDatabaseName(QDir(CommHistoryDatabasePath::databaseDir()).absoluteFilePath(CommHistoryDatabasePath::databaseFile()));
+    QVERIFY(database.open());
 
     QList<int> times;
 
@@ -185,28 +263,22 @@ void CallModelPerfTest::getEvents()
     iterations = PERF_ITERATIONS;
     #endif
 
-    char *iterVar = getenv("PERF_ITERATIONS");
-    if (iterVar) {
-        int iters = QString::fromLatin1(iterVar).toInt();
-        if (iters > 0) {
-            iterations = iters;
-        }
-    }
-
     qDebug() << Q_FUNC_INFO << "- Fetching events." << iterations << "iterations";
-    for(int i = 0; i < iterations; i++) {
+    for (int i = 0; i < iterations; i++) {
+        if (!stored) {
+            QSqlQuery query(database);
+            QVERIFY(query.exec(QStringLiteral("DELETE FROM ContactCache")));
+        }
 
+        // Recipients and stored resolutions are released when the model is destroyed
         CallModel fetchModel;
-
-        fetchModel.setResolveContacts(resolve ? EventModel::ResolveImmediately : EventModel::DoNotResolve);
+        fetchModel.setResolveContacts(EventModel::ResolveImmediately);
         fetchModel.setFilter(CallModel::SortByContact);
 
         QElapsedTimer time;
         time.start();
 
-        bool result = fetchModel.getEvents();
-        QVERIFY(result);
-
+        QVERIFY(fetchModel.getEvents());
         if (!fetchModel.isReady())
             waitForSignal(&fetchModel, SIGNAL(modelReady(bool)));
 
@@ -217,6 +289,10 @@ void CallModelPerfTest::getEvents()
         QVERIFY(fetchModel.rowCount() > 0);
     }
 
+    database.close();
+    database = QSqlDatabase();
+    QSqlDatabase::removeDatabase(QStringLiteral("perf_callmodel"));
+
     summarizeResults(metaObject()->className(), times, logFile, startTime.secsTo(QDateTime::currentDateTime()));
 }
 
@@ -36,9 +36,13 @@ private slots:
     void init();
     void getEvents_data();
     void getEvents();
+    void startup_data();
+    void startup();
     void cleanupTestCase();
 
 private:
+    void createTestData(int events, int contacts, int selected);
+
     QFile *logFile;
     QStringList remoteUids;
     QList<int> contactIndices;
@@ -26,6 +26,7 @@ include( ../performance_tests.pri )
 
 TARGET = perf_callmodel
 QT -= gui
+QT += sql
 SOURCES += callmodelperftest.cpp
 HEADERS += callmodelperftest.h
 
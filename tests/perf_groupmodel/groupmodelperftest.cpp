@@ -27,6 +27,9 @@
 #include <cstdlib>
 #include "groupmodelperftest.h"
 #include "groupmodel.h"
+#include "groupmanager.h"
+#include "contactgroupmodel.h"
+#include "databaseio.h"
 #include "common.h"
 
 using namespace CommHistory;
@@ -232,6 +235,175 @@ void GroupModelPerfTest::getGroups()
     summarizeResults(metaObject()->className(), times, logFile, startTime.secsTo(QDateTime::currentDateTime()));
 }
 
+void GroupModelPerfTest::addGroupsToContactGroupModel_data()
+{
+    QTest::addColumn<int>("existing");
+    QTest::addColumn<int>("added");
+
+    QTest::newRow("1000 groups added to 100 groups") << 100 << 1000;
+    QTest::newRow("1000 groups added to 1000 groups") << 1000 << 1000;
+    QTest::newRow("1000 groups added to 5000 groups") << 5000 << 1000;
+}
+
+void GroupModelPerfTest::addGroupsToContactGroupModel()
+{
+    QFETCH(int, existing);
+    QFETCH(int, added);
+
+    QDateTime startTime = QDateTime::currentDateTime();
+
+    cleanupTestGroups();
+    cleanupTestEvents();
+
+    qDebug() << Q_FUNC_INFO << "- Creating" << existing << "existing groups";
+
+    QList<Group> groupList;
+    for (int i = 0; i < existing; i++) {
+        Group grp;
+        grp.setLocalUid(RING_ACCOUNT);
+        grp.setRecipients(RecipientList::fromUids(RING_ACCOUNT, QStringList() << QString::number(10000000 + i)));
+        groupList << grp;
+    }
+
+    {
+        GroupManager addManager;
+        QVERIFY(addManager.addGroups(groupList));
+    }
+
+    QList<int> times;
+
+    int iterations = 10;
+    #ifdef PERF_ITERATIONS
+    iterations = PERF_ITERATIONS;
+    #endif
+
+    char *iterVar = getenv("PERF_ITERATIONS");
+    if (iterVar) {
+        int iters = QString::fromLatin1(iterVar).toInt();
+        if (iters > 0) {
+            iterations = iters;
+        }
+    }
+
+    qDebug() << Q_FUNC_INFO << "- Adding groups." << iterations << "iterations";
+    for (int i = 0; i < iterations; i++) {
+        GroupManager manager;
+        manager.setResolveContacts(GroupManager::DoNotResolve);
+        QVERIFY(manager.getGroups());
+        if (!manager.isReady())
+            waitForSignal(&manager, SIGNAL(modelReady(bool)));
+
+        ContactGroupModel model;
+        model.setManager(&manager);
+        int initialCount = model.rowCount();
+
+        // Every iteration adds new addresses, so none of them combine with existing items
+        QList<Group> newGroups;
+        for (int j = 0; j < added; j++) {
+            Group grp;
+            grp.setLocalUid(RING_ACCOUNT);
+            grp.setRecipients(RecipientList::fromUids(RING_ACCOUNT, QStringList() << QString::number(20000000 + i * added + j)));
+            newGroups << grp;
+        }
+
+        QElapsedTimer time;
+        time.start();
+        QVERIFY(manager.addGroups(newGroups));
+
+        int elapsed = time.elapsed();
+        times << elapsed;
+        qDebug("Time elapsed: %d ms", elapsed);
+
+        QCOMPARE(model.rowCount(), initialCount + added);
+    }
+
+    summarizeResults(metaObject()->className(), times, logFile, startTime.secsTo(QDateTime::currentDateTime()));
+}
+
+void GroupModelPerfTest::memberLookup_data()
+{
+    QTest::addColumn<int>("groups");
+    QTest::addColumn<bool>("indexed");
+
+    QTest::newRow("10000 groups, scanning remoteUids") << 10000 << false;
+    QTest::newRow("10000 groups, using GroupMembers") << 10000 << true;
+}
+
+void GroupModelPerfTest::memberLookup()
+{
+    QFETCH(int, groups);
+    QFETCH(bool, indexed);
+
+    QDateTime startTime = QDateTime::currentDateTime();
+
+    cleanupTestGroups();
+    cleanupTestEvents();
+
+    qDebug() << Q_FUNC_INFO << "- Creating" << groups << "groups";
+
+    // Every third group has three participants, the others have one
+    DatabaseIO *database = DatabaseIO::instance();
+    QVERIFY(database->transaction());
+    for (int i = 0; i < groups; i++) {
+        QStringList uids;
+        uids << QString::number(30000000 + i);
+        if (i % 3 == 0)
+            uids << QString::number(40000000 + i) << QString::number(50000000 + i);
+
+        Group grp;
+        grp.setLocalUid(RING_ACCOUNT);
+        grp.setRecipients(RecipientList::fromUids(RING_ACCOUNT, uids));
+        QVERIFY(database->addGroup(grp));
+    }
+    QVERIFY(database->commit());
+
+    QList<int> times;
+
+    int iterations = 10;
+    #ifdef PERF_ITERATIONS
+    iterations = PERF_ITERATIONS;
+    #endif
+
+    char *iterVar = getenv("PERF_ITERATIONS");
+    if (iterVar) {
+        int iters = QString::fromLatin1(iterVar).toInt();
+        if (iters > 0) {
+            iterations = iters;
+        }
+    }
+
+    qDebug() << Q_FUNC_INFO << "- Looking up groups by member." << iterations << "iterations";
+    for (int i = 0; i < iterations; i++) {
+        // A participant that is not the first of its group
+        const int index = (qrand() % ((groups + 2) / 3)) * 3;
+        const QString remoteUid = QString::number(50000000 + index);
+
+        QElapsedTimer time;
+        time.start();
+
+        QList<Group> results;
+        if (indexed) {
+            QVERIFY(database->getGroupsByMember(RING_ACCOUNT, remoteUid, results));
+        } else {
+            QList<Group> all;
+            QVERIFY(database->getGroups(RING_ACCOUNT, QString(), all));
+            foreach (const Group &g, all) {
+                if (g.recipients().matchesRemoteUid(remoteUid))
+                    results.append(g);
+            }
+        }
+
+        int elapsed = time.elapsed();
+        times << elapsed;
+        qDebug("Time elapsed: %d ms", elapsed);
+
+        QCOMPARE(results.size(), 1);
+        QCOMPARE(results.first().recipients().size(), 3);
+    }
+
+    summarizeResults(metaObject()->className(), times, logFile, startTime.secsTo(QDateTime::currentDateTime()));
+}
+
 void GroupModelPerfTest::cleanupTestCase()
 {
     if(logFile) {
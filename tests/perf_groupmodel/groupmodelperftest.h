@@ -36,6 +36,10 @@ private slots:
     void init();
     void getGroups_data();
     void getGroups();
+    void addGroupsToContactGroupModel_data();
+    void addGroupsToContactGroupModel();
+    void memberLookup_data();
+    void memberLookup();
     void cleanupTestCase();
 
 private:
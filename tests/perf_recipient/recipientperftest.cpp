@@ -0,0 +1,386 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jolla.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+#include <QtTest/QtTest>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QThread>
+#include <cstdlib>
+#include <qtcontacts-extensions.h>
+#include <qtcontacts-extensions_impl.h>
+#include "recipientperftest.h"
+#include "recipient.h"
+#include "commonutils.h"
+#include "commonutils_p.h"
+#include "common.h"
+
+using namespace CommHistory;
+
+namespace {
+
+const char *countryCodes[] = { "358", "44", "49", "1", "33", "7" };
+const int countryCodeCount = sizeof(countryCodes) / sizeof(countryCodes[0]);
+
+// Return the same international number formatted in different ways
+QStringList numberVariants(int index)
+{
+    const QString countryCode(QString::fromLatin1(countryCodes[index % countryCodeCount]));
+    const QString subscriber(QString::number(401000000 + index * 37));
+
+    return QStringList()
+        << QString::fromLatin1("+%1%2").arg(countryCode).arg(subscriber)
+        << QString::fromLatin1("+%1 %2 %3 %4").arg(countryCode).arg(subscriber.left(2)).arg(subscriber.mid(2, 3)).arg(subscriber.mid(5))
+        << QString::fromLatin1("+%1 (%2) %3-%4").arg(countryCode).arg(subscriber.left(2)).arg(subscriber.mid(2, 3)).arg(subscriber.mid(5))
+        << QString::fromLatin1("+%1-%2-%3").arg(countryCode).arg(subscriber.left(5)).arg(subscriber.mid(5));
+}
+
+// Looks up recipients for the same set of addresses as the other threads
+class InterningThread : public QThread
+{
+public:
+    InterningThread(const QStringList &numbers, int rounds)
+        : numbers(numbers)
+        , rounds(rounds)
+    {
+    }
+
+    QStringList numbers;
+    int rounds;
+
+protected:
+    void run()
+    {
+        // Keep one set alive, so that most lookups find an existing instance
+        QList<Recipient> held;
+        foreach (const QString &number, numbers)
+            held << Recipient(RING_ACCOUNT, number);
+
+        for (int round = 0; round < rounds; round++) {
+            foreach (const QString &number, numbers)
+                Recipient(RING_ACCOUNT, number);
+        }
+    }
+};
+
+}
+
+void RecipientPerfTest::initTestCase()
+{
+    logFile = new QFile("libcommhistory-performance-test.log");
+    if(!logFile->open(QIODevice::Append)) {
+        qDebug() << "!!!! Failed to open log file !!!!";
+        logFile = 0;
+    }
+}
+
+void RecipientPerfTest::matches_data()
+{
+    QTest::addColumn<int>("numbers");
+    QTest::addColumn<int>("rounds");
+
+    QTest::newRow("100 numbers, 10 rounds") << 100 << 10;
+    QTest::newRow("100 numbers, 100 rounds") << 100 << 100;
+    QTest::newRow("1000 numbers, 10 rounds") << 1000 << 10;
+    QTest::newRow("1000 numbers, 100 rounds") << 1000 << 100;
+}
+
+void RecipientPerfTest::matches()
+{
+    QFETCH(int, numbers);
+    QFETCH(int, rounds);
+
+    QDateTime startTime = QDateTime::currentDateTime();
+
+    // Recipients of the same minimized number share their data, so the full
+    // comparison is reached when matching against other forms of the number
+    QList<Recipient> recipients;
+    QList<QList<Recipient::PhoneNumberMatchDetails> > variants;
+    for (int i = 0; i < numbers; i++) {
+        const QStringList forms(numberVariants(i));
+        recipients << Recipient(RING_ACCOUNT, forms.first());
+
+        QList<Recipient::PhoneNumberMatchDetails> details;
+        foreach (const QString &number, forms)
+            details << Recipient::phoneNumberMatchDetails(number);
+        variants << details;
+    }
+
+    QList<int> times;
+
+    int iterations = 10;
+    #ifdef PERF_ITERATIONS
+    iterations = PERF_ITERATIONS;
+    #endif
+
+    char *iterVar = getenv("PERF_ITERATIONS");
+    if (iterVar) {
+        int iters = QString::fromLatin1(iterVar).toInt();
+        if (iters > 0) {
+            iterations = iters;
+        }
+    }
+
+    qDebug() << Q_FUNC_INFO << "- Matching" << numbers << "numbers." << iterations << "iterations";
+    for (int i = 0; i < iterations; i++) {
+        int matched = 0;
+        int compared = 0;
+
+        QElapsedTimer time;
+        time.start();
+
+        for (int round = 0; round < rounds; round++) {
+            for (int n = 0; n < numbers; n++) {
+                const Recipient &recipient(recipients.at(n));
+                const Recipient &other(recipients.at((n + 1) % numbers));
+
+                // Every form of a number should match, but not those of another number
+                foreach (const Recipient::PhoneNumberMatchDetails &details, variants.at(n)) {
+                    if (recipient.matchesPhoneNumber(details))
+                        ++matched;
+                    if (other.matchesPhoneNumber(details))
+                        --matched;
+                    compared += 2;
+                }
+
+                if (recipient.matches(Recipient(RING_ACCOUNT, variants.at(n).last().number)))
+                    ++matched;
+                if (recipient.matches(other))
+                    --matched;
+                compared += 2;
+            }
+        }
+
+        int elapsed = time.elapsed();
+        times << elapsed;
+        qDebug("Time elapsed: %d ms, %d comparisons", elapsed, compared);
+
+        QCOMPARE(matched, rounds * numbers * 5);
+    }
+
+    summarizeResults(metaObject()->className(), times, logFile, startTime.secsTo(QDateTime::currentDateTime()));
+}
+
+void RecipientPerfTest::intern_data()
+{
+    QTest::addColumn<int>("threads");
+    QTest::addColumn<int>("numbers");
+    QTest::addColumn<int>("rounds");
+
+    QTest::newRow("1 thread, 1000 numbers, 100 rounds") << 1 << 1000 << 100;
+    QTest::newRow("4 threads, 1000 numbers, 100 rounds") << 4 << 1000 << 100;
+    QTest::newRow("8 threads, 1000 numbers, 100 rounds") << 8 << 1000 << 100;
+}
+
+void RecipientPerfTest::intern()
+{
+    QFETCH(int, threads);
+    QFETCH(int, numbers);
+    QFETCH(int, rounds);
+
+    QDateTime startTime = QDateTime::currentDateTime();
+
+    QStringList remoteUids;
+    for (int i = 0; i < numbers; i++)
+        remoteUids << numberVariants(i).first();
+
+    QList<int> times;
+
+    int iterations = 10;
+    #ifdef PERF_ITERATIONS
+    iterations = PERF_ITERATIONS;
+    #endif
+
+    char *iterVar = getenv("PERF_ITERATIONS");
+    if (iterVar) {
+        int iters = QString::fromLatin1(iterVar).toInt();
+        if (iters > 0) {
+            iterations = iters;
+        }
+    }
+
+    qDebug() << Q_FUNC_INFO << "- Interning" << numbers << "numbers in" << threads << "threads." << iterations << "iterations";
+    for (int i = 0; i < iterations; i++) {
+        QList<InterningThread *> workers;
+        for (int t = 0; t < threads; t++)
+            workers << new InterningThread(remoteUids, rounds);
+
+        QElapsedTimer time;
+        time.start();
+
+        foreach (InterningThread *worker, workers)
+            worker->start();
+        foreach (InterningThread *worker, workers)
+            worker->wait();
+
+        int elapsed = time.elapsed();
+        times << elapsed;
+        qDebug("Time elapsed: %d ms, %d lookups", elapsed, threads * numbers * (rounds + 1));
+
+        qDeleteAll(workers);
+    }
+
+    summarizeResults(metaObject()->className(), times, logFile, startTime.secsTo(QDateTime::currentDateTime()));
+}
+
+void RecipientPerfTest::listMatches_data()
+{
+    QTest::addColumn<int>("participants");
+    QTest::addColumn<int>("rounds");
+
+    QTest::newRow("10 participants, 1000 rounds") << 10 << 1000;
+    QTest::newRow("100 participants, 100 rounds") << 100 << 100;
+    QTest::newRow("500 participants, 100 rounds") << 500 << 100;
+}
+
+void RecipientPerfTest::listMatches()
+{
+    QFETCH(int, participants);
+    QFETCH(int, rounds);
+
+    QDateTime startTime = QDateTime::currentDateTime();
+
+    // A group's list is kept, while each event's list is created as it arrives
+    QList<Recipient> recipients;
+    for (int i = 0; i < participants; i++)
+        recipients << Recipient(RING_ACCOUNT, numberVariants(i).first());
+
+    const RecipientList group(recipients);
+    QList<Recipient> reordered;
+    for (int i = participants - 1; i >= 0; i--)
+        reordered << recipients.at(i);
+
+    QList<int> times;
+
+    int iterations = 10;
+    #ifdef PERF_ITERATIONS
+    iterations = PERF_ITERATIONS;
+    #endif
+
+    char *iterVar = getenv("PERF_ITERATIONS");
+    if (iterVar) {
+        int iters = QString::fromLatin1(iterVar).toInt();
+        if (iters > 0) {
+            iterations = iters;
+        }
+    }
+
+    qDebug() << Q_FUNC_INFO << "- Comparing lists of" << participants << "recipients." << iterations << "iterations";
+    for (int i = 0; i < iterations; i++) {
+        int matched = 0;
+
+        QElapsedTimer time;
+        time.start();
+
+        for (int round = 0; round < rounds; round++) {
+            const RecipientList event(reordered);
+            if (event.matches(group))
+                ++matched;
+            if (group.hasSameContacts(event))
+                ++matched;
+        }
+
+        int elapsed = time.elapsed();
+        times << elapsed;
+        qDebug("Time elapsed: %d ms", elapsed);
+
+        QCOMPARE(matched, rounds * 2);
+    }
+
+    summarizeResults(metaObject()->className(), times, logFile, startTime.secsTo(QDateTime::currentDateTime()));
+}
+
+void RecipientPerfTest::minimize_data()
+{
+    QTest::addColumn<bool>("reference");
+    QTest::addColumn<bool>("formatted");
+    QTest::addColumn<int>("rounds");
+
+    QTest::newRow("QtContactsSqliteExtensions, 100 rounds") << true << false << 100;
+    QTest::newRow("commhistory, 100 rounds") << false << false << 100;
+    QTest::newRow("QtContactsSqliteExtensions, formatted, 100 rounds") << true << true << 100;
+    QTest::newRow("commhistory, formatted, 100 rounds") << false << true << 100;
+}
+
+void RecipientPerfTest::minimize()
+{
+    QFETCH(bool, reference);
+    QFETCH(bool, formatted);
+    QFETCH(int, rounds);
+
+    QDateTime startTime = QDateTime::currentDateTime();
+
+    // Numbers as stored by the phone, or in a formatted form which takes the slow path
+    QStringList numbers;
+    for (int i = 0; i < 1000; i++)
+        numbers << numberVariants(i).at(formatted ? 1 : 0);
+
+    QList<int> times;
+
+    int iterations = 10;
+    #ifdef PERF_ITERATIONS
+    iterations = PERF_ITERATIONS;
+    #endif
+
+    char *iterVar = getenv("PERF_ITERATIONS");
+    if (iterVar) {
+        int iters = QString::fromLatin1(iterVar).toInt();
+        if (iters > 0) {
+            iterations = iters;
+        }
+    }
+
+    qDebug() << Q_FUNC_INFO << "- Minimizing" << numbers.count() << "numbers." << iterations << "iterations";
+    for (int i = 0; i < iterations; i++) {
+        int characters = 0;
+
+        QElapsedTimer time;
+        time.start();
+
+        for (int round = 0; round < rounds; round++) {
+            foreach (const QString &number, numbers) {
+                if (reference)
+                    characters += QtContactsSqliteExtensions::minimizePhoneNumber(number, QtContactsSqliteExtensions::DefaultMaximumPhoneNumberCharacters).length();
+                else
+                    characters += minimizePhoneNumber(number).length();
+            }
+        }
+
+        int elapsed = time.elapsed();
+        times << elapsed;
+        qDebug("Time elapsed: %d ms", elapsed);
+
+        QCOMPARE(characters, rounds * numbers.count() * phoneNumberMatchLength());
+    }
+
+    summarizeResults(metaObject()->className(), times, logFile, startTime.secsTo(QDateTime::currentDateTime()));
+}
+
+void RecipientPerfTest::cleanupTestCase()
+{
+    if(logFile) {
+        logFile->close();
+        delete logFile;
+        logFile = 0;
+    }
+}
+
+QTEST_MAIN(RecipientPerfTest)
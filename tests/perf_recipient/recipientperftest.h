@@ -0,0 +1,49 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jolla.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+#ifndef RECIPIENTPERFTEST_H
+#define RECIPIENTPERFTEST_H
+
+#include <QObject>
+#include <QFile>
+
+class RecipientPerfTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void matches_data();
+    void matches();
+    void intern_data();
+    void intern();
+    void listMatches_data();
+    void listMatches();
+    void minimize_data();
+    void minimize();
+    void cleanupTestCase();
+
+private:
+    QFile *logFile;
+};
+
+#endif
@@ -0,0 +1,236 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jolla.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+#include <QtTest/QtTest>
+#include <QDateTime>
+#include <cstdlib>
+#include "recipienteventmodelperftest.h"
+#include "recipienteventmodel.h"
+#include "callmodel.h"
+#include "databaseio.h"
+#include "common.h"
+#include "commhistorydatabasepath.h"
+
+#include <QSqlDatabase>
+#include <QSqlQuery>
+
+using namespace CommHistory;
+
+void RecipientEventModelPerfTest::initTestCase()
+{
+    initTestDatabase();
+
+    logFile = new QFile("libcommhistory-performance-test.log");
+    if(!logFile->open(QIODevice::Append)) {
+        qDebug() << "!!!! Failed to open log file !!!!";
+        logFile = 0;
+    }
+
+    qsrand( QDateTime::currentDateTime().toTime_t() );
+}
+
+void RecipientEventModelPerfTest::getEvents_data()
+{
+    QTest::addColumn<int>("events");
+    QTest::addColumn<int>("addresses");
+
+    QTest::newRow("10000 events, 1000 addresses") << 10000 << 1000;
+    QTest::newRow("100000 events, 1000 addresses") << 100000 << 1000;
+    QTest::newRow("1000000 events, 10000 addresses") << 1000000 << 10000;
+}
+
+void RecipientEventModelPerfTest::getEvents()
+{
+    QFETCH(int, events);
+    QFETCH(int, addresses);
+
+    QDateTime startTime = QDateTime::currentDateTime();
+
+    addEvents(events, addresses);
+    if (QTest::currentTestFailed())
+        return;
+
+    QList<int> times;
+    int iterations = perfIterations();
+
+    qDebug() << Q_FUNC_INFO << "- Fetching events." << iterations << "iterations";
+    for (int i = 0; i < iterations; i++) {
+        const QString remoteUid = QString::number(20000000 + qrand() % addresses);
+
+        RecipientEventModel fetchModel;
+        fetchModel.setResolveContacts(EventModel::DoNotResolve);
+        fetchModel.setRecipients(Recipient(RING_ACCOUNT, remoteUid));
+
+        QElapsedTimer time;
+        time.start();
+
+        QVERIFY(fetchModel.getEvents());
+        if (!fetchModel.isReady())
+            waitForSignal(&fetchModel, SIGNAL(modelReady(bool)));
+
+        int elapsed = time.elapsed();
+        times << elapsed;
+        qDebug("Time elapsed: %d ms", elapsed);
+
+        QCOMPARE(fetchModel.rowCount(), events / addresses);
+    }
+
+    summarizeResults(metaObject()->className(), times, logFile, startTime.secsTo(QDateTime::currentDateTime()));
+}
+
+void RecipientEventModelPerfTest::storage_data()
+{
+    QTest::addColumn<int>("events");
+    QTest::addColumn<int>("addresses");
+
+    QTest::newRow("10000 events, 1000 addresses") << 10000 << 1000;
+    QTest::newRow("100000 events, 1000 addresses") << 100000 << 1000;
+}
+
+void RecipientEventModelPerfTest::storage()
+{
+    QFETCH(int, events);
+    QFETCH(int, addresses);
+
+    QDateTime startTime = QDateTime::currentDateTime();
+
+    addEvents(events, addresses);
+    if (QTest::currentTestFailed())
+        return;
+
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), QStringLiteral("perf_recipienteventmodel"));
+        db.setDatabaseName(QDir(CommHistoryDatabasePath::databaseDir()).absoluteFilePath(CommHistoryDatabasePath::databaseFile()));
+        QVERIFY(db.open());
+
+        QSqlQuery query(db);
+        QVERIFY(query.exec(QStringLiteral("PRAGMA page_size")) && query.next());
+        const qint64 pageSize = query.value(0).toLongLong();
+        QVERIFY(query.exec(QStringLiteral("PRAGMA page_count")) && query.next());
+        const qint64 pageCount = query.value(0).toLongLong();
+        QVERIFY(query.exec(QStringLiteral("PRAGMA freelist_count")) && query.next());
+        const qint64 freePages = query.value(0).toLongLong();
+        query.finish();
+        db.close();
+
+        const qint64 used = (pageCount - freePages) * pageSize;
+        qDebug("Database size: %lld bytes, %lld bytes per event", used, used / events);
+        if (logFile) {
+            QTextStream out(logFile);
+            out << metaObject()->className() << " " << QTest::currentDataTag()
+                << ": database size " << used << " bytes, " << (used / events) << " bytes per event\n";
+        }
+    }
+    QSqlDatabase::removeDatabase(QStringLiteral("perf_recipienteventmodel"));
+
+    QList<int> times;
+    int iterations = perfIterations();
+
+    // Reading every event decodes the local and remote UID of each row
+    qDebug() << Q_FUNC_INFO << "- Reading all events." << iterations << "iterations";
+    for (int i = 0; i < iterations; i++) {
+        CallModel fetchModel;
+        fetchModel.setResolveContacts(EventModel::DoNotResolve);
+        fetchModel.setQueryMode(EventModel::SyncQuery);
+        fetchModel.setFilter(CallModel::SortByTime);
+
+        QElapsedTimer time;
+        time.start();
+
+        QVERIFY(fetchModel.getEvents());
+
+        int elapsed = time.elapsed();
+        times << elapsed;
+        qDebug("Time elapsed: %d ms", elapsed);
+
+        QCOMPARE(fetchModel.rowCount(), events);
+    }
+
+    summarizeResults(metaObject()->className(), times, logFile, startTime.secsTo(QDateTime::currentDateTime()));
+}
+
+void RecipientEventModelPerfTest::addEvents(int events, int addresses)
+{
+    cleanupTestGroups();
+    cleanupTestEvents();
+
+    int commitBatchSize = 10000;
+    #ifdef PERF_BATCH_SIZE
+    commitBatchSize = PERF_BATCH_SIZE;
+    #endif
+
+    qDebug() << Q_FUNC_INFO << "- Creating" << events << "new events";
+
+    // Calls are added directly, without the models, to make large tables feasible
+    DatabaseIO *database = DatabaseIO::instance();
+    QDateTime when = QDateTime::currentDateTime().addSecs(-events);
+    QVERIFY(database->transaction());
+    for (int ei = 0; ei < events; ei++) {
+        Event e;
+        e.setType(Event::CallEvent);
+        e.setDirection(qrand() % 2 ? Event::Outbound : Event::Inbound);
+        e.setStartTime(when.addSecs(ei));
+        e.setEndTime(when.addSecs(ei));
+        e.setLocalUid(RING_ACCOUNT);
+        e.setRecipients(Recipient(RING_ACCOUNT, QString::number(20000000 + ei % addresses)));
+        e.setIsMissedCall(false);
+        QVERIFY(database->addEvent(e));
+
+        if ((ei + 1) % commitBatchSize == 0) {
+            qDebug() << Q_FUNC_INFO << "- added" << (ei + 1) << "/" << events << "events";
+            QVERIFY(database->commit());
+            QVERIFY(database->transaction());
+        }
+    }
+    QVERIFY(database->commit());
+}
+
+int RecipientEventModelPerfTest::perfIterations() const
+{
+    int iterations = 10;
+    #ifdef PERF_ITERATIONS
+    iterations = PERF_ITERATIONS;
+    #endif
+
+    char *iterVar = getenv("PERF_ITERATIONS");
+    if (iterVar) {
+        int iters = QString::fromLatin1(iterVar).toInt();
+        if (iters > 0) {
+            iterations = iters;
+        }
+    }
+
+    return iterations;
+}
+
+void RecipientEventModelPerfTest::cleanupTestCase()
+{
+    if(logFile) {
+        logFile->close();
+        delete logFile;
+        logFile = 0;
+    }
+
+    deleteAll();
+}
+
+QTEST_MAIN(RecipientEventModelPerfTest)
@@ -28,6 +28,8 @@ SUBDIRS = \
     perf_callmodel \
     perf_conversationmodel \
     perf_groupmodel \
+    perf_recipient \
+    perf_recipienteventmodel \
     perf_recentcontactsmodel \
     profile_callmodel \
     profile_conversationmodel \
@@ -31,5 +31,12 @@ SUBDIRS = \
     ut_groupmodel \
     ut_recentcontactsmodel \
     ut_singleeventmodel \
-    ut_recipienteventmodel
+    ut_recipienteventmodel \
+    ut_retentionpolicy \
+    ut_databasemaintenance \
+    ut_databasemigration \
+    ut_databasebackup \
+    ut_recipient \
+    ut_contactresolver \
+    ut_commonutils
 
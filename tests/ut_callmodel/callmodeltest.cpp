@@ -22,11 +22,13 @@
 
 #include <QtTest/QtTest>
 #include <QDBusConnection>
+#include <QSqlQuery>
 #include "callmodeltest.h"
 #include "commonutils.h"
 #include "common.h"
 #include "modelwatcher.h"
 #include "databaseio.h"
+#include "databaseio_p.h"
 
 using namespace CommHistory;
 
@@ -881,6 +883,69 @@ void CallModelTest::deleteAllCalls()
     QCOMPARE(model.rowCount(), 0);
 }
 
+void CallModelTest::deleteAllCallsInBatches_data()
+{
+    QTest::addColumn<int>("maxWriteLockTime");
+
+    // Short enough that the deletion is split into many transactions
+    QTest::newRow("short lock time") << 1;
+    // Batches grow when they are fast, which must not end the deletion early
+    QTest::newRow("default lock time") << -1;
+}
+
+void CallModelTest::deleteAllCallsInBatches()
+{
+    QFETCH(int, maxWriteLockTime);
+
+    CallModel model;
+    watcher.setModel(&model);
+    model.setQueryMode(EventModel::SyncQuery);
+
+    const int total = 500;
+    QDateTime when = QDateTime::currentDateTime();
+    QList<Event> events;
+    for (int i = 0; i < total; i++) {
+        Event e;
+        e.setType(Event::CallEvent);
+        e.setDirection(i % 2 ? Event::Inbound : Event::Outbound);
+        e.setLocalUid(RING_ACCOUNT);
+        e.setRecipients(Recipient(RING_ACCOUNT, QString("+3581234%1").arg(i % 50)));
+        e.setStartTime(when.addSecs(i));
+        e.setEndTime(when.addSecs(i + 10));
+        events.append(e);
+    }
+    QVERIFY(model.addEvents(events));
+    QVERIFY(watcher.waitForAdded(total));
+
+    DatabaseIO &database(model.databaseIO());
+    const int defaultWriteLockTime = database.maxWriteLockTime();
+    if (maxWriteLockTime >= 0)
+        database.setMaxWriteLockTime(maxWriteLockTime);
+
+    QSignalSpy progress(&database, SIGNAL(deletionProgress(int,int)));
+    QVERIFY(model.deleteAll());
+    database.setMaxWriteLockTime(defaultWriteLockTime);
+
+    QVERIFY(progress.count() > 1);
+    int deleted = 0;
+    foreach (const QList<QVariant> &arguments, progress) {
+        QVERIFY(arguments.at(0).toInt() > deleted);
+        deleted = arguments.at(0).toInt();
+        QCOMPARE(arguments.at(1).toInt(), progress.first().at(1).toInt());
+    }
+    QCOMPARE(deleted, progress.last().at(1).toInt());
+    QVERIFY(deleted >= total);
+
+    QVERIFY(model.getEvents());
+    QCOMPARE(model.rowCount(), 0);
+
+    QSqlQuery query(DatabaseIOPrivate::instance()->connection());
+    QVERIFY(query.exec(QString("SELECT COUNT(*) FROM Events WHERE type = %1").arg(Event::CallEvent)));
+    QVERIFY(query.next());
+    QCOMPARE(query.value(0).toInt(), 0);
+    query.finish();
+}
+
 void CallModelTest::testMarkAllRead()
 {
     CallModel callModel;
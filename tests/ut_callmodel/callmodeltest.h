@@ -47,6 +47,8 @@ private slots:
     void testSIPAddress();
     void testLimit();
     void deleteAllCalls();
+    void deleteAllCallsInBatches_data();
+    void deleteAllCallsInBatches();
     void testMarkAllRead();
     void testModifyEvent();
     void testMinimizedPhone();
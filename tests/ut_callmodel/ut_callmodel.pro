@@ -26,5 +26,6 @@ include( ../tests.pri )
 
 TARGET = ut_callmodel
 QT -= gui
+QT += sql
 SOURCES += callmodeltest.cpp
 HEADERS += callmodeltest.h
@@ -0,0 +1,179 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jolla.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+#include <QtTest/QtTest>
+
+#include <qtcontacts-extensions.h>
+#include <qtcontacts-extensions_impl.h>
+
+#include "commonutilstest.h"
+#include "commonutils.h"
+#include "commonutils_p.h"
+
+using namespace CommHistory;
+
+namespace {
+
+// The implementation used before the in-library kernel, which results must match
+QString referenceMinimize(const QString &number)
+{
+    return QtContactsSqliteExtensions::minimizePhoneNumber(number, QtContactsSqliteExtensions::DefaultMaximumPhoneNumberCharacters);
+}
+
+QString referenceNormalize(const QString &number, bool validate)
+{
+    QtContactsSqliteExtensions::NormalizePhoneNumberFlags flags(QtContactsSqliteExtensions::KeepPhoneNumberDialString);
+    if (validate)
+        flags |= QtContactsSqliteExtensions::ValidatePhoneNumber;
+    return QtContactsSqliteExtensions::normalizePhoneNumber(number, flags);
+}
+
+void addNumberRows()
+{
+    QTest::addColumn<QString>("number");
+
+    QTest::newRow("empty") << QString();
+    QTest::newRow("plus") << QString::fromLatin1("+");
+    QTest::newRow("short") << QString::fromLatin1("112");
+    QTest::newRow("match length") << QString::fromLatin1("12345678");
+    QTest::newRow("match length with plus") << QString::fromLatin1("+12345678");
+    QTest::newRow("one over match length") << QString::fromLatin1("123456789");
+    QTest::newRow("national") << QString::fromLatin1("0401234567");
+    QTest::newRow("international") << QString::fromLatin1("+358401234567");
+    QTest::newRow("idd") << QString::fromLatin1("00358401234567");
+    QTest::newRow("long") << QString::fromLatin1("+35840123456789012345");
+    QTest::newRow("spaces") << QString::fromLatin1("+358 40 123 4567");
+    QTest::newRow("dashes") << QString::fromLatin1("040-123-4567");
+    QTest::newRow("parentheses") << QString::fromLatin1("+1 (555) 123-4567");
+    QTest::newRow("dial string") << QString::fromLatin1("+35801234567#3333");
+    QTest::newRow("pause") << QString::fromLatin1("+358401234567p1234");
+    QTest::newRow("wait") << QString::fromLatin1("+358401234567w1234");
+    QTest::newRow("star code") << QString::fromLatin1("*100#");
+    QTest::newRow("inner plus") << QString::fromLatin1("12345+6789012");
+    QTest::newRow("two plus") << QString::fromLatin1("++358401234567");
+    QTest::newRow("text") << QString::fromLatin1("The Palace");
+    QTest::newRow("address") << QString::fromLatin1("user@example.com");
+    QTest::newRow("digit and colon") << QString::fromLatin1("0123456789:");
+    QTest::newRow("digit and slash") << QString::fromLatin1("/0123456789");
+    QTest::newRow("latin1 letter") << QString::fromLatin1("04012345\xe9" "67");
+    QTest::newRow("arabic-indic digits") << QString::fromUtf8("\xd9\xa0\xd9\xa4\xd9\xa0\xd9\xa1\xd9\xa2\xd9\xa3\xd9\xa4\xd9\xa5\xd9\xa6\xd9\xa7");
+    QTest::newRow("fullwidth digits") << QString::fromUtf8("\xef\xbc\x90\xef\xbc\x94\xef\xbc\x90\xef\xbc\x91\xef\xbc\x92\xef\xbc\x93\xef\xbc\x94\xef\xbc\x95\xef\xbc\x96");
+    QTest::newRow("letter above 0xff") << QString(QChar(0x0130)) + QString::fromLatin1("0401234567");
+}
+
+}
+
+void CommonUtilsTest::minimizePhoneNumber_data()
+{
+    addNumberRows();
+}
+
+void CommonUtilsTest::minimizePhoneNumber()
+{
+    QFETCH(QString, number);
+
+    QCOMPARE(CommHistory::minimizePhoneNumber(number), referenceMinimize(number));
+
+    // The kernel either gives the same result, or declines the number
+    QChar buffer[QtContactsSqliteExtensions::DefaultMaximumPhoneNumberCharacters];
+    const int length = CommHistory::minimizePhoneNumber(number.constData(), number.length(), buffer);
+    if (length >= 0)
+        QCOMPARE(QString(buffer, length), referenceMinimize(number));
+}
+
+void CommonUtilsTest::normalizePhoneNumber_data()
+{
+    addNumberRows();
+}
+
+void CommonUtilsTest::normalizePhoneNumber()
+{
+    QFETCH(QString, number);
+
+    QCOMPARE(CommHistory::normalizePhoneNumber(number, false), referenceNormalize(number, false));
+    QCOMPARE(CommHistory::normalizePhoneNumber(number, true), referenceNormalize(number, true));
+}
+
+void CommonUtilsTest::generatedNumbers()
+{
+    // Every length up to beyond the match length, from each set of characters
+    const QString alphabets[] = {
+        QString::fromLatin1("0123456789"),
+        QString::fromLatin1("0123456789+"),
+        QString::fromLatin1("0123456789 -()"),
+        QString::fromLatin1("0123456789#*pw"),
+        QString::fromLatin1("0123456789:;/@"),
+        QString::fromLatin1("0123456789") + QChar(0x0660) + QChar(0xff10) + QChar(0x8030)
+    };
+
+    qsrand(1);
+    for (unsigned a = 0; a < sizeof(alphabets) / sizeof(alphabets[0]); ++a) {
+        const QString &alphabet(alphabets[a]);
+        for (int length = 0; length < 24; ++length) {
+            for (int round = 0; round < 50; ++round) {
+                QString number;
+                if (round % 2)
+                    number.append(QLatin1Char('+'));
+                for (int i = 0; i < length; ++i)
+                    number.append(alphabet.at(qrand() % alphabet.length()));
+
+                if (CommHistory::minimizePhoneNumber(number) != referenceMinimize(number))
+                    QFAIL(qPrintable(QString::fromLatin1("minimizePhoneNumber differs for '%1'").arg(number)));
+                if (CommHistory::normalizePhoneNumber(number, false) != referenceNormalize(number, false))
+                    QFAIL(qPrintable(QString::fromLatin1("normalizePhoneNumber differs for '%1'").arg(number)));
+                if (CommHistory::normalizePhoneNumber(number, true) != referenceNormalize(number, true))
+                    QFAIL(qPrintable(QString::fromLatin1("validated normalizePhoneNumber differs for '%1'").arg(number)));
+            }
+        }
+    }
+}
+
+void CommonUtilsTest::remoteAddressMatch_data()
+{
+    QTest::addColumn<QString>("uid");
+    QTest::addColumn<QString>("match");
+    QTest::addColumn<bool>("minimized");
+    QTest::addColumn<bool>("result");
+
+    QTest::newRow("same") << "+358401234567" << "+358401234567" << false << true;
+    QTest::newRow("same, minimized") << "+358401234567" << "+358401234567" << true << true;
+    QTest::newRow("national, minimized") << "+358401234567" << "0401234567" << true << true;
+    QTest::newRow("national") << "+358401234567" << "0401234567" << false << false;
+    QTest::newRow("formatted, minimized") << "+358 40 123 4567" << "0401234567" << true << true;
+    QTest::newRow("different, minimized") << "+358401234567" << "+358401234568" << true << false;
+    QTest::newRow("short and long, minimized") << "1234567" << "+358401234567" << true << false;
+    QTest::newRow("text") << "The Palace" << "The Police" << true << false;
+    QTest::newRow("text, same") << "The Palace" << "the palace" << true << true;
+}
+
+void CommonUtilsTest::remoteAddressMatch()
+{
+    QFETCH(QString, uid);
+    QFETCH(QString, match);
+    QFETCH(bool, minimized);
+    QFETCH(bool, result);
+
+    QCOMPARE(CommHistory::remoteAddressMatch(RING_ACCOUNT, uid, match, minimized), result);
+    QCOMPARE(CommHistory::remoteAddressMatch(RING_ACCOUNT, match, uid, minimized), result);
+}
+
+QTEST_MAIN(CommonUtilsTest)
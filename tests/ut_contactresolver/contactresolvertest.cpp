@@ -0,0 +1,327 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jolla.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+#include <QtTest/QtTest>
+#include <QSqlQuery>
+
+#include "contactresolvertest.h"
+#include "contactresolver.h"
+#include "contactlistener.h"
+#include "commonutils.h"
+#include "resolutioncache_p.h"
+#include "databaseio_p.h"
+#include "common.h"
+
+using namespace CommHistory;
+
+namespace {
+
+Recipient recipientAt(const QSignalSpy &spy, int index)
+{
+    return spy.at(index).at(0).value<Recipient>();
+}
+
+}
+
+void ContactResolverTest::initTestCase()
+{
+    initTestDatabase();
+    qRegisterMetaType<CommHistory::Recipient>();
+    qRegisterMetaType<CommHistory::RecipientList>("RecipientList");
+
+    // Resolutions are stored between runs, so each run uses addresses that were never resolved
+    addressSeed = QDateTime::currentMSecsSinceEpoch();
+    addressCount = 0;
+}
+
+Recipient ContactResolverTest::newRecipient()
+{
+    return Recipient(ACCOUNT1, QString::fromLatin1("resolver%1-%2@localhost").arg(addressSeed).arg(addressCount++));
+}
+
+QString ContactResolverTest::newPhoneNumber(const QString &prefix)
+{
+    // The same count gives numbers with the same minimized form for different prefixes
+    return prefix + QString::fromLatin1("%1").arg((addressSeed + addressCount) % 10000000, 7, 10, QLatin1Char('0'));
+}
+
+void ContactResolverTest::resolverFinished()
+{
+    watchedResolvedOnFinish = watched.isContactResolved();
+}
+
+void ContactResolverTest::batchOrder()
+{
+    ContactResolver resolver(this);
+    QSignalSpy batchFinished(&resolver, SIGNAL(batchFinished(int)));
+    QSignalSpy finished(&resolver, SIGNAL(finished()));
+
+    Recipient known(newRecipient());
+    resolver.add(known);
+    QTRY_COMPARE(finished.count(), 1);
+    QVERIFY(known.isContactResolved());
+    finished.clear();
+
+    QList<Recipient> first;
+    first << newRecipient() << newRecipient();
+    const int firstBatch = resolver.addBatch(first);
+    const int sharedBatch = resolver.addBatch(QList<Recipient>() << first.at(1));
+    const int knownBatch = resolver.addBatch(QList<Recipient>() << known);
+    QVERIFY(firstBatch < sharedBatch);
+    QVERIFY(sharedBatch < knownBatch);
+
+    // A batch with nothing to look up finishes without waiting for earlier batches
+    QTRY_COMPARE(batchFinished.count(), 3);
+    QCOMPARE(batchFinished.at(0).at(0).toInt(), knownBatch);
+
+    // Batches sharing a recipient both finish once it is resolved
+    QSet<int> lookupBatches;
+    lookupBatches << batchFinished.at(1).at(0).toInt() << batchFinished.at(2).at(0).toInt();
+    QCOMPARE(lookupBatches, QSet<int>() << firstBatch << sharedBatch);
+    foreach (const Recipient &recipient, first)
+        QVERIFY(recipient.isContactResolved());
+
+    QTRY_COMPARE(finished.count(), 1);
+    QCOMPARE(batchFinished.count(), 3);
+}
+
+void ContactResolverTest::sharedMinimizedNumber()
+{
+    ContactResolver resolver(this);
+    QSignalSpy batchFinished(&resolver, SIGNAL(batchFinished(int)));
+    QSignalSpy finished(&resolver, SIGNAL(finished()));
+
+    // The same number on two SIM accounts, and another form of it, are distinct recipients
+    // pending for one minimized number
+    const QString number(newPhoneNumber(QString::fromLatin1("+35840")));
+    addressCount++;
+    QList<Recipient> recipients;
+    recipients << Recipient(RING_ACCOUNT + QLatin1String("/account0"), number)
+               << Recipient(RING_ACCOUNT + QLatin1String("/account1"), number)
+               << Recipient(RING_ACCOUNT, QLatin1Char('0') + number.mid(4));
+    QCOMPARE(recipients.at(0).minimizedRemoteUid(), recipients.at(1).minimizedRemoteUid());
+    QCOMPARE(recipients.at(0).minimizedRemoteUid(), recipients.at(2).minimizedRemoteUid());
+
+    const int batch = resolver.addBatch(recipients);
+    QTRY_COMPARE(finished.count(), 1);
+    QCOMPARE(batchFinished.count(), 1);
+    QCOMPARE(batchFinished.at(0).at(0).toInt(), batch);
+    foreach (const Recipient &recipient, recipients)
+        QVERIFY(recipient.isContactResolved());
+}
+
+void ContactResolverTest::reprioritize()
+{
+    ContactResolver resolver(this);
+    resolver.setLookupLimit(1);
+    QSignalSpy resolved(&resolver, SIGNAL(recipientResolved(CommHistory::Recipient)));
+    QSignalSpy finished(&resolver, SIGNAL(finished()));
+
+    QList<Recipient> recipients;
+    for (int i = 0; i < 4; i++)
+        recipients << newRecipient();
+
+    // The first is looked up at once, and the rest are queued in the order they are added
+    foreach (const Recipient &recipient, recipients)
+        resolver.add(recipient, 0);
+
+    // Adding a queued recipient again replaces its priority
+    resolver.add(recipients.at(3), 10);
+    resolver.add(recipients.at(1), -1);
+
+    QTRY_COMPARE(finished.count(), 1);
+    QCOMPARE(resolved.count(), 4);
+    QCOMPARE(recipientAt(resolved, 0), recipients.at(0));
+    QCOMPARE(recipientAt(resolved, 1), recipients.at(3));
+    QCOMPARE(recipientAt(resolved, 2), recipients.at(2));
+    QCOMPARE(recipientAt(resolved, 3), recipients.at(1));
+}
+
+void ContactResolverTest::cancelInFlight()
+{
+    ContactResolver resolver(this);
+    resolver.setLookupLimit(1);
+    connect(&resolver, SIGNAL(finished()), SLOT(resolverFinished()));
+    QSignalSpy resolved(&resolver, SIGNAL(recipientResolved(CommHistory::Recipient)));
+    QSignalSpy batchFinished(&resolver, SIGNAL(batchFinished(int)));
+    QSignalSpy finished(&resolver, SIGNAL(finished()));
+
+    QList<Recipient> recipients;
+    for (int i = 0; i < 3; i++)
+        recipients << newRecipient();
+    const int batch = resolver.addBatch(recipients);
+
+    // Only queued recipients are cancelled; the one being looked up still resolves
+    watched = recipients.at(0);
+    watchedResolvedOnFinish = false;
+    resolver.cancel(recipients.at(0));
+    resolver.cancel(recipients.at(1));
+    resolver.cancel(recipients.at(2));
+
+    QTRY_COMPARE(finished.count(), 1);
+    QVERIFY(watchedResolvedOnFinish);
+    QCOMPARE(batchFinished.count(), 1);
+    QCOMPARE(batchFinished.at(0).at(0).toInt(), batch);
+    QCOMPARE(resolved.count(), 1);
+    QCOMPARE(recipientAt(resolved, 0), recipients.at(0));
+    QVERIFY(!recipients.at(1).isContactResolved());
+    QVERIFY(!recipients.at(2).isContactResolved());
+
+    // Cancelled recipients can be added again
+    resolver.add(recipients.at(1));
+    QTRY_COMPARE(finished.count(), 2);
+    QVERIFY(recipients.at(1).isContactResolved());
+    watched = Recipient();
+}
+
+void ContactResolverTest::lookupLimitDrain()
+{
+    ContactResolver resolver(this);
+    resolver.setLookupLimit(2);
+    QCOMPARE(resolver.lookupLimit(), 2);
+    QSignalSpy resolved(&resolver, SIGNAL(recipientResolved(CommHistory::Recipient)));
+    QSignalSpy finished(&resolver, SIGNAL(finished()));
+
+    QList<Recipient> recipients;
+    for (int i = 0; i < 6; i++)
+        recipients << newRecipient();
+    resolver.add(recipients);
+
+    // Finished is only reported once the queue has been drained
+    QTRY_COMPARE(finished.count(), 1);
+    QCOMPARE(resolved.count(), recipients.size());
+    foreach (const Recipient &recipient, recipients)
+        QVERIFY(recipient.isContactResolved());
+
+    // Removing the limit looks up everything still queued
+    resolver.setLookupLimit(1);
+    recipients.clear();
+    for (int i = 0; i < 4; i++)
+        recipients << newRecipient();
+    resolver.add(recipients);
+    resolver.setLookupLimit(0);
+    QCOMPARE(resolver.lookupLimit(), 0);
+
+    QTRY_COMPARE(finished.count(), 2);
+    QCOMPARE(resolved.count(), 10);
+    foreach (const Recipient &recipient, recipients)
+        QVERIFY(recipient.isContactResolved());
+}
+
+void ContactResolverTest::listenerUnmatched()
+{
+    ContactChangeListener contactChangeListener;
+    QSharedPointer<ContactListener> listener(ContactListener::instance());
+    QSignalSpy contactChanged(listener.data(), SIGNAL(contactChanged(RecipientList)));
+
+    const Recipient phone(RING_ACCOUNT, newPhoneNumber(QString::fromLatin1("+35840")));
+    // Same minimized number, but not a match for the full number
+    const Recipient otherPrefix(RING_ACCOUNT, newPhoneNumber(QString::fromLatin1("+35850")));
+    addressCount++;
+    const Recipient otherNumber(RING_ACCOUNT, newPhoneNumber(QString::fromLatin1("+35840")));
+    addressCount++;
+    const Recipient address(newRecipient());
+    const Recipient otherAddress(newRecipient());
+    QCOMPARE(phone.minimizedRemoteUid(), otherPrefix.minimizedRemoteUid());
+
+    QList<Recipient> recipients;
+    recipients << phone << otherPrefix << otherNumber << address << otherAddress;
+
+    ContactResolver resolver(this);
+    QSignalSpy finished(&resolver, SIGNAL(finished()));
+    resolver.add(recipients);
+    QTRY_COMPARE(finished.count(), 1);
+    foreach (const Recipient &recipient, recipients) {
+        QVERIFY(recipient.isContactResolved());
+        QCOMPARE(recipient.contactId(), 0);
+    }
+
+    // Only the recipients matching a new contact's addresses are resolved to it
+    const int phoneContact = addTestContact(QString::fromLatin1("Unmatched Phone"), phone.remoteUid(), RING_ACCOUNT, &contactChangeListener);
+    QVERIFY(phoneContact != -1);
+    QTRY_COMPARE(phone.contactId(), phoneContact);
+
+    const int addressContact = addTestContact(QString::fromLatin1("Unmatched Address"), address.remoteUid(), address.localUid(), &contactChangeListener);
+    QVERIFY(addressContact != -1);
+    QTRY_COMPARE(address.contactId(), addressContact);
+
+    QList<Recipient> changed;
+    for (int i = 0; i < contactChanged.count(); i++)
+        changed.append(contactChanged.at(i).at(0).value<RecipientList>().recipients());
+    QVERIFY(changed.contains(phone));
+    QVERIFY(changed.contains(address));
+
+    foreach (const Recipient &recipient, QList<Recipient>() << otherPrefix << otherNumber << otherAddress) {
+        QVERIFY(recipient.isContactResolved());
+        QCOMPARE(recipient.contactId(), 0);
+        QVERIFY(!changed.contains(recipient));
+    }
+
+    deleteTestContact(phoneContact, &contactChangeListener);
+    deleteTestContact(addressContact, &contactChangeListener);
+}
+
+void ContactResolverTest::staleResolution()
+{
+    ContactChangeListener contactChangeListener;
+
+    // A contact added while nothing was running leaves the stored result for its address stale
+    const Recipient address(newRecipient());
+    const int contactId = addTestContact(QString::fromLatin1("Stale Resolution"), address.remoteUid(), address.localUid(), &contactChangeListener);
+    QVERIFY(contactId != -1);
+
+    QSqlQuery query(DatabaseIOPrivate::instance()->connection());
+    QVERIFY(query.prepare("INSERT OR REPLACE INTO ContactCache (localUid, remoteUid, contactId, nameHash, addressFlags) "
+                          "VALUES (:localUid, :remoteUid, 0, 0, 0)"));
+    query.bindValue(":localUid", address.localUid());
+    query.bindValue(":remoteUid", address.minimizedRemoteUid());
+    QVERIFY(query.exec());
+    query.finish();
+
+    // Nothing else holds the cache here, so this instance loads the stored results as after a restart
+    QSharedPointer<ResolutionCache> cache(ResolutionCache::instance());
+    QSignalSpy cacheChanged(cache.data(), SIGNAL(changed(RecipientList)));
+
+    // The stored result is used at once, and corrected once it has been validated
+    ContactResolver resolver(this);
+    resolver.add(address);
+    QVERIFY(address.isContactResolved());
+    QCOMPARE(address.contactId(), 0);
+
+    QTRY_COMPARE(cacheChanged.count(), 1);
+    QCOMPARE(address.contactId(), contactId);
+    QVERIFY(cacheChanged.at(0).at(0).value<RecipientList>().contains(address));
+
+    // The corrected result is written when flushed explicitly
+    cache->flush();
+    QVERIFY(query.prepare("SELECT contactId FROM ContactCache WHERE localUid = :localUid AND remoteUid = :remoteUid"));
+    query.bindValue(":localUid", address.localUid());
+    query.bindValue(":remoteUid", address.minimizedRemoteUid());
+    QVERIFY(query.exec());
+    QVERIFY(query.next());
+    QCOMPARE(query.value(0).toInt(), contactId);
+    query.finish();
+
+    deleteTestContact(contactId, &contactChangeListener);
+}
+
+QTEST_MAIN(ContactResolverTest)
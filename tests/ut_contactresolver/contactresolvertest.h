@@ -0,0 +1,57 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jolla.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+#ifndef CONTACTRESOLVERTEST_H
+#define CONTACTRESOLVERTEST_H
+
+#include <QObject>
+
+#include "recipient.h"
+
+class ContactResolverTest : public QObject
+{
+    Q_OBJECT
+
+public slots:
+    void resolverFinished();
+
+private slots:
+    void initTestCase();
+    void batchOrder();
+    void sharedMinimizedNumber();
+    void reprioritize();
+    void cancelInFlight();
+    void lookupLimitDrain();
+    void listenerUnmatched();
+    void staleResolution();
+
+private:
+    CommHistory::Recipient newRecipient();
+    QString newPhoneNumber(const QString &prefix);
+
+    qint64 addressSeed;
+    int addressCount;
+    CommHistory::Recipient watched;
+    bool watchedResolvedOnFinish;
+};
+
+#endif
@@ -0,0 +1,183 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jollamobile.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+
+
+
+#include "databasebackuptest.h"
+
+#include "databasebackup.h"
+#include "databaseio.h"
+#include "event.h"
+#include "group.h"
+#include "messagepart.h"
+#include "common.h"
+#include "commhistorydatabasepath.h"
+
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QtTest/QtTest>
+
+static const QString backupDir = TEST_DATABASE_DIR + QStringLiteral("/backup");
+static const QString restoreRootDir = TEST_DATABASE_DIR + QStringLiteral("/restore");
+
+static int eventId = -1;
+static int eventCount = 0;
+
+static int count(const QString &databaseFile, const QString &statement)
+{
+    int result = -1;
+    {
+        QSqlDatabase database = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), QStringLiteral("ut-backup"));
+        database.setDatabaseName(databaseFile);
+        if (database.open()) {
+            QSqlQuery query(database);
+            if (query.exec(statement) && query.next())
+                result = query.value(0).toInt();
+            query.finish();
+            database.close();
+        }
+    }
+    QSqlDatabase::removeDatabase(QStringLiteral("ut-backup"));
+    return result;
+}
+
+void DatabaseBackupTest::initTestCase()
+{
+    initTestDatabase();
+
+    Group group;
+    addTestGroup(group, RING_ACCOUNT, "5550201");
+
+    Event event;
+    event.setLocalUid(RING_ACCOUNT);
+    event.setRecipients(Recipient(RING_ACCOUNT, "5550201"));
+    event.setType(Event::MMSEvent);
+    event.setDirection(Event::Inbound);
+    event.setStartTime(QDateTime::currentDateTime());
+    event.setEndTime(QDateTime::currentDateTime());
+    event.setFreeText("backup");
+    event.setGroupId(group.id());
+    QVERIFY(DatabaseIO::instance()->addEvent(event));
+    eventId = event.id();
+
+    const QString dir = CommHistoryDatabasePath::dataDir(eventId);
+    QVERIFY(QDir().mkpath(dir));
+    QFile file(dir + "part.txt");
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    file.write("backup");
+    file.close();
+
+    MessagePart part;
+    part.setContentId("part");
+    part.setContentType("text/plain");
+    part.setPath(file.fileName());
+    event.setMessageParts(QList<MessagePart>() << part);
+    QVERIFY(DatabaseIO::instance()->modifyEvent(event));
+
+    eventCount = count(QDir(CommHistoryDatabasePath::databaseDir()).absoluteFilePath(CommHistoryDatabasePath::databaseFile()),
+                       "SELECT COUNT(*) FROM Events");
+    QVERIFY(eventCount > 0);
+}
+
+void DatabaseBackupTest::cleanupTestCase()
+{
+    CommHistoryDatabasePath::setRootDir(TEST_DATABASE_DIR);
+    deleteAll();
+}
+
+void DatabaseBackupTest::testBackup()
+{
+    QDir(backupDir).removeRecursively();
+
+    DatabaseBackup backup;
+    backup.setStepPages(1);
+    QCOMPARE(backup.stepPages(), 1);
+    QSignalSpy progress(&backup, SIGNAL(progress(int,int)));
+    QSignalSpy finished(&backup, SIGNAL(finished(bool)));
+    QVERIFY(backup.backup(backupDir));
+    QVERIFY(progress.count() > 1);
+    QCOMPARE(progress.last().at(0).toInt(), progress.last().at(1).toInt());
+    QCOMPARE(finished.count(), 1);
+    QCOMPARE(finished.first().first().toBool(), true);
+    QVERIFY(!backup.isRunning());
+
+    // Parts are copied, and refer to the copies relative to the backup
+    const QString databaseFile = QDir(backupDir).absoluteFilePath(CommHistoryDatabasePath::databaseFile());
+    QCOMPARE(count(databaseFile, "SELECT COUNT(*) FROM Events"), eventCount);
+    QCOMPARE(count(databaseFile, QString("SELECT COUNT(*) FROM MessageParts WHERE path = 'data/%1/part.txt'").arg(eventId)), 1);
+
+    QFile file(QString("%1/data/%2/part.txt").arg(backupDir).arg(eventId));
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QCOMPARE(file.readAll(), QByteArray("backup"));
+
+    // An existing backup is not replaced
+    QVERIFY(!backup.backup(backupDir));
+    QVERIFY(QFile::exists(databaseFile));
+}
+
+void DatabaseBackupTest::testSchedule()
+{
+    const QString dir = TEST_DATABASE_DIR + QStringLiteral("/backup-scheduled");
+    QDir(dir).removeRecursively();
+
+    DatabaseBackup backup;
+    backup.setStepPages(1);
+    QSignalSpy finished(&backup, SIGNAL(finished(bool)));
+    backup.schedule(dir);
+    QTRY_COMPARE(finished.count(), 1);
+    QCOMPARE(finished.first().first().toBool(), true);
+    QVERIFY(!backup.isRunning());
+
+    QCOMPARE(count(QDir(dir).absoluteFilePath(CommHistoryDatabasePath::databaseFile()), "SELECT COUNT(*) FROM Events"),
+             eventCount);
+    QVERIFY(QFile::exists(QString("%1/data/%2/part.txt").arg(dir).arg(eventId)));
+
+    QDir(dir).removeRecursively();
+}
+
+void DatabaseBackupTest::testRestore()
+{
+    QDir(restoreRootDir).removeRecursively();
+    CommHistoryDatabasePath::setRootDir(restoreRootDir);
+
+    QVERIFY(DatabaseBackup::restore(backupDir));
+
+    // Parts refer to the new data directory
+    const QString databaseFile = QDir(CommHistoryDatabasePath::databaseDir()).absoluteFilePath(CommHistoryDatabasePath::databaseFile());
+    const QString path = CommHistoryDatabasePath::dataDir(eventId) + "part.txt";
+    QCOMPARE(count(databaseFile, "SELECT COUNT(*) FROM Events"), eventCount);
+    QCOMPARE(count(databaseFile, QString("SELECT COUNT(*) FROM MessageParts WHERE path = '%1'").arg(path)), 1);
+
+    QFile file(path);
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QCOMPARE(file.readAll(), QByteArray("backup"));
+
+    // Only restores into a data directory without a database
+    QVERIFY(!DatabaseBackup::restore(backupDir));
+
+    CommHistoryDatabasePath::setRootDir(TEST_DATABASE_DIR);
+    QDir(restoreRootDir).removeRecursively();
+    QDir(backupDir).removeRecursively();
+}
+
+QTEST_MAIN(DatabaseBackupTest)
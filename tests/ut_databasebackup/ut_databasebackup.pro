@@ -0,0 +1,31 @@
+###############################################################################
+#
+# This file is part of libcommhistory.
+#
+# Copyright (C) 2014 Jolla Ltd.
+# Contact: John Brooks <john.brooks@jollamobile.com>
+#
+# This library is free software; you can redistribute it and/or modify it
+# under the terms of the GNU Lesser General Public License version 2.1 as
+# published by the Free Software Foundation.
+#
+# This library is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+# or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+# License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this library; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+#
+###############################################################################
+
+include( ../../common-project-config.pri )
+include( ../../common-vars.pri )
+include( ../tests.pri )
+
+TARGET = ut_databasebackup
+QT -= gui
+QT += sql
+SOURCES += databasebackuptest.cpp
+HEADERS += databasebackuptest.h
@@ -0,0 +1,172 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jollamobile.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+
+
+#include "databasemaintenancetest.h"
+
+#include "databasemaintenance.h"
+#include "eventmodel.h"
+#include "databaseio.h"
+#include "databaseio_p.h"
+#include "event.h"
+#include "group.h"
+#include "common.h"
+
+#include <QtTest/QtTest>
+#include <QSqlQuery>
+
+static void addEvents(const QString &remoteUid, int count)
+{
+    EventModel model;
+    Group group;
+    addTestGroup(group, RING_ACCOUNT, remoteUid);
+
+    // Long texts, so that the deleted events leave free pages
+    const QString text(2000, QLatin1Char('x'));
+    for (int i = 0; i < count; i++) {
+        QVERIFY(addTestEvent(model, Event::SMSEvent, Event::Inbound, RING_ACCOUNT, group.id(),
+                             text, false, false, QDateTime::currentDateTime(), remoteUid) != -1);
+    }
+}
+
+void DatabaseMaintenanceTest::initTestCase()
+{
+    initTestDatabase();
+}
+
+void DatabaseMaintenanceTest::cleanupTestCase()
+{
+    deleteAll();
+}
+
+void DatabaseMaintenanceTest::testMeasure()
+{
+    DatabaseMaintenance maintenance;
+    QCOMPARE(maintenance.walSize(), qint64(0));
+    QCOMPARE(maintenance.freelistSize(), qint64(0));
+
+    QSignalSpy measured(&maintenance, SIGNAL(measured(qint64,qint64)));
+    addEvents("5550001", 10);
+    QVERIFY(maintenance.measure());
+    QCOMPARE(measured.count(), 1);
+    QVERIFY(maintenance.walSize() > 0);
+    QCOMPARE(measured.first().at(0).toLongLong(), maintenance.walSize());
+    QCOMPARE(measured.first().at(1).toLongLong(), maintenance.freelistSize());
+}
+
+void DatabaseMaintenanceTest::testVacuum()
+{
+    addEvents("5550002", 200);
+    QVERIFY(DatabaseIO::instance()->deleteAllEvents(Event::UnknownType));
+
+    DatabaseMaintenance maintenance;
+    QVERIFY(maintenance.measure());
+    const qint64 freed = maintenance.freelistSize();
+    QVERIFY(freed > 0);
+
+    maintenance.setVacuumThreshold(0);
+    QSignalSpy finished(&maintenance, SIGNAL(finished(bool)));
+    QVERIFY(maintenance.maintain());
+    QCOMPARE(finished.count(), 1);
+    QCOMPARE(finished.first().first().toBool(), true);
+    QCOMPARE(maintenance.freelistSize(), qint64(0));
+
+    // Nothing to do within the thresholds
+    QVERIFY(maintenance.maintain());
+    QCOMPARE(maintenance.freelistSize(), qint64(0));
+}
+
+void DatabaseMaintenanceTest::testConvert()
+{
+    DatabaseMaintenance maintenance;
+    maintenance.setVacuumThreshold(0);
+    QVERIFY(maintenance.maintain());
+    QVERIFY(maintenance.incrementalVacuumEnabled());
+    QCOMPARE(maintenance.freelistSize(), qint64(0));
+
+    // An archive as created before incremental vacuum, with free pages
+    QSqlQuery query(DatabaseIOPrivate::instance()->connection());
+    QVERIFY(query.exec(QStringLiteral("PRAGMA archive.auto_vacuum = NONE")));
+    QVERIFY(query.exec(QStringLiteral("VACUUM archive")));
+    QVERIFY(query.exec(QStringLiteral("CREATE TABLE archive.Filler (data BLOB)")));
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO archive.Filler VALUES (zeroblob(1000000))")));
+    QVERIFY(query.exec(QStringLiteral("DROP TABLE archive.Filler")));
+    query.finish();
+
+    QVERIFY(maintenance.measure());
+    QVERIFY(!maintenance.incrementalVacuumEnabled());
+    const qint64 freed = maintenance.freelistSize();
+    QVERIFY(freed > 0);
+
+    // Not converted when disabled
+    QCOMPARE(maintenance.autoVacuumConversion(), true);
+    maintenance.setAutoVacuumConversion(false);
+    QVERIFY(maintenance.maintain());
+    QVERIFY(!maintenance.incrementalVacuumEnabled());
+    QCOMPARE(maintenance.freelistSize(), freed);
+
+    maintenance.setAutoVacuumConversion(true);
+    QVERIFY(maintenance.maintain());
+    QVERIFY(maintenance.incrementalVacuumEnabled());
+    QCOMPARE(maintenance.freelistSize(), qint64(0));
+}
+
+void DatabaseMaintenanceTest::testCheckpoint()
+{
+    addEvents("5550003", 50);
+
+    DatabaseMaintenance maintenance;
+    QVERIFY(maintenance.measure());
+    QVERIFY(maintenance.walSize() > 0);
+
+    // Truncating succeeds without other readers
+    maintenance.setCheckpointThreshold(0);
+    maintenance.setTruncateThreshold(0);
+    QVERIFY(maintenance.maintain());
+    QCOMPARE(maintenance.walSize(), qint64(0));
+}
+
+void DatabaseMaintenanceTest::testSchedule()
+{
+    addEvents("5550004", 50);
+
+    DatabaseMaintenance maintenance;
+    maintenance.setCheckpointThreshold(0);
+    maintenance.setTruncateThreshold(0);
+    maintenance.setCheckInterval(50);
+    maintenance.setIdleInterval(100);
+    QCOMPARE(maintenance.checkInterval(), 50);
+    QCOMPARE(maintenance.idleInterval(), 100);
+
+    QSignalSpy finished(&maintenance, SIGNAL(finished(bool)));
+    maintenance.start();
+    QVERIFY(maintenance.isActive());
+    QTRY_COMPARE(finished.count(), 1);
+    QCOMPARE(finished.first().first().toBool(), true);
+    QCOMPARE(maintenance.walSize(), qint64(0));
+
+    maintenance.stop();
+    QVERIFY(!maintenance.isActive());
+}
+
+QTEST_MAIN(DatabaseMaintenanceTest)
@@ -0,0 +1,369 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jollamobile.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+
+
+#include "databasemigrationtest.h"
+
+#include "databasemigration.h"
+#include "eventmodel.h"
+#include "conversationmodel.h"
+#include "recipienteventmodel.h"
+#include "databaseio.h"
+#include "databaseio_p.h"
+#include "databasemigration_p.h"
+#include "event.h"
+#include "group.h"
+#include "common.h"
+
+#include <QSqlQuery>
+#include <QtTest/QtTest>
+
+static bool execute(const QString &statement)
+{
+    QSqlQuery query(DatabaseIOPrivate::instance()->connection());
+    return query.exec(statement);
+}
+
+static int count(const QString &statement)
+{
+    QSqlQuery query(DatabaseIOPrivate::instance()->connection());
+    if (!query.exec(statement) || !query.next())
+        return -1;
+    return query.value(0).toInt();
+}
+
+// Stores the subscriber identities as before schema version 11, and queues their migration
+static void unmigrateProperties()
+{
+    QVERIFY(execute("INSERT OR IGNORE INTO EventPropertyKeys (key) VALUES ('subscriberIdentity')"));
+    QVERIFY(execute("INSERT INTO EventProperties (eventId, keyId, value) "
+                    "SELECT id, (SELECT id FROM EventPropertyKeys WHERE key = 'subscriberIdentity'), subscriberIdentity "
+                    "FROM Events WHERE subscriberIdentity IS NOT NULL"));
+    QVERIFY(execute("UPDATE Events SET subscriberIdentity = NULL"));
+    QVERIFY(execute("INSERT INTO Migrations (name, lastId) SELECT 'promotedProperties', MAX(id) FROM Events"));
+}
+
+// Stores the extra properties with their keys as before schema version 11,
+// and queues both migrations as the upgrades would
+static void unmigratePropertyKeys()
+{
+    QVERIFY(execute("CREATE TABLE IF NOT EXISTS OldEventProperties ( "
+                    "  eventId INTEGER, "
+                    "  key TEXT, "
+                    "  value BLOB, "
+                    "  FOREIGN KEY (eventId) REFERENCES Events(id) ON DELETE CASCADE, "
+                    "  PRIMARY KEY (eventId, key) ON CONFLICT REPLACE "
+                    ")"));
+    QVERIFY(execute("INSERT INTO OldEventProperties (eventId, key, value) "
+                    "SELECT id, 'subscriberIdentity', subscriberIdentity FROM Events WHERE subscriberIdentity IS NOT NULL"));
+    QVERIFY(execute("INSERT INTO OldEventProperties (eventId, key, value) "
+                    "SELECT id, 'test-property', 'value' || id FROM Events"));
+    QVERIFY(execute("UPDATE Events SET subscriberIdentity = NULL, hasExtraProperties = 1"));
+    QVERIFY(execute("INSERT INTO Migrations (name, lastId) SELECT '" PROPERTY_KEYS_MIGRATION "', MAX(id) FROM Events"));
+    QVERIFY(execute("INSERT INTO Migrations (name, lastId) SELECT '" PROMOTED_PROPERTIES_MIGRATION "', MAX(id) FROM Events"));
+}
+
+// Stores the UIDs of events as text, as before schema version 9, and
+// queues their migration
+static void unmigrateUids()
+{
+    foreach (const QString &schema, QStringList() << "main" << "archive") {
+        QVERIFY(execute(QString("ALTER TABLE %1.Events ADD COLUMN localUid TEXT").arg(schema)));
+        QVERIFY(execute(QString("ALTER TABLE %1.Events ADD COLUMN remoteUid TEXT").arg(schema)));
+    }
+    QVERIFY(execute("UPDATE Events SET "
+                    "localUid = (SELECT uid FROM LocalUids WHERE id = Events.localUidId), "
+                    "remoteUid = IFNULL((SELECT uid FROM RemoteUids WHERE id = Events.remoteUidId), ''), "
+                    "localUidId = NULL, remoteUidId = NULL"));
+    QVERIFY(execute("CREATE INDEX events_remoteUid ON Events (remoteUid)"));
+    QVERIFY(execute("INSERT INTO Migrations (name, lastId) SELECT '" UID_DICTIONARY_MIGRATION "', MAX(id) FROM Events"));
+}
+
+static int addEvents(const Group &group, int count, const QString &subscriberIdentity)
+{
+    EventModel model;
+    int id = -1;
+    for (int i = 0; i < count; i++) {
+        id = addTestEvent(model, Event::SMSEvent, Event::Inbound, RING_ACCOUNT, group.id(), "text",
+                          false, false, QDateTime::currentDateTime(), group.recipients().value(0).remoteUid(),
+                          false, QString(), subscriberIdentity);
+    }
+    return id;
+}
+
+void DatabaseMigrationTest::initTestCase()
+{
+    initTestDatabase();
+}
+
+void DatabaseMigrationTest::cleanupTestCase()
+{
+    deleteAll();
+}
+
+void DatabaseMigrationTest::testMigrate()
+{
+    Group group;
+    addTestGroup(group, RING_ACCOUNT, "5550101");
+    const int eventId = addEvents(group, 3, "subscriber1");
+    QVERIFY(eventId != -1);
+
+    DatabaseMigration migration;
+    QVERIFY(!migration.isPending());
+
+    unmigrateProperties();
+    QVERIFY(migration.isPending());
+    QCOMPARE(count("SELECT COUNT(*) FROM EventProperties"), 3);
+
+    // Queries read the properties that have not been migrated
+    Event event;
+    QVERIFY(DatabaseIO::instance()->getEvent(eventId, event));
+    QCOMPARE(event.subscriberIdentity(), QString("subscriber1"));
+    Group readGroup;
+    QVERIFY(DatabaseIO::instance()->getGroup(group.id(), readGroup));
+    QCOMPARE(readGroup.subscriberIdentity(), QString("subscriber1"));
+
+    migration.setBatchSize(2);
+    QCOMPARE(migration.batchSize(), 2);
+    QSignalSpy progress(&migration, SIGNAL(progress(int,int)));
+    QSignalSpy finished(&migration, SIGNAL(finished(bool)));
+    QVERIFY(migration.migrate());
+    QCOMPARE(progress.count(), 2);
+    QCOMPARE(progress.last().at(0).toInt(), 3);
+    QCOMPARE(progress.last().at(1).toInt(), 3);
+    QCOMPARE(finished.count(), 1);
+    QCOMPARE(finished.first().first().toBool(), true);
+    QVERIFY(!migration.isPending());
+
+    QCOMPARE(count("SELECT COUNT(*) FROM EventProperties"), 0);
+    QCOMPARE(count("SELECT COUNT(*) FROM Events WHERE subscriberIdentity = 'subscriber1'"), 3);
+    QCOMPARE(count("SELECT COUNT(*) FROM Events WHERE hasExtraProperties = 1"), 0);
+
+    QVERIFY(DatabaseIO::instance()->getEvent(eventId, event));
+    QCOMPARE(event.subscriberIdentity(), QString("subscriber1"));
+    QVERIFY(DatabaseIO::instance()->getGroup(group.id(), readGroup));
+    QCOMPARE(readGroup.subscriberIdentity(), QString("subscriber1"));
+
+    // Nothing left to migrate
+    QVERIFY(migration.migrate());
+    QCOMPARE(progress.count(), 2);
+}
+
+void DatabaseMigrationTest::testSchedule()
+{
+    Group group;
+    addTestGroup(group, RING_ACCOUNT, "5550102");
+    const int eventId = addEvents(group, 5, "subscriber2");
+    QVERIFY(eventId != -1);
+
+    unmigrateProperties();
+
+    DatabaseMigration migration;
+    migration.setBatchSize(2);
+    QSignalSpy finished(&migration, SIGNAL(finished(bool)));
+    migration.schedule();
+    QTRY_COMPARE(finished.count(), 1);
+    QCOMPARE(finished.first().first().toBool(), true);
+    QVERIFY(!migration.isRunning());
+    QVERIFY(!migration.isPending());
+
+    Event event;
+    QVERIFY(DatabaseIO::instance()->getEvent(eventId, event));
+    QCOMPARE(event.subscriberIdentity(), QString("subscriber2"));
+    QCOMPARE(count("SELECT COUNT(*) FROM EventProperties"), 0);
+}
+
+void DatabaseMigrationTest::testPropertyKeys()
+{
+    deleteAll();
+
+    Group group;
+    addTestGroup(group, RING_ACCOUNT, "5550103");
+    addEvents(group, 2, "subscriber3");
+    const int eventId = addEvents(group, 1, "subscriber3");
+    QVERIFY(eventId != -1);
+
+    unmigratePropertyKeys();
+    DatabaseIOPrivate *io = DatabaseIOPrivate::instance();
+    QVERIFY(io->migrationPending(PROPERTY_KEYS_MIGRATION));
+    QCOMPARE(count("SELECT COUNT(*) FROM OldEventProperties"), 6);
+
+    // Properties are read with their keys until migrated
+    Event event;
+    QVERIFY(DatabaseIO::instance()->getEvent(eventId, event));
+    QCOMPARE(event.subscriberIdentity(), QString("subscriber3"));
+    QCOMPARE(event.extraProperty("test-property").toString(), QString("value%1").arg(eventId));
+    Group readGroup;
+    QVERIFY(DatabaseIO::instance()->getGroup(group.id(), readGroup));
+    QCOMPARE(readGroup.subscriberIdentity(), QString("subscriber3"));
+
+    // Events can't move to the archive before their properties
+    QVERIFY(!io->archiveEvents(QList<int>() << eventId));
+
+    // Replacing the properties of an event removes the old ones
+    QVariantMap properties;
+    properties.insert("test-property", "changed");
+    event.setExtraProperties(properties);
+    QVERIFY(DatabaseIO::instance()->modifyEvent(event));
+    QCOMPARE(count(QString("SELECT COUNT(*) FROM OldEventProperties WHERE eventId = %1").arg(eventId)), 0);
+
+    DatabaseMigration migration;
+    migration.setBatchSize(2);
+    QVERIFY(migration.migrate());
+    QVERIFY(!migration.isPending());
+    QVERIFY(!io->migrationPending(PROPERTY_KEYS_MIGRATION));
+
+    QCOMPARE(count("SELECT COUNT(*) FROM OldEventProperties"), 0);
+    QCOMPARE(count("SELECT COUNT(*) FROM EventProperties"), 3);
+    QCOMPARE(count("SELECT COUNT(*) FROM Events WHERE subscriberIdentity = 'subscriber3'"), 2);
+
+    QVERIFY(DatabaseIO::instance()->getEvent(eventId, event));
+    QCOMPARE(event.extraProperty("test-property").toString(), QString("changed"));
+    QVERIFY(DatabaseIO::instance()->getEvent(eventId - 1, event));
+    QCOMPARE(event.subscriberIdentity(), QString("subscriber3"));
+    QCOMPARE(event.extraProperty("test-property").toString(), QString("value%1").arg(eventId - 1));
+
+    QVERIFY(execute("DROP TABLE OldEventProperties"));
+}
+
+void DatabaseMigrationTest::testLibrarySchedule()
+{
+    Group group;
+    addTestGroup(group, RING_ACCOUNT, "5550104");
+    const int eventId = addEvents(group, 3, "subscriber4");
+    QVERIFY(eventId != -1);
+
+    unmigrateProperties();
+
+    // As when the database is opened with migrations pending
+    DatabaseIOPrivate *io = DatabaseIOPrivate::instance();
+    io->scheduleMigrations();
+    QTRY_VERIFY(!io->migrationPending(PROMOTED_PROPERTIES_MIGRATION));
+
+    Event event;
+    QVERIFY(DatabaseIO::instance()->getEvent(eventId, event));
+    QCOMPARE(event.subscriberIdentity(), QString("subscriber4"));
+}
+
+void DatabaseMigrationTest::testUidDictionary()
+{
+    deleteAll();
+
+    Group group;
+    addTestGroup(group, RING_ACCOUNT, "5550105");
+    const int eventId = addEvents(group, 3, QString());
+    QVERIFY(eventId != -1);
+    QVERIFY(execute(QString("UPDATE Events SET messageToken = 'uidToken' WHERE id = %1").arg(eventId)));
+    QVERIFY(execute(QString("UPDATE Events SET mmsId = 'uidMms', type = %1, direction = %2 WHERE id = %3")
+                    .arg(Event::MMSEvent).arg(Event::Inbound).arg(eventId - 1)));
+
+    unmigrateUids();
+    DatabaseIOPrivate *io = DatabaseIOPrivate::instance();
+    QVERIFY(io->migrationPending(UID_DICTIONARY_MIGRATION));
+    QCOMPARE(count("SELECT COUNT(*) FROM Events WHERE localUidId IS NULL AND localUid IS NOT NULL"), 3);
+
+    // Events are read and filtered by the UIDs that have not been migrated
+    Event event;
+    QVERIFY(DatabaseIO::instance()->getEvent(eventId, event));
+    QCOMPARE(event.localUid(), RING_ACCOUNT);
+    QCOMPARE(event.recipients().value(0).remoteUid(), QString("5550105"));
+
+    Event tokenEvent;
+    QVERIFY(DatabaseIO::instance()->getEventByMessageToken("uidToken", tokenEvent));
+    QCOMPARE(tokenEvent.id(), eventId);
+    QCOMPARE(tokenEvent.localUid(), RING_ACCOUNT);
+    QCOMPARE(tokenEvent.recipients().value(0).remoteUid(), QString("5550105"));
+
+    Event mmsEvent;
+    QVERIFY(DatabaseIO::instance()->getEventByMmsId("uidMms", mmsEvent));
+    QCOMPARE(mmsEvent.id(), eventId - 1);
+    QCOMPARE(mmsEvent.localUid(), RING_ACCOUNT);
+    QCOMPARE(mmsEvent.recipients().value(0).remoteUid(), QString("5550105"));
+
+    ConversationModel model;
+    model.setQueryMode(EventModel::SyncQuery);
+    QVERIFY(model.setFilter(Event::UnknownType, RING_ACCOUNT));
+    QVERIFY(model.getEvents(group.id()));
+    QCOMPARE(model.rowCount(), 3);
+
+    // A changed UID replaces the text, which would otherwise be read instead
+    event.setRecipients(Recipient(RING_ACCOUNT, "5550106"));
+    QVERIFY(DatabaseIO::instance()->modifyEvent(event));
+    QCOMPARE(count(QString("SELECT COUNT(*) FROM Events WHERE id = %1 AND remoteUid IS NULL").arg(eventId)), 1);
+    QVERIFY(DatabaseIO::instance()->getEvent(eventId, event));
+    QCOMPARE(event.recipients().value(0).remoteUid(), QString("5550106"));
+
+    DatabaseMigration migration;
+    migration.setBatchSize(2);
+    QVERIFY(migration.migrate());
+    QVERIFY(!io->migrationPending(UID_DICTIONARY_MIGRATION));
+
+    QCOMPARE(count("SELECT COUNT(*) FROM Events WHERE localUid IS NOT NULL OR remoteUid IS NOT NULL"), 0);
+    QCOMPARE(count("SELECT COUNT(*) FROM Events WHERE remoteUidId = (SELECT id FROM RemoteUids WHERE uid = '5550105')"), 2);
+    QCOMPARE(count("SELECT COUNT(*) FROM sqlite_master WHERE name = 'events_remoteUid'"), 0);
+
+    QVERIFY(DatabaseIO::instance()->getEvent(eventId, event));
+    QCOMPARE(event.localUid(), RING_ACCOUNT);
+    QCOMPARE(event.recipients().value(0).remoteUid(), QString("5550106"));
+    QVERIFY(DatabaseIO::instance()->getEvent(eventId - 1, event));
+    QCOMPARE(event.recipients().value(0).remoteUid(), QString("5550105"));
+
+    QVERIFY(model.getEvents(group.id()));
+    QCOMPARE(model.rowCount(), 3);
+}
+
+void DatabaseMigrationTest::testMinimizedRemoteUids()
+{
+    deleteAll();
+
+    const QString number("+3585550107");
+    Group group;
+    addTestGroup(group, RING_ACCOUNT, number);
+    QVERIFY(addEvents(group, 3, QString()) != -1);
+
+    // As before schema version 8
+    QVERIFY(execute("UPDATE Events SET minimizedRemoteUid = NULL"));
+    QVERIFY(execute("INSERT INTO Migrations (name, lastId) SELECT '" MINIMIZED_REMOTE_UIDS_MIGRATION "', MAX(id) FROM Events"));
+
+    // Events without a minimized address are matched by the address
+    RecipientEventModel model;
+    model.setRecipients(Recipient(RING_ACCOUNT, number));
+    QVERIFY(model.getEvents());
+    QTRY_VERIFY(model.isReady());
+    QCOMPARE(model.rowCount(), 3);
+
+    DatabaseMigration migration;
+    migration.setBatchSize(2);
+    QVERIFY(migration.migrate());
+    QVERIFY(!DatabaseIOPrivate::instance()->migrationPending(MINIMIZED_REMOTE_UIDS_MIGRATION));
+
+    QCOMPARE(count("SELECT COUNT(*) FROM Events WHERE minimizedRemoteUid IS NULL"), 0);
+    QCOMPARE(count(QString("SELECT COUNT(*) FROM Events WHERE minimizedRemoteUid = '%1'")
+                   .arg(Recipient(RING_ACCOUNT, number).minimizedRemoteUid())), 3);
+
+    QVERIFY(model.getEvents());
+    QTRY_VERIFY(model.isReady());
+    QCOMPARE(model.rowCount(), 3);
+}
+
+QTEST_MAIN(DatabaseMigrationTest)
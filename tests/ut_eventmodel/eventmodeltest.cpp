@@ -33,6 +33,7 @@
 #include "event.h"
 #include "common.h"
 #include "databaseio.h"
+#include "commhistorydatabasepath.h"
 
 #include "modelwatcher.h"
 
@@ -1393,6 +1394,8 @@ void EventModelTest::testExtraProperties()
     newEvent.setLocalUid("/org/freedesktop/Telepathy/Account/gabble/jabber/dut_40localhost0");
     newEvent.setRecipients(Recipient(newEvent.localUid(), "td@localhost"));
     newEvent.setExtraProperty("testing", 42);
+    // Stored in a column of Events rather than in EventProperties
+    newEvent.setSubscriberIdentity("subscriber1");
 
     QVERIFY(model.addEvent(newEvent));
     QVERIFY(watcher.waitForAdded());
@@ -1402,11 +1405,22 @@ void EventModelTest::testExtraProperties()
     QVERIFY(model2.getEventById(newEvent.id()));
     Event returnedEvent = model2.event();
     QVERIFY(returnedEvent.isValid());
-    QCOMPARE(returnedEvent.extraProperties().size(), 1);
+    QCOMPARE(returnedEvent.extraProperties().size(), 2);
     QCOMPARE(returnedEvent.extraProperty("testing").toInt(), 42);
+    QCOMPARE(returnedEvent.subscriberIdentity(), QString("subscriber1"));
 
-    // Remove property
+    // Remove the other property
     newEvent.setExtraProperty("testing", QVariant());
+    QVERIFY(model.modifyEvent(newEvent));
+    QVERIFY(watcher.waitForUpdated());
+
+    QVERIFY(model2.getEventById(newEvent.id()));
+    returnedEvent = model2.event();
+    QCOMPARE(returnedEvent.extraProperties().size(), 1);
+    QCOMPARE(returnedEvent.subscriberIdentity(), QString("subscriber1"));
+
+    // Remove property
+    newEvent.setSubscriberIdentity(QString());
     QVERIFY(newEvent.extraProperties().isEmpty());
     QVERIFY(newEvent.modifiedProperties().contains(Event::ExtraProperties));
     QVERIFY(model.modifyEvent(newEvent));
@@ -1590,6 +1604,142 @@ void EventModelTest::testBufferInsertions()
     rowsInserted.clear();
 }
 
+void EventModelTest::testChangeJournal()
+{
+    EventModel model;
+    watcher.setModel(&model);
+
+    qint64 sequence = -1;
+    QVERIFY(model.databaseIO().lastChangeSequence(sequence));
+    QVERIFY(sequence >= 0);
+    const qint64 startSequence = sequence;
+
+    Group g;
+    addTestGroup(g, RING_ACCOUNT, "5550001");
+
+    int eventId = addTestEvent(model, Event::SMSEvent, Event::Inbound, RING_ACCOUNT, g.id(), "journal");
+    QVERIFY(watcher.waitForAdded());
+    QVERIFY(eventId != -1);
+
+    Event event;
+    QVERIFY(model.databaseIO().getEvent(eventId, event));
+    event.setFreeText("journal modified");
+    QVERIFY(model.modifyEvent(event));
+    QVERIFY(watcher.waitForUpdated());
+
+    QVERIFY(model.deleteEvent(eventId));
+    QVERIFY(watcher.waitForDeleted());
+
+    QList<DatabaseIO::Change> changes;
+    bool complete = false;
+    QVERIFY(model.databaseIO().getChanges(startSequence, changes, complete));
+    QVERIFY(complete);
+    QVERIFY(!changes.isEmpty());
+
+    QList<DatabaseIO::Change::Operation> eventOperations;
+    bool groupInserted = false;
+    foreach (const DatabaseIO::Change &change, changes) {
+        QCOMPARE(change.sequence, sequence + 1);
+        sequence = change.sequence;
+
+        if (change.table == DatabaseIO::Change::EventsTable && change.id == eventId) {
+            QCOMPARE(change.groupId, g.id());
+            eventOperations.append(change.operation);
+        } else if (change.table == DatabaseIO::Change::GroupsTable && change.id == g.id()) {
+            groupInserted |= (change.operation == DatabaseIO::Change::Insert);
+        }
+    }
+
+    QVERIFY(groupInserted);
+    QVERIFY(eventOperations.size() >= 3);
+    QVERIFY(eventOperations.first() == DatabaseIO::Change::Insert);
+    QVERIFY(eventOperations.contains(DatabaseIO::Change::Update));
+    QVERIFY(eventOperations.last() == DatabaseIO::Change::Delete);
+
+    qint64 lastSequence = 0;
+    QVERIFY(model.databaseIO().lastChangeSequence(lastSequence));
+    QCOMPARE(lastSequence, sequence);
+
+    // Nothing after the most recent entry
+    QVERIFY(model.databaseIO().getChanges(lastSequence, changes, complete));
+    QVERIFY(complete);
+    QVERIFY(changes.isEmpty());
+
+    // Without writes from another connection, synchronizing is a no-op
+    QVERIFY(model.synchronize());
+}
+
+void EventModelTest::testCollectMessageParts()
+{
+    QThread collectorThread;
+    collectorThread.start();
+
+    EventModel model;
+    watcher.setModel(&model);
+    model.setBackgroundThread(&collectorThread);
+
+    Event event;
+    event.setLocalUid(RING_ACCOUNT);
+    event.setRecipients(Recipient(RING_ACCOUNT, "0506661235"));
+    event.setType(Event::MMSEvent);
+    event.setDirection(Event::Inbound);
+    event.setStartTime(QDateTime::currentDateTime());
+    event.setEndTime(QDateTime::currentDateTime());
+    event.setFreeText("collect");
+    event.setGroupId(group1.id());
+    QVERIFY(model.addEvent(event));
+    QVERIFY(watcher.waitForAdded());
+    QVERIFY(event.id() != -1);
+
+    // Parts are stored under the data directory of the event
+    const QString dir = CommHistoryDatabasePath::dataDir(event.id());
+    QVERIFY(QDir().mkpath(dir));
+
+    QList<MessagePart> parts;
+    qint64 size = 0;
+    for (int i = 0; i < 3; i++) {
+        QFile file(dir + QString("part%1.txt").arg(i));
+        QVERIFY(file.open(QIODevice::WriteOnly));
+        size += file.write(QByteArray(100 * (i + 1), 'x'));
+        file.close();
+
+        MessagePart part;
+        part.setContentId(QString("part%1").arg(i));
+        part.setContentType("text/plain");
+        part.setPath(file.fileName());
+        parts << part;
+    }
+    event.setMessageParts(parts);
+    QVERIFY(model.modifyEvent(event));
+    QVERIFY(watcher.waitForUpdated());
+
+    // Parts stored again without ids orphan the old rows, but not their files
+    event.setMessageParts(parts);
+    QVERIFY(model.modifyEvent(event));
+    QVERIFY(watcher.waitForUpdated());
+
+    QSignalSpy collected(&model.databaseIO(), SIGNAL(messagePartsCollected(qint64)));
+    model.databaseIO().collectMessageParts(&collectorThread);
+    QTRY_COMPARE_WITH_TIMEOUT(collected.count(), 1, 10000);
+    QCOMPARE(collected.first().first().toLongLong(), qint64(0));
+    foreach (const MessagePart &part, parts)
+        QVERIFY(QFile::exists(part.path()));
+    collected.clear();
+
+    QVERIFY(model.deleteEvent(event.id()));
+    QVERIFY(watcher.waitForDeleted());
+
+    QTRY_COMPARE_WITH_TIMEOUT(collected.count(), 1, 10000);
+    QCOMPARE(collected.first().first().toLongLong(), size);
+
+    foreach (const MessagePart &part, parts)
+        QVERIFY(!QFile::exists(part.path()));
+    QVERIFY(!QDir(dir).exists());
+
+    collectorThread.quit();
+    collectorThread.wait();
+}
+
 void EventModelTest::cleanupTestCase()
 {
     deleteAll();
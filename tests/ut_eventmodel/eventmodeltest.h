@@ -58,6 +58,8 @@ private slots:
     void testAddNonDigitRemoteId_data();
     void testAddNonDigitRemoteId();
     void testBufferInsertions();
+    void testChangeJournal();
+    void testCollectMessageParts();
     void cleanupTestCase();
 
     void groupsUpdatedSlot(const QList<int> &groupIds);
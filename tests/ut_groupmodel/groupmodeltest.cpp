@@ -23,11 +23,15 @@
 #include <QtTest/QtTest>
 
 #include <QDBusConnection>
+#include <QSqlQuery>
 #include "groupmodeltest.h"
 #include "groupmodel.h"
 #include "event.h"
 #include "common.h"
 #include "databaseio.h"
+#include "databaseio_p.h"
+#include "updatesemitter.h"
+#include "contactgroup.h"
 
 using namespace CommHistory;
 
@@ -1404,4 +1408,425 @@ void GroupModelTest::endTimeUpdate()
     QVERIFY(model.group(model.index(0, 0)).endTime().toTime_t() != olEvent.endTime().toTime_t());
 }
 
+void GroupModelTest::getGroupsById()
+{
+    addInitialTestGroups();
+
+    GroupModel model;
+    model.setResolveContacts(GroupManager::DoNotResolve);
+    model.setQueryMode(EventModel::SyncQuery);
+    QVERIFY(model.getGroups());
+    QCOMPARE(model.rowCount(), 4);
+
+    QList<int> ids;
+    for (int i = 0; i < model.rowCount(); i++)
+        ids.append(model.group(model.index(i, 0)).id());
+    // Unknown ids are skipped
+    ids.append(-1);
+
+    QList<Group> groups;
+    QVERIFY(model.databaseIO().getGroups(ids, groups));
+    QCOMPARE(groups.size(), 4);
+
+    foreach (const Group &group, groups) {
+        Group single;
+        QVERIFY(model.databaseIO().getGroup(group.id(), single));
+        QCOMPARE(group.localUid(), single.localUid());
+        QCOMPARE(group.recipients(), single.recipients());
+        QCOMPARE(group.lastEventId(), single.lastEventId());
+        QCOMPARE(group.unreadMessages(), single.unreadMessages());
+        QCOMPARE(group.endTimeT(), single.endTimeT());
+    }
+
+    QVERIFY(model.databaseIO().getGroups(QList<int>(), groups));
+    QVERIFY(groups.isEmpty());
+}
+
+void GroupModelTest::getGroupsByMember()
+{
+    DatabaseIO *database = DatabaseIO::instance();
+
+    Group multi;
+    multi.setLocalUid(RING_ACCOUNT);
+    multi.setRecipients(RecipientList::fromUids(RING_ACCOUNT, QStringList() << "+15550101234" << "+15550105678"));
+    QVERIFY(database->addGroup(multi));
+
+    Group single;
+    single.setLocalUid(RING_ACCOUNT);
+    single.setRecipients(RecipientList::fromUids(RING_ACCOUNT, QStringList() << "+15550105678"));
+    QVERIFY(database->addGroup(single));
+
+    Group im;
+    im.setLocalUid(ACCOUNT1);
+    im.setRecipients(RecipientList::fromUids(ACCOUNT1, QStringList() << "member@localhost"));
+    QVERIFY(database->addGroup(im));
+
+    // Any participant of a group matches
+    QList<Group> groups;
+    QVERIFY(database->getGroupsByMember(RING_ACCOUNT, "+15550101234", groups));
+    QCOMPARE(groups.size(), 1);
+    QCOMPARE(groups.first().id(), multi.id());
+
+    QVERIFY(database->getGroupsByMember(RING_ACCOUNT, "+15550105678", groups));
+    QCOMPARE(groups.size(), 2);
+
+    QVERIFY(database->getGroupsByMember(QString(), "Member@localhost", groups));
+    QCOMPARE(groups.size(), 1);
+    QCOMPARE(groups.first().id(), im.id());
+
+    QVERIFY(database->getGroupsByMember(ACCOUNT2, "member@localhost", groups));
+    QVERIFY(groups.isEmpty());
+
+    // Groups match by their whole set of participants, in any order
+    QVERIFY(database->getGroupsByRecipients(RecipientList::fromUids(RING_ACCOUNT, QStringList() << "+15550105678" << "+15550101234"), groups));
+    QCOMPARE(groups.size(), 1);
+    QCOMPARE(groups.first().id(), multi.id());
+
+    QVERIFY(database->getGroupsByRecipients(RecipientList::fromUids(RING_ACCOUNT, QStringList() << "+15550105678"), groups));
+    QCOMPARE(groups.size(), 1);
+    QCOMPARE(groups.first().id(), single.id());
+
+    // Members follow changes to the group
+    multi.setRecipients(RecipientList::fromUids(RING_ACCOUNT, QStringList() << "+15550101234" << "+15550109999"));
+    QVERIFY(database->modifyGroup(multi));
+    QVERIFY(database->getGroupsByMember(RING_ACCOUNT, "+15550105678", groups));
+    QCOMPARE(groups.size(), 1);
+    QCOMPARE(groups.first().id(), single.id());
+    QVERIFY(database->getGroupsByMember(RING_ACCOUNT, "+15550109999", groups));
+    QCOMPARE(groups.size(), 1);
+    QCOMPARE(groups.first().id(), multi.id());
+
+    QVERIFY(database->deleteGroup(multi.id()));
+    QVERIFY(database->getGroupsByMember(RING_ACCOUNT, "+15550101234", groups));
+    QVERIFY(groups.isEmpty());
+}
+
+void GroupModelTest::pagedQuery()
+{
+    EventModel eventModel;
+    QDateTime when = QDateTime::currentDateTime().addDays(-1);
+
+    // Pairs of groups share an end time, to test paging between them
+    QSet<int> addedIds;
+    for (int i = 0; i < 12; i++) {
+        Group group;
+        addTestGroup(group, ACCOUNT1, QString("paged%1@localhost").arg(i));
+        QVERIFY(addTestEvent(eventModel, Event::IMEvent, Event::Inbound, ACCOUNT1, group.id(),
+                             "paged", false, false, when.addSecs(i / 2),
+                             QString("paged%1@localhost").arg(i)) != -1);
+        addedIds.insert(group.id());
+    }
+
+    GroupModel model;
+    model.setResolveContacts(GroupManager::DoNotResolve);
+    model.setQueryMode(EventModel::StreamedAsyncQuery);
+    model.setFirstChunkSize(3);
+    model.setChunkSize(5);
+    QVERIFY(model.getGroups());
+    QVERIFY(model.isReady());
+    QCOMPARE(model.rowCount(), 3);
+    QVERIFY(model.canFetchMore(QModelIndex()));
+
+    model.fetchMore(QModelIndex());
+    QCOMPARE(model.rowCount(), 8);
+    QVERIFY(model.canFetchMore(QModelIndex()));
+
+    model.fetchMore(QModelIndex());
+    QCOMPARE(model.rowCount(), 12);
+    QVERIFY(!model.canFetchMore(QModelIndex()));
+
+    QSet<int> fetchedIds;
+    for (int i = 0; i < model.rowCount(); i++) {
+        Group group = model.group(model.index(i, 0));
+        fetchedIds.insert(group.id());
+        if (i > 0)
+            QVERIFY(model.group(model.index(i - 1, 0)).endTimeT() >= group.endTimeT());
+    }
+    QCOMPARE(fetchedIds, addedIds);
+
+    // Pages follow the last event time of groups as their events change
+    DatabaseIO *database = DatabaseIO::instance();
+    QList<Group> page;
+    QVERIFY(database->getGroupsPage(QString(), QString(), 0, -1, 12, page));
+    QCOMPARE(page.size(), 12);
+    const int newestId = page.first().id();
+
+    QSqlQuery query(DatabaseIOPrivate::instance()->connection());
+    QVERIFY(query.exec(QString("UPDATE Events SET endTime = endTime - 86400 WHERE groupId = %1").arg(newestId)));
+    QVERIFY(database->getGroupsPage(QString(), QString(), 0, -1, 12, page));
+    QCOMPARE(page.size(), 12);
+    QCOMPARE(page.last().id(), newestId);
+
+    QList<Group> rest;
+    QVERIFY(database->getGroupsPage(QString(), QString(), page.at(5).endTimeT(), page.at(5).id(), 12, rest));
+    QCOMPARE(rest.size(), 6);
+    QCOMPARE(rest.first().id(), page.at(6).id());
+
+    QVERIFY(query.exec(QString("DELETE FROM Events WHERE groupId = %1").arg(newestId)));
+    QVERIFY(query.exec(QString("SELECT lastEventTime FROM Groups WHERE id = %1").arg(newestId)));
+    QVERIFY(query.next());
+    QCOMPARE(query.value(0).toInt(), 0);
+}
+
+void GroupModelTest::deleteGroupsPartially()
+{
+    GroupModel groupModel;
+    groupModel.setResolveContacts(GroupManager::DoNotResolve);
+    groupModel.setQueryMode(EventModel::SyncQuery);
+
+    Group group;
+    addTestGroup(group, ACCOUNT1, "5550100");
+
+    EventModel model;
+    QList<Event> events;
+    const QDateTime when = QDateTime::currentDateTime();
+    for (int i = 0; i < 200; i++) {
+        Event e;
+        e.setType(Event::SMSEvent);
+        e.setDirection(Event::Inbound);
+        e.setGroupId(group.id());
+        e.setStartTime(when.addSecs(i));
+        e.setEndTime(when.addSecs(i));
+        e.setLocalUid(ACCOUNT1);
+        e.setRecipients(Recipient(ACCOUNT1, "5550100"));
+        e.setFreeText("partial");
+        events.append(e);
+    }
+    QVERIFY(model.addEvents(events));
+
+    // The events are deleted in committed batches before the group fails to
+    QSqlQuery query(DatabaseIOPrivate::instance()->connection());
+    QVERIFY(query.exec("CREATE TEMP TRIGGER fail_group_delete BEFORE DELETE ON main.Groups "
+                       "BEGIN SELECT RAISE(ABORT, 'test'); END"));
+    query.finish();
+
+    DatabaseIO &database(model.databaseIO());
+    const int maxWriteLockTime = database.maxWriteLockTime();
+    database.setMaxWriteLockTime(1);
+
+    qRegisterMetaType<QList<int> >();
+    QSignalSpy eventDeleted(UpdatesEmitter::instance().data(), SIGNAL(eventDeleted(int)));
+    QSignalSpy groupsUpdated(UpdatesEmitter::instance().data(), SIGNAL(groupsUpdated(QList<int>)));
+    QSignalSpy groupsDeleted(UpdatesEmitter::instance().data(), SIGNAL(groupsDeleted(QList<int>)));
+    QVERIFY(!groupModel.deleteGroups(QList<int>() << group.id()));
+    database.setMaxWriteLockTime(maxWriteLockTime);
+
+    QVERIFY(query.exec("DROP TRIGGER fail_group_delete"));
+    query.finish();
+
+    QCOMPARE(eventDeleted.count(), events.size());
+    foreach (const Event &e, events) {
+        QVERIFY(eventDeleted.contains(QList<QVariant>() << e.id()));
+    }
+    QCOMPARE(groupsUpdated.count(), 1);
+    QCOMPARE(groupsUpdated.first().at(0).value<QList<int> >(), QList<int>() << group.id());
+    QCOMPARE(groupsDeleted.count(), 0);
+
+    Group g;
+    QVERIFY(database.getGroup(group.id(), g));
+    int total = -1;
+    QVERIFY(database.totalEventsInGroup(group.id(), total));
+    QCOMPARE(total, 0);
+
+    QVERIFY(groupModel.deleteGroups(QList<int>() << group.id()));
+    QCOMPARE(groupsDeleted.count(), 1);
+}
+
+void GroupModelTest::deleteGroupsInBatches()
+{
+    GroupModel groupModel;
+    groupModel.setResolveContacts(GroupManager::DoNotResolve);
+    groupModel.setQueryMode(EventModel::SyncQuery);
+
+    Group group;
+    addTestGroup(group, ACCOUNT1, "5550101");
+
+    EventModel model;
+    QList<Event> events;
+    const QDateTime when = QDateTime::currentDateTime();
+    for (int i = 0; i < 500; i++) {
+        Event e;
+        e.setType(Event::SMSEvent);
+        e.setDirection(Event::Inbound);
+        e.setGroupId(group.id());
+        e.setStartTime(when.addSecs(i));
+        e.setEndTime(when.addSecs(i));
+        e.setLocalUid(ACCOUNT1);
+        e.setRecipients(Recipient(ACCOUNT1, "5550101"));
+        e.setFreeText("batched");
+        events.append(e);
+    }
+    QVERIFY(model.addEvents(events));
+
+    // With the default lock time, fast batches grow; every event must still be reported
+    qRegisterMetaType<QList<int> >();
+    QSignalSpy eventDeleted(UpdatesEmitter::instance().data(), SIGNAL(eventDeleted(int)));
+    QSignalSpy groupsDeleted(UpdatesEmitter::instance().data(), SIGNAL(groupsDeleted(QList<int>)));
+    QVERIFY(groupModel.deleteGroups(QList<int>() << group.id()));
+
+    QCOMPARE(eventDeleted.count(), events.size());
+    foreach (const Event &e, events) {
+        QVERIFY(eventDeleted.contains(QList<QVariant>() << e.id()));
+    }
+    QCOMPARE(groupsDeleted.count(), 1);
+
+    QSqlQuery query(DatabaseIOPrivate::instance()->connection());
+    query.prepare("SELECT COUNT(*) FROM Events WHERE groupId = :groupId");
+    query.bindValue(":groupId", group.id());
+    QVERIFY(query.exec());
+    QVERIFY(query.next());
+    QCOMPARE(query.value(0).toInt(), 0);
+    query.finish();
+}
+
+void GroupModelTest::lazyGroupObjects()
+{
+    addInitialTestGroups();
+
+    GroupModel model;
+    model.setResolveContacts(GroupManager::DoNotResolve);
+    model.setQueryMode(EventModel::SyncQuery);
+    QVERIFY(model.getGroups());
+    QCOMPARE(model.rowCount(), 4);
+
+    // Rows are served from group data alone
+    QCOMPARE(model.manager()->findChildren<GroupObject*>().size(), 0);
+    Group group = model.group(model.index(0, 0));
+    QVERIFY(group.isValid());
+
+    GroupObject *go = model.groupObject(model.index(0, 0));
+    QVERIFY(go);
+    QCOMPARE(go->id(), group.id());
+    QCOMPARE(model.groupObject(model.index(0, 0)), go);
+    QCOMPARE(model.manager()->group(group.id()), go);
+    QCOMPARE(model.manager()->findChildren<GroupObject*>().size(), 1);
+
+    // Changes still reach the object once it exists
+    QSignalSpy lastEventChanged(go, SIGNAL(lastEventIdChanged()));
+    EventModel eventModel;
+    int eventId = addTestEvent(eventModel, Event::IMEvent, Event::Inbound, group.localUid(), group.id(),
+                               "lazy", false, false, QDateTime::currentDateTime(),
+                               group.recipients().first().remoteUid());
+    QVERIFY(eventId != -1);
+    QTRY_VERIFY(lastEventChanged.count() > 0);
+    QCOMPARE(go->lastEventId(), eventId);
+    QCOMPARE(model.group(model.findGroup(group.id())).lastEventId(), eventId);
+}
+
+void GroupModelTest::findGroupRows()
+{
+    GroupModel model;
+    model.setResolveContacts(GroupManager::DoNotResolve);
+    model.setQueryMode(EventModel::SyncQuery);
+    QVERIFY(model.getGroups());
+    QCOMPARE(model.rowCount(), 0);
+
+    // Groups sharing an end time must still be found in their own rows
+    EventModel eventModel;
+    const QDateTime when = QDateTime::currentDateTime().addDays(-1);
+    QList<int> groupIds;
+    for (int i = 0; i < 4; i++) {
+        Group g;
+        addTestGroup(g, ACCOUNT1, QString("findrow%1@localhost").arg(i));
+        QVERIFY(addTestEvent(eventModel, Event::IMEvent, Event::Inbound, ACCOUNT1, g.id(),
+                             "row", false, false, when) != -1);
+        groupIds.append(g.id());
+    }
+    QTRY_COMPARE(model.rowCount(), 4);
+
+    foreach (int id, groupIds) {
+        QModelIndex index = model.findGroup(id);
+        QVERIFY(index.isValid());
+        QCOMPARE(model.group(index).id(), id);
+    }
+
+    // A newer event moves its group to the top
+    QVERIFY(addTestEvent(eventModel, Event::IMEvent, Event::Inbound, ACCOUNT1, groupIds[2],
+                         "row", false, false, when.addSecs(60)) != -1);
+    QTRY_COMPARE(model.findGroup(groupIds[2]).row(), 0);
+    foreach (int id, groupIds) {
+        QModelIndex index = model.findGroup(id);
+        QVERIFY(index.isValid());
+        QCOMPARE(model.group(index).id(), id);
+    }
+
+    QVERIFY(model.deleteGroups(QList<int>() << groupIds[1]));
+    QTRY_COMPARE(model.rowCount(), 3);
+    QVERIFY(!model.findGroup(groupIds[1]).isValid());
+    groupIds.removeAt(1);
+    foreach (int id, groupIds) {
+        QModelIndex index = model.findGroup(id);
+        QVERIFY(index.isValid());
+        QCOMPARE(model.group(index).id(), id);
+    }
+}
+
+void GroupModelTest::contactGroupAggregates()
+{
+    GroupManager manager;
+
+    Group g1;
+    g1.setId(1001);
+    g1.setLocalUid(ACCOUNT1);
+    g1.setRecipients(RecipientList::fromUids(ACCOUNT1, QStringList() << "aggregate1@localhost"));
+    g1.setStartTimeT(100);
+    g1.setEndTimeT(100);
+    g1.setUnreadMessages(2);
+    g1.setLastEventId(10);
+    g1.setLastMessageText("one");
+
+    Group g2;
+    g2.setId(1002);
+    g2.setLocalUid(ACCOUNT2);
+    g2.setRecipients(RecipientList::fromUids(ACCOUNT2, QStringList() << "aggregate2@localhost"));
+    g2.setStartTimeT(200);
+    g2.setEndTimeT(200);
+    g2.setUnreadMessages(3);
+    g2.setLastEventId(20);
+    g2.setLastMessageText("two");
+
+    GroupObject o1(g1, &manager);
+    GroupObject o2(g2, &manager);
+
+    ContactGroup contactGroup;
+    contactGroup.addGroup(&o1);
+    contactGroup.addGroup(&o2);
+    QCOMPARE(contactGroup.unreadMessages(), 5);
+    QCOMPARE(contactGroup.endTimeT(), quint32(200));
+    QCOMPARE(contactGroup.lastEventId(), 20);
+
+    // A new message makes the older group the most recent one
+    QSignalSpy unreadChanged(&contactGroup, SIGNAL(unreadMessagesChanged()));
+    QSignalSpy lastEventChanged(&contactGroup, SIGNAL(lastEventChanged()));
+    o1.setUnreadMessages(3);
+    o1.setEndTimeT(300);
+    o1.setLastEventId(11);
+    o1.setLastMessageText("three");
+    contactGroup.updateGroup(&o1);
+    QCOMPARE(contactGroup.unreadMessages(), 6);
+    QCOMPARE(contactGroup.endTimeT(), quint32(300));
+    QCOMPARE(contactGroup.lastEventId(), 11);
+    QCOMPARE(contactGroup.lastMessageText(), QString("three"));
+    QCOMPARE(unreadChanged.count(), 1);
+    QCOMPARE(lastEventChanged.count(), 1);
+
+    // Reading the other group only changes the unread count
+    o2.setUnreadMessages(0);
+    contactGroup.updateGroup(&o2);
+    QCOMPARE(contactGroup.unreadMessages(), 3);
+    QCOMPARE(contactGroup.lastEventId(), 11);
+    QCOMPARE(lastEventChanged.count(), 1);
+
+    // When the most recent group moves back, the other group takes over
+    o1.setEndTimeT(50);
+    contactGroup.updateGroup(&o1);
+    QCOMPARE(contactGroup.endTimeT(), quint32(200));
+    QCOMPARE(contactGroup.lastEventId(), 20);
+    QCOMPARE(contactGroup.lastMessageText(), QString("two"));
+
+    QVERIFY(!contactGroup.removeGroup(&o1));
+    QCOMPARE(contactGroup.unreadMessages(), 0);
+    QCOMPARE(contactGroup.groups().size(), 1);
+}
+
 QTEST_MAIN(GroupModelTest)
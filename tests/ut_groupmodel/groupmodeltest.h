@@ -63,6 +63,14 @@ private slots:
     void limitOffset();
     void noRemoteId();
     void endTimeUpdate();
+    void getGroupsById();
+    void getGroupsByMember();
+    void pagedQuery();
+    void deleteGroupsPartially();
+    void deleteGroupsInBatches();
+    void lazyGroupObjects();
+    void findGroupRows();
+    void contactGroupAggregates();
     void cleanupTestCase();
     void cleanup();
 
@@ -26,5 +26,6 @@ include( ../tests.pri )
 
 TARGET = ut_groupmodel
 QT -= gui
+QT += sql
 SOURCES += groupmodeltest.cpp
 HEADERS += groupmodeltest.h
@@ -0,0 +1,218 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jolla.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+#include <QtTest/QtTest>
+#include <QThread>
+#include <algorithm>
+
+#include "recipienttest.h"
+#include "recipient.h"
+#include "commonutils.h"
+#include "common.h"
+
+using namespace CommHistory;
+
+namespace {
+
+QString testPhoneNumber(int index)
+{
+    return QString::fromLatin1("+35840%1").arg(1000000 + index);
+}
+
+QString testAddress(int index)
+{
+    return QString::fromLatin1("user%1@localhost").arg(index);
+}
+
+// Creates and drops recipients for the same addresses as the other threads
+class InterningThread : public QThread
+{
+public:
+    InterningThread(int addresses, int rounds)
+        : addresses(addresses)
+        , rounds(rounds)
+        , mismatches(0)
+    {
+    }
+
+    int addresses;
+    int rounds;
+    int mismatches;
+    QList<Recipient> recipients;
+
+protected:
+    void run()
+    {
+        for (int round = 0; round < rounds; round++) {
+            QList<Recipient> created;
+            for (int i = 0; i < addresses; i++) {
+                // Alternate the form of the number, which should not affect interning
+                const QString number(round % 2 ? testPhoneNumber(i) : testPhoneNumber(i).mid(4).prepend(QLatin1Char('0')));
+                created << Recipient(RING_ACCOUNT, number) << Recipient(ACCOUNT1, testAddress(i));
+            }
+
+            for (int i = 0; i < addresses; i++) {
+                if (created.at(i * 2) != Recipient(RING_ACCOUNT, testPhoneNumber(i)))
+                    ++mismatches;
+                if (created.at(i * 2 + 1) != Recipient(ACCOUNT1, testAddress(i)))
+                    ++mismatches;
+            }
+
+            // Keep only the last round, so that most instances are destroyed while others look them up
+            if (round == rounds - 1)
+                recipients = created;
+        }
+    }
+};
+
+}
+
+void RecipientTest::interning()
+{
+    Recipient phone(RING_ACCOUNT, testPhoneNumber(1));
+    QVERIFY(phone == Recipient(RING_ACCOUNT, testPhoneNumber(1)));
+    QVERIFY(phone == Recipient(RING_ACCOUNT, testPhoneNumber(1).mid(4).prepend(QLatin1Char('0'))));
+    QVERIFY(phone != Recipient(RING_ACCOUNT, testPhoneNumber(2)));
+
+    Recipient address(ACCOUNT1, testAddress(1));
+    QVERIFY(address == Recipient(ACCOUNT1, testAddress(1)));
+    QVERIFY(address == Recipient(ACCOUNT1, testAddress(1).toUpper()));
+    QVERIFY(address != Recipient(ACCOUNT2, testAddress(1)));
+    QVERIFY(address != Recipient(ACCOUNT1, testAddress(2)));
+
+    // A recreated instance is equal to one created before the last reference was released
+    const QString remoteUid(testAddress(3));
+    Recipient first(ACCOUNT1, remoteUid);
+    first = Recipient();
+    Recipient second(ACCOUNT1, remoteUid);
+    QVERIFY(second == Recipient(ACCOUNT1, remoteUid));
+    QCOMPARE(second.remoteUid(), remoteUid);
+}
+
+void RecipientTest::threadedInterning_data()
+{
+    QTest::addColumn<int>("threads");
+    QTest::addColumn<int>("addresses");
+    QTest::addColumn<int>("rounds");
+
+    QTest::newRow("2 threads") << 2 << 500 << 50;
+    QTest::newRow("8 threads") << 8 << 500 << 50;
+    QTest::newRow("8 threads, few addresses") << 8 << 10 << 2000;
+}
+
+void RecipientTest::threadedInterning()
+{
+    QFETCH(int, threads);
+    QFETCH(int, addresses);
+    QFETCH(int, rounds);
+
+    QList<InterningThread *> workers;
+    for (int i = 0; i < threads; i++)
+        workers << new InterningThread(addresses, rounds);
+
+    foreach (InterningThread *worker, workers)
+        worker->start();
+    foreach (InterningThread *worker, workers)
+        QVERIFY(worker->wait(60000));
+
+    // Instances still held by the threads are shared with every new instance
+    foreach (InterningThread *worker, workers) {
+        QCOMPARE(worker->mismatches, 0);
+        QCOMPARE(worker->recipients.count(), addresses * 2);
+        for (int i = 0; i < addresses; i++) {
+            QVERIFY(worker->recipients.at(i * 2) == Recipient(RING_ACCOUNT, testPhoneNumber(i)));
+            QVERIFY(worker->recipients.at(i * 2 + 1) == Recipient(ACCOUNT1, testAddress(i)));
+        }
+    }
+
+    qDeleteAll(workers);
+}
+
+void RecipientTest::listMatches_data()
+{
+    QTest::addColumn<int>("size");
+
+    QTest::newRow("2 recipients") << 2;
+    QTest::newRow("20 recipients") << 20;
+    QTest::newRow("200 recipients") << 200;
+}
+
+void RecipientTest::listMatches()
+{
+    QFETCH(int, size);
+
+    // The same addresses in another form, in a different order
+    QList<Recipient> recipients, variants;
+    for (int i = 0; i < size; i++) {
+        if (i % 2) {
+            recipients << Recipient(RING_ACCOUNT, testPhoneNumber(i));
+            variants << Recipient(RING_ACCOUNT, testPhoneNumber(i).mid(1).prepend(QLatin1String("00")));
+        } else {
+            recipients << Recipient(ACCOUNT1, testAddress(i));
+            variants << Recipient(ACCOUNT1, testAddress(i).toUpper());
+        }
+    }
+
+    RecipientList list(recipients);
+    QList<Recipient> reordered(variants);
+    std::reverse(reordered.begin(), reordered.end());
+    RecipientList other(reordered);
+    QVERIFY(list.matches(other));
+    QVERIFY(other.matches(list));
+    QVERIFY(list.hasSameContacts(other));
+
+    // Repeated recipients are ignored
+    RecipientList duplicated(recipients);
+    duplicated.append(variants.first());
+    duplicated.append(recipients.last());
+    QVERIFY(list.matches(duplicated));
+    QVERIFY(duplicated.matches(list));
+
+    // The list is compared again after modification
+    RecipientList extended(recipients);
+    QVERIFY(extended.matches(list));
+    extended.append(Recipient(ACCOUNT2, testAddress(0)));
+    QVERIFY(!extended.matches(list));
+    QVERIFY(!list.matches(extended));
+    QVERIFY(!extended.hasSameContacts(list));
+
+    QList<Recipient> replaced(variants);
+    replaced.replace(size / 2, Recipient(RING_ACCOUNT, testPhoneNumber(size + 1)));
+    QVERIFY(!list.matches(RecipientList(replaced)));
+    QVERIFY(!RecipientList(replaced).matches(list));
+
+    // Resolved recipients without a contact are compared by address
+    foreach (const Recipient &r, recipients + variants)
+        r.setResolved(0);
+    QVERIFY(list.hasSameContacts(other));
+    QVERIFY(!list.hasSameContacts(RecipientList(replaced)));
+
+    // United lists contain one recipient for each address
+    RecipientList united(recipients.mid(0, size / 2));
+    united.unite(other);
+    QCOMPARE(united.size(), size);
+    QVERIFY(united.matches(list));
+    united.unite(list);
+    QCOMPARE(united.size(), size);
+}
+
+QTEST_MAIN(RecipientTest)
@@ -0,0 +1,498 @@
+/******************************************************************************
+**
+** This file is part of libcommhistory.
+**
+** Copyright (C) 2014 Jolla Ltd.
+** Contact: John Brooks <john.brooks@jollamobile.com>
+**
+** This library is free software; you can redistribute it and/or modify it
+** under the terms of the GNU Lesser General Public License version 2.1 as
+** published by the Free Software Foundation.
+**
+** This library is distributed in the hope that it will be useful, but
+** WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+** or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+** License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this library; if not, write to the Free Software Foundation, Inc.,
+** 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+**
+******************************************************************************/
+
+
+#include "retentionpolicytest.h"
+
+#include "retentionpolicy.h"
+#include "eventmodel.h"
+#include "updatesemitter.h"
+#include "databaseio.h"
+#include "databaseio_p.h"
+#include "commhistorydatabase.h"
+#include "conversationmodel.h"
+#include "event.h"
+#include "group.h"
+#include "common.h"
+
+#include <QtTest/QtTest>
+#include <QSqlQuery>
+#include <QThread>
+
+#include <algorithm>
+
+void RetentionPolicyTest::initTestCase()
+{
+    initTestDatabase();
+
+    qRegisterMetaType<QList<int> >();
+}
+
+void RetentionPolicyTest::init()
+{
+    // Limits apply to the whole database
+    QVERIFY(DatabaseIO::instance()->deleteAllEvents(Event::UnknownType));
+}
+
+void RetentionPolicyTest::cleanupTestCase()
+{
+    deleteAll();
+}
+
+void RetentionPolicyTest::testMaxAge()
+{
+    EventModel model;
+    Group group;
+    addTestGroup(group, RING_ACCOUNT, "5550001");
+
+    const QDateTime now = QDateTime::currentDateTime();
+    int oldSms = addTestEvent(model, Event::SMSEvent, Event::Inbound, RING_ACCOUNT, group.id(),
+                              "old", false, false, now.addDays(-45), "5550001");
+    int newSms = addTestEvent(model, Event::SMSEvent, Event::Inbound, RING_ACCOUNT, group.id(),
+                              "new", false, false, now.addDays(-1), "5550001");
+    int oldCall = addTestEvent(model, Event::CallEvent, Event::Inbound, RING_ACCOUNT, -1,
+                               "", false, false, now.addDays(-45), "5550001");
+    QVERIFY(oldSms != -1 && newSms != -1 && oldCall != -1);
+
+    RetentionPolicy policy;
+    policy.setMaxAge(Event::ShortMessagingCategory, 30);
+    QCOMPARE(policy.maxAge(Event::ShortMessagingCategory), 30);
+    QCOMPARE(policy.maxAge(Event::VoicecallCategory), 0);
+
+    QList<int> eventIds, groupIds;
+    QVERIFY(policy.dryRun(eventIds, groupIds));
+    QCOMPARE(eventIds, QList<int>() << oldSms);
+    QVERIFY(groupIds.isEmpty());
+
+    // Nothing is deleted by a dry run
+    Event event;
+    QVERIFY(model.databaseIO().getEvent(oldSms, event));
+
+    QSignalSpy finished(&policy, SIGNAL(finished(bool,int,int)));
+    QSignalSpy eventDeleted(UpdatesEmitter::instance().data(), SIGNAL(eventDeleted(int)));
+    QSignalSpy groupsUpdated(UpdatesEmitter::instance().data(), SIGNAL(groupsUpdated(const QList<int>&)));
+    QVERIFY(policy.enforce());
+
+    QCOMPARE(finished.count(), 1);
+    QCOMPARE(finished.first().at(0).toBool(), true);
+    QCOMPARE(finished.first().at(1).toInt(), 1);
+    QCOMPARE(finished.first().at(2).toInt(), 0);
+
+    QCOMPARE(eventDeleted.count(), 1);
+    QCOMPARE(eventDeleted.first().first().toInt(), oldSms);
+    QCOMPARE(groupsUpdated.count(), 1);
+    QCOMPARE(groupsUpdated.first().first().value<QList<int> >(), QList<int>() << group.id());
+
+    QVERIFY(!model.databaseIO().getEvent(oldSms, event));
+    QVERIFY(model.databaseIO().getEvent(newSms, event));
+    QVERIFY(model.databaseIO().getEvent(oldCall, event));
+}
+
+void RetentionPolicyTest::testMaxEventsPerGroup()
+{
+    EventModel model;
+    Group group;
+    addTestGroup(group, RING_ACCOUNT, "5550002");
+
+    const QDateTime now = QDateTime::currentDateTime();
+    QList<int> eventIds;
+    for (int i = 5; i > 0; i--) {
+        eventIds << addTestEvent(model, Event::SMSEvent, Event::Inbound, RING_ACCOUNT, group.id(),
+                                 "text", false, false, now.addDays(-i), "5550002");
+        QVERIFY(eventIds.last() != -1);
+    }
+
+    // A draft is neither deleted nor counted
+    int draft = addTestEvent(model, Event::SMSEvent, Event::Outbound, RING_ACCOUNT, group.id(),
+                             "draft", true, false, now.addDays(-10), "5550002");
+    QVERIFY(draft != -1);
+
+    RetentionPolicy policy;
+    policy.setMaxEventsPerGroup(2);
+
+    QList<int> pruned, groupIds;
+    QVERIFY(policy.dryRun(pruned, groupIds));
+    QCOMPARE(pruned, eventIds.mid(0, 3));
+    QVERIFY(groupIds.isEmpty());
+
+    QVERIFY(policy.enforce());
+
+    Event event;
+    for (int i = 0; i < eventIds.size(); i++)
+        QCOMPARE(model.databaseIO().getEvent(eventIds.at(i), event), i >= 3);
+    QVERIFY(model.databaseIO().getEvent(draft, event));
+}
+
+void RetentionPolicyTest::testEmptyGroups()
+{
+    EventModel model;
+    Group group1, group2;
+    addTestGroup(group1, RING_ACCOUNT, "5550003");
+    addTestGroup(group2, RING_ACCOUNT, "5550004");
+
+    const QDateTime now = QDateTime::currentDateTime();
+    QVERIFY(addTestEvent(model, Event::SMSEvent, Event::Inbound, RING_ACCOUNT, group1.id(),
+                         "old", false, false, now.addDays(-60), "5550003") != -1);
+    QVERIFY(addTestEvent(model, Event::SMSEvent, Event::Inbound, RING_ACCOUNT, group2.id(),
+                         "old", false, false, now.addDays(-60), "5550004") != -1);
+    QVERIFY(addTestEvent(model, Event::SMSEvent, Event::Inbound, RING_ACCOUNT, group2.id(),
+                         "new", false, false, now, "5550004") != -1);
+
+    RetentionPolicy policy;
+    policy.setMaxAge(Event::AnyCategory, 30);
+
+    QList<int> eventIds, groupIds;
+    QVERIFY(policy.dryRun(eventIds, groupIds));
+    QCOMPARE(eventIds.size(), 2);
+    QCOMPARE(groupIds, QList<int>() << group1.id());
+
+    QSignalSpy finished(&policy, SIGNAL(finished(bool,int,int)));
+    QSignalSpy groupsDeleted(UpdatesEmitter::instance().data(), SIGNAL(groupsDeleted(const QList<int>&)));
+    QVERIFY(policy.enforce());
+
+    QCOMPARE(finished.count(), 1);
+    QCOMPARE(finished.first().at(1).toInt(), 2);
+    QCOMPARE(finished.first().at(2).toInt(), 1);
+    QCOMPARE(groupsDeleted.count(), 1);
+    QCOMPARE(groupsDeleted.first().first().value<QList<int> >(), QList<int>() << group1.id());
+
+    Group group;
+    QVERIFY(!model.databaseIO().getGroup(group1.id(), group));
+    QVERIFY(model.databaseIO().getGroup(group2.id(), group));
+}
+
+void RetentionPolicyTest::testMaxDatabaseSize()
+{
+    EventModel model;
+    Group group;
+    addTestGroup(group, RING_ACCOUNT, "5550005");
+
+    const QDateTime now = QDateTime::currentDateTime();
+    QList<int> eventIds;
+    for (int i = 0; i < 3; i++) {
+        eventIds << addTestEvent(model, Event::SMSEvent, Event::Inbound, RING_ACCOUNT, group.id(),
+                                 "text", false, false, now.addSecs(i), "5550005");
+        QVERIFY(eventIds.last() != -1);
+    }
+    int draft = addTestEvent(model, Event::SMSEvent, Event::Outbound, RING_ACCOUNT, group.id(),
+                             "draft", true, false, now, "5550005");
+    QVERIFY(draft != -1);
+
+    RetentionPolicy policy;
+
+    // No limit
+    QList<int> pruned, groupIds;
+    QVERIFY(policy.dryRun(pruned, groupIds));
+    QVERIFY(pruned.isEmpty());
+
+    // Unreachable limit, so every event but the draft goes
+    policy.setMaxDatabaseSize(1);
+    QVERIFY(policy.dryRun(pruned, groupIds));
+    QCOMPARE(pruned, eventIds);
+    QVERIFY(groupIds.isEmpty());
+}
+
+void RetentionPolicyTest::testSchedule()
+{
+    EventModel model;
+    Group group;
+    addTestGroup(group, RING_ACCOUNT, "5550006");
+
+    int eventId = addTestEvent(model, Event::SMSEvent, Event::Inbound, RING_ACCOUNT, group.id(),
+                               "old", false, false, QDateTime::currentDateTime().addDays(-60), "5550006");
+    QVERIFY(eventId != -1);
+
+    RetentionPolicy policy;
+    policy.setMaxAge(Event::AnyCategory, 30);
+    policy.setIdleInterval(100);
+    QCOMPARE(policy.idleInterval(), 100);
+
+    QSignalSpy finished(&policy, SIGNAL(finished(bool,int,int)));
+    policy.schedule();
+    QVERIFY(!policy.isRunning());
+    QTRY_COMPARE(finished.count(), 1);
+    QCOMPARE(finished.first().at(0).toBool(), true);
+    QCOMPARE(finished.first().at(1).toInt(), 1);
+    QVERIFY(!policy.isRunning());
+
+    Event event;
+    QVERIFY(!model.databaseIO().getEvent(eventId, event));
+}
+
+static int archivedEventCount()
+{
+    QSqlQuery query(DatabaseIOPrivate::instance()->connection());
+    if (!query.exec(QLatin1String("SELECT COUNT(*) FROM archive.Events")) || !query.next())
+        return -1;
+    return query.value(0).toInt();
+}
+
+void RetentionPolicyTest::testArchive()
+{
+    EventModel model;
+    Group group;
+    addTestGroup(group, RING_ACCOUNT, "5550007");
+
+    const QDateTime now = QDateTime::currentDateTime();
+    QList<int> eventIds;
+    for (int i = 60; i > 56; i--) {
+        eventIds << addTestEvent(model, Event::SMSEvent, Event::Inbound, RING_ACCOUNT, group.id(),
+                                 "old", false, false, now.addDays(-i), "5550007");
+        QVERIFY(eventIds.last() != -1);
+    }
+    int lastId = addTestEvent(model, Event::SMSEvent, Event::Inbound, RING_ACCOUNT, group.id(),
+                              "new", false, false, now.addDays(-40), "5550007");
+    QVERIFY(lastId != -1);
+    QVERIFY(model.databaseIO().markAsReadGroup(group.id()));
+
+    // Unread events stay in the main database
+    int unreadId = addTestEvent(model, Event::SMSEvent, Event::Inbound, RING_ACCOUNT, group.id(),
+                                "unread", false, false, now.addDays(-50), "5550007");
+    QVERIFY(unreadId != -1);
+
+    RetentionPolicy policy;
+    policy.setArchiveAge(30);
+    QCOMPARE(policy.archiveAge(), 30);
+
+    // Archiving deletes nothing
+    QList<int> pruned, groupIds;
+    QVERIFY(policy.dryRun(pruned, groupIds));
+    QVERIFY(pruned.isEmpty());
+
+    QSignalSpy finished(&policy, SIGNAL(finished(bool,int,int)));
+    QSignalSpy eventDeleted(UpdatesEmitter::instance().data(), SIGNAL(eventDeleted(int)));
+    QVERIFY(policy.enforce());
+    QCOMPARE(finished.count(), 1);
+    QCOMPARE(finished.first().at(1).toInt(), 0);
+    QCOMPARE(eventDeleted.count(), 0);
+
+    // The last event of the group is not archived
+    QCOMPARE(archivedEventCount(), eventIds.size());
+
+    Event event;
+    foreach (int id, eventIds) {
+        QVERIFY(model.databaseIO().getEvent(id, event));
+        QCOMPARE(event.id(), id);
+        QCOMPARE(event.groupId(), group.id());
+    }
+
+    int total = 0;
+    QVERIFY(model.databaseIO().totalEventsInGroup(group.id(), total));
+    QCOMPARE(total, eventIds.size() + 2);
+
+    Group g;
+    QVERIFY(model.databaseIO().getGroup(group.id(), g));
+    QCOMPARE(g.lastEventId(), lastId);
+    QCOMPARE(g.unreadMessages(), 1);
+
+    // Conversations continue into the archive in order
+    ConversationModel conversation;
+    QSignalSpy modelReady(&conversation, SIGNAL(modelReady(bool)));
+    QVERIFY(conversation.getEvents(group.id()));
+    QTRY_COMPARE(modelReady.count(), 1);
+    QCOMPARE(conversation.rowCount(), eventIds.size() + 2);
+    QCOMPARE(conversation.event(conversation.index(0, 0)).id(), lastId);
+    QCOMPARE(conversation.event(conversation.index(1, 0)).id(), unreadId);
+    for (int i = 0; i < eventIds.size(); i++)
+        QCOMPARE(conversation.event(conversation.index(i + 2, 0)).id(), eventIds.at(eventIds.size() - 1 - i));
+
+    // Modified events return to the main database
+    QVERIFY(model.databaseIO().getEvent(eventIds.first(), event));
+    event.setIsRead(false);
+    QVERIFY(model.databaseIO().modifyEvent(event));
+    QCOMPARE(archivedEventCount(), eventIds.size() - 1);
+    QVERIFY(model.databaseIO().getGroup(group.id(), g));
+    QCOMPARE(g.unreadMessages(), 2);
+
+    // Deleting the rest of the group's events leaves the newest archived one
+    QVERIFY(model.databaseIO().getEvent(lastId, event));
+    QVERIFY(model.databaseIO().deleteEvent(event, 0));
+    QVERIFY(model.databaseIO().getEvent(unreadId, event));
+    QVERIFY(model.databaseIO().deleteEvent(event, 0));
+    QVERIFY(model.databaseIO().getEvent(eventIds.first(), event));
+    QVERIFY(model.databaseIO().deleteEvent(event, 0));
+    QCOMPARE(archivedEventCount(), eventIds.size() - 2);
+    QVERIFY(model.databaseIO().getGroup(group.id(), g));
+    QCOMPARE(g.lastEventId(), eventIds.last());
+
+    // Archived events are deleted with their group, and the deletions are logged
+    qint64 sequence = 0;
+    QVERIFY(model.databaseIO().lastChangeSequence(sequence));
+    QVERIFY(model.databaseIO().deleteGroups(QList<int>() << group.id(), 0));
+    QCOMPARE(archivedEventCount(), 0);
+
+    QList<DatabaseIO::Change> changes;
+    bool complete = false;
+    QVERIFY(model.databaseIO().getChanges(sequence, changes, complete));
+    QVERIFY(complete);
+    QList<int> deletedIds;
+    foreach (const DatabaseIO::Change &change, changes) {
+        QCOMPARE(change.sequence, ++sequence);
+        if (change.table == DatabaseIO::Change::EventsTable && change.operation == DatabaseIO::Change::Delete) {
+            QCOMPARE(change.groupId, group.id());
+            deletedIds.append(change.id);
+        }
+    }
+    QCOMPARE(deletedIds.size(), eventIds.size() - 1);
+    for (int i = 1; i < eventIds.size(); i++)
+        QVERIFY(deletedIds.contains(eventIds.at(i)));
+}
+
+void RetentionPolicyTest::testArchiveRecovery()
+{
+    EventModel model;
+    Group group;
+    addTestGroup(group, RING_ACCOUNT, "5550008");
+
+    const QDateTime now = QDateTime::currentDateTime();
+    QList<int> eventIds;
+    for (int i = 3; i > 0; i--) {
+        eventIds << addTestEvent(model, Event::SMSEvent, Event::Inbound, RING_ACCOUNT, group.id(),
+                                 "moving", false, false, now.addDays(-i), "5550008");
+        QVERIFY(eventIds.last() != -1);
+    }
+    QVERIFY(model.databaseIO().markAsReadGroup(group.id()));
+
+    // A move interrupted after the archive committed leaves events in both databases
+    QSqlQuery query(DatabaseIOPrivate::instance()->connection());
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO archive.Events (id, groupId, type, endTime, isRead) "
+                                      "SELECT id, groupId, type, endTime, isRead FROM main.Events "
+                                      "WHERE id IN (%1, %2)").arg(eventIds.at(0)).arg(eventIds.at(1))));
+    query.finish();
+    QCOMPARE(archivedEventCount(), 2);
+
+    // The main table's copy of a modified event is kept
+    Event event;
+    QVERIFY(model.databaseIO().getEvent(eventIds.at(0), event));
+    event.setIsRead(false);
+    QVERIFY(model.databaseIO().modifyEvent(event));
+    QCOMPARE(archivedEventCount(), 1);
+    QVERIFY(model.databaseIO().getEvent(eventIds.at(0), event));
+    QCOMPARE(event.isRead(), false);
+    QCOMPARE(event.freeText(), QString("moving"));
+
+    // Enforcing the policy completes the remaining moves
+    RetentionPolicy policy;
+    QVERIFY(policy.enforce());
+    QCOMPARE(archivedEventCount(), 0);
+    QVERIFY(model.databaseIO().getEvent(eventIds.at(1), event));
+    QCOMPARE(event.freeText(), QString("moving"));
+
+    int total = 0;
+    QVERIFY(model.databaseIO().totalEventsInGroup(group.id(), total));
+    QCOMPARE(total, eventIds.size());
+
+    QVERIFY(model.databaseIO().deleteGroups(QList<int>() << group.id(), 0));
+}
+
+void RetentionPolicyTest::testDeleteArchived()
+{
+    EventModel model;
+    Group group;
+    addTestGroup(group, RING_ACCOUNT, "5550009");
+
+    const QDateTime archived = QDateTime::currentDateTime().addDays(-60);
+    QList<int> eventIds;
+    for (int i = 0; i < 250; i++) {
+        eventIds << addTestEvent(model, Event::SMSEvent, Event::Inbound, RING_ACCOUNT, group.id(),
+                                 "archived", false, false, archived.addSecs(i), "5550009");
+        QVERIFY(eventIds.last() != -1);
+    }
+    int lastId = addTestEvent(model, Event::SMSEvent, Event::Inbound, RING_ACCOUNT, group.id(),
+                              "last", false, false, QDateTime::currentDateTime(), "5550009");
+    QVERIFY(lastId != -1);
+    QVERIFY(model.databaseIO().markAsReadGroup(group.id()));
+
+    RetentionPolicy policy;
+    policy.setArchiveAge(30);
+    QVERIFY(policy.enforce());
+    QCOMPARE(archivedEventCount(), eventIds.size());
+
+    // An archived part, and the last event left in both databases by an interrupted move
+    QSqlQuery query(DatabaseIOPrivate::instance()->connection());
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO archive.MessageParts (id, eventId, contentId, contentType, path) "
+                                      "VALUES (%1, %1, 'part', 'text/plain', '')").arg(eventIds.first())));
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO archive.Events (id, groupId, type, endTime, isRead) "
+                                      "SELECT id, groupId, type, endTime, isRead FROM main.Events "
+                                      "WHERE id = %1").arg(lastId)));
+    query.finish();
+
+    QThread collectorThread;
+    collectorThread.start();
+    QSignalSpy collected(&model.databaseIO(), SIGNAL(messagePartsCollected(qint64)));
+
+    // Archived events are deleted in batches too, and each deletion is logged once
+    const int maxWriteLockTime = model.databaseIO().maxWriteLockTime();
+    model.databaseIO().setMaxWriteLockTime(1);
+    qint64 sequence = 0;
+    QVERIFY(model.databaseIO().lastChangeSequence(sequence));
+    QVERIFY(model.databaseIO().deleteGroups(QList<int>() << group.id(), &collectorThread));
+    model.databaseIO().setMaxWriteLockTime(maxWriteLockTime);
+    QCOMPARE(archivedEventCount(), 0);
+
+    QList<DatabaseIO::Change> changes;
+    bool complete = false;
+    QVERIFY(model.databaseIO().getChanges(sequence, changes, complete));
+    QVERIFY(complete);
+    QList<int> deletedIds;
+    foreach (const DatabaseIO::Change &change, changes) {
+        if (change.table == DatabaseIO::Change::EventsTable && change.operation == DatabaseIO::Change::Delete)
+            deletedIds.append(change.id);
+    }
+    std::sort(deletedIds.begin(), deletedIds.end());
+    QCOMPARE(deletedIds, QList<int>() << eventIds << lastId);
+
+    // The collector removes parts of archived events from the archive
+    QTRY_COMPARE_WITH_TIMEOUT(collected.count(), 1, 10000);
+    QVERIFY(query.exec(QLatin1String("SELECT COUNT(*) FROM archive.MessageParts")) && query.next());
+    QCOMPARE(query.value(0).toInt(), 0);
+    query.finish();
+
+    collectorThread.quit();
+    collectorThread.wait();
+}
+
+void RetentionPolicyTest::testArchiveUnavailable()
+{
+    QVERIFY(CommHistoryDatabase::hasArchiveFile(DatabaseIOPrivate::instance()->connection()));
+
+    // The archive records its version, so that it is prepared only once
+    QSqlQuery versionQuery(DatabaseIOPrivate::instance()->connection());
+    QVERIFY(versionQuery.exec(QStringLiteral("PRAGMA archive.user_version")) && versionQuery.next());
+    QVERIFY(versionQuery.value(0).toInt() > 0);
+    versionQuery.finish();
+
+    // An archive in memory, as attached when the archive file fails to attach
+    {
+        QSqlDatabase database = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), QStringLiteral("ut-archive"));
+        database.setDatabaseName(QStringLiteral(":memory:"));
+        QVERIFY(database.open());
+        QSqlQuery query(database);
+        QVERIFY(query.exec(QStringLiteral("ATTACH DATABASE ':memory:' AS archive")));
+        QVERIFY(!CommHistoryDatabase::hasArchiveFile(database));
+        query.finish();
+        database.close();
+    }
+    QSqlDatabase::removeDatabase(QStringLiteral("ut-archive"));
+}
+
+QTEST_MAIN(RetentionPolicyTest)
@@ -34,6 +34,7 @@
 #include "../src/callevent.h"
 #include "../src/group.h"
 #include "../src/databaseio.h"
+#include "../src/databasebackup.h"
 
 #include "catcher.h"
 
@@ -149,9 +150,14 @@ void printUsage()
                         << std::endl;
     std::cout << "                 import-json [-relativeDate yyMMdd] filename"
                         << std::endl;
+    std::cout << "                 backup directory"
+                        << std::endl;
+    std::cout << "                 restore directory"
+                        << std::endl;
     std::cout << "When adding new events, the default count is 1."                                                                                         << std::endl;
     std::cout << "When adding new events, the given local-ui is ignored, if -sms or -mms specified."                                                       << std::endl;
     std::cout << "New events are of IM type and have random contents."                                                                                     << std::endl;
+    std::cout << "Restoring requires that there is no database yet."                                                                                       << std::endl;
 }
 
 class ReadinessTester : public QObject
@@ -174,6 +180,23 @@ public slots:
     }
 };
 
+class BackupProgress : public QObject
+{
+    Q_OBJECT
+
+public:
+    BackupProgress(DatabaseBackup &backup)
+    {
+        connect(&backup, SIGNAL(progress(int,int)), SLOT(progress(int,int)));
+    }
+
+public slots:
+    void progress(int completed, int total)
+    {
+        std::cout << "\r" << completed << "/" << total << std::flush;
+    }
+};
+
 template<typename ModelType>
 void waitForReadiness(ModelType &model)
 {
@@ -1327,6 +1350,35 @@ int doJsonImport(const QStringList &arguments, const QVariantMap &options)
     return 0;
 }
 
+int doBackup(const QStringList &arguments, const QVariantMap &options)
+{
+    Q_UNUSED(options);
+
+    DatabaseBackup backup;
+    BackupProgress progress(backup);
+    const bool ok = backup.backup(arguments.at(2));
+    std::cout << std::endl;
+
+    if (!ok) {
+        qCritical() << "Error backing up to" << arguments.at(2);
+        return -1;
+    }
+
+    return 0;
+}
+
+int doRestore(const QStringList &arguments, const QVariantMap &options)
+{
+    Q_UNUSED(options);
+
+    if (!DatabaseBackup::restore(arguments.at(2))) {
+        qCritical() << "Error restoring from" << arguments.at(2);
+        return -1;
+    }
+
+    return 0;
+}
+
 }
 
 int main(int argc, char **argv)
@@ -1393,6 +1445,10 @@ int main(int argc, char **argv)
             return doImport(args, options);
         } else if (args.at(1) == "import-json" && args.count() >= 3) {
             return doJsonImport(args, options);
+        } else if (args.at(1) == "backup" && args.count() > 2) {
+            return doBackup(args, options);
+        } else if (args.at(1) == "restore" && args.count() > 2) {
+            return doRestore(args, options);
         } else {
             printUsage();
         }